@@ -267,6 +267,59 @@ ftdispi_read( struct ftdispi_context *fsc,
               uint16_t count,
               uint8_t gpo );
 
+/**
+ * @brief Assert CS, set general purpose output and write wbuf to spi,
+ * leaving CS asserted so that reads can follow continuously.
+ *
+ * @param[in,out] fsc previously opened spi contex
+ * @param[in] wbuf buffer to write
+ * @param[in] wcount number of bytes to write
+ * @param[in] gpo general purpose output states for the duration of
+ * the stream
+ *
+ * @retval #FTDISPI_ERROR_NONE on success
+ * @retval #FTDISPI_ERROR_CTX on context error
+ * @retval #FTDISPI_ERROR_LIB on libftdi error
+ * @retval #FTDISPI_ERROR_MEM on allocation error
+ * @retval #FTDISPI_ERROR_CMD on invalid parameters
+ */
+__dll int
+ftdispi_stream_start( struct ftdispi_context *fsc,
+                      const void *wbuf,
+                      uint16_t wcount,
+                      uint8_t gpo );
+
+/**
+ * @brief Queue a read of count bytes in a stream started with
+ * ftdispi_stream_start. Returns without waiting for the data, which
+ * the caller collects from the bulk in endpoint.
+ *
+ * @param[in,out] fsc previously opened spi contex
+ * @param[in] count number of bytes to read
+ *
+ * @retval #FTDISPI_ERROR_NONE on success
+ * @retval #FTDISPI_ERROR_CTX on context error
+ * @retval #FTDISPI_ERROR_LIB on libftdi error
+ * @retval #FTDISPI_ERROR_CMD on invalid parameters
+ */
+__dll int
+ftdispi_stream_read( struct ftdispi_context *fsc,
+                     uint16_t count );
+
+/**
+ * @brief Finish a stream, discarding any reads still queued and
+ * returning CS to idle. Returns only when CS get back to idle state.
+ *
+ * @param[in,out] fsc previously opened spi contex
+ *
+ * @retval #FTDISPI_ERROR_NONE on success
+ * @retval #FTDISPI_ERROR_CTX on context error
+ * @retval #FTDISPI_ERROR_LIB on libftdi error
+ * @retval #FTDISPI_ERROR_TO on timeout error
+ */
+__dll int
+ftdispi_stream_stop( struct ftdispi_context *fsc );
+
 /**
  * @brief Set the new general purpose default state, and change the device
  * output accordingly. Returns only when GPO status have changed.
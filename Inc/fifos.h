@@ -36,6 +36,8 @@
 
 #include "tpiuDecoder.h"
 #include "itmDecoder.h"
+#include "msgDecoder.h"
+#include "metrics.h"
 
 #include "generics.h"
 
@@ -53,7 +55,7 @@ struct fifosHandle;
 
 /* Fifos running */
 void fifoForceSync( struct fifosHandle *f, bool synced );                  /* Force sync status */
-void fifoProtocolPump( struct fifosHandle *f, uint8_t c );                 /* Send undecoded data to the fifo */
+void fifoProtocolPump( struct fifosHandle *f, uint8_t *c, int len );       /* Send undecoded data block to the fifo */
 
 /* Getters and setters */
 void fifoSetChannel( struct fifosHandle *f, int chan, char *n, char *s );
@@ -67,7 +69,14 @@ char *fifoGetChanPath( struct fifosHandle *f );
 bool fifoGetUseTPIU( struct fifosHandle *f );
 bool fifoGetForceITMSync( struct fifosHandle *f );
 int fifoGettpiuITMChannel( struct fifosHandle *f );
+uint32_t fifoGetTPIUUnrouted( struct fifosHandle *f );
+uint32_t fifoGetTPIUOverflow( struct fifosHandle *f );
 void fifoUsePermafiles( struct fifosHandle *f, bool usePermafilesSet );
+void fifoSetSyncLossCB( struct fifosHandle *f, void ( *cb )( void *param ), void *param );
+void fifoSetMsgCB( struct fifosHandle *f, void ( *cb )( struct msg *m, void *param ), void *param );
+
+/* Metrics */
+void fifoMetrics( struct metricsOut *o, void *param );                    /* Collector for the metrics server */
 
 /* Filewriting */
 void fifoFilewriter( struct fifosHandle *f, bool useFilewriter, char *workingPath );
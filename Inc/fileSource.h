@@ -0,0 +1,78 @@
+/*
+ * File Source Module
+ * ==================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _FILE_SOURCE_
+#define _FILE_SOURCE_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct FileSource
+{
+    int fd;                                  /* The capture file */
+    size_t size;                             /* Its length when last looked at */
+    const uint8_t *map;                      /* Mapping of it (when not following) */
+    size_t pos;                              /* Offset of the next byte to hand out */
+
+    bool follow;                             /* At the end of the file wait for it to grow */
+    int notify;                              /* Change notification for the file (-1 if none) */
+    uint8_t *buf;                            /* Copy of the data handed out when following... */
+    uint32_t bufLen;                         /* ...and its size */
+
+    double rate;                             /* Bytes per second to replay at (0 for as fast as possible) */
+    struct timespec start;                   /* Time pacing was started */
+    uint64_t paced;                          /* ...and bytes handed out since then */
+};
+
+// ====================================================================================================
+/* Open a capture file for replay, either as fast as it can be processed (rate 0) or paced to rate */
+/* bytes per second. With follow set, data appended to the file is handed out as it arrives.     */
+bool FileSourceOpen( struct FileSource *s, const char *filename, bool follow, double rate );
+
+/* Get up to maxLen bytes from the file. d points into the file mapping (or a copy of the data when */
+/* following), and remains valid until the next call. Returns the number of bytes, 0 at end of file */
+/* (when not following) or -1 for an error.                                                          */
+int32_t FileSourceGet( struct FileSource *s, const uint8_t **d, uint32_t maxLen );
+
+void FileSourceClose( struct FileSource *s );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
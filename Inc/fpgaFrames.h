@@ -0,0 +1,62 @@
+/*
+ * FPGA Frame Compaction Module
+ * ============================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _FPGA_FRAMES_
+#define _FPGA_FRAMES_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Frames from the orbtrace FPGA are a header byte followed by 16 bytes of trace */
+#define FPGA_FRAME_LEN   (17)
+#define FPGA_PAYLOAD_LEN (16)
+
+#define FPGA_HDR_IDLE  (0x80)    /* Frame header: frame carries no data */
+#define FPGA_HDR_FIXED (0x78)    /* ...bits that are always zero */
+#define FPGA_HDR_WIDTH (0x06)    /* ...trace port width */
+#define FPGA_HDR_SYNC  (0x01)    /* ...FPGA is in sync with the trace port */
+
+// ====================================================================================================
+/* Compact a run of whole frames from f into d, dropping headers and idle frames. Stops at the */
+/* first frame whose header, idle flag aside, isn't hdr. Returns the number of frames used,    */
+/* with the number that carried data (and so the FPGA_PAYLOAD_LEN byte lots written to d) in   */
+/* dataFrames. d must have room for FPGA_PAYLOAD_LEN bytes per frame, used or not.             */
+uint32_t FPGAFramesCompact( const uint8_t *f, uint32_t frames, uint8_t hdr, uint8_t *d, uint32_t *dataFrames );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
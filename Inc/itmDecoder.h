@@ -77,7 +77,9 @@ enum ITMPacketType
     ITM_PT_HW,
     ITM_PT_XTN,
     ITM_PT_RSRVD,
-    ITM_PT_NISYNC
+    ITM_PT_NISYNC,
+    ITM_PT_GTS1,
+    ITM_PT_GTS2
 };
 
 /* Events from the process of pumping bytes through the ITM decoder */
@@ -117,7 +119,7 @@ struct ITMPacket
 
     uint8_t len;
     uint8_t pageRegister; /* The current stimulus page register value */
-    uint8_t d[ITM_MAX_PACKET];
+    uint8_t d[ITM_MAX_PACKET];           /* Payload (SW and HW packets are zero padded to ITM_DATA_PACKET) */
 };
 
 /* Time conditions of a TS message */
@@ -138,6 +140,7 @@ struct ITMDecoderStats
     uint32_t ReservedPkt;                /* Number of Reserved Packets received */
     uint32_t ErrorPkt;                   /* Number of Packets received we don't know how to handle */
     uint32_t PagePkt;                    /* Number of Packets received containing page sets */
+    uint32_t GTSPkt;                     /* Number of Global Timestamp Packets received */
 };
 
 /* The ITM decoder state */
@@ -153,6 +156,24 @@ struct ITMDecoder
     enum _protoState p;                  /* Current state of the receiver */
 };
 
+/* A SW or HW packet as decoded by ITMDecodeBlock */
+struct ITMRecord
+{
+    uint8_t type;                        /* ITM_PT_SW or ITM_PT_HW */
+    uint8_t srcAddr;                     /* Channel (SW) or discriminator (HW) */
+    uint8_t len;                         /* Payload length */
+    uint8_t pageRegister;                /* Stimulus port page register when it was received */
+    uint32_t value;                      /* Payload, little endian and zero padded */
+};
+
+/* Destination for ITMDecodeBlock */
+struct ITMRecordBuffer
+{
+    struct ITMRecord *r;                 /* Records */
+    uint32_t size;                       /* ...capacity */
+    uint32_t len;                        /* ...and how many are in use */
+};
+
 /* A fully decoded message (expanded in msgDecoder.h) */
 struct msg;
 
@@ -161,10 +182,12 @@ void ITMDecoderForceSync( struct ITMDecoder *i, bool isSynced );
 void ITMDecoderZeroStats( struct ITMDecoder *i );
 bool ITMDecoderIsSynced( struct ITMDecoder *i );
 struct ITMDecoderStats *ITMDecoderGetStats( struct ITMDecoder *i );
+uint32_t ITMDecoderSkipToSync( struct ITMDecoder *i, const uint8_t *c, uint32_t len );
 bool ITMGetPacket( struct ITMDecoder *i, struct ITMPacket *p );
 bool ITMGetDecodedPacket( struct ITMDecoder *i, struct msg *decoded );
 
 enum ITMPumpEvent ITMPump( struct ITMDecoder *i, uint8_t c );
+uint32_t ITMDecodeBlock( struct ITMDecoder *i, const uint8_t *c, uint32_t len, struct ITMRecordBuffer *b, enum ITMPumpEvent *e );
 
 void ITMDecoderInit( struct ITMDecoder *i, bool startSynced );
 // ====================================================================================================
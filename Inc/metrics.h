@@ -0,0 +1,91 @@
+/*
+ * Metrics Module
+ * ==============
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Performance metrics, served in Prometheus text format to anything that
+ * connects to the metrics port (e.g. a Prometheus scraper, or just curl).
+ * Each subsystem keeps its own counters, updated atomically by whichever
+ * thread does the work, and registers a collector which reports them when
+ * a scrape arrives. Where there are several instances of a subsystem each
+ * registers with its own labels (e.g. source="1").
+ */
+
+#ifndef _METRICS_
+#define _METRICS_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ====================================================================================================
+
+#define METRICS_HIST_BUCKETS (24)             /* Latency buckets, doubling from 1uS to about 8S */
+
+/* Latency histogram. Buckets aren't cumulative here, they're summed when reported */
+struct metricsHistogram
+{
+    uint64_t bucket[METRICS_HIST_BUCKETS];    /* Observations of no more than 2^n uS */
+    uint64_t count;                           /* All observations, including those beyond the last bucket */
+    uint64_t sum;                             /* ...and their total in uS */
+};
+
+struct metricsHandle;
+struct metricsOut;
+
+/* Called for each scrape to report a subsystem's metrics into o */
+typedef void ( *metricsCollector )( struct metricsOut *o, void *param );
+
+// ====================================================================================================
+
+/* Recording, from any thread */
+uint64_t metricsTimeUs( void );
+void metricsHistogramAdd( struct metricsHistogram *h, uint64_t us );
+
+/* Reporting, from a collector. labels is either NULL or of the form 'name="value",...' */
+void metricsFamily( struct metricsOut *o, const char *name, const char *type, const char *help );
+void metricsValue( struct metricsOut *o, const char *name, const char *labels, uint64_t v );
+void metricsHistogram( struct metricsOut *o, const char *name, const char *labels, struct metricsHistogram *h );
+
+/* Server */
+bool metricsRegister( struct metricsHandle *h, metricsCollector c, void *param, const char *labels );
+void metricsShutdown( struct metricsHandle *h );
+struct metricsHandle *metricsStart( int port );
+
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Message Codec Module
+ * ====================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compact binary encoding of decoded messages, for passing them between threads
+ * and processes. A struct msg is padded out to its largest member; encoded, a
+ * typical software message takes four bytes. Each record is;
+ *
+ *   Type byte  : Message type in bits 4..0, format version in bits 7..5
+ *   Timestamp  : Change since the previous record, zigzag varint
+ *   Payload    : Depends on type, small fields as bytes, the rest as varints
+ *
+ * Timestamps are relative, so an encoder and decoder pair must see the same
+ * records in the same order.
+ */
+
+#ifndef _MSG_CODEC_
+#define _MSG_CODEC_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "msgDecoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MSG_CODEC_VERSION (1)                 /* Format version carried in every record */
+#define MSG_CODEC_MAXLEN  (32)                /* Longest a record can be */
+
+struct MSGCodec
+{
+    uint64_t ts;                              /* Timestamp of the last record, the next is relative to it */
+};
+
+// ====================================================================================================
+uint32_t MSGCodecEncode( struct MSGCodec *c, struct msg *m, uint8_t *b );
+int32_t MSGCodecDecode( struct MSGCodec *c, const uint8_t *b, uint32_t len, struct msg *m );
+
+void MSGCodecInit( struct MSGCodec *c );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -22,6 +22,7 @@ enum MSGType
     MSG_DWT_EVENT,
     MSG_EXCEPTION,
     MSG_TS,
+    MSG_GTS,
 
     /* Add new message types here */
 
@@ -43,6 +44,18 @@ struct TSMsg
     uint32_t timeInc;
 };
 
+/* Global timestamp message. A GTS1 carries the low order bits of the global timestamp (all */
+/* 26 of them, or just those that changed) and GTS2 the rest, so each is applied with mask.  */
+struct gtsMsg
+{
+    enum MSGType msgtype;
+    uint64_t ts;
+    uint64_t bits;                       /* Timestamp bits carried by the packet, in place */
+    uint64_t mask;                       /* ...and which bits they are */
+    bool wrap;                           /* High order bits have changed, a GTS2 will follow */
+    bool clkCh;                          /* Clock has changed, a GTS2 will follow */
+};
+
 /* Software message */
 struct swMsg
 {
@@ -131,14 +144,17 @@ struct msg
         struct dwtMsg dwtMsg;
         struct excMsg excMsg;
         struct pcSampleMsg pcSampleMsg;
+        struct gtsMsg gtsMsg;
     };
 };
 
 struct ITMPacket;
+struct ITMRecord;
 
 // ====================================================================================================
 
 bool msgDecoder( struct ITMPacket *packet, struct msg *decoded );
+bool msgDecodeRecord( struct ITMRecord *r, struct msg *decoded, uint64_t ts );
 
 // ====================================================================================================
 #ifdef __cplusplus
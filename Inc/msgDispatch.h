@@ -0,0 +1,79 @@
+/*
+ * Message Dispatch Module
+ * =======================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MSG_DISPATCH_
+#define _MSG_DISPATCH_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "itmDecoder.h"
+#include "msgDecoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MSG_DISPATCH_RECORDS (256)            /* Number of SW/HW packets decoded in bulk at a time */
+
+/* Called with a decoded message (the struct for its type) which is only valid for the call */
+typedef void ( *MSGDispatchHandler )( void *decoded, void *param );
+
+/* Called for decoder events (everything except ITM_EV_NONE and ITM_EV_PACKET_RXED) */
+typedef void ( *MSGDispatchEventCB )( enum ITMPumpEvent e, void *param );
+
+struct MSGDispatch
+{
+    struct ITMDecoder *i;                     /* Decoder that data is pumped through */
+    MSGDispatchHandler h[MSG_NUM_MSGS];       /* Handler for each message type (NULL to ignore) */
+    MSGDispatchHandler all;                   /* Handler for every message, before the one for its type */
+    MSGDispatchEventCB ecb;                   /* Handler for decoder events (NULL to just report them) */
+    void *param;                              /* What to pass to all of the above */
+
+    struct ITMRecordBuffer b;                 /* SW/HW packets decoded in bulk */
+    struct ITMRecord r[MSG_DISPATCH_RECORDS]; /* ...and the storage for them */
+    struct msg m;                             /* Message being dispatched */
+};
+
+// ====================================================================================================
+bool MSGDispatchRegister( struct MSGDispatch *d, enum MSGType t, MSGDispatchHandler h );
+void MSGDispatchRegisterAll( struct MSGDispatch *d, MSGDispatchHandler h );
+void MSGDispatchPump( struct MSGDispatch *d, uint8_t *c, uint32_t len );
+void MSGDispatchMsg( struct MSGDispatch *d, struct msg *m );
+void MSGDispatchEvent( struct MSGDispatch *d, enum ITMPumpEvent e );
+
+void MSGDispatchInit( struct MSGDispatch *d, struct ITMDecoder *i, MSGDispatchEventCB ecb, void *param );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
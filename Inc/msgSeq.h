@@ -33,7 +33,12 @@
 
 /*
  * Sequencer for re-ordering messages from the ITM according to prioritize
- * timestamp information in the flow.
+ * timestamp information in the flow. Messages leave the sequencer with ts
+ * set to absolute target time, built from global timestamps (GTS) plus any
+ * local timestamps since the last of them. Messages between two time points
+ * are spread evenly across the interval. The window grows as needed up to
+ * a maximum; if that's exceeded messages are released early (stamped with
+ * the last known time) and counted as overflow.
  *
  * Spec at https://static.docs.arm.com/ddi0403/e/DDI0403E_B_armv7m_arm.pdf
  */
@@ -59,18 +64,28 @@ struct MSGSeq
 
     uint32_t wp;             /* Write pointer */
     uint32_t rp;             /* Read pointer */
+    uint32_t unstamped;      /* First message still waiting for its time */
     uint32_t pbl;            /* Buffer length */
+    uint32_t maxEntries;     /* ...and the most it's allowed to grow to */
     bool releaseTimeMsg;     /* Indicator to release msg at head of queue */
 
+    uint64_t gts;            /* Global timestamp, assembled from GTS messages */
+    uint64_t localTime;      /* Local timestamp increments since the last GTS */
+    uint64_t batchTime;      /* Time of the last time point */
+
+    uint32_t overflow;       /* Number of times the window was exceeded */
+
     struct msg *pbuffer;     /* The buffer */
 };
 
 // ====================================================================================================
 
-void MSGSeqInit( struct MSGSeq *d, struct ITMDecoder *i, uint32_t maxEntries );
+void MSGSeqInit( struct MSGSeq *d, struct ITMDecoder *i, uint32_t initialEntries, uint32_t maxEntries );
 struct msg *MSGSeqGetPacket( struct MSGSeq *d );
+uint32_t MSGSeqGetOverflow( struct MSGSeq *d );
 
 bool MSGSeqPump( struct MSGSeq *d, uint8_t c );
+bool MSGSeqPumpMsg( struct MSGSeq *d, struct msg *p );
 
 // ====================================================================================================
 #ifdef __cplusplus
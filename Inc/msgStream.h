@@ -0,0 +1,101 @@
+/*
+ * Message Stream Module
+ * =====================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Framing of encoded messages (see msgCodec.h) for sending them over a byte
+ * stream, such as orbuculum's decoded event port. Each frame is;
+ *
+ *   Sync       : MSG_STREAM_SYNC_PRELEN x MSG_STREAM_SYNC_PRE, then MSG_STREAM_SYNC_TERM
+ *   Length     : Of the records that follow, two bytes little endian
+ *   Records    : Encoded with a codec reset at the start of the frame
+ *
+ * Frames stand alone, so a reader can start with any of them. One that joins
+ * part way through, or that has had data dropped, looks for the next sync.
+ * A sync can turn up inside a frame by chance, so a frame is only used if
+ * its records decode to exactly its length. If it doesn't, the search for a
+ * sync starts again straight after the false one, so real frames inside what
+ * was taken for a frame aren't lost.
+ *
+ * Only messages are carried. ITM decoder events (overflows, syncs and sync
+ * losses) and the decoder stats stay with whoever decoded the trace.
+ */
+
+#ifndef _MSG_STREAM_
+#define _MSG_STREAM_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "msgDecoder.h"
+#include "msgCodec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MSG_STREAM_SYNC_PRE    (0xFF)         /* Byte repeated at the start of a frame sync... */
+#define MSG_STREAM_SYNC_PRELEN (5)            /* ...this many times... */
+#define MSG_STREAM_SYNC_TERM   (0xA5)         /* ...and the byte it finishes with */
+#define MSG_STREAM_HDR_LEN     (MSG_STREAM_SYNC_PRELEN + 3)
+#define MSG_STREAM_MAXLEN      (16384)        /* Most record bytes in a frame */
+
+/* Called with each message from a frame, which is only valid for the call */
+typedef void ( *MSGStreamHandler )( struct msg *m, void *param );
+
+/* A frame being built, or being read. One of these is only used for one or the other */
+struct MSGStream
+{
+    struct MSGCodec c;                        /* Codec for the records in the frame */
+    uint32_t len;                             /* Bytes of the frame so far (header included) */
+    uint32_t run;                             /* Sync lead in seen while looking for a frame */
+    uint32_t badFrames;                       /* Frames read that weren't whole or didn't decode */
+    uint8_t f[MSG_STREAM_HDR_LEN + MSG_STREAM_MAXLEN];
+
+    /* Bytes put back to be looked through again when what was read as a frame wasn't one */
+    uint8_t r[MSG_STREAM_HDR_LEN + MSG_STREAM_MAXLEN];
+    uint32_t rlen;                            /* ...how many there are */
+    uint32_t rpos;                            /* ...and how many of them have been looked at */
+};
+
+// ====================================================================================================
+bool MSGStreamAdd( struct MSGStream *s, struct msg *m );
+uint32_t MSGStreamFrame( struct MSGStream *s, const uint8_t **f );
+
+void MSGStreamPump( struct MSGStream *s, const uint8_t *c, uint32_t len, MSGStreamHandler h, void *param );
+uint32_t MSGStreamGetBadFrames( struct MSGStream *s );
+
+void MSGStreamInit( struct MSGStream *s );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -35,6 +35,7 @@
 #define _NW_CLIENT_
 
 #include "generics.h"
+#include "metrics.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,16 +47,36 @@ extern "C" {
 
 #define NWCLIENT_SERVER_PORT (3443)           /* Server port definition */
 #define TRANSFER_SIZE (4096)
+#define NWCLIENT_QUEUE_KB (1024)              /* Default data that can wait for each client, in KBytes */
+
+/* What happens when more is waiting for a client than its queue will hold */
+enum nwclientOverflow
+{
+    NWCLIENT_DROP_NEWEST,                     /* Drop what doesn't fit */
+    NWCLIENT_DROP_OLDEST,                     /* Make room by dropping from the front of the queue */
+    NWCLIENT_DISCONNECT                       /* Disconnect the client */
+};
+
+/* Where a client that's had data dropped picks the stream up again */
+enum nwclientRestart
+{
+    NWCLIENT_RESTART_ANY,                     /* Anywhere, nothing is known about the stream */
+    NWCLIENT_RESTART_ITM,                     /* After an ITM sync */
+    NWCLIENT_RESTART_TPIU,                    /* After a TPIU full sync */
+    NWCLIENT_RESTART_FRAMES,                  /* At a frame boundary, the stream being whole TPIU frames */
+    NWCLIENT_RESTART_MSGS                     /* After the sync at the start of a frame of encoded messages */
+};
 
 struct nwclientsHandle;
 
 // ====================================================================================================
 
 void nwclientSend( struct nwclientsHandle *h, uint32_t len, uint8_t *buffer );
+void nwclientMetrics( struct metricsOut *o, void *param );
 
 void nwclientShutdown( struct nwclientsHandle *h );
 bool nwclientShutdownComplete( struct nwclientsHandle *h );
-struct nwclientsHandle *nwclientStart( int port );
+struct nwclientsHandle *nwclientStart( int port, uint32_t queueSize, enum nwclientOverflow overflow, enum nwclientRestart restart, uint32_t historySize, bool zeroCopy );
 
 // ====================================================================================================
 #ifdef __cplusplus
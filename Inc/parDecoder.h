@@ -0,0 +1,74 @@
+/*
+ * Parallel Capture Decoder Module
+ * ===============================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Decodes a recorded capture file on a pool of threads. The file is split into chunks at
+ * TPIU syncs (or ITM syncs when there's no TPIU), each chunk is decoded by its own TPIU
+ * and ITM decoders and the resulting messages are delivered in file order.
+ */
+
+#ifndef _PAR_DECODER_
+#define _PAR_DECODER_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "itmDecoder.h"
+#include "msgDecoder.h"
+#include "tpiuDecoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PAR_CHUNK_SIZE      (1024*1024)    /* Target size of each chunk of the file to be decoded */
+#define PAR_MAX_CHECKPOINTS (1024)         /* Points at the start of a chunk where it may rejoin the previous one */
+
+/* Called, in file order, for each message decoded */
+typedef void ( *ParDecoderMsgCB )( struct msg *m, void *param );
+
+/* Called, in order with the messages, for ITM decoder events (everything except ITM_EV_NONE and  */
+/* ITM_EV_PACKET_RXED). The caller's decoder stats are as a serial decode would have left them. */
+typedef void ( *ParDecoderEventCB )( enum ITMPumpEvent e, void *param );
+
+struct ParDecoder;
+
+// ====================================================================================================
+struct ParDecoder *ParDecoderOpen( const char *filename, struct ITMDecoder *i, bool useTPIU, uint8_t tpiuITMChannel, uint32_t threads );
+bool ParDecoderPump( struct ParDecoder *p, ParDecoderMsgCB cb, ParDecoderEventCB ecb, void *param );
+struct TPIUDecoderStats *ParDecoderGetTPIUStats( struct ParDecoder *p );
+void ParDecoderClose( struct ParDecoder *p );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
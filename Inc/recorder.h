@@ -0,0 +1,89 @@
+/*
+ * Flight Recorder Module
+ * ============================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Flight recorder. The last few megabytes of raw trace from a source are
+ * kept in a preallocated ring whether anyone is listening or not, so that
+ * when something goes wrong there's a record of what led up to it. The
+ * capture thread copies each block in (and looks for the trigger pattern,
+ * if there is one), which is all it costs until the ring is dumped to a
+ * file. That happens on its own thread, when triggered by a signal, by the
+ * pattern turning up in the trace or by loss of TPIU or ITM sync.
+ */
+
+#ifndef _RECORDER_
+#define _RECORDER_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ====================================================================================================
+
+#define RECORDER_MAX_PATTERN (32)             /* Longest trigger pattern */
+
+/* What caused a dump */
+enum recorderTrigger
+{
+    RECORDER_TRIG_SIGNAL,                     /* Asked for (i.e. SIGUSR1) */
+    RECORDER_TRIG_PATTERN,                    /* Trigger pattern seen in the trace */
+    RECORDER_TRIG_SYNCLOSS,                   /* TPIU or ITM lost sync */
+    RECORDER_NUM_TRIGGERS
+};
+
+struct recorderHandle;
+
+// ====================================================================================================
+
+/* Recording, from the capture thread */
+void recorderWrite( struct recorderHandle *r, const uint8_t *d, uint32_t len );
+
+/* Dumping, from anywhere (including a signal handler) */
+void recorderTrigger( struct recorderHandle *r, enum recorderTrigger t );
+
+/* Configuration, before recording starts. pattern is a string of hex bytes (e.g. "DEADBEEF") */
+bool recorderSetPattern( struct recorderHandle *r, const char *pattern );
+
+void recorderMetrics( struct metricsOut *o, void *param );
+void recorderShutdown( struct recorderHandle *r );
+struct recorderHandle *recorderStart( uint32_t size, const char *prefix );
+
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,110 @@
+/*
+ * SPSC Ring Buffer Module
+ * =======================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock-free single producer, single consumer byte ring. The producer (e.g. a
+ * capture thread) never waits; if there isn't room for a block it's dropped
+ * and counted. The consumer processes data in place and then releases it.
+ * The only lock is the one the consumer sleeps on when there's nothing to do,
+ * and the producer only touches that when the consumer is actually asleep.
+ * A consumer looking after several rings can have them share one waiter, so
+ * it sleeps until any of them has something for it.
+ */
+
+#ifndef _SPSC_RING_
+#define _SPSC_RING_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPSC_CACHE_LINE (64)                  /* Keeps the producer and consumer sides apart */
+
+struct SPSCRingStats
+{
+    uint32_t overruns;                        /* Number of blocks dropped for lack of space */
+    uint64_t overrunBytes;                    /* ...and the bytes in them */
+    uint32_t highWater;                       /* Most that's been waiting in the ring */
+};
+
+/* Where a consumer sleeps when there's nothing for it to do */
+struct SPSCWaiter
+{
+    bool waiting;                             /* Consumer is asleep waiting for data */
+    pthread_mutex_t lock;                     /* ...on this */
+    pthread_cond_t cond;                      /* ...until this */
+};
+
+struct SPSCRing
+{
+    uint8_t *d;                               /* The storage */
+    uint32_t size;                            /* ...and its size (a power of two) */
+    struct SPSCWaiter *w;                     /* Where the consumer waits, its own unless shared */
+
+    /* Producer side */
+    uint64_t wp __attribute__( ( aligned( SPSC_CACHE_LINE ) ) ); /* Total bytes written */
+    struct SPSCRingStats stats;               /* Only updated by the producer */
+
+    /* Consumer side */
+    uint64_t rp __attribute__( ( aligned( SPSC_CACHE_LINE ) ) ); /* Total bytes consumed */
+    struct SPSCWaiter ownWaiter;              /* Waiter used when it's not shared */
+};
+
+// ====================================================================================================
+/* Producer */
+bool SPSCRingWrite( struct SPSCRing *r, const uint8_t *d, uint32_t len );
+uint32_t SPSCRingSpace( struct SPSCRing *r );
+
+/* Consumer */
+uint32_t SPSCRingPeek( struct SPSCRing *r, uint8_t **d, uint32_t timeoutmS );
+void SPSCRingConsume( struct SPSCRing *r, uint32_t len );
+bool SPSCWaiterWait( struct SPSCWaiter *w, struct SPSCRing **r, uint32_t n, uint32_t timeoutmS );
+
+/* Anyone */
+uint32_t SPSCRingUsed( struct SPSCRing *r );
+void SPSCRingGetStats( struct SPSCRing *r, struct SPSCRingStats *s );
+
+bool SPSCRingInit( struct SPSCRing *r, uint32_t size );
+void SPSCRingSetWaiter( struct SPSCRing *r, struct SPSCWaiter *w );
+void SPSCRingFree( struct SPSCRing *r );
+void SPSCWaiterInit( struct SPSCWaiter *w );
+void SPSCWaiterFree( struct SPSCWaiter *w );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
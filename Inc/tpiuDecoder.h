@@ -61,7 +61,19 @@ enum TPIUPumpState
     TPIU_ERROR
 };
 
+/* How the decoder decides that frames have gone stale and sync should be dropped */
+enum TPIUTimingPolicy
+{
+    TPIU_TIMING_BLOCK_CLOCK,               /* Coarse monotonic clock, sampled once per block (or per frame for TPIUPump) */
+    TPIU_TIMING_FRAME_COUNT,               /* Too many frames received without a sync */
+    TPIU_TIMING_NONE                       /* Never time out (e.g. for replay from file) */
+};
+
 #define TPIU_PACKET_LEN (16)
+#define TPIU_NUM_STREAMS (128)
+#define TPIU_NULL_STREAM (0)               /* Stream ID 0 is padding */
+#define TPIU_RESERVED_STREAM (0x7F)        /* ...and 0x7F is reserved */
+#define TPIU_STALE_FRAMES (1<<20)          /* Frames without a sync before TPIU_TIMING_FRAME_COUNT drops sync */
 
 struct TPIUDecoderStats
 {
@@ -77,7 +89,10 @@ struct TPIUDecoder
     uint8_t byteCount;                     /* Current byte number in reception */
     uint8_t currentStream;                 /* Currently selected stream */
     uint32_t syncMonitor;                  /* State of sync reception ... in case we loose sync */
-    struct timeval lastPacket;             /* Timestamp for last packet arrival */
+    enum TPIUTimingPolicy timing;          /* How we check for stale frames */
+    uint64_t now;                          /* Time (mS) this block (or frame) arrived, for TPIU_TIMING_BLOCK_CLOCK */
+    uint64_t lastPacket;                   /* Time (mS) of last packet arrival, for TPIU_TIMING_BLOCK_CLOCK */
+    uint32_t framesSinceSync;              /* Frames since last sync, for TPIU_TIMING_FRAME_COUNT */
     uint8_t rxedPacket[TPIU_PACKET_LEN];   /* Packet currently under construction */
 
     struct TPIUDecoderStats stats;         /* Record of comms stats */
@@ -93,15 +108,31 @@ struct TPIUPacket
     } packet[TPIU_PACKET_LEN];
 };
 
+/* Destination for TPIUGetStreamData, a contiguous buffer for each stream of interest */
+struct TPIUStreamBuffers
+{
+    uint8_t *d[TPIU_NUM_STREAMS];          /* Buffer for each stream (NULL to discard its data) */
+    uint32_t size[TPIU_NUM_STREAMS];       /* ...its capacity */
+    uint32_t len[TPIU_NUM_STREAMS];        /* ...and how much of it is in use */
+    uint32_t overflow;                     /* Bytes lost because there was no room for them (updated atomically) */
+    uint32_t unrouted;                     /* Bytes for streams with nowhere to go, excluding null stream (ditto) */
+};
+
+/* Callback for events from TPIUPumpBlock...p is only valid for TPIU_EV_RXEDPACKET */
+typedef void ( *TPIUPacketCB )( enum TPIUPumpEvent e, struct TPIUPacket *p, void *param );
+
 // ====================================================================================================
 void TPIUDecoderForceSync( struct TPIUDecoder *t, uint8_t offset );
 bool TPIUGetPacket( struct TPIUDecoder *t, struct TPIUPacket *p );
+bool TPIUGetStreamData( struct TPIUDecoder *t, struct TPIUStreamBuffers *b );
 void TPIUDecoderZeroStats( struct TPIUDecoder *t );
 bool TPIUDecoderSynced( struct TPIUDecoder *t );
 struct TPIUDecoderStats *TPIUDecoderGetStats( struct TPIUDecoder *t );
 enum TPIUPumpEvent TPIUPump( struct TPIUDecoder *t, uint8_t d );
+void TPIUPumpBlock( struct TPIUDecoder *t, uint8_t *d, uint32_t len, TPIUPacketCB cb, void *param );
+void TPIUPumpBlockStreams( struct TPIUDecoder *t, uint8_t *d, uint32_t len, struct TPIUStreamBuffers *b, TPIUPacketCB cb, void *param );
 
-void TPIUDecoderInit( struct TPIUDecoder *t );
+void TPIUDecoderInit( struct TPIUDecoder *t, enum TPIUTimingPolicy timing );
 // ====================================================================================================
 #ifdef __cplusplus
 }
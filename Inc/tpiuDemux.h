@@ -0,0 +1,82 @@
+/*
+ * TPIU Demultiplexer Module
+ * =========================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TPIU_DEMUX_
+#define _TPIU_DEMUX_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tpiuDecoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TPIU_DEMUX_BUFLEN (8192)              /* Size of buffer for each registered stream */
+
+/* Called with a contiguous run of bytes received on a registered stream */
+typedef void ( *TPIUDemuxStreamCB )( uint8_t *d, uint32_t len, void *param );
+
+/* Called for TPIU sync events (everything except TPIU_EV_RXEDPACKET) */
+typedef void ( *TPIUDemuxEventCB )( enum TPIUPumpEvent e, void *param );
+
+struct TPIUDemux
+{
+    struct TPIUDecoder t;                     /* The decoder we're demuxing */
+    struct TPIUStreamBuffers b;               /* Where unpacked frames for each stream end up */
+
+    TPIUDemuxStreamCB cb[TPIU_NUM_STREAMS];   /* Consumer for each registered stream */
+    void *param[TPIU_NUM_STREAMS];            /* ...and what to pass to it */
+    uint8_t registered[TPIU_NUM_STREAMS];     /* List of registered streams */
+    uint32_t numRegistered;                   /* ...and how many of them there are */
+
+    TPIUDemuxEventCB ecb;                     /* Consumer for sync events */
+    void *eparam;                             /* ...and what to pass to it */
+};
+
+// ====================================================================================================
+bool TPIUDemuxRegister( struct TPIUDemux *m, uint8_t stream, TPIUDemuxStreamCB cb, void *param );
+void TPIUDemuxPump( struct TPIUDemux *m, uint8_t *d, uint32_t len );
+void TPIUDemuxForceSync( struct TPIUDemux *m, uint8_t offset );
+struct TPIUDecoderStats *TPIUDemuxGetStats( struct TPIUDemux *m );
+uint32_t TPIUDemuxGetUnrouted( struct TPIUDemux *m );
+uint32_t TPIUDemuxGetOverflow( struct TPIUDemux *m );
+void TPIUDemuxReset( struct TPIUDemux *m );
+void TPIUDemuxShutdown( struct TPIUDemux *m );
+
+void TPIUDemuxInit( struct TPIUDemux *m, enum TPIUTimingPolicy timing, TPIUDemuxEventCB ecb, void *eparam );
+// ====================================================================================================
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -331,6 +331,65 @@ __dll int ftdispi_read( struct ftdispi_context *fsc,
     return ftdispi_write_read( fsc, 0, 0, buf, count, gpo );
 }
 
+__dll int ftdispi_stream_start( struct ftdispi_context *fsc,
+                                const void *wbuf, uint16_t wcount,
+                                uint8_t gpo )
+{
+    int i;
+
+    ASSERT_CHECK( !fsc, "CTX NOT INITIALIZED", FTDISPI_ERROR_CTX );
+    ASSERT_CHECK( !( wbuf && wcount ), "NO CMD", FTDISPI_ERROR_CMD );
+    ASSERT_CHECK( ftdispi_realloc( fsc, wcount + 6 ), "REALLOC", FTDISPI_ERROR_MEM );
+
+    i = 0;
+    fsc->mem[i++] = SET_BITS_LOW;
+    fsc->mem[i++] = ( ( 0x0F & ( fsc->bitini ^ BIT_P_CS ) ) | ( BIT_P_GX & gpo ) );
+    fsc->mem[i++] = BIT_DIR;
+    fsc->mem[i++] = fsc->wr_cmd;
+    fsc->mem[i++] = ( wcount - 1 ) & 0xFF;
+    fsc->mem[i++] = ( ( wcount - 1 ) >> 8 ) & 0xFF;
+    memcpy( fsc->mem + i, wbuf, wcount );
+    i += wcount;
+    FTDI_CHECK( ftdi_write_data( &fsc->fc, fsc->mem, i ), "STREAM WR", fsc->fc );
+
+    return FTDISPI_ERROR_NONE;
+}
+
+__dll int ftdispi_stream_read( struct ftdispi_context *fsc, uint16_t count )
+{
+    uint8_t buf[3];
+
+    ASSERT_CHECK( !fsc, "CTX NOT INITIALIZED", FTDISPI_ERROR_CTX );
+    ASSERT_CHECK( !count, "NO CMD", FTDISPI_ERROR_CMD );
+
+    buf[0] = fsc->rd_cmd;
+    buf[1] = ( count - 1 ) & 0xFF;
+    buf[2] = ( ( count - 1 ) >> 8 ) & 0xFF;
+    FTDI_CHECK( ftdi_write_data( &fsc->fc, buf, 3 ), "STREAM RD", fsc->fc );
+
+    return FTDISPI_ERROR_NONE;
+}
+
+__dll int ftdispi_stream_stop( struct ftdispi_context *fsc )
+{
+    uint8_t buf[3];
+
+    ASSERT_CHECK( !fsc, "CTX NOT INITIALIZED", FTDISPI_ERROR_CTX );
+
+    /* Throw away any reads that haven't happened yet, and their data */
+#ifdef SIO_TCOFLUSH
+    FTDI_CHECK( ftdi_tcioflush( &fsc->fc ), "PURGE", fsc->fc );
+#else
+    FTDI_CHECK( ftdi_usb_purge_buffers( &fsc->fc ), "PURGE", fsc->fc );
+#endif
+
+    buf[0] = SET_BITS_LOW;
+    buf[1] = fsc->bitini;
+    buf[2] = BIT_DIR;
+    FTDI_CHECK( ftdi_write_data( &fsc->fc, buf, 3 ), "STREAM STOP", fsc->fc );
+    return ftdispi_wait( fsc, BIT_P_CS, fsc->bitini, RETRY_MAX );
+}
+
 __dll int ftdispi_setgpo( struct ftdispi_context *fsc, uint8_t gpo )
 {
     uint8_t buf[3];
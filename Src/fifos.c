@@ -77,12 +77,16 @@
 #include "git_version_info.h"
 #include "generics.h"
 #include "tpiuDecoder.h"
+#include "tpiuDemux.h"
 #include "itmDecoder.h"
 #include "fileWriter.h"
 #include "fifos.h"
 #include "msgDecoder.h"
+#include "msgDispatch.h"
+#include "msgCodec.h"
 
 #define MAX_STRING_LENGTH (100)              /* Maximum length that will be output from a fifo for a single event */
+#define RX_BUFFER_LENGTH  (512)              /* Amount of encoded messages read from a channel pipe at a time */
 
 struct Channel                               /* Information for an individual channel */
 {
@@ -91,6 +95,7 @@ struct Channel                               /* Information for an individual ch
 
     /* Runtime state */
     int handle;                              /* Handle to the fifo */
+    struct MSGCodec codec;                   /* Encoder for messages going into it */
     pthread_t thread;                        /* Thread on which it's running */
 
     char *fifoName;                          /* Constructed fifo name (from chanPath and name) */
@@ -102,8 +107,8 @@ struct fifosHandle
     /* The decoders and the packets from them */
     struct ITMDecoder i;
     struct ITMPacket h;
-    struct TPIUDecoder t;
-    struct TPIUPacket p;
+    struct TPIUDemux t;
+    struct MSGDispatch m;                         /* Dispatcher of decoded messages to their handlers */
     enum timeDelay timeStatus;                    /* Indicator of if this time is exact */
     uint64_t timeStamp;                           /* Latest received time */
 
@@ -118,6 +123,11 @@ struct fifosHandle
     bool permafile;                               /* Use permanent files rather than fifos */
     int tpiuITMChannel;                           /* TPIU channel on which ITM appears */
 
+    void ( *syncLossCB )( void *param );          /* Called when TPIU or ITM loses sync */
+    void *syncLossParam;                          /* ...with this */
+    void ( *msgCB )( struct msg *m, void *param ); /* Called with every decoded message */
+    void *msgParam;                               /* ...with this */
+
     struct Channel c[NUM_CHANNELS + 1];           /* Output for each channel */
 };
 
@@ -140,6 +150,52 @@ struct _runThreadParams                   /* Structure for parameters passed to
 // ====================================================================================================
 // Handlers for the fifos
 // ====================================================================================================
+static ssize_t _writeSW( struct Channel *c, int opfile, struct swMsg *m )
+
+/* Output a software message to the fifo, formatted if there's a format for it */
+
+{
+    char constructString[MAX_STRING_LENGTH];
+    size_t writeDataLen;
+
+    if ( c->presFormat )
+    {
+        // formatted output....start with specials
+        if ( strstr( c->presFormat, "%f" ) )
+        {
+            /* type punning on same host, after correctly building 32bit val
+             * only unsafe on systems where u32/float have diff byte order */
+            float *nastycast = ( float * )&m->value;
+            writeDataLen = snprintf( constructString, MAX_STRING_LENGTH, c->presFormat, *nastycast, *nastycast, *nastycast, *nastycast );
+        }
+        else if ( strstr( c->presFormat, "%c" ) )
+        {
+            /* Format contains %c, so execute repeatedly for all characters in sent data */
+            writeDataLen = 0;
+            uint8_t op[4] = {m->value & 0xff, ( m->value >> 8 ) & 0xff, ( m->value >> 16 ) & 0xff, ( m->value >> 24 ) & 0xff};
+
+            uint32_t l = 0;
+
+            do
+            {
+                writeDataLen += snprintf( &constructString[writeDataLen], MAX_STRING_LENGTH - writeDataLen, c->presFormat, op[l], op[l], op[l], op[l] );
+            }
+            while ( ++l < m->len );
+        }
+        else
+        {
+            writeDataLen = snprintf( constructString, MAX_STRING_LENGTH, c->presFormat, m->value, m->value, m->value, m->value );
+        }
+
+        return write( opfile, constructString, ( writeDataLen < MAX_STRING_LENGTH ) ? writeDataLen : MAX_STRING_LENGTH );
+    }
+    else
+    {
+        // raw output.
+        return write( opfile, &m->value, m->len );
+    }
+}
+// ====================================================================================================
 static void *_runFifo( void *arg )
 
 /* This is the control loop for the channel fifos (for each software port) */
@@ -147,12 +203,17 @@ static void *_runFifo( void *arg )
 {
     struct _runThreadParams *params = ( struct _runThreadParams * )arg;
     struct Channel *c = params->c;
-    struct swMsg m;
-    uint32_t w;
+    struct MSGCodec codec;
+    struct msg m;
 
-    char constructString[MAX_STRING_LENGTH];
+    uint8_t rxBuffer[RX_BUFFER_LENGTH];
+    uint32_t rxLen = 0;
+    uint32_t ofs;
+    int32_t used;
     int opfile;
-    size_t readDataLen, writeDataLen, written = 0;
+    ssize_t readDataLen, written;
+
+    MSGCodecInit( &codec );
 
     /* Remove the file if it exists */
     unlink( c->fifoName );
@@ -178,52 +239,41 @@ static void *_runFifo( void *arg )
             opfile = open( c->fifoName, O_WRONLY | O_CREAT, 0666 );
         }
 
+        written = 1;
+
         do
         {
-            /* ....get the packet */
-            readDataLen = read( params->listenHandle, &m, sizeof( struct msg ) );
+            /* ....get the packets, after anything left over from last time */
+            readDataLen = read( params->listenHandle, &rxBuffer[rxLen], RX_BUFFER_LENGTH - rxLen );
 
             if ( readDataLen <= 0 )
             {
                 continue;
             }
 
-            if ( c->presFormat )
-            {
-                // formatted output....start with specials
-                if ( strstr( c->presFormat, "%f" ) )
-                {
-                    /* type punning on same host, after correctly building 32bit val
-                     * only unsafe on systems where u32/float have diff byte order */
-                    float *nastycast = ( float * )&m.value;
-                    writeDataLen = snprintf( constructString, MAX_STRING_LENGTH, c->presFormat, *nastycast, *nastycast, *nastycast, *nastycast );
-                }
-                else if ( strstr( c->presFormat, "%c" ) )
-                {
-                    /* Format contains %c, so execute repeatedly for all characters in sent data */
-                    writeDataLen = 0;
-                    uint8_t op[4] = {m.value & 0xff, ( m.value >> 8 ) & 0xff, ( m.value >> 16 ) & 0xff, ( m.value >> 24 ) & 0xff};
+            rxLen += readDataLen;
+            ofs = 0;
+            used = 0;
 
-                    uint32_t l = 0;
+            /* Output every complete message, a partial one stays in the buffer until the rest arrives */
+            while ( ( written > 0 ) && ( ( used = MSGCodecDecode( &codec, &rxBuffer[ofs], rxLen - ofs, &m ) ) > 0 ) )
+            {
+                ofs += used;
 
-                    do
-                    {
-                        writeDataLen += snprintf( &constructString[writeDataLen], MAX_STRING_LENGTH - writeDataLen, c->presFormat, op[l], op[l], op[l], op[l] );
-                    }
-                    while ( ++l < m.len );
-                }
-                else
+                if ( m.genericMsg.msgtype == MSG_SOFTWARE )
                 {
-                    writeDataLen = snprintf( constructString, MAX_STRING_LENGTH, c->presFormat, m.value, m.value, m.value, m.value );
+                    written = _writeSW( c, opfile, &m.swMsg );
                 }
-
-                written = write( opfile, constructString, ( writeDataLen < MAX_STRING_LENGTH ) ? writeDataLen : MAX_STRING_LENGTH );
             }
-            else
+
+            if ( used < 0 )
             {
-                // raw output.
-                written = write( opfile, &w, sizeof ( w ) );
+                /* We're out of step with the encoder, which can't happen, so don't spin on it */
+                ofs = rxLen;
             }
+
+            memmove( rxBuffer, &rxBuffer[ofs], rxLen - ofs );
+            rxLen -= ofs;
         }
         while ( ( readDataLen > 0 ) && ( written > 0 ) );
 
@@ -434,7 +484,16 @@ void _handleSW( struct swMsg *m, struct fifosHandle *f )
     {
         if ( ( m->srcAddr < NUM_CHANNELS ) && ( f->c[m->srcAddr].handle ) )
         {
-            write( f->c[m->srcAddr].handle, m, sizeof( struct msg ) );
+            /* Timestamps are sent relative to the last message, so only move the encoder on if this */
+            /* one actually went (it won't if the pipe is full).                                     */
+            struct MSGCodec codec = f->c[m->srcAddr].codec;
+            uint8_t b[MSG_CODEC_MAXLEN];
+            uint32_t len = MSGCodecEncode( &codec, ( struct msg * )m, b );
+
+            if ( write( f->c[m->srcAddr].handle, b, len ) == ( ssize_t )len )
+            {
+                f->c[m->srcAddr].codec = codec;
+            }
         }
     }
 }
@@ -449,6 +508,14 @@ void _handleNISYNC( struct nisyncMsg *m, struct fifosHandle *f )
     write( f->c[HW_CHANNEL].handle, outputString, opLen );
 }
 
+// ====================================================================================================
+void _handleAny( struct msg *m, struct fifosHandle *f )
+
+/* Every message, whatever its type, goes to whoever asked for them */
+
+{
+    f->msgCB( m, f->msgParam );
+}
 // ====================================================================================================
 void _handleTS( struct TSMsg *m, struct fifosHandle *f )
 
@@ -466,128 +533,98 @@ void _handleTS( struct TSMsg *m, struct fifosHandle *f )
     write( f->c[HW_CHANNEL].handle, outputString, opLen );
 }
 // ====================================================================================================
-void _itmPumpProcess( struct fifosHandle *f, char c )
+static void _itmPumpBlock( uint8_t *c, uint32_t len, void *param )
 
-/* Handle individual characters into the itm decoder */
+/* Pump a run of ITM data into the decoder */
 
 {
-    struct msg decoded;
+    struct fifosHandle *f = ( struct fifosHandle * )param;
 
-    typedef void ( *handlers )( void *decoded, struct fifosHandle * f );
+    MSGDispatchPump( &f->m, c, len );
+}
+// ====================================================================================================
+static void _tpiuEvent( enum TPIUPumpEvent e, void *param )
 
-    /* Handlers for each complete message received */
-    static const handlers h[MSG_NUM_MSGS] =
-    {
-        /* MSG_UNKNOWN */         NULL,
-        /* MSG_RESERVED */        NULL,
-        /* MSG_ERROR */           NULL,
-        /* MSG_NONE */            NULL,
-        /* MSG_SOFTWARE */        ( handlers )_handleSW,
-        /* MSG_NISYNC */          ( handlers )_handleNISYNC,
-        /* MSG_OSW */             ( handlers )_handleDataOffsetWP,
-        /* MSG_DATA_ACCESS_WP */  ( handlers )_handleDataAccessWP,
-        /* MSG_DATA_RWWP */       ( handlers )_handleDataRWWP,
-        /* MSG_PC_SAMPLE */       ( handlers )_handlePCSample,
-        /* MSG_DWT_EVENT */       ( handlers )_handleDWTEvent,
-        /* MSG_EXCEPTION */       ( handlers )_handleException,
-        /* MSG_TS */              ( handlers )_handleTS
-    };
+/* Callback for sync events from the TPIU decoder */
 
-    switch ( ITMPump( &f->i, c ) )
-    {
-        // ------------------------------------
-        case ITM_EV_NONE:
-            break;
+{
+    struct fifosHandle *f = ( struct fifosHandle * )param;
 
+    switch ( e )
+    {
         // ------------------------------------
-        case ITM_EV_UNSYNCED:
-            genericsReport( V_WARN, "ITM Lost Sync (%d)" EOL, ITMDecoderGetStats( &f->i )->lostSyncCount );
-            break;
+        case TPIU_EV_NEWSYNC:
+            genericsReport( V_INFO, "TPIU In Sync (%d)" EOL, TPIUDemuxGetStats( &f->t )->syncCount );
 
-        // ------------------------------------
-        case ITM_EV_SYNCED:
-            genericsReport( V_INFO, "ITM In Sync (%d)" EOL, ITMDecoderGetStats( &f->i )->syncCount );
-            break;
+        // This fall-through is deliberate
+        case TPIU_EV_SYNCED:
 
-        // ------------------------------------
-        case ITM_EV_OVERFLOW:
-            genericsReport( V_WARN, "ITM Overflow (%d)" EOL, ITMDecoderGetStats( &f->i )->overflow );
+            ITMDecoderForceSync( &f->i, true );
             break;
 
         // ------------------------------------
-        case ITM_EV_ERROR:
-            genericsReport( V_WARN, "ITM Error" EOL );
+        case TPIU_EV_RXING:
+        case TPIU_EV_NONE:
+        case TPIU_EV_RXEDPACKET:
             break;
 
         // ------------------------------------
-        case ITM_EV_PACKET_RXED:
-            ITMGetDecodedPacket( &f->i, &decoded );
+        case TPIU_EV_UNSYNCED:
+            genericsReport( V_INFO, "TPIU Lost Sync (%d)" EOL, TPIUDemuxGetStats( &f->t )->lostSync );
+            ITMDecoderForceSync( &f->i, false );
 
-            /* See if we decoded a dispatchable match. genericMsg is just used to access */
-            /* the first two members of the decoded structs in a portable way.           */
-            if ( h[decoded.genericMsg.msgtype] )
+            if ( f->syncLossCB )
             {
-                ( h[decoded.genericMsg.msgtype] )( &decoded, f );
+                f->syncLossCB( f->syncLossParam );
             }
 
             break;
 
+        // ------------------------------------
+        case TPIU_EV_ERROR:
+            genericsReport( V_ERROR, "****ERROR****" EOL );
+            break;
             // ------------------------------------
     }
 }
 // ====================================================================================================
-static void _tpiuProtocolPump( struct fifosHandle *f, uint8_t c )
+static void _itmEvent( enum ITMPumpEvent e, void *param )
+
+/* Callback for events from the ITM decoder */
 
 {
-    switch ( TPIUPump( &f->t, c ) )
+    struct fifosHandle *f = ( struct fifosHandle * )param;
+
+    switch ( e )
     {
         // ------------------------------------
-        case TPIU_EV_NEWSYNC:
-            genericsReport( V_INFO, "TPIU In Sync (%d)" EOL, TPIUDecoderGetStats( &f->t )->syncCount );
+        case ITM_EV_UNSYNCED:
+            genericsReport( V_WARN, "ITM Lost Sync (%d)" EOL, ITMDecoderGetStats( &f->i )->lostSyncCount );
 
-        // This fall-through is deliberate
-        case TPIU_EV_SYNCED:
+            if ( f->syncLossCB )
+            {
+                f->syncLossCB( f->syncLossParam );
+            }
 
-            ITMDecoderForceSync( &f->i, true );
             break;
 
         // ------------------------------------
-        case TPIU_EV_RXING:
-        case TPIU_EV_NONE:
+        case ITM_EV_SYNCED:
+            genericsReport( V_INFO, "ITM In Sync (%d)" EOL, ITMDecoderGetStats( &f->i )->syncCount );
             break;
 
         // ------------------------------------
-        case TPIU_EV_UNSYNCED:
-            genericsReport( V_INFO, "TPIU Lost Sync (%d)" EOL, TPIUDecoderGetStats( &f->t )->lostSync );
-            ITMDecoderForceSync( &f->i, false );
+        case ITM_EV_OVERFLOW:
+            genericsReport( V_WARN, "ITM Overflow (%d)" EOL, ITMDecoderGetStats( &f->i )->overflow );
             break;
 
         // ------------------------------------
-        case TPIU_EV_RXEDPACKET:
-            if ( !TPIUGetPacket( &f->t, &f->p ) )
-            {
-                genericsReport( V_WARN, "TPIUGetPacket fell over" EOL );
-            }
-
-            for ( uint32_t g = 0; g < f->p.len; g++ )
-            {
-                if ( f->p.packet[g].s == f->tpiuITMChannel )
-                {
-                    _itmPumpProcess( f, f->p.packet[g].d );
-                    continue;
-                }
-
-                if ( ( f->p.packet[g].s != 0 ) && ( f->p.packet[g].s != 0x7f ) )
-                {
-                    genericsReport( V_INFO, "Unknown TPIU channel %02x" EOL, f->p.packet[g].s );
-                }
-            }
-
+        case ITM_EV_ERROR:
+            genericsReport( V_WARN, "ITM Error" EOL );
             break;
 
         // ------------------------------------
-        case TPIU_EV_ERROR:
-            genericsReport( V_ERROR, "****ERROR****" EOL );
+        default:
             break;
             // ------------------------------------
     }
@@ -685,23 +722,57 @@ int fifoGettpiuITMChannel( struct fifosHandle *f )
 {
     return f->tpiuITMChannel;
 }
+// ====================================================================================================
+uint32_t fifoGetTPIUUnrouted( struct fifosHandle *f )
+
+/* Bytes that arrived for TPIU streams nothing is listening to */
+
+{
+    return TPIUDemuxGetUnrouted( &f->t );
+}
+// ====================================================================================================
+uint32_t fifoGetTPIUOverflow( struct fifosHandle *f )
+
+/* Bytes lost from TPIU streams because they couldn't be handed on in time */
+
+{
+    return TPIUDemuxGetOverflow( &f->t );
+}
+// ====================================================================================================
+void fifoSetSyncLossCB( struct fifosHandle *f, void ( *cb )( void *param ), void *param )
+
+/* Have cb called (on the thread pumping the protocol) whenever TPIU or ITM loses sync */
+
+{
+    f->syncLossCB = cb;
+    f->syncLossParam = param;
+}
+// ====================================================================================================
+void fifoSetMsgCB( struct fifosHandle *f, void ( *cb )( struct msg *m, void *param ), void *param )
+
+/* Have cb called (on the thread pumping the protocol) with every message decoded. Set before fifoCreate */
+
+{
+    f->msgCB = cb;
+    f->msgParam = param;
+}
 
 // ====================================================================================================
 // Main interface components
 // ====================================================================================================
-void fifoProtocolPump( struct fifosHandle *f, uint8_t c )
+void fifoProtocolPump( struct fifosHandle *f, uint8_t *c, int len )
 
 /* Top level protocol pump */
 
 {
     if ( f->useTPIU )
     {
-        _tpiuProtocolPump( f, c );
+        TPIUDemuxPump( &f->t, c, len );
     }
     else
     {
         /* There's no TPIU in use, so this goes straight to the ITM layer */
-        _itmPumpProcess( f, c );
+        _itmPumpBlock( c, len, f );
     }
 }
 // ====================================================================================================
@@ -710,10 +781,61 @@ void fifoForceSync( struct fifosHandle *f, bool synced )
 /* Reset TPIU state and put ITM into defined state */
 
 {
-    TPIUDecoderForceSync( &f->t, 0 );
+    TPIUDemuxForceSync( &f->t, 0 );
     ITMDecoderForceSync( &f->i, synced );
 }
 // ====================================================================================================
+void fifoMetrics( struct metricsOut *o, void *param )
+
+/* Collector for the metrics server, reporting on the decoders. The fifo processing thread */
+/* updates their stats atomically, so they can be read from here while it's running.       */
+
+{
+    struct fifosHandle *f = ( struct fifosHandle * )param;
+    struct TPIUDecoderStats *t = TPIUDemuxGetStats( &f->t );
+    struct ITMDecoderStats *i = ITMDecoderGetStats( &f->i );
+    const struct
+    {
+        const char *type;
+        uint32_t *count;
+    } pkts[] =
+    {
+        { "sw", &i->SWPkt }, { "hw", &i->HWPkt }, { "ts", &i->TSPkt }, { "gts", &i->GTSPkt },
+        { "xtn", &i->XTNPkt }, { "page", &i->PagePkt }, { "reserved", &i->ReservedPkt }, { "error", &i->ErrorPkt }
+    };
+    char labels[30];
+
+    if ( f->useTPIU )
+    {
+        metricsFamily( o, "orbuculum_tpiu_frames_total", "counter", "TPIU frames received" );
+        metricsValue( o, "orbuculum_tpiu_frames_total", NULL, __atomic_load_n( &t->packets, __ATOMIC_RELAXED ) );
+        metricsFamily( o, "orbuculum_tpiu_syncs_total", "counter", "TPIU syncs received" );
+        metricsValue( o, "orbuculum_tpiu_syncs_total", NULL, __atomic_load_n( &t->syncCount, __ATOMIC_RELAXED ) );
+        metricsFamily( o, "orbuculum_tpiu_sync_losses_total", "counter", "Times TPIU sync was lost" );
+        metricsValue( o, "orbuculum_tpiu_sync_losses_total", NULL, __atomic_load_n( &t->lostSync, __ATOMIC_RELAXED ) );
+        metricsFamily( o, "orbuculum_tpiu_errors_total", "counter", "TPIU decode errors" );
+        metricsValue( o, "orbuculum_tpiu_errors_total", NULL, __atomic_load_n( &t->error, __ATOMIC_RELAXED ) );
+        metricsFamily( o, "orbuculum_tpiu_unrouted_bytes_total", "counter", "Bytes received for TPIU streams with no consumer" );
+        metricsValue( o, "orbuculum_tpiu_unrouted_bytes_total", NULL, TPIUDemuxGetUnrouted( &f->t ) );
+        metricsFamily( o, "orbuculum_tpiu_overflow_bytes_total", "counter", "Bytes lost from TPIU streams with a full buffer" );
+        metricsValue( o, "orbuculum_tpiu_overflow_bytes_total", NULL, TPIUDemuxGetOverflow( &f->t ) );
+    }
+
+    metricsFamily( o, "orbuculum_itm_syncs_total", "counter", "ITM syncs received" );
+    metricsValue( o, "orbuculum_itm_syncs_total", NULL, __atomic_load_n( &i->syncCount, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_itm_sync_losses_total", "counter", "Times ITM sync was lost" );
+    metricsValue( o, "orbuculum_itm_sync_losses_total", NULL, __atomic_load_n( &i->lostSyncCount, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_itm_overflows_total", "counter", "ITM overflow packets received" );
+    metricsValue( o, "orbuculum_itm_overflows_total", NULL, __atomic_load_n( &i->overflow, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_itm_packets_total", "counter", "ITM packets received, by type" );
+
+    for ( uint32_t n = 0; n < sizeof( pkts ) / sizeof( pkts[0] ); n++ )
+    {
+        snprintf( labels, sizeof( labels ), "type=\"%s\"", pkts[n].type );
+        metricsValue( o, "orbuculum_itm_packets_total", labels, __atomic_load_n( pkts[n].count, __ATOMIC_RELAXED ) );
+    }
+}
+// ====================================================================================================
 bool fifoCreate( struct fifosHandle *f )
 
 /* Create each sub-process that will handle a port */
@@ -726,9 +848,33 @@ bool fifoCreate( struct fifosHandle *f )
     f->lastHWExceptionTS = genericsTimestampuS();
 
     /* Reset the TPIU handler before we start */
-    TPIUDecoderInit( &f->t );
+    TPIUDemuxInit( &f->t, TPIU_TIMING_BLOCK_CLOCK, _tpiuEvent, f );
+
+    if ( !TPIUDemuxRegister( &f->t, f->tpiuITMChannel, _itmPumpBlock, f ) )
+    {
+        genericsReport( V_ERROR, "Cannot use TPIU channel %d for ITM" EOL, f->tpiuITMChannel );
+        return false;
+    }
+
     ITMDecoderInit( &f->i, f->forceITMSync );
 
+    /* Handlers for each complete message received */
+    MSGDispatchInit( &f->m, &f->i, _itmEvent, f );
+    MSGDispatchRegister( &f->m, MSG_SOFTWARE, ( MSGDispatchHandler )_handleSW );
+    MSGDispatchRegister( &f->m, MSG_NISYNC, ( MSGDispatchHandler )_handleNISYNC );
+    MSGDispatchRegister( &f->m, MSG_OSW, ( MSGDispatchHandler )_handleDataOffsetWP );
+    MSGDispatchRegister( &f->m, MSG_DATA_ACCESS_WP, ( MSGDispatchHandler )_handleDataAccessWP );
+    MSGDispatchRegister( &f->m, MSG_DATA_RWWP, ( MSGDispatchHandler )_handleDataRWWP );
+    MSGDispatchRegister( &f->m, MSG_PC_SAMPLE, ( MSGDispatchHandler )_handlePCSample );
+    MSGDispatchRegister( &f->m, MSG_DWT_EVENT, ( MSGDispatchHandler )_handleDWTEvent );
+    MSGDispatchRegister( &f->m, MSG_EXCEPTION, ( MSGDispatchHandler )_handleException );
+    MSGDispatchRegister( &f->m, MSG_TS, ( MSGDispatchHandler )_handleTS );
+
+    if ( f->msgCB )
+    {
+        MSGDispatchRegisterAll( &f->m, ( MSGDispatchHandler )_handleAny );
+    }
+
     /* Cycle through channels and create a fifo for each one that is enabled */
     for ( int t = 0; t < ( NUM_CHANNELS + 1 ); t++ )
     {
@@ -749,6 +895,7 @@ bool fifoCreate( struct fifosHandle *f )
                 }
 
                 f->c[t].handle = fd[1];
+                MSGCodecInit( &f->c[t].codec );
 
                 params = ( struct _runThreadParams * )malloc( sizeof( struct _runThreadParams ) );
                 params->listenHandle = fd[0];
@@ -0,0 +1,352 @@
+/*
+ * File Source Module
+ * ==================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replay of capture files. The file is mapped rather than read, so a block of it can be handed
+ * straight to the decoders. Replay can either go as fast as the data can be processed, or be
+ * paced against the clock to a given data rate. When following a file that's still being
+ * written, growth is waited for with inotify where that's available. A file being followed
+ * can also be truncated, which would fault any access to a mapping past its new end, so it's
+ * read instead.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined LINUX
+    #include <sys/inotify.h>
+#endif
+#include "fileSource.h"
+
+#define PACE_INTERVAL  (1000000)          /* nS of data handed out at a time when pacing */
+#define NOTIFY_TIMEOUT (1000)             /* mS to wait for notification before checking anyway */
+#define POLL_INTERVAL  (10000)            /* uS between checks on the file without notification */
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static double _elapsed( struct timespec *from )
+
+/* Seconds since a time */
+
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec - from->tv_sec ) + ( now.tv_nsec - from->tv_nsec ) / 1e9;
+}
+// ====================================================================================================
+static void _sleepUntil( struct timespec *from, double secs )
+
+{
+#if defined LINUX
+    struct timespec t = *from;
+
+    t.tv_sec += ( time_t )secs;
+    t.tv_nsec += ( long )( ( secs - ( time_t )secs ) * 1e9 );
+
+    if ( t.tv_nsec >= 1000000000L )
+    {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+
+    while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL ) == EINTR );
+#else
+    /* There's no absolute sleep here, so sleep for whatever is left of the time from now */
+    double left = secs - _elapsed( from );
+    struct timespec t;
+
+    if ( left <= 0 )
+    {
+        return;
+    }
+
+    t.tv_sec = ( time_t )left;
+    t.tv_nsec = ( long )( ( left - ( time_t )left ) * 1e9 );
+
+    while ( ( nanosleep( &t, &t ) < 0 ) && ( errno == EINTR ) );
+#endif
+}
+// ====================================================================================================
+static void _resetPace( struct FileSource *s )
+
+/* Start pacing from now, so time spent waiting for data isn't caught up on in a rush */
+
+{
+    clock_gettime( CLOCK_MONOTONIC, &s->start );
+    s->paced = 0;
+}
+// ====================================================================================================
+static bool _refresh( struct FileSource *s )
+
+/* Pick up the file as it is now, mapping it unless it's being followed. Returns false if it can't be */
+
+{
+    struct stat st;
+
+    if ( fstat( s->fd, &st ) < 0 )
+    {
+        return false;
+    }
+
+    if ( ( size_t )st.st_size == s->size )
+    {
+        return true;
+    }
+
+    if ( s->map )
+    {
+        munmap( ( void * )s->map, s->size );
+        s->map = NULL;
+    }
+
+    /* If the file has been truncated then it's being started again, so we do too */
+    if ( ( size_t )st.st_size < s->pos )
+    {
+        s->pos = 0;
+    }
+
+    s->size = st.st_size;
+
+    if ( ( s->size ) && ( !s->follow ) )
+    {
+        if ( ( s->map = mmap( NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0 ) ) == MAP_FAILED )
+        {
+            s->map = NULL;
+            s->size = 0;
+            return false;
+        }
+
+        madvise( ( void * )s->map, s->size, MADV_SEQUENTIAL );
+    }
+
+    return true;
+}
+// ====================================================================================================
+static void _waitForGrowth( struct FileSource *s )
+
+/* Wait until the file may have changed */
+
+{
+#if defined LINUX
+    uint8_t events[sizeof( struct inotify_event ) + NAME_MAX + 1];
+    struct pollfd p = { .fd = s->notify, .events = POLLIN };
+
+    if ( s->notify >= 0 )
+    {
+        /* Any event is only a hint to look at the file again, so what they say doesn't matter. */
+        /* Any left over will just get us back here a bit quicker next time.                   */
+        if ( ( poll( &p, 1, NOTIFY_TIMEOUT ) > 0 ) && ( read( s->notify, events, sizeof( events ) ) < 0 ) )
+        {
+            usleep( POLL_INTERVAL );
+        }
+
+        return;
+    }
+
+#endif
+    usleep( POLL_INTERVAL );
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+bool FileSourceOpen( struct FileSource *s, const char *filename, bool follow, double rate )
+
+{
+    memset( s, 0, sizeof( struct FileSource ) );
+    s->notify = -1;
+    s->follow = follow;
+    s->rate = rate;
+
+    if ( ( s->fd = open( filename, O_RDONLY ) ) < 0 )
+    {
+        return false;
+    }
+
+#if defined LINUX
+
+    if ( follow )
+    {
+        /* Without notification we fall back to checking the file regularly */
+        if ( ( s->notify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) ) >= 0 )
+        {
+            if ( inotify_add_watch( s->notify, filename, IN_MODIFY | IN_CLOSE_WRITE ) < 0 )
+            {
+                close( s->notify );
+                s->notify = -1;
+            }
+        }
+    }
+
+#endif
+
+    if ( !_refresh( s ) )
+    {
+        FileSourceClose( s );
+        return false;
+    }
+
+    _resetPace( s );
+    return true;
+}
+// ====================================================================================================
+int32_t FileSourceGet( struct FileSource *s, const uint8_t **d, uint32_t maxLen )
+
+{
+    size_t len;
+    ssize_t r;
+    double due;
+
+    if ( ( s->follow ) && ( s->bufLen < maxLen ) )
+    {
+        free( s->buf );
+        s->bufLen = 0;
+
+        if ( !( s->buf = ( uint8_t * )malloc( maxLen ) ) )
+        {
+            return -1;
+        }
+
+        s->bufLen = maxLen;
+    }
+
+    do
+    {
+        while ( s->pos == s->size )
+        {
+            if ( !s->follow )
+            {
+                return 0;
+            }
+
+            _waitForGrowth( s );
+
+            if ( !_refresh( s ) )
+            {
+                return -1;
+            }
+
+            _resetPace( s );
+        }
+
+        len = s->size - s->pos;
+
+        if ( s->rate > 0 )
+        {
+            /* Hand out what's due a pacing interval at a time, sleeping until it is */
+            due = s->rate * PACE_INTERVAL / 1e9;
+            len = ( len < due ) ? len : ( ( due < 1 ) ? 1 : due );
+            _sleepUntil( &s->start, ( s->paced + len ) / s->rate );
+
+            /* ...and if we fell behind, catch up */
+            due = s->rate * _elapsed( &s->start ) - s->paced;
+
+            if ( due > len )
+            {
+                len = ( due < s->size - s->pos ) ? due : s->size - s->pos;
+            }
+        }
+
+        len = ( len < maxLen ) ? len : maxLen;
+
+        if ( !s->follow )
+        {
+            *d = &s->map[s->pos];
+            r = len;
+        }
+        else
+        {
+            while ( ( ( r = pread( s->fd, s->buf, len, s->pos ) ) < 0 ) && ( errno == EINTR ) );
+
+            if ( r < 0 )
+            {
+                return -1;
+            }
+
+            /* Nothing there means it's been truncated since we looked, so look again */
+            if ( !r )
+            {
+                s->size = s->pos;
+            }
+
+            *d = s->buf;
+        }
+    }
+    while ( !r );
+
+    s->paced += r;
+    s->pos += r;
+    return r;
+}
+// ====================================================================================================
+void FileSourceClose( struct FileSource *s )
+
+{
+    if ( s->map )
+    {
+        munmap( ( void * )s->map, s->size );
+    }
+
+    free( s->buf );
+
+    if ( s->notify >= 0 )
+    {
+        close( s->notify );
+    }
+
+    if ( s->fd >= 0 )
+    {
+        close( s->fd );
+    }
+
+    s->map = NULL;
+    s->buf = NULL;
+    s->bufLen = 0;
+    s->notify = s->fd = -1;
+}
+// ====================================================================================================
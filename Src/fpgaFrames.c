@@ -0,0 +1,189 @@
+/*
+ * FPGA Frame Compaction Module
+ * ============================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compaction of the frames arriving from the orbtrace FPGA. Each frame is a header followed by
+ * 16 bytes of trace, and the link is mostly idle frames when the target is quiet. A run of
+ * frames is stripped of headers and idle frames in one pass, with the payload moved as a
+ * single vector where that's available. The best implementation for the host is selected on
+ * first use.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fpgaFrames.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HAVE_X86_SIMD
+#endif
+
+/* Amount d moves on by for a frame with header h, without a branch on whether it's idle */
+#define ADVANCE(h) ( ( ~( h ) & FPGA_HDR_IDLE ) >> 3 )
+
+typedef uint32_t ( *_compactFn )( const uint8_t *f, uint32_t frames, uint8_t hdr, uint8_t *d, uint32_t *dataFrames );
+static _compactFn _compact;
+static pthread_once_t _compactOnce = PTHREAD_ONCE_INIT;
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static uint32_t _compactScalar( const uint8_t *f, uint32_t frames, uint8_t hdr, uint8_t *d, uint32_t *dataFrames )
+
+/* Portable version, payload is always copied and only kept if the frame carried data */
+
+{
+    uint8_t *s = d;
+    uint32_t n;
+
+    for ( n = 0; ( n < frames ) && ( ( f[0] & ~FPGA_HDR_IDLE ) == hdr ); n++ )
+    {
+        memcpy( d, &f[1], FPGA_PAYLOAD_LEN );
+        d += ADVANCE( f[0] );
+        f += FPGA_FRAME_LEN;
+    }
+
+    *dataFrames = ( d - s ) / FPGA_PAYLOAD_LEN;
+    return n;
+}
+// ====================================================================================================
+#ifdef HAVE_X86_SIMD
+__attribute__( ( target( "sse2" ) ) )
+static uint32_t _compactSSE2( const uint8_t *f, uint32_t frames, uint8_t hdr, uint8_t *d, uint32_t *dataFrames )
+
+{
+    uint8_t *s = d;
+    uint32_t n;
+
+    for ( n = 0; ( n < frames ) && ( ( f[0] & ~FPGA_HDR_IDLE ) == hdr ); n++ )
+    {
+        _mm_storeu_si128( ( __m128i * )d, _mm_loadu_si128( ( const __m128i * )&f[1] ) );
+        d += ADVANCE( f[0] );
+        f += FPGA_FRAME_LEN;
+    }
+
+    *dataFrames = ( d - s ) / FPGA_PAYLOAD_LEN;
+    return n;
+}
+// ====================================================================================================
+__attribute__( ( target( "avx2" ) ) )
+static uint32_t _compactAVX2( const uint8_t *f, uint32_t frames, uint8_t hdr, uint8_t *d, uint32_t *dataFrames )
+
+/* Headers are checked eight frames at a time, so a run of idle frames costs very little */
+
+{
+    const __m256i idx = _mm256_setr_epi32( 0, 1 * FPGA_FRAME_LEN, 2 * FPGA_FRAME_LEN, 3 * FPGA_FRAME_LEN,
+                                           4 * FPGA_FRAME_LEN, 5 * FPGA_FRAME_LEN, 6 * FPGA_FRAME_LEN, 7 * FPGA_FRAME_LEN );
+    const __m256i mask = _mm256_set1_epi32( ( uint8_t )~FPGA_HDR_IDLE );
+    const __m256i want = _mm256_set1_epi32( hdr );
+    uint8_t *s = d;
+    uint32_t n = 0;
+
+    for ( ; n + 8 <= frames; n += 8 )
+    {
+        /* The last header gathered is well inside the eight frames, so this can't overrun */
+        __m256i h = _mm256_i32gather_epi32( ( const int * )f, idx, 1 );
+
+        if ( _mm256_movemask_epi8( _mm256_cmpeq_epi32( _mm256_and_si256( h, mask ), want ) ) != -1 )
+        {
+            /* Somewhere in here is where we stop, so leave it to the frame at a time loop */
+            break;
+        }
+
+        /* Idle flag of each frame, moved up to where movemask can see it */
+        if ( _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_slli_epi32( h, 24 ) ) ) != 0xFF )
+        {
+            for ( uint32_t k = 0; k < 8; k++ )
+            {
+                _mm_storeu_si128( ( __m128i * )d, _mm_loadu_si128( ( const __m128i * )&f[1] ) );
+                d += ADVANCE( f[0] );
+                f += FPGA_FRAME_LEN;
+            }
+        }
+        else
+        {
+            f += 8 * FPGA_FRAME_LEN;
+        }
+    }
+
+    for ( ; ( n < frames ) && ( ( f[0] & ~FPGA_HDR_IDLE ) == hdr ); n++ )
+    {
+        _mm_storeu_si128( ( __m128i * )d, _mm_loadu_si128( ( const __m128i * )&f[1] ) );
+        d += ADVANCE( f[0] );
+        f += FPGA_FRAME_LEN;
+    }
+
+    *dataFrames = ( d - s ) / FPGA_PAYLOAD_LEN;
+    return n;
+}
+#endif
+// ====================================================================================================
+static void _selectCompact( void )
+
+/* Select the best compactor for this host. Called once, whichever thread gets here first */
+
+{
+    _compact = _compactScalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        _compact = _compactAVX2;
+    }
+    else if ( __builtin_cpu_supports( "sse2" ) )
+    {
+        _compact = _compactSSE2;
+    }
+
+#endif
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+uint32_t FPGAFramesCompact( const uint8_t *f, uint32_t frames, uint8_t hdr, uint8_t *d, uint32_t *dataFrames )
+
+{
+    pthread_once( &_compactOnce, _selectCompact );
+    return _compact( f, frames, hdr, d, dataFrames );
+}
+// ====================================================================================================
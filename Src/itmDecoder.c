@@ -39,6 +39,7 @@
 #include <string.h>
 #include "itmDecoder.h"
 #include "msgDecoder.h"
+#include "syncScan.h"
 
 #ifdef DEBUG
     #include <stdio.h>
@@ -52,8 +53,80 @@
 #define TPIU_SYNCMASK         0xFFFFFFFF
 #define TPIU_SYNCPATTERN      0xFFFFFF7F      /* This should not be seen in ITM data */
 #define MAX_PACKET            (5)
+#define MAX_GTS1_PACKET       (5)     /* Header plus TS[25:0] and flags */
+#define MAX_GTS2_PACKET       (7)     /* Header plus TS[63:26] */
 #define DEFAULT_PAGE_REGISTER (0x07)
 
+/* Stats are read from other threads (e.g. for metrics), so they're only ever added to atomically */
+#define STAT_ADD(s,n)         __atomic_fetch_add( &( s ), ( n ), __ATOMIC_RELAXED )
+
+/* What a header byte, received while idle, announces */
+enum _hdrKind
+{
+    HDR_SW,                              /* Instrumentation (SW) source packet */
+    HDR_HW,                              /* Hardware source packet */
+    HDR_SYNC,                            /* Zero byte, part of a sync */
+    HDR_OVERFLOW,                        /* Overflow */
+    HDR_TS1,                             /* Timestamp format 1, more to follow */
+    HDR_TS2,                             /* Timestamp format 2, single byte */
+    HDR_GTS1,                            /* Global timestamp 1 */
+    HDR_GTS2,                            /* Global timestamp 2 */
+    HDR_NISYNC,                          /* Normal I-Sync */
+    HDR_PAGE,                            /* Stimulus port page register setting */
+    HDR_XTN,                             /* Other extension packet, more to follow */
+    HDR_RSVD1,                           /* Reserved, single byte */
+    HDR_RSVD,                            /* Reserved, more to follow */
+    HDR_ILLEGAL                          /* Encoding we don't know how to handle */
+};
+
+/* Classification of a header byte ... the tests are order dependent, so don't shuffle them */
+#define _HDR_KIND(c)                                                    \
+    ( ( c ) == 0x00                   ? HDR_SYNC     :                   \
+      ( ( c ) & 0x03 )                ? ( ( ( c ) & 0x04 ) ? HDR_HW : HDR_SW ) : \
+      ( c ) == 0x70                   ? HDR_OVERFLOW :                   \
+      !( ( c ) & 0x0F )               ? ( ( ( c ) & 0x80 ) ? HDR_TS1 : HDR_TS2 ) : \
+      ( ( c ) & 0xDF ) == 0x94        ? ( ( ( c ) & 0x20 ) ? HDR_GTS2 : HDR_GTS1 ) : \
+      ( c ) == 0x08                   ? HDR_NISYNC   :                   \
+      ( ( c ) & 0x08 )                ? ( ( ( c ) & 0x84 ) ? HDR_XTN : HDR_PAGE ) : \
+      ( ( c ) & 0x04 )                ? ( ( ( c ) & 0x80 ) ? HDR_RSVD : HDR_RSVD1 ) : \
+      HDR_ILLEGAL )
+
+/* Payload bytes to collect for a source packet (NISYNC has contextIDlen added at runtime) */
+#define _HDR_LEN(c)                                                     \
+    ( ( _HDR_KIND(c) == HDR_SW ) || ( _HDR_KIND(c) == HDR_HW ) ? ( ( ( ( c ) & 0x03 ) == 3 ) ? 4 : ( ( c ) & 0x03 ) ) : \
+      ( _HDR_KIND(c) == HDR_NISYNC ) ? MAX_PACKET : 0 )
+
+/* State to move to once the header has been absorbed */
+#define _HDR_NEXT(c)                                                    \
+    ( _HDR_KIND(c) == HDR_SW     ? ITM_SW     :                         \
+      _HDR_KIND(c) == HDR_HW     ? ITM_HW     :                         \
+      _HDR_KIND(c) == HDR_TS1    ? ITM_TS     :                         \
+      _HDR_KIND(c) == HDR_GTS1   ? ITM_GTS1   :                         \
+      _HDR_KIND(c) == HDR_GTS2   ? ITM_GTS2   :                         \
+      _HDR_KIND(c) == HDR_NISYNC ? ITM_NISYNC :                         \
+      _HDR_KIND(c) == HDR_XTN    ? ITM_XTN    :                         \
+      _HDR_KIND(c) == HDR_RSVD   ? ITM_RSVD   : ITM_IDLE )
+
+/* Short source packets are read as 32 bit values, so need their top bytes cleared */
+#define _HDR_ZERO(c) ( ( _HDR_LEN(c) < ITM_DATA_PACKET ) && ( _HDR_NEXT(c) == ITM_SW || _HDR_NEXT(c) == ITM_HW ) )
+
+#define _HDR(c)    { _HDR_KIND(c), _HDR_LEN(c), _HDR_NEXT(c), _HDR_ZERO(c) }
+#define _HDR4(c)   _HDR(c), _HDR((c)+1), _HDR((c)+2), _HDR((c)+3)
+#define _HDR16(c)  _HDR4(c), _HDR4((c)+4), _HDR4((c)+8), _HDR4((c)+12)
+#define _HDR64(c)  _HDR16(c), _HDR16((c)+16), _HDR16((c)+32), _HDR16((c)+48)
+
+/* Everything ITM_IDLE needs to know about a header byte, in one lookup */
+static const struct
+{
+    uint8_t kind;                        /* enum _hdrKind */
+    uint8_t len;                         /* Payload bytes to collect */
+    uint8_t next;                        /* enum _protoState to move to */
+    uint8_t zero;                        /* Payload must be cleared before collection */
+} _hdrTable[256] =
+{
+    _HDR64( 0x00 ), _HDR64( 0x40 ), _HDR64( 0x80 ), _HDR64( 0xC0 )
+};
+
 // Define this to get transitions printed out
 // ====================================================================================================
 void ITMDecoderInit( struct ITMDecoder *i, bool startSynced )
@@ -72,7 +145,13 @@ void ITMDecoderInit( struct ITMDecoder *i, bool startSynced )
 void ITMDecoderZeroStats( struct ITMDecoder *i )
 
 {
-    memset( &i->stats, 0, sizeof( struct ITMDecoderStats ) );
+    uint32_t *s = ( uint32_t * )&i->stats;
+
+    /* ...the stats are all uint32_t counters */
+    for ( uint32_t n = 0; n < sizeof( struct ITMDecoderStats ) / sizeof( uint32_t ); n++ )
+    {
+        __atomic_store_n( &s[n], 0, __ATOMIC_RELAXED );
+    }
 }
 // ====================================================================================================
 bool ITMDecoderIsSynced( struct ITMDecoder *i )
@@ -96,7 +175,7 @@ void ITMDecoderForceSync( struct ITMDecoder *i, bool isSynced )
         if ( isSynced )
         {
             i->p = ITM_IDLE;
-            i->stats.syncCount++;
+            STAT_ADD( i->stats.syncCount, 1 );
             i->pk.len = 0;
         }
     }
@@ -104,12 +183,35 @@ void ITMDecoderForceSync( struct ITMDecoder *i, bool isSynced )
     {
         if ( !isSynced )
         {
-            i->stats.lostSyncCount++;
+            STAT_ADD( i->stats.lostSyncCount, 1 );
             i->p = ITM_UNSYNCED;
         }
     }
 }
 // ====================================================================================================
+uint32_t ITMDecoderSkipToSync( struct ITMDecoder *i, const uint8_t *c, uint32_t len )
+
+/* While unsynced, absorb everything that can't contain a sync. Returns number of bytes consumed */
+
+{
+    uint32_t skip;
+
+    if ( i->p != ITM_UNSYNCED )
+    {
+        return 0;
+    }
+
+    skip = SyncScanITM( c, len );
+
+    /* Keep the tail of what we skipped in case a sync straddles the block */
+    for ( const uint8_t *s = ( skip > sizeof( i->syncStat ) ) ? c + skip - sizeof( i->syncStat ) : c; s < c + skip; s++ )
+    {
+        i->syncStat = ( i->syncStat << 8 ) | *s;
+    }
+
+    return skip;
+}
+// ====================================================================================================
 bool ITMGetPacket( struct ITMDecoder *i, struct ITMPacket *p )
 
 /* Copy raw received packet into transfer buffer */
@@ -152,12 +254,12 @@ enum ITMPumpEvent ITMPump( struct ITMDecoder *i, uint8_t c )
 
     if ( ( ( i->syncStat )&TPIU_SYNCMASK ) == TPIU_SYNCPATTERN )
     {
-        i->stats.tpiuSyncCount++;
+        STAT_ADD( i->stats.tpiuSyncCount, 1 );
     }
 
     if ( ( ( i->syncStat )&SYNCMASK ) == SYNCPATTERN )
     {
-        i->stats.syncCount++;
+        STAT_ADD( i->stats.syncCount, 1 );
 
         /* Page register is reset on a sync */
         i->pk.pageRegister = 0;
@@ -175,188 +277,142 @@ enum ITMPumpEvent ITMPump( struct ITMDecoder *i, uint8_t c )
 
             // -----------------------------------------------------
             case ITM_IDLE:
-
-                /* Start off by making sure entire received packet is 0'ed */
-                memset( i->pk.d, 0, ITM_MAX_PACKET );
-
-                // *************************************************
-                // ************** SYNC PACKET **********************
-                // *************************************************
-                if ( c == 0b00000000 )
-                {
-                    break;
-                }
+                newState = _hdrTable[c].next;
 
                 // *************************************************
                 // ************** SOURCE PACKET ********************
                 // *************************************************
-                if ( c & 0b00000011 )
+                /* These dominate, so deal with them before getting into the rest */
+                if ( _hdrTable[c].kind <= HDR_HW )
                 {
-                    i->targetCount = ( c & 0x03 );
+                    /* Instrumentation (SW) or HW packet */
+                    STAT_ADD( *( ( _hdrTable[c].kind == HDR_SW ) ? &i->stats.SWPkt : &i->stats.HWPkt ), 1 );
 
-                    if ( i->targetCount == 3 )
+                    if ( _hdrTable[c].zero )
                     {
-                        i->targetCount = 4;
+                        memset( i->pk.d, 0, ITM_DATA_PACKET );
                     }
 
+                    i->targetCount = _hdrTable[c].len;
                     i->pk.len = 0;
                     i->pk.srcAddr = ( c & 0xF8 ) >> 3;
-
-                    if ( !( c & 0x04 ) )
-                    {
-                        /* This is a Instrumentation (SW) packet */
-                        i->stats.SWPkt++;
-                        newState = ITM_SW;
-                    }
-                    else
-                    {
-                        /* This is a HW packet */
-                        i->stats.HWPkt++;
-                        newState = ITM_HW;
-                    }
-
-                    break;
-                }
-
-                // *************************************************
-                // ************** PROTOCOL PACKET ******************
-                // *************************************************
-
-                if ( c == 0b01110000 )
-                {
-                    /* This is an overflow packet */
-                    i->stats.overflow++;
-                    retVal = ITM_EV_OVERFLOW;
                     break;
                 }
 
-                // ***********************************************
-                if ( !( c & 0x0F ) )
+                switch ( _hdrTable[c].kind )
                 {
-                    i->pk.len = 1; /* The '1' is deliberate. */
-                    /* This is a timestamp packet */
-                    i->pk.d[0] = c;
-                    i->stats.TSPkt++;
-
-                    if ( c & 0x80 )
-                    {
-                        /* This is TS packet format 1, so there's more to follow */
-                        newState = ITM_TS;
-                    }
-                    else
-                    {
+                    // *************************************************
+                    // ************** SYNC PACKET **********************
+                    // *************************************************
+                    case HDR_SYNC:
+                        break;
+
+                    // *************************************************
+                    // ************** PROTOCOL PACKETS *****************
+                    // *************************************************
+                    case HDR_OVERFLOW:
+                        /* This is an overflow packet */
+                        STAT_ADD( i->stats.overflow, 1 );
+                        retVal = ITM_EV_OVERFLOW;
+                        break;
+
+                    // ***********************************************
+                    case HDR_TS2:
                         /* This is TS packet format 2, no more to come, and no change of state */
                         i->pk.type = ITM_PT_TS;
                         retVal = ITM_EV_PACKET_RXED;
-                    }
-
-                    break;
-                }
-
-                // ***********************************************
-                if ( ( c & 0b11011111 ) == 0b10010100 )
-                {
-                    /* This is a global timestamp packet */
-                    if ( ( c & 0b00100000 ) == 0 )
-                    {
-                        newState = ITM_GTS1;
-                    }
-                    else
-                    {
-                        newState = ITM_GTS2;
-                    }
-
-                    break;
-                }
-
-                // ***********************************************
-                if ( c == 0b00001000 )
-                {
-                    /* This is a normal I-sync packet */
-                    newState = ITM_NISYNC;
-                    i->pk.len = 0;
-                    i->targetCount = MAX_PACKET + i->contextIDlen;
-                    break;
-                }
 
-                // ***********************************************
-                if ( ( c & 0b00001000 ) == 0b00001000 )
-                {
-                    /* Extension Packet */
-                    i->pk.len = 1; /* The '1' is deliberate. */
-                    i->stats.XTNPkt++;
-
-                    i->pk.d[0] = c;
-
-                    if ( !( c & 0x84 ) )
-                    {
+                    // Fallthrough
+                    case HDR_TS1:
+                        /* This is a timestamp packet ... for format 1 there's more to follow */
+                        i->pk.len = 1; /* The '1' is deliberate. */
+                        i->pk.d[0] = c;
+                        STAT_ADD( i->stats.TSPkt, 1 );
+                        break;
+
+                    // ***********************************************
+                    case HDR_GTS1:
+                    case HDR_GTS2:
+                        /* This is a global timestamp packet */
+                        i->pk.len = 1;
+                        i->pk.d[0] = c;
+                        STAT_ADD( i->stats.GTSPkt, 1 );
+                        break;
+
+                    // ***********************************************
+                    case HDR_NISYNC:
+                        /* This is a normal I-sync packet */
+                        i->pk.len = 0;
+                        i->targetCount = _hdrTable[c].len + i->contextIDlen;
+                        break;
+
+                    // ***********************************************
+                    case HDR_PAGE:
                         /* This is the Stimulus Port Page Register setting ... deal with it here */
-                        i->stats.PagePkt++;
+                        STAT_ADD( i->stats.PagePkt, 1 );
                         i->pk.pageRegister = ( c >> 4 ) & 0x07;
-                    }
-                    else
-                    {
-                        newState = ITM_XTN;
-                    }
-
-                    break;
-                }
 
-                // ***********************************************
-                if ( ( ( c & 0b11000100 ) == 0b11000100 ) ||
-                        ( ( c & 0b10000100 ) == 0b10000100 ) ||
-                        ( ( c & 0b11110000 ) == 0b11110000 ) ||
-                        ( ( c & 0b00000100 ) == 0b00000100 ) )
-                {
-                    /* Reserved packets - we have no idea what these are */
-                    i->pk.len = 1;
-                    i->stats.ReservedPkt++;
-                    i->pk.d[0] = c;
+                    // Fallthrough
+                    case HDR_XTN:
+                        /* Extension Packet */
+                        i->pk.len = 1; /* The '1' is deliberate. */
+                        STAT_ADD( i->stats.XTNPkt, 1 );
+                        i->pk.d[0] = c;
+                        break;
 
-                    if ( !( c & 0x80 ) )
-                    {
+                    // ***********************************************
+                    case HDR_RSVD1:
                         i->pk.type = ITM_PT_RSRVD;
                         retVal = ITM_EV_PACKET_RXED;
-                    }
-                    else
-                    {
-                        /* According to protocol, this is multi-byte, so report it */
-                        newState = ITM_RSVD;
-                    }
-
-                    break;
-                }
 
-                // Any other value here isn't valid - so fall through to illegal packet case
-
-
-                // *************************************************
-                // ************** ILLEGAL PACKET *******************
-                // *************************************************
-                /* This is a reserved encoding we don't know how to handle */
-                /* ...assume it's line noise and wait for sync again */
-                i->stats.ErrorPkt++;
+                    // Fallthrough
+                    case HDR_RSVD:
+                        /* Reserved packets - we have no idea what these are */
+                        /* According to protocol, the multi-byte ones get reported once complete */
+                        i->pk.len = 1;
+                        STAT_ADD( i->stats.ReservedPkt, 1 );
+                        i->pk.d[0] = c;
+                        break;
+
+                    // *************************************************
+                    // ************** ILLEGAL PACKET *******************
+                    // *************************************************
+                    default:
+                        /* This is a reserved encoding we don't know how to handle */
+                        /* ...assume it's line noise and wait for sync again */
+                        STAT_ADD( i->stats.ErrorPkt, 1 );
 #ifdef DEBUG
-                fprintf( stderr, EOL "%02X " EOL, c );
+                        fprintf( stderr, EOL "%02X " EOL, c );
 #endif
-                retVal = ITM_EV_ERROR;
-                genericsReport( V_DEBUG, "General error for packet type %02x" EOL, c );
+                        retVal = ITM_EV_ERROR;
+                        genericsReport( V_DEBUG, "General error for packet type %02x" EOL, c );
+                        break;
+                }
+
                 break;
 
             // -----------------------------------------------------
             case ITM_GTS1:  // Collecting GTS1 timestamp - wait for a zero continuation bit
-                if ( ( c & 0x80 ) == 0 )
+                i->pk.d[i->pk.len++] = c;
+
+                if ( ( !( c & 0x80 ) ) || ( i->pk.len >= MAX_GTS1_PACKET ) )
                 {
                     newState = ITM_IDLE;
+                    i->pk.type = ITM_PT_GTS1;
+                    retVal = ITM_EV_PACKET_RXED;
                 }
 
                 break;
 
             // -----------------------------------------------------
             case ITM_GTS2: // Collecting GTS2 timestamp - wait for a zero continuation bit
-                if ( ( c & 0x80 ) == 0 )
+                i->pk.d[i->pk.len++] = c;
+
+                if ( ( !( c & 0x80 ) ) || ( i->pk.len >= MAX_GTS2_PACKET ) )
                 {
                     newState = ITM_IDLE;
+                    i->pk.type = ITM_PT_GTS2;
+                    retVal = ITM_EV_PACKET_RXED;
                 }
 
                 break;
@@ -454,3 +510,127 @@ enum ITMPumpEvent ITMPump( struct ITMDecoder *i, uint8_t c )
     return retVal;
 }
 // ====================================================================================================
+static uint32_t _decodeRun( struct ITMDecoder *i, const uint8_t *c, uint32_t len, struct ITMRecordBuffer *b )
+
+/* While idle, decode SW and HW packets straight into b. Returns the number of bytes consumed */
+
+{
+    const uint8_t *p = c;
+    const uint8_t *end = c + len;
+    struct ITMRecord *r = &b->r[b->len];
+    struct ITMRecord *rend = &b->r[b->size];
+    uint32_t swPkts = 0;
+    uint32_t hwPkts = 0;
+
+    while ( ( p < end ) && ( r < rend ) )
+    {
+        uint8_t h = *p;
+        uint32_t n = _hdrTable[h].len;
+        uint32_t v;
+
+        /* Anything other than a complete source packet is left for ITMPump */
+        if ( ( _hdrTable[h].kind > HDR_HW ) || ( ( uint32_t )( end - p ) <= n ) )
+        {
+            break;
+        }
+
+        switch ( n )
+        {
+            case 1:
+                v = p[1];
+                break;
+
+            case 2:
+                v = p[1] | ( ( uint32_t )p[2] << 8 );
+                break;
+
+            default:
+                v = p[1] | ( ( uint32_t )p[2] << 8 ) | ( ( uint32_t )p[3] << 16 ) | ( ( uint32_t )p[4] << 24 );
+                break;
+        }
+
+        /* A TPIU sync can only end on a 0x7F, so let ITMPump see any packet containing one and */
+        /* it'll be counted just as it would be otherwise. Zero padding can't look like 0x7F.   */
+        if ( ( h == 0x7F ) || ( ( ( v ^ 0x7F7F7F7F ) - 0x01010101 ) & ~( v ^ 0x7F7F7F7F ) & 0x80808080 ) )
+        {
+            break;
+        }
+
+        r->type = ( _hdrTable[h].kind == HDR_SW ) ? ITM_PT_SW : ITM_PT_HW;
+        r->srcAddr = h >> 3;
+        r->len = n;
+        r->pageRegister = i->pk.pageRegister;
+        r->value = v;
+
+        swPkts += ( _hdrTable[h].kind == HDR_SW );
+        hwPkts += ( _hdrTable[h].kind == HDR_HW );
+        r++;
+        p += n + 1;
+    }
+
+    STAT_ADD( i->stats.SWPkt, swPkts );
+    STAT_ADD( i->stats.HWPkt, hwPkts );
+    b->len = r - b->r;
+
+    /* Every header is non-zero, so no ITM sync can have ended in there, but keep the history */
+    /* up to date for whatever comes next.                                                   */
+    for ( const uint8_t *s = ( ( uint32_t )( p - c ) > sizeof( i->syncStat ) ) ? p - sizeof( i->syncStat ) : c; s < p; s++ )
+    {
+        i->syncStat = ( i->syncStat << 8 ) | *s;
+    }
+
+    return p - c;
+}
+// ====================================================================================================
+uint32_t ITMDecodeBlock( struct ITMDecoder *i, const uint8_t *c, uint32_t len, struct ITMRecordBuffer *b, enum ITMPumpEvent *e )
+
+/* Decode a block of ITM, with SW and HW packets going into b as records. Returns the number */
+/* of bytes consumed. This will be short of len if b fills, or if anything else turns up    */
+/* that the caller needs to know about, in which case e is set to the event (as returned by  */
+/* ITMPump) to be dealt with after the records already in b.                                 */
+
+{
+    const uint8_t *p = c;
+    const uint8_t *end = c + len;
+
+    *e = ITM_EV_NONE;
+
+    while ( ( p < end ) && ( b->len < b->size ) )
+    {
+        if ( i->p == ITM_IDLE )
+        {
+            p += _decodeRun( i, p, end - p, b );
+        }
+        else if ( i->p == ITM_UNSYNCED )
+        {
+            p += ITMDecoderSkipToSync( i, p, end - p );
+        }
+
+        if ( ( p == end ) || ( b->len == b->size ) )
+        {
+            break;
+        }
+
+        /* Buffer edges and anything unusual go through the state machine */
+        *e = ITMPump( i, *p++ );
+
+        if ( ( *e == ITM_EV_PACKET_RXED ) && ( ( i->pk.type == ITM_PT_SW ) || ( i->pk.type == ITM_PT_HW ) ) )
+        {
+            struct ITMRecord *r = &b->r[b->len++];
+
+            r->type = i->pk.type;
+            r->srcAddr = i->pk.srcAddr;
+            r->len = i->pk.len;
+            r->pageRegister = i->pk.pageRegister;
+            r->value = i->pk.d[0] | ( ( uint32_t )i->pk.d[1] << 8 ) | ( ( uint32_t )i->pk.d[2] << 16 ) | ( ( uint32_t )i->pk.d[3] << 24 );
+            *e = ITM_EV_NONE;
+        }
+        else if ( *e != ITM_EV_NONE )
+        {
+            break;
+        }
+    }
+
+    return p - c;
+}
+// ====================================================================================================
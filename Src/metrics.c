@@ -0,0 +1,527 @@
+/*
+ * Metrics Module
+ * ==============
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Metrics server. Anything connecting to the port gets the current set of
+ * metrics in Prometheus text format (version 0.0.4) as a HTTP response, and
+ * the connection is then closed. Whatever it asked for is ignored, there's
+ * only one thing to serve. Scrapes are rare so they're handled one at a time
+ * on the listening thread.
+ *
+ * A collector can be registered more than once (e.g. once per source) with
+ * different labels, which are added to everything it reports. The samples
+ * of each metric are gathered together under a single header, whichever
+ * collectors reported them, as the format requires.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "generics.h"
+#include "metrics.h"
+
+#define MAX_COLLECTORS     (64)               /* Subsystems (or instances of them) that can report */
+#define MAX_LABELS_LEN     (256)              /* Longest set of labels on a sample */
+#define REQUEST_SIZE       (4096)             /* Most of a request that'll be read */
+#define REQUEST_TIMEOUT_MS (1000)             /* Time a client gets to send its request */
+#define INITIAL_TEXT_SIZE  (1024)             /* Starting size of each metric's text, it grows as needed */
+
+/* Text being built, growing as needed */
+struct text
+{
+    char *b;
+    size_t len;                               /* How much of it there is */
+    size_t size;                              /* ...and how much room */
+};
+
+/* A metric's header and the samples for it */
+struct family
+{
+    char *name;
+    struct text t;
+};
+
+struct metricsOut
+{
+    struct family *f;                         /* Metrics reported so far */
+    uint32_t numFamilies;
+    uint32_t current;                         /* ...and the one samples are going to */
+    const char *labels;                       /* Labels for the collector that's running */
+    bool failed;                              /* Ran out of memory building it */
+};
+
+struct metricsHandle
+{
+    int sockfd;                               /* Listening socket */
+    pthread_t ipThread;                       /* Thread serving scrapes */
+    bool finish;                              /* Its time to leave */
+
+    pthread_mutex_t lock;                     /* Protection for the collector list */
+    uint32_t numCollectors;
+    struct
+    {
+        metricsCollector c;
+        void *param;
+        char *labels;                         /* Labels added to everything it reports */
+    } collector[MAX_COLLECTORS];
+};
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _textPrintf( struct metricsOut *o, struct text *t, const char *fmt, ... )
+
+/* Append to some text, growing it if needed */
+
+{
+    va_list va;
+    int l;
+    char *n;
+
+    while ( !o->failed )
+    {
+        va_start( va, fmt );
+        l = vsnprintf( t->b ? &t->b[t->len] : NULL, t->size - t->len, fmt, va );
+        va_end( va );
+
+        if ( l < 0 )
+        {
+            o->failed = true;
+        }
+        else if ( ( t->b ) && ( t->len + l < t->size ) )
+        {
+            t->len += l;
+            return;
+        }
+        else if ( !( n = realloc( t->b, t->size ? t->size * 2 : INITIAL_TEXT_SIZE ) ) )
+        {
+            o->failed = true;
+        }
+        else
+        {
+            t->b = n;
+            t->size = t->size ? t->size * 2 : INITIAL_TEXT_SIZE;
+        }
+    }
+}
+// ====================================================================================================
+static const char *_labels( struct metricsOut *o, const char *labels, char *b )
+
+/* Combine the collector's labels with those for a sample into b (MAX_LABELS_LEN long). Returns */
+/* NULL if there aren't any.                                                                   */
+
+{
+    if ( ( o->labels ) && ( labels ) )
+    {
+        snprintf( b, MAX_LABELS_LEN, "%s,%s", o->labels, labels );
+        return b;
+    }
+
+    return o->labels ? : labels;
+}
+// ====================================================================================================
+static void _sample( struct metricsOut *o, const char *name, const char *suffix, const char *labels, const char *value )
+
+/* Add a sample to the metric samples are currently going to */
+
+{
+    if ( o->current < o->numFamilies )
+    {
+        _textPrintf( o, &o->f[o->current].t, "%s%s%s%s%s %s\n", name, suffix,
+                     labels ? "{" : "", labels ? : "", labels ? "}" : "", value );
+    }
+}
+// ====================================================================================================
+static bool _readRequest( int fd )
+
+/* Take the request from the client, so that closing the connection doesn't reset it before */
+/* the response has been received. Whatever it says, it gets the metrics.                   */
+
+{
+    char req[REQUEST_SIZE + 1];
+    size_t len = 0;
+    ssize_t r;
+
+    while ( len < REQUEST_SIZE )
+    {
+        if ( ( r = read( fd, &req[len], REQUEST_SIZE - len ) ) <= 0 )
+        {
+            /* Timed out or went away without finishing the request */
+            return false;
+        }
+
+        len += r;
+        req[len] = 0;
+
+        if ( strstr( req, "\r\n\r\n" ) || strstr( req, "\n\n" ) )
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+// ====================================================================================================
+static bool _write( int fd, const char *b, size_t len )
+
+{
+    ssize_t w;
+
+    while ( len )
+    {
+        if ( ( w = write( fd, b, len ) ) <= 0 )
+        {
+            return false;
+        }
+
+        b += w;
+        len -= w;
+    }
+
+    return true;
+}
+// ====================================================================================================
+static void _serve( struct metricsHandle *h, int fd )
+
+/* Collect everything and send it to a client */
+
+{
+    struct metricsOut o = { .f = NULL };
+    char hdr[200];
+    size_t len = 0;
+    bool ok;
+
+    pthread_mutex_lock( &h->lock );
+
+    for ( uint32_t n = 0; n < h->numCollectors; n++ )
+    {
+        o.labels = h->collector[n].labels;
+        o.current = o.numFamilies;
+        h->collector[n].c( &o, h->collector[n].param );
+    }
+
+    pthread_mutex_unlock( &h->lock );
+
+    for ( uint32_t n = 0; n < o.numFamilies; n++ )
+    {
+        len += o.f[n].t.len;
+    }
+
+    if ( o.failed )
+    {
+        snprintf( hdr, sizeof( hdr ), "HTTP/1.0 500 Internal Server Error\r\nConnection: close\r\n\r\n" );
+        _write( fd, hdr, strlen( hdr ) );
+    }
+    else
+    {
+        snprintf( hdr, sizeof( hdr ),
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %zu\r\n"
+                  "Connection: close\r\n\r\n", len );
+        ok = _write( fd, hdr, strlen( hdr ) );
+
+        for ( uint32_t n = 0; ( ok ) && ( n < o.numFamilies ); n++ )
+        {
+            ok = _write( fd, o.f[n].t.b, o.f[n].t.len );
+        }
+    }
+
+    for ( uint32_t n = 0; n < o.numFamilies; n++ )
+    {
+        free( o.f[n].name );
+        free( o.f[n].t.b );
+    }
+
+    free( o.f );
+}
+// ====================================================================================================
+static void *_listenTask( void *arg )
+
+{
+    struct metricsHandle *h = ( struct metricsHandle * )arg;
+    const struct timeval tv = { .tv_sec = REQUEST_TIMEOUT_MS / 1000, .tv_usec = ( REQUEST_TIMEOUT_MS % 1000 ) * 1000 };
+    int newsockfd;
+
+    listen( h->sockfd, 5 );
+
+    while ( !h->finish )
+    {
+        if ( ( newsockfd = accept( h->sockfd, NULL, NULL ) ) < 0 )
+        {
+            continue;
+        }
+
+        if ( !h->finish )
+        {
+            /* Don't let a client that never sends anything hold things up */
+            setsockopt( newsockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+            setsockopt( newsockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+
+            if ( _readRequest( newsockfd ) )
+            {
+                _serve( h, newsockfd );
+            }
+        }
+
+        close( newsockfd );
+    }
+
+    close( h->sockfd );
+    return NULL;
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+uint64_t metricsTimeUs( void )
+
+/* Monotonic time, for measuring latencies */
+
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+// ====================================================================================================
+void metricsHistogramAdd( struct metricsHistogram *h, uint64_t us )
+
+/* Record an observation. This can be called from more than one thread at once */
+
+{
+    /* Bucket n holds observations of more than 2^(n-1) and no more than 2^n uS */
+    uint32_t b = ( us > 1 ) ? 64 - __builtin_clzll( us - 1 ) : 0;
+
+    if ( b < METRICS_HIST_BUCKETS )
+    {
+        __atomic_fetch_add( &h->bucket[b], 1, __ATOMIC_RELAXED );
+    }
+
+    __atomic_fetch_add( &h->sum, us, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &h->count, 1, __ATOMIC_RELAXED );
+}
+// ====================================================================================================
+void metricsFamily( struct metricsOut *o, const char *name, const char *type, const char *help )
+
+/* Introduce a metric, which the samples that follow are for. If it's already been reported */
+/* (by another collector) they're added to what's there.                                     */
+
+{
+    struct family *n;
+
+    for ( o->current = 0; o->current < o->numFamilies; o->current++ )
+    {
+        if ( !strcmp( o->f[o->current].name, name ) )
+        {
+            return;
+        }
+    }
+
+    if ( ( o->failed ) || ( !( n = realloc( o->f, ( o->numFamilies + 1 ) * sizeof( struct family ) ) ) ) )
+    {
+        o->failed = true;
+        return;
+    }
+
+    o->f = n;
+    memset( &o->f[o->numFamilies], 0, sizeof( struct family ) );
+
+    if ( !( o->f[o->numFamilies].name = strdup( name ) ) )
+    {
+        o->failed = true;
+        return;
+    }
+
+    o->numFamilies++;
+    _textPrintf( o, &o->f[o->current].t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type );
+}
+// ====================================================================================================
+void metricsValue( struct metricsOut *o, const char *name, const char *labels, uint64_t v )
+
+{
+    char l[MAX_LABELS_LEN];
+    char s[24];
+
+    snprintf( s, sizeof( s ), "%" PRIu64, v );
+    _sample( o, name, "", _labels( o, labels, l ), s );
+}
+// ====================================================================================================
+void metricsHistogram( struct metricsOut *o, const char *name, const char *labels, struct metricsHistogram *h )
+
+/* Report a histogram, in seconds. The count is taken first so that it's never more than */
+/* the buckets that were reported, if observations are arriving while this is going on.  */
+
+{
+    uint64_t count = __atomic_load_n( &h->count, __ATOMIC_RELAXED );
+    uint64_t sum = __atomic_load_n( &h->sum, __ATOMIC_RELAXED );
+    uint64_t total = 0;
+    char l[MAX_LABELS_LEN];
+    char bl[MAX_LABELS_LEN + 20];
+    char s[24];
+
+    labels = _labels( o, labels, l );
+
+    for ( uint32_t b = 0; b <= METRICS_HIST_BUCKETS; b++ )
+    {
+        if ( b < METRICS_HIST_BUCKETS )
+        {
+            total += __atomic_load_n( &h->bucket[b], __ATOMIC_RELAXED );
+            snprintf( bl, sizeof( bl ), "%s%sle=\"%.6f\"", labels ? : "", labels ? "," : "", ( double )( 1ULL << b ) / 1000000 );
+        }
+        else
+        {
+            snprintf( bl, sizeof( bl ), "%s%sle=\"+Inf\"", labels ? : "", labels ? "," : "" );
+        }
+
+        snprintf( s, sizeof( s ), "%" PRIu64, ( ( total < count ) && ( b < METRICS_HIST_BUCKETS ) ) ? total : count );
+        _sample( o, name, "_bucket", bl, s );
+    }
+
+    snprintf( s, sizeof( s ), "%.6f", ( double )sum / 1000000 );
+    _sample( o, name, "_sum", labels, s );
+    snprintf( s, sizeof( s ), "%" PRIu64, count );
+    _sample( o, name, "_count", labels, s );
+}
+// ====================================================================================================
+bool metricsRegister( struct metricsHandle *h, metricsCollector c, void *param, const char *labels )
+
+/* Add a collector, to be called for every scrape. labels (which may be NULL) are added to */
+/* everything it reports.                                                                   */
+
+{
+    bool r = false;
+
+    if ( !h )
+    {
+        return false;
+    }
+
+    pthread_mutex_lock( &h->lock );
+
+    if ( h->numCollectors < MAX_COLLECTORS )
+    {
+        h->collector[h->numCollectors].c = c;
+        h->collector[h->numCollectors].param = param;
+        h->collector[h->numCollectors].labels = labels ? strdup( labels ) : NULL;
+        h->numCollectors++;
+        r = true;
+    }
+
+    pthread_mutex_unlock( &h->lock );
+    return r;
+}
+// ====================================================================================================
+void metricsShutdown( struct metricsHandle *h )
+
+{
+    if ( !h )
+    {
+        return;
+    }
+
+    /* Knock the listening thread out of accept */
+    h->finish = true;
+    shutdown( h->sockfd, SHUT_RDWR );
+}
+// ====================================================================================================
+struct metricsHandle *metricsStart( int port )
+
+/* Create the metrics server. It's only reachable from this machine */
+
+{
+    struct sockaddr_in serv_addr;
+    int flag = 1;
+    struct metricsHandle *h = ( struct metricsHandle * )calloc( 1, sizeof( struct metricsHandle ) );
+
+    if ( !h )
+    {
+        return NULL;
+    }
+
+    if ( ( h->sockfd = socket( AF_INET, SOCK_STREAM, 0 ) ) < 0 )
+    {
+        genericsReport( V_ERROR, "Error opening metrics socket" EOL );
+        goto free_and_return;
+    }
+
+    if ( setsockopt( h->sockfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof( flag ) ) < 0 )
+    {
+        genericsReport( V_ERROR, "setsockopt(SO_REUSEADDR) failed" EOL );
+        goto close_and_return;
+    }
+
+    memset( &serv_addr, 0, sizeof( serv_addr ) );
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    serv_addr.sin_port = htons( port );
+
+    if ( bind( h->sockfd, ( struct sockaddr * ) &serv_addr, sizeof( serv_addr ) ) < 0 )
+    {
+        genericsReport( V_ERROR, "Error binding metrics port %d" EOL, port );
+        goto close_and_return;
+    }
+
+    pthread_mutex_init( &h->lock, NULL );
+
+    if ( pthread_create( &( h->ipThread ), NULL, &_listenTask, h ) )
+    {
+        genericsReport( V_ERROR, "Failed to create metrics thread" EOL );
+        goto close_and_return;
+    }
+
+    return h;
+
+close_and_return:
+    close( h->sockfd );
+free_and_return:
+    free( h );
+    return NULL;
+}
+// ====================================================================================================
@@ -0,0 +1,353 @@
+/*
+ * Message Codec Module
+ * ====================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "msgCodec.h"
+
+#define TYPE_MASK     (0x1F)                  /* Bits of the type byte holding the message type */
+#define VERSION_SHIFT (5)                     /* ...and where the version starts */
+
+/* Encoding state, tracking where we are in the buffer */
+struct _enc
+{
+    uint8_t *b;
+};
+
+/* Decoding state, tracking where we are in the buffer and if we ran off the end */
+struct _dec
+{
+    const uint8_t *b;
+    const uint8_t *end;
+    bool truncated;
+};
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _putByte( struct _enc *e, uint8_t v )
+
+{
+    *e->b++ = v;
+}
+// ====================================================================================================
+static void _putVarint( struct _enc *e, uint64_t v )
+
+/* Seven bits at a time, least significant first, top bit set on all but the last */
+
+{
+    while ( v > 0x7F )
+    {
+        *e->b++ = 0x80 | ( v & 0x7F );
+        v >>= 7;
+    }
+
+    *e->b++ = v;
+}
+// ====================================================================================================
+static uint8_t _getByte( struct _dec *d )
+
+{
+    if ( d->b >= d->end )
+    {
+        d->truncated = true;
+        return 0;
+    }
+
+    return *d->b++;
+}
+// ====================================================================================================
+static uint64_t _getVarint( struct _dec *d )
+
+{
+    uint64_t v = 0;
+    uint8_t c;
+
+    for ( uint32_t shift = 0; shift < 64; shift += 7 )
+    {
+        c = _getByte( d );
+        v |= ( uint64_t )( c & 0x7F ) << shift;
+
+        if ( !( c & 0x80 ) )
+        {
+            break;
+        }
+    }
+
+    return v;
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+uint32_t MSGCodecEncode( struct MSGCodec *c, struct msg *m, uint8_t *b )
+
+/* Encode m into b, which must have room for MSG_CODEC_MAXLEN bytes. Returns the encoded length */
+
+{
+    struct _enc e = { .b = b };
+    uint64_t delta = m->genericMsg.ts - c->ts;
+    uint32_t shift;
+    uint32_t nbits;
+
+    if ( ( uint32_t )m->genericMsg.msgtype >= MSG_NUM_MSGS )
+    {
+        return 0;
+    }
+
+    _putByte( &e, ( MSG_CODEC_VERSION << VERSION_SHIFT ) | m->genericMsg.msgtype );
+
+    /* Zigzag the delta, so small steps either way are short */
+    _putVarint( &e, ( delta << 1 ) ^ ( ( int64_t )delta >> 63 ) );
+    c->ts = m->genericMsg.ts;
+
+    switch ( m->genericMsg.msgtype )
+    {
+        // ------------------------------------
+        case MSG_SOFTWARE:
+            _putByte( &e, ( m->swMsg.srcAddr << 3 ) | ( m->swMsg.len & 7 ) );
+
+            for ( uint32_t n = 0; ( n < m->swMsg.len ) && ( n < sizeof( uint32_t ) ); n++ )
+            {
+                _putByte( &e, m->swMsg.value >> ( 8 * n ) );
+            }
+
+            break;
+
+        // ------------------------------------
+        case MSG_NISYNC:
+            _putByte( &e, m->nisyncMsg.type );
+            _putVarint( &e, m->nisyncMsg.addr );
+            break;
+
+        // ------------------------------------
+        case MSG_OSW:
+            _putByte( &e, m->oswMsg.comp );
+            _putVarint( &e, m->oswMsg.offset );
+            break;
+
+        // ------------------------------------
+        case MSG_DATA_ACCESS_WP:
+            _putByte( &e, m->wptMsg.comp );
+            _putVarint( &e, m->wptMsg.data );
+            break;
+
+        // ------------------------------------
+        case MSG_DATA_RWWP:
+            _putByte( &e, ( m->watchMsg.comp & 0x7F ) | ( m->watchMsg.isWrite ? 0x80 : 0 ) );
+            _putVarint( &e, m->watchMsg.data );
+            break;
+
+        // ------------------------------------
+        case MSG_PC_SAMPLE:
+            _putByte( &e, m->pcSampleMsg.sleep );
+            _putVarint( &e, m->pcSampleMsg.pc );
+            break;
+
+        // ------------------------------------
+        case MSG_DWT_EVENT:
+            _putByte( &e, m->dwtMsg.event );
+            break;
+
+        // ------------------------------------
+        case MSG_EXCEPTION:
+            _putByte( &e, m->excMsg.eventType );
+            _putVarint( &e, m->excMsg.exceptionNumber );
+            break;
+
+        // ------------------------------------
+        case MSG_TS:
+            _putByte( &e, ( ( struct TSMsg * )m )->timeStatus );
+            _putVarint( &e, ( ( struct TSMsg * )m )->timeInc );
+            break;
+
+        // ------------------------------------
+        case MSG_GTS:
+            /* The mask is always a contiguous run of bits, so it's sent as where it starts and how long it is */
+            shift = m->gtsMsg.mask ? __builtin_ctzll( m->gtsMsg.mask ) : 0;
+            nbits = __builtin_popcountll( m->gtsMsg.mask );
+            _putByte( &e, ( m->gtsMsg.wrap ? 1 : 0 ) | ( m->gtsMsg.clkCh ? 2 : 0 ) );
+            _putByte( &e, shift );
+            _putByte( &e, nbits );
+            _putVarint( &e, m->gtsMsg.bits >> shift );
+            break;
+
+        // ------------------------------------
+        default:
+            /* Nothing more than the type */
+            break;
+            // ------------------------------------
+    }
+
+    return e.b - b;
+}
+// ====================================================================================================
+int32_t MSGCodecDecode( struct MSGCodec *c, const uint8_t *b, uint32_t len, struct msg *m )
+
+/* Decode a record from the len bytes at b into m. Returns the number of bytes used, 0 if b */
+/* doesn't contain a whole record yet, or -1 if it isn't a record we understand.          */
+
+{
+    struct _dec d = { .b = b, .end = b + len, .truncated = false };
+    uint8_t t;
+    uint64_t z;
+    uint32_t shift;
+    uint32_t nbits;
+    uint8_t v;
+
+    t = _getByte( &d );
+
+    if ( d.truncated )
+    {
+        return 0;
+    }
+
+    if ( ( ( t >> VERSION_SHIFT ) != MSG_CODEC_VERSION ) || ( ( t & TYPE_MASK ) >= MSG_NUM_MSGS ) )
+    {
+        return -1;
+    }
+
+    memset( m, 0, sizeof( struct msg ) );
+    m->genericMsg.msgtype = t & TYPE_MASK;
+    z = _getVarint( &d );
+    m->genericMsg.ts = c->ts + ( ( z >> 1 ) ^ -( z & 1 ) );
+
+    switch ( m->genericMsg.msgtype )
+    {
+        // ------------------------------------
+        case MSG_SOFTWARE:
+            v = _getByte( &d );
+            m->swMsg.srcAddr = v >> 3;
+            m->swMsg.len = v & 7;
+
+            for ( uint32_t n = 0; ( n < m->swMsg.len ) && ( n < sizeof( uint32_t ) ); n++ )
+            {
+                m->swMsg.value |= ( uint32_t )_getByte( &d ) << ( 8 * n );
+            }
+
+            break;
+
+        // ------------------------------------
+        case MSG_NISYNC:
+            m->nisyncMsg.type = _getByte( &d );
+            m->nisyncMsg.addr = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_OSW:
+            m->oswMsg.comp = _getByte( &d );
+            m->oswMsg.offset = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_DATA_ACCESS_WP:
+            m->wptMsg.comp = _getByte( &d );
+            m->wptMsg.data = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_DATA_RWWP:
+            v = _getByte( &d );
+            m->watchMsg.comp = v & 0x7F;
+            m->watchMsg.isWrite = ( v & 0x80 ) != 0;
+            m->watchMsg.data = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_PC_SAMPLE:
+            m->pcSampleMsg.sleep = _getByte( &d ) != 0;
+            m->pcSampleMsg.pc = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_DWT_EVENT:
+            m->dwtMsg.event = _getByte( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_EXCEPTION:
+            m->excMsg.eventType = _getByte( &d );
+            m->excMsg.exceptionNumber = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_TS:
+            ( ( struct TSMsg * )m )->timeStatus = _getByte( &d );
+            ( ( struct TSMsg * )m )->timeInc = _getVarint( &d );
+            break;
+
+        // ------------------------------------
+        case MSG_GTS:
+            v = _getByte( &d );
+            m->gtsMsg.wrap = ( v & 1 ) != 0;
+            m->gtsMsg.clkCh = ( v & 2 ) != 0;
+            shift = _getByte( &d ) & 63;
+            nbits = _getByte( &d );
+
+            if ( nbits )
+            {
+                m->gtsMsg.mask = ( ( shift + nbits ) >= 64 ) ? ( ~0ULL << shift ) : ( ( ( 1ULL << nbits ) - 1 ) << shift );
+            }
+
+            m->gtsMsg.bits = ( _getVarint( &d ) << shift ) & m->gtsMsg.mask;
+            break;
+
+        // ------------------------------------
+        default:
+            break;
+            // ------------------------------------
+    }
+
+    if ( d.truncated )
+    {
+        return 0;
+    }
+
+    c->ts = m->genericMsg.ts;
+    return d.b - b;
+}
+// ====================================================================================================
+void MSGCodecInit( struct MSGCodec *c )
+
+/* Reset a codec, encoder and decoder must be reset together */
+
+{
+    c->ts = 0;
+}
+// ====================================================================================================
@@ -43,6 +43,8 @@
 #include "msgDecoder.h"
 #include "generics.h"
 
+#define GTS1_BITS (26)                   /* Number of low order timestamp bits carried by a GTS1 */
+
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
@@ -253,6 +255,52 @@ static bool _handleTS( struct ITMPacket *packet, struct TSMsg *decoded )
     return true;
 }
 // ====================================================================================================
+static bool _handleGTS( struct ITMPacket *packet, struct gtsMsg *decoded )
+
+/* ... a global timestamp, GTS1 for bits 25:0 or GTS2 for bits 63:26 */
+
+{
+    uint32_t shift = ( packet->type == ITM_PT_GTS1 ) ? 0 : GTS1_BITS;
+    uint32_t nbits = 0;
+    uint64_t bits = 0;
+    uint32_t v;
+
+    decoded->msgtype = MSG_GTS;
+    decoded->wrap = false;
+    decoded->clkCh = false;
+
+    /* Seven bits per byte following the header...except the last of a full GTS1 which has flags */
+    for ( uint32_t n = 1; n < packet->len; n++ )
+    {
+        v = packet->d[n] & 0x7F;
+
+        if ( ( packet->type == ITM_PT_GTS1 ) && ( n == 4 ) )
+        {
+            decoded->clkCh = ( ( v & 0x20 ) != 0 );
+            decoded->wrap = ( ( v & 0x40 ) != 0 );
+            bits |= ( uint64_t )( v & 0x1F ) << nbits;
+            nbits += 5;
+        }
+        else
+        {
+            bits |= ( uint64_t )v << nbits;
+            nbits += 7;
+        }
+    }
+
+    if ( !nbits )
+    {
+        decoded->bits = decoded->mask = 0;
+    }
+    else
+    {
+        decoded->mask = ( ( shift + nbits ) >= 64 ) ? ( ~0ULL << shift ) : ( ( ( 1ULL << nbits ) - 1 ) << shift );
+        decoded->bits = ( bits << shift ) & decoded->mask;
+    }
+
+    return true;
+}
+// ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
 // Publically available routines
@@ -288,6 +336,11 @@ bool msgDecoder( struct ITMPacket *packet, struct msg *decoded )
             wasDecoded = _handleNISYNC( packet, ( struct nisyncMsg * )decoded );
             break;
 
+        case ITM_PT_GTS1:
+        case ITM_PT_GTS2:
+            wasDecoded = _handleGTS( packet, ( struct gtsMsg * )decoded );
+            break;
+
         case ITM_PT_XTN:
             genericsReport( V_INFO, "Unknown Extension Packet Received" EOL );
             decoded->genericMsg.msgtype = MSG_UNKNOWN;
@@ -306,3 +359,34 @@ bool msgDecoder( struct ITMPacket *packet, struct msg *decoded )
     return wasDecoded;
 }
 // ====================================================================================================
+bool msgDecodeRecord( struct ITMRecord *r, struct msg *decoded, uint64_t ts )
+
+/* Expand a record from ITMDecodeBlock. The caller provides the timestamp, so it can be taken */
+/* once for a whole block rather than for every message.                                     */
+
+{
+    struct ITMPacket packet;
+
+    decoded->genericMsg.ts = ts;
+
+    if ( r->type == ITM_PT_SW )
+    {
+        decoded->swMsg.msgtype = MSG_SOFTWARE;
+        decoded->swMsg.srcAddr = r->srcAddr;
+        decoded->swMsg.len = r->len;
+        decoded->swMsg.value = r->value;
+        return true;
+    }
+
+    /* HW packets go through the same handlers as msgDecoder uses */
+    packet.type = ITM_PT_HW;
+    packet.srcAddr = r->srcAddr;
+    packet.len = r->len;
+    packet.pageRegister = r->pageRegister;
+    packet.d[0] = r->value;
+    packet.d[1] = r->value >> 8;
+    packet.d[2] = r->value >> 16;
+    packet.d[3] = r->value >> 24;
+    return _handleHW( &packet, decoded );
+}
+// ====================================================================================================
@@ -0,0 +1,209 @@
+/*
+ * Message Dispatch Module
+ * =======================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Decodes ITM and hands each message straight to the handler registered for its type, so
+ * clients don't each need their own copy of the pump, event switch and handler table. Runs
+ * of SW/HW packets are decoded in bulk (see ITMDecodeBlock) and messages are built in storage
+ * owned by the dispatcher, with nothing built at all for SW packets that nobody wants.
+ */
+
+#include <string.h>
+#include "generics.h"
+#include "msgDispatch.h"
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _event( struct MSGDispatch *d, enum ITMPumpEvent e )
+
+/* Deal with an event that came out of the decoder */
+
+{
+    switch ( e )
+    {
+        // ------------------------------------
+        case ITM_EV_NONE:
+            break;
+
+        // ------------------------------------
+        case ITM_EV_PACKET_RXED:
+            if ( ITMGetDecodedPacket( d->i, &d->m ) )
+            {
+                MSGDispatchMsg( d, &d->m );
+            }
+
+            break;
+
+        // ------------------------------------
+        default:
+            MSGDispatchEvent( d, e );
+            break;
+            // ------------------------------------
+    }
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+bool MSGDispatchRegister( struct MSGDispatch *d, enum MSGType t, MSGDispatchHandler h )
+
+/* Set the handler for a message type (NULL to ignore them) */
+
+{
+    if ( t >= MSG_NUM_MSGS )
+    {
+        return false;
+    }
+
+    d->h[t] = h;
+    return true;
+}
+// ====================================================================================================
+void MSGDispatchRegisterAll( struct MSGDispatch *d, MSGDispatchHandler h )
+
+/* Set a handler that sees every message, whatever its type (NULL for none) */
+
+{
+    d->all = h;
+}
+// ====================================================================================================
+void MSGDispatchMsg( struct MSGDispatch *d, struct msg *m )
+
+/* Dispatch an already decoded message. genericMsg is just used to access the */
+/* first two members of the decoded structs in a portable way.                */
+
+{
+    if ( d->all )
+    {
+        d->all( m, d->param );
+    }
+
+    if ( ( m->genericMsg.msgtype < MSG_NUM_MSGS ) && ( d->h[m->genericMsg.msgtype] ) )
+    {
+        d->h[m->genericMsg.msgtype]( m, d->param );
+    }
+}
+// ====================================================================================================
+void MSGDispatchEvent( struct MSGDispatch *d, enum ITMPumpEvent e )
+
+/* Handle a decoder event, which can also come from somewhere other than the pump (e.g. parDecoder) */
+
+{
+    if ( d->ecb )
+    {
+        d->ecb( e, d->param );
+        return;
+    }
+
+    switch ( e )
+    {
+        case ITM_EV_UNSYNCED:
+            genericsReport( V_WARN, "ITM Lost Sync (%d)" EOL, ITMDecoderGetStats( d->i )->lostSyncCount );
+            break;
+
+        case ITM_EV_SYNCED:
+            genericsReport( V_INFO, "ITM In Sync (%d)" EOL, ITMDecoderGetStats( d->i )->syncCount );
+            break;
+
+        case ITM_EV_OVERFLOW:
+            genericsReport( V_WARN, "ITM Overflow (%d)" EOL, ITMDecoderGetStats( d->i )->overflow );
+            break;
+
+        case ITM_EV_ERROR:
+            genericsReport( V_WARN, "ITM Error" EOL );
+            break;
+
+        default:
+            break;
+    }
+}
+// ====================================================================================================
+void MSGDispatchPump( struct MSGDispatch *d, uint8_t *c, uint32_t len )
+
+/* Decode a block of ITM, dispatching messages and events in the order they turn up */
+
+{
+    enum ITMPumpEvent e;
+    uint64_t ts;
+
+    while ( len )
+    {
+        d->b.len = 0;
+        uint32_t used = ITMDecodeBlock( d->i, c, len, &d->b, &e );
+        c += used;
+        len -= used;
+
+        if ( d->b.len )
+        {
+            /* One stamp does for the whole batch */
+            ts = genericsTimestampuS();
+
+            for ( struct ITMRecord *r = d->r; r < &d->r[d->b.len]; r++ )
+            {
+                if ( ( r->type == ITM_PT_SW ) && ( !d->h[MSG_SOFTWARE] ) && ( !d->all ) )
+                {
+                    continue;
+                }
+
+                if ( msgDecodeRecord( r, &d->m, ts ) )
+                {
+                    MSGDispatchMsg( d, &d->m );
+                }
+            }
+        }
+
+        _event( d, e );
+    }
+}
+// ====================================================================================================
+void MSGDispatchInit( struct MSGDispatch *d, struct ITMDecoder *i, MSGDispatchEventCB ecb, void *param )
+
+/* Reset a dispatcher for decoder i, with no handlers registered */
+
+{
+    memset( d, 0, sizeof( struct MSGDispatch ) );
+    d->i = i;
+    d->ecb = ecb;
+    d->param = param;
+    d->b.r = d->r;
+    d->b.size = MSG_DISPATCH_RECORDS;
+}
+// ====================================================================================================
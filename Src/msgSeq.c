@@ -38,13 +38,14 @@
  * from https://static.docs.arm.com/ddi0403/e/DDI0403E_B_armv7m_arm.pdf
  */
 
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include "generics.h"
 #include "msgSeq.h"
 #include "msgDecoder.h"
 
+#define MIN_ENTRIES (2)      /* Smallest workable buffer ... one message plus the free slot */
+
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
@@ -64,24 +65,60 @@ static bool _bufferPacket( struct MSGSeq *d )
         return false;
     }
 
-    /* Make a copy of it for later dispatch */
-    memcpy( &d->pbuffer[d->wp], &p, sizeof( struct msg ) );
+    return MSGSeqPumpMsg( d, &p );
+}
+// ====================================================================================================
+static bool _makeRoom( struct MSGSeq *d )
+
+/* Make space at the end of the buffer, either by shuffling down what's already been released */
+/* or by growing it. Returns false if the window is already as big as it's allowed to get.    */
+
+{
+    struct msg *n;
+    uint32_t newLen;
 
-    /* If this is a timestamp then we put it on the front to be released first */
-    if ( d->pbuffer[d->wp].genericMsg.msgtype == MSG_TS )
+    if ( d->rp )
     {
-        d->releaseTimeMsg = true;
+        memmove( d->pbuffer, &d->pbuffer[d->rp], ( d->wp - d->rp ) * sizeof( struct msg ) );
+        d->wp -= d->rp;
+        d->unstamped = ( d->unstamped > d->rp ) ? d->unstamped - d->rp : 0;
+        d->rp = 0;
         return true;
     }
-    else
+
+    if ( d->pbl >= d->maxEntries )
     {
-        d->wp = ( d->wp + 1 ) % d->pbl;
+        return false;
+    }
 
-        assert( d->wp != d->rp );
+    newLen = ( d->pbl * 2 < d->maxEntries ) ? d->pbl * 2 : d->maxEntries;
 
-        /* If the next message would cause overflow, then empty regardless */
-        return ( ( ( d->wp + 1 ) % d->pbl ) == d->rp );
+    if ( !( n = realloc( d->pbuffer, newLen * sizeof( struct msg ) ) ) )
+    {
+        return false;
     }
+
+    d->pbuffer = n;
+    d->pbl = newLen;
+    return true;
+}
+// ====================================================================================================
+static void _stampPending( struct MSGSeq *d, uint64_t now )
+
+/* Spread the messages that arrived since the last time point evenly over the interval up to now */
+
+{
+    uint32_t n = d->wp - d->unstamped;
+
+    for ( uint32_t k = 0; k < n; k++ )
+    {
+        /* If time went backwards (e.g. half of a GTS pair) then just leave them where they were */
+        d->pbuffer[d->unstamped + k].genericMsg.ts = ( now < d->batchTime ) ? d->batchTime :
+                d->batchTime + ( ( now - d->batchTime ) * ( k + 1 ) ) / n;
+    }
+
+    d->unstamped = d->wp;
+    d->batchTime = now;
 }
 // ====================================================================================================
 // ====================================================================================================
@@ -90,21 +127,33 @@ static bool _bufferPacket( struct MSGSeq *d )
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
-void MSGSeqInit( struct MSGSeq *d, struct ITMDecoder *i, uint32_t maxEntries )
+void MSGSeqInit( struct MSGSeq *d, struct ITMDecoder *i, uint32_t initialEntries, uint32_t maxEntries )
 
-/* Reset and initialise an Message Sequencer instance */
+/* Reset and initialise an Message Sequencer instance. The window starts at initialEntries and */
+/* grows, as needed, up to maxEntries.                                                         */
 
 {
     memset( d, 0, sizeof( struct MSGSeq ) );
     d->i = i;
-    d->pbl = maxEntries;
-    d->pbuffer = calloc( maxEntries, sizeof( struct msg ) );
+    d->pbl = ( initialEntries < MIN_ENTRIES ) ? MIN_ENTRIES : initialEntries;
+    d->maxEntries = ( maxEntries < d->pbl ) ? d->pbl : maxEntries;
+    d->pbuffer = calloc( d->pbl, sizeof( struct msg ) );
+}
+// ====================================================================================================
+uint32_t MSGSeqGetOverflow( struct MSGSeq *d )
+
+/* Number of times messages had to be released (or dropped) before their time was known */
+
+{
+    return d->overflow;
 }
 // ====================================================================================================
 struct msg *MSGSeqGetPacket( struct MSGSeq *d )
 
+/* Get the next message in sequence, with ts set to its (interpolated) absolute target time */
+
 {
-    uint32_t trp = d->rp;
+    struct msg *p;
 
     /* Roll the timestamp off the front if it's present */
     if ( d->releaseTimeMsg )
@@ -115,13 +164,78 @@ struct msg *MSGSeqGetPacket( struct MSGSeq *d )
 
     if ( d->wp == d->rp )
     {
+        /* All gone, so start again from the bottom of the buffer */
+        d->wp = d->rp = d->unstamped = 0;
         return NULL;
     }
 
-    /* Roll to next entry */
-    d->rp = ( d->rp + 1 ) % d->pbl;
+    p = &d->pbuffer[d->rp];
+
+    /* If we're being emptied before the next time point then the best we know is the last one */
+    if ( d->rp >= d->unstamped )
+    {
+        p->genericMsg.ts = d->batchTime;
+        d->unstamped = d->rp + 1;
+    }
+
+    d->rp++;
+    return p;
+}
+// ====================================================================================================
+bool MSGSeqPumpMsg( struct MSGSeq *d, struct msg *p )
+
+/* Buffer an already decoded message. Returns true when the buffer should be emptied */
+
+{
+    /* If we were told to empty last time and weren't then the oldest message has to go */
+    if ( ( d->wp == d->pbl ) && ( !_makeRoom( d ) ) )
+    {
+        d->rp++;
+        d->overflow++;
+        _makeRoom( d );
+    }
+
+    /* Make a copy of it for later dispatch */
+    memcpy( &d->pbuffer[d->wp], p, sizeof( struct msg ) );
+
+    /* Keep track of target time. Local timestamps are added to the last global one, which  */
+    /* assumes they're counting the same clock (it's only until the next GTS if they aren't) */
+    switch ( p->genericMsg.msgtype )
+    {
+        case MSG_GTS:
+            d->gts = ( d->gts & ~p->gtsMsg.mask ) | p->gtsMsg.bits;
+            d->localTime = 0;
+
+            /* A GTS is a time point, but stays in order with everything else */
+            _stampPending( d, d->gts );
+            d->pbuffer[d->wp++].genericMsg.ts = d->batchTime;
+            d->unstamped = d->wp;
+            break;
+
+        case MSG_TS:
+            d->localTime += ( ( struct TSMsg * )p )->timeInc;
+
+            /* Anything waiting happened between the last time point and this one. The timestamp */
+            /* itself is put on the front to be released first.                                 */
+            _stampPending( d, d->gts + d->localTime );
+            d->pbuffer[d->wp].genericMsg.ts = d->batchTime;
+            d->releaseTimeMsg = true;
+            return true;
+
+        default:
+            d->wp++;
+            break;
+    }
+
+    /* Always keep a free slot at the end for the next message */
+    if ( ( d->wp == d->pbl ) && ( !_makeRoom( d ) ) )
+    {
+        /* Window exceeded, so this lot has to go without waiting for their time */
+        d->overflow++;
+        return true;
+    }
 
-    return &d->pbuffer[trp];
+    return false;
 }
 // ====================================================================================================
 bool MSGSeqPump( struct MSGSeq *d, uint8_t c )
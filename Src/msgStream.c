@@ -0,0 +1,260 @@
+/*
+ * Message Stream Module
+ * =====================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "msgStream.h"
+
+#define SYNC_LEN (MSG_STREAM_SYNC_PRELEN + 1)
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static uint32_t _frameLen( struct MSGStream *s )
+
+{
+    return s->f[SYNC_LEN] | ( s->f[SYNC_LEN + 1] << 8 );
+}
+// ====================================================================================================
+static bool _decodeFrame( struct MSGStream *s, MSGStreamHandler h, void *param )
+
+/* Decode the records in a whole frame, handing them to h if there is one. Returns false */
+/* if they don't all decode, or don't finish exactly at the end of the frame.           */
+
+{
+    const uint8_t *b = &s->f[MSG_STREAM_HDR_LEN];
+    const uint8_t *end = b + _frameLen( s );
+    struct msg m;
+    int32_t n;
+
+    MSGCodecInit( &s->c );
+
+    while ( b < end )
+    {
+        if ( ( n = MSGCodecDecode( &s->c, b, end - b, &m ) ) <= 0 )
+        {
+            return false;
+        }
+
+        if ( h )
+        {
+            h( &m, param );
+        }
+
+        b += n;
+    }
+
+    return true;
+}
+// ====================================================================================================
+static uint32_t _pump( struct MSGStream *s, const uint8_t *c, uint32_t len, MSGStreamHandler h, void *param, bool *bad )
+
+/* Read frames from a run of bytes, handing the messages in them to h. Returns the number of */
+/* bytes used, stopping early (with bad set) if what was being read turns out not to be a frame. */
+
+{
+    const uint8_t *start = c;
+    uint32_t n;
+
+    *bad = false;
+
+    while ( len )
+    {
+        if ( s->len < SYNC_LEN )
+        {
+            /* Looking for the next sync, a byte at a time */
+            if ( ( *c == MSG_STREAM_SYNC_TERM ) && ( s->run >= MSG_STREAM_SYNC_PRELEN ) )
+            {
+                s->len = SYNC_LEN;
+                s->run = 0;
+            }
+            else
+            {
+                s->run = ( *c == MSG_STREAM_SYNC_PRE ) ? s->run + 1 : 0;
+            }
+
+            c++;
+            len--;
+            continue;
+        }
+
+        if ( s->len < MSG_STREAM_HDR_LEN )
+        {
+            s->f[s->len++] = *c++;
+            len--;
+
+            if ( ( s->len == MSG_STREAM_HDR_LEN ) && ( _frameLen( s ) > MSG_STREAM_MAXLEN ) )
+            {
+                /* Can't be a frame, so that wasn't really a sync */
+                *bad = true;
+                break;
+            }
+
+            continue;
+        }
+
+        n = MSG_STREAM_HDR_LEN + _frameLen( s ) - s->len;
+        n = ( len < n ) ? len : n;
+        memcpy( &s->f[s->len], c, n );
+        s->len += n;
+        c += n;
+        len -= n;
+
+        if ( s->len == MSG_STREAM_HDR_LEN + _frameLen( s ) )
+        {
+            /* Only use the frame if all of it's good, a sync can turn up in the data by chance */
+            if ( !_decodeFrame( s, NULL, NULL ) )
+            {
+                *bad = true;
+                break;
+            }
+
+            _decodeFrame( s, h, param );
+            s->len = 0;
+        }
+    }
+
+    return c - start;
+}
+// ====================================================================================================
+static void _putBack( struct MSGStream *s )
+
+/* What was read as a frame wasn't one, so its sync was false. Everything after that sync is put */
+/* back to be looked through again, ahead of anything that hasn't been looked at yet. A frame is  */
+/* only ever started from put back bytes while there are some, so there's always room for them.   */
+
+{
+    uint32_t back = s->len - SYNC_LEN;
+    uint32_t keep = s->rlen - s->rpos;
+
+    memmove( &s->r[back], &s->r[s->rpos], keep );
+    memcpy( s->r, &s->f[SYNC_LEN], back );
+    s->rlen = back + keep;
+    s->rpos = 0;
+    s->len = 0;
+    s->run = 0;
+    s->badFrames++;
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+bool MSGStreamAdd( struct MSGStream *s, struct msg *m )
+
+/* Add a message to the frame being built. Returns true when the frame is full, and */
+/* has to be taken (with MSGStreamFrame) before anything else is added.            */
+
+{
+    if ( !s->len )
+    {
+        /* Each frame starts the codec afresh, so it can be decoded on its own */
+        MSGCodecInit( &s->c );
+        s->len = MSG_STREAM_HDR_LEN;
+    }
+
+    s->len += MSGCodecEncode( &s->c, m, &s->f[s->len] );
+    return ( s->len - MSG_STREAM_HDR_LEN > MSG_STREAM_MAXLEN - MSG_CODEC_MAXLEN );
+}
+// ====================================================================================================
+uint32_t MSGStreamFrame( struct MSGStream *s, const uint8_t **f )
+
+/* Finish the frame being built, returning its length (0 if it's empty) and setting f to */
+/* point to it. It's only valid until the next message is added.                        */
+
+{
+    uint32_t len = s->len;
+
+    if ( !len )
+    {
+        return 0;
+    }
+
+    memset( s->f, MSG_STREAM_SYNC_PRE, MSG_STREAM_SYNC_PRELEN );
+    s->f[MSG_STREAM_SYNC_PRELEN] = MSG_STREAM_SYNC_TERM;
+    s->f[SYNC_LEN] = ( len - MSG_STREAM_HDR_LEN ) & 0xFF;
+    s->f[SYNC_LEN + 1] = ( len - MSG_STREAM_HDR_LEN ) >> 8;
+    s->len = 0;
+    *f = s->f;
+    return len;
+}
+// ====================================================================================================
+void MSGStreamPump( struct MSGStream *s, const uint8_t *c, uint32_t len, MSGStreamHandler h, void *param )
+
+/* Read frames from a block of the stream, handing the messages in them to h */
+
+{
+    uint32_t n;
+    bool bad;
+
+    do
+    {
+        /* Anything put back after a false sync is looked through before new data */
+        if ( s->rpos < s->rlen )
+        {
+            s->rpos += _pump( s, &s->r[s->rpos], s->rlen - s->rpos, h, param, &bad );
+        }
+        else
+        {
+            n = _pump( s, c, len, h, param, &bad );
+            c += n;
+            len -= n;
+        }
+
+        if ( bad )
+        {
+            _putBack( s );
+        }
+    }
+    while ( ( len ) || ( s->rpos < s->rlen ) );
+}
+// ====================================================================================================
+uint32_t MSGStreamGetBadFrames( struct MSGStream *s )
+
+{
+    return s->badFrames;
+}
+// ====================================================================================================
+void MSGStreamInit( struct MSGStream *s )
+
+/* Reset a stream, for building frames or for reading them */
+
+{
+    memset( s, 0, sizeof( struct MSGStream ) );
+}
+// ====================================================================================================
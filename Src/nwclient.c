@@ -31,93 +31,949 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * Network server for the raw trace feed (or for a feed of decoded events,
+ * which is sent in just the same way). A single thread runs an event loop
+ * (epoll on Linux, poll elsewhere) which accepts clients, notices when they
+ * go away and sends them whatever couldn't be sent straight away. Data is
+ * sent to each client directly by nwclientSend, on whichever thread calls
+ * it. Anything the socket won't take right then goes into that client's
+ * output queue, and the loop is asked to send it when the socket has room.
+ * There's no thread or pipe per client, and in the usual case the data is
+ * copied once, straight into the socket. What does have to wait is copied
+ * once into a reference counted block shared by all of the client queues,
+ * sent from there with sendmsg (zero copy for large sends, if asked for)
+ * and freed when the last client has sent it, so memory use and copying
+ * don't go up with the number of clients.
+ *
+ * A client's queue is bounded. When it's full data is dropped (newest or
+ * oldest, as configured) or the client is disconnected, so a client that
+ * can't keep up never holds up capture or the other clients. After a drop
+ * the client is sent nothing more until a restart point in the stream (the
+ * end of a sync, or a frame boundary), which is sent with a sync in front
+ * of it so that the client's decoder picks up cleanly from there.
+ *
+ * If asked to, the server also keeps the stream from the latest restart
+ * point onwards, up to a limit, in the same shared blocks. A new client is
+ * started off with a sync and that history, so its decoder locks on as soon
+ * as it connects rather than waiting for the next sync in the live stream.
+ */
+
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <string.h>
 #include <strings.h>
+#include <inttypes.h>
+#if defined LINUX
+    #include <sys/epoll.h>
+    #include <linux/errqueue.h>
+    #if defined SO_ZEROCOPY && defined MSG_ZEROCOPY
+        #define HAVE_ZEROCOPY
+    #endif
+#endif
 #include "generics.h"
+#include "metrics.h"
+#include "tpiuDecoder.h"
+#include "msgStream.h"
 #include "nwclient.h"
 
+#define SYNC_MAX_LEN        (6)               /* Longest sync put in front of a restart point */
+#define CLIENT_MAX_REFS     (4096)            /* Most pieces of blocks in a client queue (a power of 2) */
+#define FLUSH_MAX_IOV       (64)              /* Most pieces sent to a client in one go */
+#define ZEROCOPY_MIN        (16*1024)         /* Smallest send done zero copy, below that copying is cheaper */
+#define HIST_MAX_BLOCKS     (CLIENT_MAX_REFS/4) /* Most blocks in the history (a power of 2) */
+#define LOOP_MAX_EVENTS     (32)              /* Most events dealt with in one go */
+#define LOOP_MAX_FDS        (256)             /* Most clients (plus the listener and wakeup) that poll looks after */
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL (0)                  /* Not available (OSX), SIGPIPE is blocked anyway */
+#endif
+
+/* The sync in front of each sort of restart point */
+static const struct
+{
+    uint8_t pre;                              /* Byte repeated at the start of the sync... */
+    uint32_t preLen;                          /* ...this many times */
+    uint8_t term;                             /* ...and the byte it finishes with */
+} _sync[] =
+{
+    [NWCLIENT_RESTART_ANY]    = { 0x00, 0, 0x00 },
+    [NWCLIENT_RESTART_ITM]    = { 0x00, 5, 0x80 },
+    [NWCLIENT_RESTART_TPIU]   = { 0xFF, 3, 0x7F },
+    [NWCLIENT_RESTART_FRAMES] = { 0xFF, 3, 0x7F },
+    [NWCLIENT_RESTART_MSGS]   = { MSG_STREAM_SYNC_PRE, MSG_STREAM_SYNC_PRELEN, MSG_STREAM_SYNC_TERM },
+};
+
+/* A block of data shared by the client queues that have it in them */
+struct nwBlock
+{
+    uint32_t refs;                            /* References from queues (and zero copy sends in flight) */
+    uint32_t len;                             /* Length of the data */
+    uint64_t ofs;                             /* ...and where it starts in the stream */
+    uint8_t d[];
+};
+
+/* A piece of a block (or of a sync) waiting to be sent to a client */
+struct nwRef
+{
+    struct nwBlock *b;                        /* Block the data is in, or NULL if it's not shared */
+    const uint8_t *d;                         /* Data still to be sent... */
+    uint32_t len;                             /* ...and how much of it there is */
+};
+
+/* A block kept for a zero copy send until the kernel is done with it */
+struct nwHold
+{
+    struct nwBlock *b;
+    uint32_t seq;                             /* Number of the send it was in */
+};
+
+/* Master structure for the nwclients */
+struct nwclientsHandle
+
+{
+    struct nwClient *firstClient;             /* Head of linked list of network clients */
+    pthread_mutex_t clientList;               /* Lock for list of network clients, and their queues */
+
+    int sockfd;                               /* The socket for the inferior */
+    int wake[2];                              /* Pipe for waking the event loop */
+#if defined LINUX
+    int epfd;                                 /* The epoll instance the loop waits on */
+#endif
+    pthread_t ipThread;                       /* The event loop thread */
+    bool finish;                              /* Its time to leave */
+    bool loopDone;                            /* ...and the event loop has */
+
+    uint32_t queueSize;                       /* Data that can wait for each client */
+    enum nwclientOverflow overflow;           /* What happens when that's not enough */
+    enum nwclientRestart restart;             /* Where clients can pick the stream up after a drop */
+    uint32_t syncLen;                         /* Length of the sync in front of a restart point */
+    uint8_t syncBytes[SYNC_MAX_LEN];          /* ...and the sync itself */
+    uint64_t streamOfs;                       /* Bytes given to clients so far */
+    bool zeroCopy;                            /* Send large blocks zero copy */
+    uint64_t blockBytes;                      /* Data in blocks held for the clients */
+
+    /* History for starting new clients off from */
+    uint32_t histSize;                        /* Most history kept, 0 for none */
+    struct nwBlock **hist;                    /* Blocks it's in */
+    uint32_t histW;                           /* Total blocks put in it */
+    uint32_t histR;                           /* ...and let go of */
+    uint32_t histRun;                         /* Sync lead in at the end of it */
+    bool histValid;                           /* There's a restart point in it... */
+    uint64_t histStart;                       /* ...and this is where that is in the stream */
+
+    struct metricsHistogram writeTime;        /* Time taken by writes to clients */
+};
+
+/* List of any connected network clients */
+struct nwClient
+
+{
+    int fd;                                   /* Socket to the client */
+    struct nwclientsHandle *parent;           /* Who owns this list */
+    struct nwClient *nextClient;
+    struct nwClient *prevClient;
+    bool dead;                                /* Connection has failed, loop should remove it */
+
+    /* Output queue, for what the socket wouldn't take straight away */
+    struct nwRef *r;                          /* Pieces of blocks waiting to be sent */
+    uint32_t rw;                              /* Total pieces put in the queue */
+    uint32_t rr;                              /* ...and taken out of it */
+    uint64_t qwp;                             /* Total bytes put in the queue */
+    uint64_t qrp;                             /* ...and taken out of it */
+    bool outArmed;                            /* Loop is watching for the socket to have room */
+    uint64_t frameBase;                       /* Queue position of a frame boundary, for RESTART_FRAMES */
+    uint64_t restartAt;                       /* Queue position just after the last sync put in it */
+
+    /* Recovery from overflow */
+    bool overflowing;                         /* Data has been dropped since the queue was last empty */
+    bool resyncing;                           /* Waiting for a restart point before queuing more */
+    uint32_t preRun;                          /* Sync lead in at the end of what's been looked through */
+
+    /* Zero copy sends */
+    bool zeroCopy;                            /* Large sends are zero copy */
+    struct nwHold *hold;                      /* Blocks in zero copy sends the kernel hasn't finished */
+    uint32_t hw;                              /* Total blocks held */
+    uint32_t hr;                              /* ...and released */
+    uint32_t zcSeq;                           /* Number of the next zero copy send */
+
+    char peer[INET_ADDRSTRLEN + 6];           /* Where the client is, as address:port */
+    uint64_t sent;                            /* Bytes sent to it */
+    uint64_t dropped;                         /* ...and dropped because its queue was full */
+    uint64_t overflows;                       /* Times its queue has been full */
+};
+
+// ====================================================================================================
+// Network server implementation for raw SWO feed
+// ====================================================================================================
+static void _lock( struct nwclientsHandle *h )
+
+{
+    if ( pthread_mutex_lock( &h->clientList ) )
+    {
+        genericsExit( -1, "Failed to acquire mutex" EOL );
+    }
+}
+// ====================================================================================================
+static void _wakeLoop( struct nwclientsHandle *h )
+
+{
+    uint8_t b = 0;
+
+    /* If the pipe is full then the loop has plenty of wakeups waiting already */
+    if ( write( h->wake[1], &b, 1 ) < 0 )
+    {
+        return;
+    }
+}
+// ====================================================================================================
+static void _armOutput( struct nwClient *c, bool on )
+
+/* Have the event loop watch (or stop watching) for the client's socket to have room. Call locked */
+
+{
+    if ( c->outArmed == on )
+    {
+        return;
+    }
+
+    c->outArmed = on;
+#if defined LINUX
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | ( on ? EPOLLOUT : 0 ), .data.ptr = c };
+    epoll_ctl( c->parent->epfd, EPOLL_CTL_MOD, c->fd, &ev );
+#else
+
+    /* poll picks up the change the next time round, so make sure there is one */
+    if ( on )
+    {
+        _wakeLoop( c->parent );
+    }
+
+#endif
+}
+// ====================================================================================================
+static bool _sendStraight( struct nwClient *c, const uint8_t *d, uint32_t len, uint32_t *sent )
+
+/* Send as much as the socket will take without waiting. Returns false if the client has failed */
+
+{
+    uint64_t startTime = metricsTimeUs();
+    ssize_t n = send( c->fd, d, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+
+    *sent = 0;
+
+    if ( n < 0 )
+    {
+        return ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) || ( errno == EINTR );
+    }
+
+    metricsHistogramAdd( &c->parent->writeTime, metricsTimeUs() - startTime );
+    __atomic_store_n( &c->sent, c->sent + n, __ATOMIC_RELAXED );
+    *sent = n;
+    return true;
+}
+// ====================================================================================================
+static struct nwBlock *_blockNew( struct nwclientsHandle *h, const uint8_t *d, uint32_t len, uint64_t s )
+
+/* Copy a block into a buffer that the client queues can share. Call locked */
+
+{
+    struct nwBlock *b = ( struct nwBlock * )malloc( sizeof( struct nwBlock ) + len );
+
+    if ( b )
+    {
+        b->refs = 1;
+        b->len = len;
+        b->ofs = s;
+        memcpy( b->d, d, len );
+        __atomic_store_n( &h->blockBytes, h->blockBytes + len, __ATOMIC_RELAXED );
+    }
+
+    return b;
+}
+// ====================================================================================================
+static void _blockRelease( struct nwclientsHandle *h, struct nwBlock *b )
+
+/* Drop a reference to a block, which goes with the last of them. Call locked */
+
+{
+    if ( ( b ) && ( !--b->refs ) )
+    {
+        __atomic_store_n( &h->blockBytes, h->blockBytes - b->len, __ATOMIC_RELAXED );
+        free( b );
+    }
+}
+// ====================================================================================================
+static struct nwRef *_ref( struct nwClient *c, uint32_t n )
+
+{
+    return &c->r[n & ( CLIENT_MAX_REFS - 1 )];
+}
+// ====================================================================================================
+static uint32_t _space( struct nwClient *c )
+
+{
+    return c->parent->queueSize - ( uint32_t )( c->qwp - c->qrp );
+}
+// ====================================================================================================
+static uint32_t _refsFree( struct nwClient *c )
+
+{
+    return CLIENT_MAX_REFS - ( c->rw - c->rr );
+}
+// ====================================================================================================
+static bool _zeroCopyFor( struct nwClient *c, uint32_t len )
+
+{
+    return ( c->zeroCopy ) && ( len >= ZEROCOPY_MIN );
+}
+// ====================================================================================================
+static void _push( struct nwClient *c, struct nwBlock *b, const uint8_t *d, uint32_t len )
+
+/* Add a reference to data to the back of the queue, which must have room. Call locked */
+
+{
+    struct nwRef *r = _ref( c, c->rw++ );
+
+    r->b = b;
+    r->d = d;
+    r->len = len;
+    c->qwp += len;
+
+    if ( b )
+    {
+        b->refs++;
+    }
+}
+// ====================================================================================================
+static void _putStream( struct nwClient *c, struct nwBlock *b, uint32_t start, uint32_t len )
+
+/* Queue part of a block, which must fit. Call locked */
+
+{
+    /* Frames in the queue are in the same place as they are in the stream */
+    c->frameBase = c->qwp - ( ( b->ofs + start ) % TPIU_PACKET_LEN );
+    _push( c, b, &b->d[start], len );
+}
+// ====================================================================================================
+static void _putSync( struct nwClient *c, bool front )
+
+/* Put a sync at the front or back of the queue, so the client can pick up after it. Call locked */
+
+{
+    struct nwclientsHandle *h = c->parent;
+    struct nwRef *r;
+
+    if ( !front )
+    {
+        _push( c, NULL, h->syncBytes, h->syncLen );
+        c->restartAt = c->qwp;
+        return;
+    }
+
+    c->restartAt = c->qrp;
+    r = _ref( c, --c->rr );
+    r->b = NULL;
+    r->d = h->syncBytes;
+    r->len = h->syncLen;
+    c->qrp -= h->syncLen;
+}
+// ====================================================================================================
+static void _trim( struct nwClient *c, uint64_t x )
+
+/* Take everything before queue position x out of the queue, being done with it. Call locked */
+
+{
+    struct nwRef *r;
+    uint32_t n;
+
+    while ( ( c->qrp < x ) && ( c->rr != c->rw ) )
+    {
+        r = _ref( c, c->rr );
+        n = ( x - c->qrp < r->len ) ? x - c->qrp : r->len;
+        r->d += n;
+        r->len -= n;
+        c->qrp += n;
+
+        if ( !r->len )
+        {
+            _blockRelease( c->parent, r->b );
+            c->rr++;
+        }
+    }
+}
+// ====================================================================================================
+static bool _syncEnd( enum nwclientRestart r, uint32_t *run, const uint8_t *d, uint32_t len, uint32_t *at )
+
+/* Look for the end of a sync in d, given run bytes of its lead in just before d. If there */
+/* is one then at is set to just after it, otherwise run is updated for the next call.    */
+
+{
+    const uint8_t *p = d;
+    const uint8_t *end = d + len;
+    uint32_t k;
+
+    while ( ( p < end ) && ( p = memchr( p, _sync[r].term, end - p ) ) )
+    {
+        for ( k = 0; ( k < _sync[r].preLen ) && ( p - k > d ) && ( *( p - k - 1 ) == _sync[r].pre ); k++ );
+
+        if ( ( k == _sync[r].preLen ) || ( ( p - k == d ) && ( k + *run >= _sync[r].preLen ) ) )
+        {
+            *at = p - d + 1;
+            *run = 0;
+            return true;
+        }
+
+        p++;
+    }
+
+    /* No sync, so note how much of a lead in the data finishes with */
+    for ( k = 0; ( k < _sync[r].preLen ) && ( k < len ) && ( d[len - k - 1] == _sync[r].pre ); k++ );
+
+    *run = ( k == len ) ? *run + k : k;
+    *run = ( *run < _sync[r].preLen ) ? *run : _sync[r].preLen;
+    return false;
+}
+// ====================================================================================================
+static bool _restartIn( struct nwclientsHandle *h, uint32_t *run, const uint8_t *d, uint32_t len, uint32_t phase, uint32_t *at )
+
+/* Find the first point in d that a client can restart from, d[0] being phase bytes into a frame */
+/* and run bytes of a sync lead in coming just before it.                                         */
+
+{
+    switch ( h->restart )
+    {
+        case NWCLIENT_RESTART_ANY:
+            *at = 0;
+            return true;
+
+        case NWCLIENT_RESTART_FRAMES:
+            *at = ( TPIU_PACKET_LEN - phase ) % TPIU_PACKET_LEN;
+            return ( *at < len );
+
+        default:
+            return _syncEnd( h->restart, run, d, len, at );
+    }
+}
+// ====================================================================================================
+static void _drop( struct nwClient *c, uint64_t len )
+
+{
+    __atomic_store_n( &c->dropped, c->dropped + len, __ATOMIC_RELAXED );
+}
+// ====================================================================================================
+static void _overflow( struct nwClient *c )
+
+/* The client's queue has overflowed, which is only worth a mention the first time round */
+
+{
+    __atomic_store_n( &c->overflows, c->overflows + 1, __ATOMIC_RELAXED );
+
+    if ( !c->overflowing )
+    {
+        genericsReport( V_WARN, "Client %s can't keep up, dropping data" EOL, c->peer );
+        c->overflowing = true;
+    }
+}
+// ====================================================================================================
+static void _dropOldest( struct nwClient *c, uint32_t need )
+
+/* Make room for need bytes by dropping from the front of the queue up to a restart point. At  */
+/* least half of the queue is freed so that this isn't needed again for the very next block.   */
+/* If there's no restart point everything goes, and the client waits for one in what follows. */
+
+{
+    struct nwclientsHandle *h = c->parent;
+    uint32_t room = ( need > h->queueSize / 2 ) ? need : h->queueSize / 2;
+    uint32_t keep = ( room < h->queueSize ) ? h->queueSize - room : 0;
+    uint64_t cut = c->qwp - ( ( c->qwp - c->qrp < keep ) ? c->qwp - c->qrp : keep );
+    uint64_t start = c->qrp;
+    uint64_t pos = c->qrp;
+    uint64_t p = c->qwp;
+    uint32_t i = c->rr;
+    uint32_t st, at;
+    struct nwRef *r;
+    bool found = false;
+    bool inQueue = false;
+
+    _overflow( c );
+    c->preRun = 0;
+
+    /* Leave room in front of the restart point for the sync */
+    cut = ( cut - c->qrp < h->syncLen ) ? c->qrp + h->syncLen : cut;
+    cut = ( cut < c->qwp ) ? cut : c->qwp;
+
+    if ( ( c->restartAt >= cut + h->syncLen ) && ( c->restartAt <= c->qwp ) )
+    {
+        /* The last sync we put in is still there to restart from */
+        p = c->restartAt;
+        found = inQueue = true;
+    }
+    else
+    {
+        while ( ( !found ) && ( i != c->rw ) )
+        {
+            r = _ref( c, i++ );
+
+            if ( pos + r->len > cut )
+            {
+                st = ( cut > pos ) ? cut - pos : 0;
+
+                if ( _restartIn( h, &c->preRun, r->d + st, r->len - st, ( pos + st - c->frameBase ) % TPIU_PACKET_LEN, &at ) )
+                {
+                    p = pos + st + at;
+                    found = true;
+                }
+            }
+
+            pos += r->len;
+        }
+    }
+
+    /* Restarting from there has to make enough room, or it's no use */
+    if ( ( found ) && ( h->queueSize - ( c->qwp - p ) - h->syncLen >= need ) )
+    {
+        _trim( c, inQueue ? p - h->syncLen : p );
+        found = ( _refsFree( c ) >= 2 );
+    }
+    else
+    {
+        found = false;
+    }
+
+    if ( !found )
+    {
+        /* If the whole queue was looked through its lead in count carries on into what comes next */
+        c->preRun = ( ( !inQueue ) && ( p == c->qwp ) ) ? c->preRun : 0;
+        _trim( c, c->qwp );
+        c->resyncing = true;
+    }
+
+    _drop( c, c->qrp - start );
+
+    if ( ( found ) && ( !inQueue ) )
+    {
+        _putSync( c, true );
+    }
+}
+// ====================================================================================================
+static void _deliver( struct nwClient *c, struct nwBlock *b, uint32_t start, uint32_t len )
+
+/* Queue part of a block for the client, dealing with overflow. Call locked */
+
+{
+    struct nwclientsHandle *h = c->parent;
+    uint64_t was;
+    uint32_t at, n;
+
+    while ( ( len ) && ( !c->dead ) )
+    {
+        if ( c->resyncing )
+        {
+            /* Only pick up again at a restart point, and once there's plenty of room */
+            if ( ( _space( c ) < h->queueSize / 2 ) || ( _refsFree( c ) < CLIENT_MAX_REFS / 2 ) )
+            {
+                _drop( c, len );
+                c->preRun = 0;
+                return;
+            }
+
+            if ( !_restartIn( h, &c->preRun, &b->d[start], len, ( b->ofs + start ) % TPIU_PACKET_LEN, &at ) )
+            {
+                _drop( c, len );
+                return;
+            }
+
+            _drop( c, at );
+            start += at;
+            len -= at;
+            _putSync( c, false );
+            c->resyncing = false;
+            continue;
+        }
+
+        n = _refsFree( c ) ? _space( c ) : 0;
+
+        if ( len <= n )
+        {
+            _putStream( c, b, start, len );
+            return;
+        }
+
+        switch ( h->overflow )
+        {
+            case NWCLIENT_DISCONNECT:
+                genericsReport( V_WARN, "Client %s can't keep up, disconnecting" EOL, c->peer );
+                c->dead = true;
+                break;
+
+            case NWCLIENT_DROP_OLDEST:
+                if ( len + h->syncLen > h->queueSize / 2 )
+                {
+                    /* Too big to make room for, so only the end of it is kept */
+                    n = len - ( h->queueSize / 2 - h->syncLen );
+                    _overflow( c );
+                    was = c->qrp;
+                    _trim( c, c->qwp );
+                    _drop( c, c->qrp - was + n );
+                    start += n;
+                    len -= n;
+                    c->resyncing = true;
+                    c->preRun = 0;
+                }
+                else
+                {
+                    _dropOldest( c, len );
+                }
+
+                break;
+
+            case NWCLIENT_DROP_NEWEST:
+                /* Take what fits (a frame of messages is no use in part), then wait for a restart point */
+                _overflow( c );
+                n = ( h->restart == NWCLIENT_RESTART_MSGS ) ? 0 : n;
+
+                if ( n )
+                {
+                    _putStream( c, b, start, n );
+                }
+
+                start += n;
+                len -= n;
+                c->resyncing = true;
+                c->preRun = 0;
+                break;
+        }
+    }
+}
+// ====================================================================================================
+static struct nwBlock **_histBlock( struct nwclientsHandle *h, uint32_t n )
+
+{
+    return &h->hist[n & ( HIST_MAX_BLOCKS - 1 )];
+}
+// ====================================================================================================
+static void _histClear( struct nwclientsHandle *h )
+
+/* Let go of the history, which has nothing to start a client from until the next restart point. Call locked */
+
+{
+    while ( h->histR != h->histW )
+    {
+        _blockRelease( h, *_histBlock( h, h->histR++ ) );
+    }
+
+    h->histValid = false;
+}
+// ====================================================================================================
+static void _histAdd( struct nwclientsHandle *h, struct nwBlock *b )
+
+/* Add a block to the history, moving its start up to the latest restart point there is. */
+/* Anything before that is let go of, and so is all of it if it gets too big. Call locked */
+
+{
+    uint32_t pos = 0;
+    uint32_t at;
+    bool found = false;
+
+    if ( h->restart == NWCLIENT_RESTART_FRAMES )
+    {
+        /* The last frame boundary in (or just after) the block */
+        at = ( b->ofs + b->len ) % TPIU_PACKET_LEN;
+        found = ( at <= b->len );
+        pos = b->len - at;
+    }
+    else
+    {
+        /* Only the last sync is wanted, so keep looking until there are no more */
+        while ( ( pos < b->len ) && ( _syncEnd( h->restart, &h->histRun, &b->d[pos], b->len - pos, &at ) ) )
+        {
+            pos += at;
+            found = true;
+        }
+    }
+
+    if ( found )
+    {
+        h->histValid = true;
+        h->histStart = b->ofs + pos;
+    }
+
+    if ( !h->histValid )
+    {
+        return;
+    }
+
+    b->refs++;
+    *_histBlock( h, h->histW++ ) = b;
+
+    while ( ( h->histR != h->histW ) && ( ( *_histBlock( h, h->histR ) )->ofs + ( *_histBlock( h, h->histR ) )->len <= h->histStart ) )
+    {
+        _blockRelease( h, *_histBlock( h, h->histR++ ) );
+    }
+
+    if ( ( b->ofs + b->len - h->histStart > h->histSize ) || ( h->histW - h->histR >= HIST_MAX_BLOCKS ) )
+    {
+        _histClear( h );
+    }
+}
+// ====================================================================================================
+static void _prime( struct nwClient *c )
+
+/* Start a new client off with a sync and the history after the restart point it's kept from. */
+/* The history is never more than half of a queue, so it all fits. Call locked                */
+
+{
+    struct nwclientsHandle *h = c->parent;
+    struct nwBlock *b;
+    uint32_t start;
+
+    if ( !h->histValid )
+    {
+        return;
+    }
+
+    _putSync( c, false );
+
+    for ( uint32_t i = h->histR; i != h->histW; i++ )
+    {
+        b = *_histBlock( h, i );
+        start = ( h->histStart > b->ofs ) ? h->histStart - b->ofs : 0;
+
+        if ( start < b->len )
+        {
+            _putStream( c, b, start, b->len - start );
+        }
+    }
+
+    _armOutput( c, true );
+}
+// ====================================================================================================
+#ifdef HAVE_ZEROCOPY
+static struct nwHold *_held( struct nwClient *c, uint32_t n )
+
+{
+    return &c->hold[n & ( CLIENT_MAX_REFS - 1 )];
+}
+// ====================================================================================================
+static void _holdSent( struct nwClient *c, uint32_t n )
+
+/* The first n bytes of the queue have been sent zero copy, so the blocks they're in have to be */
+/* kept until the kernel says it's done with them. Call locked                                  */
+
+{
+    struct nwRef *r;
+
+    for ( uint32_t i = c->rr; ( n ) && ( i != c->rw ); i++ )
+    {
+        r = _ref( c, i );
+
+        if ( r->b )
+        {
+            r->b->refs++;
+            _held( c, c->hw )->b = r->b;
+            _held( c, c->hw++ )->seq = c->zcSeq;
+        }
+
+        n -= ( n < r->len ) ? n : r->len;
+    }
+
+    c->zcSeq++;
+}
+// ====================================================================================================
+static void _zeroCopyDone( struct nwClient *c )
+
+/* Release the blocks from zero copy sends that the kernel has finished with. Call locked */
+
+{
+    uint8_t control[CMSG_SPACE( sizeof( struct sock_extended_err ) ) + 64];
+    struct msghdr msg = { .msg_control = control };
+    struct sock_extended_err *e;
+    struct cmsghdr *cm;
+
+    while ( 1 )
+    {
+        msg.msg_controllen = sizeof( control );
+
+        if ( recvmsg( c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+        {
+            return;
+        }
+
+        for ( cm = CMSG_FIRSTHDR( &msg ); cm; cm = CMSG_NXTHDR( &msg, cm ) )
+        {
+            e = ( struct sock_extended_err * )CMSG_DATA( cm );
+
+            if ( ( cm->cmsg_level != SOL_IP ) || ( cm->cmsg_type != IP_RECVERR ) || ( e->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) )
+            {
+                continue;
+            }
+
+            /* Sends are completed in order, up to ee_data */
+            while ( ( c->hr != c->hw ) && ( ( int32_t )( _held( c, c->hr )->seq - e->ee_data ) <= 0 ) )
+            {
+                _blockRelease( c->parent, _held( c, c->hr++ )->b );
+            }
+        }
+    }
+}
+#endif
+// ====================================================================================================
+static void _flush( struct nwClient *c )
+
+/* Send as much of the client's output queue as the socket will take. Call locked */
 
-#define CLIENT_TERM_INTERVAL_US (10000)       /* Interval to check for all clients lost */
+{
+    struct iovec iov[FLUSH_MAX_IOV];
+    struct msghdr msg = { .msg_iov = iov };
+    uint64_t startTime;
+    uint32_t total;
+    int flags;
+    ssize_t n;
+
+    while ( ( !c->dead ) && ( c->rr != c->rw ) )
+    {
+        /* Everything queued goes in one call, as far as it can, straight from the shared blocks */
+        for ( msg.msg_iovlen = 0, total = 0; ( msg.msg_iovlen < FLUSH_MAX_IOV ) && ( c->rr + msg.msg_iovlen != c->rw ); msg.msg_iovlen++ )
+        {
+            iov[msg.msg_iovlen].iov_base = ( void * )_ref( c, c->rr + msg.msg_iovlen )->d;
+            iov[msg.msg_iovlen].iov_len = _ref( c, c->rr + msg.msg_iovlen )->len;
+            total += iov[msg.msg_iovlen].iov_len;
+        }
 
-/* Master structure for the nwclients */
-struct nwclientsHandle
+        flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#ifdef HAVE_ZEROCOPY
+        bool zc = _zeroCopyFor( c, total ) && ( CLIENT_MAX_REFS - ( c->hw - c->hr ) >= msg.msg_iovlen );
+        flags |= zc ? MSG_ZEROCOPY : 0;
+#endif
+        startTime = metricsTimeUs();
 
-{
-    struct nwClient *firstClient;             /* Head of linked list of network clients */
-    pthread_mutex_t clientList;               /* Lock for list of network clients */
+        if ( ( n = sendmsg( c->fd, &msg, flags ) ) < 0 )
+        {
+#ifdef HAVE_ZEROCOPY
 
-    int sockfd;                               /* The socket for the inferior */
-    pthread_t ipThread;                       /* The listening thread for n/w clients */
-    bool finish;                              /* Its time to leave */
-};
+            if ( ( zc ) && ( errno == ENOBUFS ) )
+            {
+                /* No more pages can be pinned, so this client goes back to copying */
+                c->zeroCopy = false;
+                continue;
+            }
 
-/* List of any connected network clients */
-struct nwClient
+#endif
+            c->dead = ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) && ( errno != EINTR );
+            break;
+        }
 
-{
-    int handle;                               /* Handle to client */
-    pthread_t thread;                         /* Execution thread */
-    struct nwclientsHandle *parent;           /* Who owns this list */
-    struct nwClient *nextClient;
-    struct nwClient *prevClient;
-    bool finish;                              /* Flag indicating it's time to cease operation */
+        metricsHistogramAdd( &c->parent->writeTime, metricsTimeUs() - startTime );
+        __atomic_store_n( &c->sent, c->sent + n, __ATOMIC_RELAXED );
+#ifdef HAVE_ZEROCOPY
+
+        if ( zc )
+        {
+            _holdSent( c, n );
+        }
 
-    /* Parameters used to run the client */
-    int portNo;                               /* Port of connection */
-    int listenHandle;                         /* Handle for listener */
+#endif
+        _trim( c, c->qrp + n );
+    }
 
-};
+    if ( ( c->rr == c->rw ) && ( !c->resyncing ) )
+    {
+        c->overflowing = false;
+    }
+
+    _armOutput( c, ( !c->dead ) && ( c->rr != c->rw ) );
+}
+// ====================================================================================================
+static void _clientAdd( struct nwclientsHandle *h, int fd, struct sockaddr_in *cli_addr )
+
+/* A new client has connected, hook it in */
 
-static int lock_with_timeout( pthread_mutex_t *mutex, const struct timespec *ts )
 {
-    int ret;
-    int left, step;
+    struct nwClient *c = ( struct nwClient * )calloc( 1, sizeof( struct nwClient ) );
+    char s[INET_ADDRSTRLEN];
 
-    left = ts->tv_sec * 1000;       /* how much waiting is left, in msec */
-    step = 10;              /* msec to sleep at each trywait() failure */
+    inet_ntop( AF_INET, &cli_addr->sin_addr, s, sizeof( s ) );
+    genericsReport( V_INFO, "New connection from %s" EOL, s );
 
-    do
+    if ( ( !c ) || ( !( c->r = ( struct nwRef * )calloc( CLIENT_MAX_REFS, sizeof( struct nwRef ) ) ) ) ||
+            ( !( c->hold = ( struct nwHold * )calloc( CLIENT_MAX_REFS, sizeof( struct nwHold ) ) ) ) )
     {
-        if ( ( ret = pthread_mutex_trylock( mutex ) ) != 0 )
-        {
-            struct timespec dly;
+        genericsReport( V_ERROR, "No memory for client" EOL );
+        goto close_and_return;
+    }
 
-            dly.tv_sec = 0;
-            dly.tv_nsec = step * 1000000;
-            nanosleep( &dly, NULL );
+    c->fd = fd;
+    c->parent = h;
+    snprintf( c->peer, sizeof( c->peer ), "%s:%d", s, ntohs( cli_addr->sin_port ) );
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
 
-            left -= step;
-        }
+#ifdef HAVE_ZEROCOPY
+    c->zeroCopy = ( h->zeroCopy ) && ( !setsockopt( fd, SOL_SOCKET, SO_ZEROCOPY, &( int )
+    {
+        1
+    }, sizeof( int ) ) );
+#endif
+
+#if defined LINUX
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+
+    if ( epoll_ctl( h->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    {
+        genericsReport( V_ERROR, "Cannot watch client" EOL );
+        goto close_and_return;
     }
-    while ( ret != 0 && left > 0 );
 
-    return ret;
-}
+#endif
 
-// ====================================================================================================
-// Network server implementation for raw SWO feed
-// ====================================================================================================
-static void _clientRemove( struct nwClient *c )
+    /* Hook into linked list */
+    _lock( h );
+    c->nextClient = h->firstClient;
+    c->prevClient = NULL;
 
-{
-    const struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+    if ( c->nextClient )
+    {
+        c->nextClient->prevClient = c;
+    }
+
+    h->firstClient = c;
 
-    close( c->portNo );
-    close( c->listenHandle );
+    /* Anything sent from here on goes after the history, since it's in the queue first */
+    _prime( c );
+    pthread_mutex_unlock( &h->clientList );
+    return;
 
-    /* First of all, make sure we can get access to the client list */
+close_and_return:
+    close( fd );
 
-    if ( lock_with_timeout( &c->parent->clientList, &ts ) < 0 )
+    if ( c )
     {
-        genericsExit( -1, "Failed to acquire mutex" EOL );
+        free( c->r );
+        free( c->hold );
+        free( c );
     }
+}
+// ====================================================================================================
+static void _clientRemove( struct nwClient *c )
+
+/* Unhook a client and free it. Call locked, from the event loop */
+
+{
+    genericsReport( V_INFO, "Connection dropped" EOL );
+
+    /* Closing the socket takes it out of the epoll set too */
+    close( c->fd );
 
     if ( c->prevClient )
     {
@@ -133,104 +989,204 @@ static void _clientRemove( struct nwClient *c )
         c->nextClient->prevClient = c->prevClient;
     }
 
-    /* OK, we made our modifications */
-    pthread_mutex_unlock( &c->parent->clientList );
+    /* Let go of anything it was still holding on to, and the memory that was allocated for it */
+    _trim( c, c->qwp );
+
+    while ( c->hr != c->hw )
+    {
+        _blockRelease( c->parent, c->hold[c->hr++ & ( CLIENT_MAX_REFS - 1 )].b );
+    }
 
-    /* Remove the memory that was allocated for this client */
+    free( c->r );
+    free( c->hold );
     free( c );
 }
 // ====================================================================================================
-static void *_client( void *args )
+static void _clientReadable( struct nwClient *c )
 
-/* Handle an individual network client account */
+/* Clients don't have anything to say, so this is just to find out if they've gone. Call locked */
 
 {
-    struct nwClient *c = ( struct nwClient * )args;
-    int readDataLen;
-    uint8_t maxTransitPacket[TRANSFER_SIZE];
+    uint8_t b[256];
+    ssize_t n;
 
-    while ( !c->finish )
-    {
-        readDataLen = read( c->listenHandle, maxTransitPacket, TRANSFER_SIZE );
+    while ( ( n = read( c->fd, b, sizeof( b ) ) ) > 0 );
 
-        if ( ( c->finish ) || ( readDataLen <= 0 ) || ( write( c->portNo, maxTransitPacket, readDataLen ) < 0 ) )
-        {
-            /* This port went away, so remove it */
-            genericsReport( V_INFO, "Connection dropped" EOL );
-            c->finish = true;
-        }
+    if ( ( !n ) || ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) && ( errno != EINTR ) ) )
+    {
+        c->dead = true;
     }
+}
+// ====================================================================================================
+static void _accept( struct nwclientsHandle *h )
 
-    close( c->listenHandle );
+{
+    struct sockaddr_in cli_addr;
+    socklen_t clilen = sizeof( cli_addr );
+    int fd;
 
-    _clientRemove( c );
-    return NULL;
+    while ( ( fd = accept( h->sockfd, ( struct sockaddr * ) &cli_addr, &clilen ) ) >= 0 )
+    {
+        _clientAdd( h, fd, &cli_addr );
+        clilen = sizeof( cli_addr );
+    }
 }
 // ====================================================================================================
-static void *_listenTask( void *arg )
+static void _reap( struct nwclientsHandle *h )
+
+/* Remove any clients that have failed */
 
 {
-    struct nwclientsHandle *h = ( struct nwclientsHandle * )arg;
-    const struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
-    int newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in cli_addr;
-    int f[2];                               /* File descriptor set for pipe */
-    struct nwClient *client;
-    char s[100];
+    struct nwClient *c;
+    struct nwClient *n;
 
-    clilen = sizeof( cli_addr );
-    listen( h->sockfd, 5 );
+    _lock( h );
 
-    while ( !h->finish )
+    for ( c = h->firstClient; c; c = n )
     {
-        newsockfd = accept( h->sockfd, ( struct sockaddr * ) &cli_addr, &clilen );
+        n = c->nextClient;
 
-        if ( h->finish )
+        if ( ( c->dead ) || ( h->finish ) )
         {
-            close( newsockfd );
-            break;
+            _clientRemove( c );
         }
+    }
+
+    pthread_mutex_unlock( &h->clientList );
+}
+// ====================================================================================================
+#if defined LINUX
+static void _waitEvents( struct nwclientsHandle *h )
 
-        inet_ntop( AF_INET, &cli_addr.sin_addr, s, 99 );
-        genericsReport( V_INFO, "New connection from %s" EOL, s );
+/* Wait for something to happen, and deal with it */
 
-        /* We got a new connection - spawn a thread to handle it */
-        if ( !pipe( f ) )
+{
+    struct epoll_event ev[LOOP_MAX_EVENTS];
+    struct nwClient *c;
+    uint8_t b[64];
+    int n;
+
+    n = epoll_wait( h->epfd, ev, LOOP_MAX_EVENTS, -1 );
+
+    for ( int e = 0; e < n; e++ )
+    {
+        if ( ev[e].data.ptr == &h->sockfd )
+        {
+            _accept( h );
+        }
+        else if ( ev[e].data.ptr == &h->wake[0] )
+        {
+            while ( read( h->wake[0], b, sizeof( b ) ) > 0 );
+        }
+        else
         {
-            client = ( struct nwClient * )calloc( 1, sizeof( struct nwClient ) );
-            client->handle = f[1];
-            client->parent = h;
-            client->listenHandle = f[0];
-            client->portNo = newsockfd;
+            c = ( struct nwClient * )ev[e].data.ptr;
+            _lock( h );
 
-            if ( !pthread_create( &( client->thread ), NULL, &_client, client ) )
+#ifdef HAVE_ZEROCOPY
+
+            /* Completed zero copy sends are reported through the error queue */
+            if ( ev[e].events & EPOLLERR )
             {
-                /* Auto-cleanup for this thread */
-                pthread_detach( client->thread );
+                _zeroCopyDone( c );
+            }
 
-                /* Hook into linked list */
-                if ( lock_with_timeout( &h->clientList, &ts ) < 0 )
-                {
-                    genericsExit( -1, "Failed to acquire mutex" EOL );
-                }
+#endif
 
-                client->nextClient = h->firstClient;
-                client->prevClient = NULL;
+            if ( ev[e].events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+            {
+                _clientReadable( c );
+            }
 
-                if ( client->nextClient )
-                {
-                    client->nextClient->prevClient = client;
-                }
+            if ( ev[e].events & EPOLLOUT )
+            {
+                _flush( c );
+            }
+
+            pthread_mutex_unlock( &h->clientList );
+        }
+    }
+}
+#else
+static void _waitEvents( struct nwclientsHandle *h )
 
-                h->firstClient = client;
+/* Wait for something to happen, and deal with it. The poll set is rebuilt each time round */
 
-                pthread_mutex_unlock( &h->clientList );
-            }
+{
+    struct pollfd p[LOOP_MAX_FDS];
+    struct nwClient *c[LOOP_MAX_FDS];
+    uint8_t b[64];
+    nfds_t n = 2;
+
+    p[0] = ( struct pollfd ) { .fd = h->sockfd, .events = POLLIN };
+    p[1] = ( struct pollfd ) { .fd = h->wake[0], .events = POLLIN };
+
+    _lock( h );
+
+    for ( struct nwClient *l = h->firstClient; ( l ) && ( n < LOOP_MAX_FDS ); l = l->nextClient )
+    {
+        c[n] = l;
+        p[n++] = ( struct pollfd ) { .fd = l->fd, .events = POLLIN | ( l->outArmed ? POLLOUT : 0 ) };
+    }
+
+    pthread_mutex_unlock( &h->clientList );
+
+    if ( poll( p, n, -1 ) <= 0 )
+    {
+        return;
+    }
+
+    if ( p[0].revents )
+    {
+        _accept( h );
+    }
+
+    if ( p[1].revents )
+    {
+        while ( read( h->wake[0], b, sizeof( b ) ) > 0 );
+    }
+
+    /* Clients are only removed by this thread, so they're all still there */
+    _lock( h );
+
+    for ( nfds_t i = 2; i < n; i++ )
+    {
+        if ( p[i].revents & ( POLLIN | POLLHUP | POLLERR ) )
+        {
+            _clientReadable( c[i] );
+        }
+
+        if ( p[i].revents & POLLOUT )
+        {
+            _flush( c[i] );
         }
     }
 
+    pthread_mutex_unlock( &h->clientList );
+}
+#endif
+// ====================================================================================================
+static void *_loopTask( void *arg )
+
+/* The event loop, looking after the listening socket and all of the clients */
+
+{
+    struct nwclientsHandle *h = ( struct nwclientsHandle * )arg;
+
+    listen( h->sockfd, 5 );
+
+    while ( !h->finish )
+    {
+        _waitEvents( h );
+        _reap( h );
+    }
+
+    _reap( h );
+    _lock( h );
+    _histClear( h );
+    pthread_mutex_unlock( &h->clientList );
     close( h->sockfd );
+    h->loopDone = true;
     return NULL;
 }
 // ====================================================================================================
@@ -242,33 +1198,178 @@ static void *_listenTask( void *arg )
 // ====================================================================================================
 void nwclientSend( struct nwclientsHandle *h, uint32_t len, uint8_t *buffer )
 
+/* Send a block to all of the clients, straight into their sockets if they'll take it. Those */
+/* that won't take it all share a single copy of the block, made by the first of them.      */
+
 {
     assert( h );
     assert( len );
 
-    const struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
-    struct nwClient *n = h->firstClient;
+    struct nwClient *c;
+    struct nwBlock *b;
+    uint32_t sent;
+    bool idle;
+    bool reap = false;
 
-    if ( !h->finish )
+    if ( h->finish )
     {
-        if ( lock_with_timeout( &h->clientList, &ts ) < 0 )
+        return;
+    }
+
+    _lock( h );
+
+    /* With a history every block is kept for it, otherwise only if a client needs it */
+    b = h->histSize ? _blockNew( h, buffer, len, h->streamOfs ) : NULL;
+
+    for ( c = h->firstClient; c; c = c->nextClient )
+    {
+        if ( c->dead )
+        {
+            continue;
+        }
+
+        sent = 0;
+        idle = ( c->rr == c->rw ) && ( !c->resyncing );
+
+        /* If there's a queue then this has to go after it, to keep things in order. Zero */
+        /* copy sends go through the queue too, since the block has to be held for them.  */
+        if ( ( idle ) && ( !_zeroCopyFor( c, len ) ) )
+        {
+            if ( !_sendStraight( c, buffer, len, &sent ) )
+            {
+                c->dead = reap = true;
+                continue;
+            }
+
+            if ( sent == len )
+            {
+                continue;
+            }
+        }
+
+        if ( ( !b ) && ( !( b = _blockNew( h, buffer, len, h->streamOfs ) ) ) )
+        {
+            /* No memory to keep it in, so it's lost to this client like any other overflow */
+            _overflow( c );
+            _drop( c, len - sent );
+            c->resyncing = true;
+            c->preRun = 0;
+            continue;
+        }
+
+        _deliver( c, b, sent, len - sent );
+
+        if ( c->dead )
+        {
+            reap = true;
+        }
+        else if ( ( idle ) && ( _zeroCopyFor( c, len ) ) )
         {
-            genericsExit( -1, "Failed to acquire mutex" EOL );
+            _flush( c );
         }
+        else
+        {
+            _armOutput( c, c->rr != c->rw );
+        }
+    }
 
-        while ( n )
+    if ( h->histSize )
+    {
+        if ( b )
         {
-            write( n->handle, buffer, len );
-            n = n->nextClient;
+            _histAdd( h, b );
         }
+        else
+        {
+            /* There's a gap in the history, so it's no use until the next restart point */
+            _histClear( h );
+            h->histRun = 0;
+        }
+    }
+
+    /* The clients (and history) that kept the block have their own references to it */
+    _blockRelease( h, b );
+    h->streamOfs += len;
+    pthread_mutex_unlock( &h->clientList );
+
+    if ( reap )
+    {
+        _wakeLoop( h );
+    }
+}
+// ====================================================================================================
+void nwclientMetrics( struct metricsOut *o, void *param )
+
+/* Collector for the metrics server, reporting on each connected client */
+
+{
+    struct nwclientsHandle *h = ( struct nwclientsHandle * )param;
+    struct nwClient *n;
+    uint32_t clients = 0;
+    uint64_t history;
+    char labels[sizeof( n->peer ) + 10];
+
+    if ( pthread_mutex_lock( &h->clientList ) )
+    {
+        return;
+    }
+
+    for ( n = h->firstClient; n; n = n->nextClient )
+    {
+        clients++;
+    }
+
+    metricsFamily( o, "orbuculum_clients", "gauge", "Network clients connected" );
+    metricsValue( o, "orbuculum_clients", NULL, clients );
+
+    metricsFamily( o, "orbuculum_client_sent_bytes_total", "counter", "Bytes sent to each network client" );
+
+    for ( n = h->firstClient; n; n = n->nextClient )
+    {
+        snprintf( labels, sizeof( labels ), "client=\"%s\"", n->peer );
+        metricsValue( o, "orbuculum_client_sent_bytes_total", labels, __atomic_load_n( &n->sent, __ATOMIC_RELAXED ) );
+    }
+
+    metricsFamily( o, "orbuculum_client_queue_bytes", "gauge", "Bytes waiting to be sent to each network client" );
+
+    for ( n = h->firstClient; n; n = n->nextClient )
+    {
+        snprintf( labels, sizeof( labels ), "client=\"%s\"", n->peer );
+        metricsValue( o, "orbuculum_client_queue_bytes", labels, n->qwp - n->qrp );
+    }
+
+    metricsFamily( o, "orbuculum_client_dropped_bytes_total", "counter", "Bytes dropped because a network client's queue was full" );
+
+    for ( n = h->firstClient; n; n = n->nextClient )
+    {
+        snprintf( labels, sizeof( labels ), "client=\"%s\"", n->peer );
+        metricsValue( o, "orbuculum_client_dropped_bytes_total", labels, __atomic_load_n( &n->dropped, __ATOMIC_RELAXED ) );
+    }
+
+    metricsFamily( o, "orbuculum_client_overflows_total", "counter", "Times a network client's queue has been full" );
 
-        pthread_mutex_unlock( &h->clientList );
+    for ( n = h->firstClient; n; n = n->nextClient )
+    {
+        snprintf( labels, sizeof( labels ), "client=\"%s\"", n->peer );
+        metricsValue( o, "orbuculum_client_overflows_total", labels, __atomic_load_n( &n->overflows, __ATOMIC_RELAXED ) );
     }
+
+    history = h->histValid ? h->streamOfs - h->histStart : 0;
+    pthread_mutex_unlock( &h->clientList );
+
+    metricsFamily( o, "orbuculum_client_buffer_bytes", "gauge", "Bytes in blocks held for network clients, shared between them" );
+    metricsValue( o, "orbuculum_client_buffer_bytes", NULL, __atomic_load_n( &h->blockBytes, __ATOMIC_RELAXED ) );
+
+    metricsFamily( o, "orbuculum_client_history_bytes", "gauge", "Bytes of history from the latest restart point, for new network clients" );
+    metricsValue( o, "orbuculum_client_history_bytes", NULL, history );
+
+    metricsFamily( o, "orbuculum_client_write_seconds", "histogram", "Time taken by writes to network clients" );
+    metricsHistogram( o, "orbuculum_client_write_seconds", NULL, &h->writeTime );
 }
 // ====================================================================================================
-struct nwclientsHandle *nwclientStart( int port )
+struct nwclientsHandle *nwclientStart( int port, uint32_t queueSize, enum nwclientOverflow overflow, enum nwclientRestart restart, uint32_t historySize, bool zeroCopy )
 
-/* Creating the listening server thread */
+/* Creating the listening server and its event loop */
 
 {
     struct sockaddr_in serv_addr;
@@ -280,6 +1381,33 @@ struct nwclientsHandle *nwclientStart( int port )
         return NULL;
     }
 
+    h->queueSize = queueSize;
+    h->overflow = overflow;
+    h->restart = restart;
+    h->syncLen = ( restart == NWCLIENT_RESTART_ANY ) ? 0 : _sync[restart].preLen + 1;
+    memset( h->syncBytes, _sync[restart].pre, _sync[restart].preLen );
+    h->syncBytes[_sync[restart].preLen] = _sync[restart].term;
+    h->zeroCopy = zeroCopy;
+
+    /* There's nothing to start a client from without restart points, and it has to fit in a queue */
+    h->histSize = ( restart == NWCLIENT_RESTART_ANY ) ? 0 : historySize;
+    h->histSize = ( h->histSize < queueSize / 2 ) ? h->histSize : queueSize / 2;
+
+    if ( ( h->histSize ) && ( !( h->hist = ( struct nwBlock ** )calloc( HIST_MAX_BLOCKS, sizeof( struct nwBlock * ) ) ) ) )
+    {
+        genericsReport( V_ERROR, "No memory for client history" EOL );
+        goto free_and_return;
+    }
+
+#ifndef HAVE_ZEROCOPY
+
+    if ( zeroCopy )
+    {
+        genericsReport( V_WARN, "Zero copy sends aren't available here, copying instead" EOL );
+    }
+
+#endif
+
     h->sockfd = socket( AF_INET, SOCK_STREAM, 0 );
     setsockopt( h->sockfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof( flag ) );
 
@@ -309,19 +1437,47 @@ struct nwclientsHandle *nwclientStart( int port )
         goto free_and_return;
     }
 
+    /* The loop deals with everything as it's ready, so nothing it does should wait */
+    fcntl( h->sockfd, F_SETFL, fcntl( h->sockfd, F_GETFL ) | O_NONBLOCK );
+
+    if ( pipe( h->wake ) < 0 )
+    {
+        genericsReport( V_ERROR, "Failed to create wakeup pipe" EOL );
+        goto free_and_return;
+    }
+
+    fcntl( h->wake[0], F_SETFL, fcntl( h->wake[0], F_GETFL ) | O_NONBLOCK );
+    fcntl( h->wake[1], F_SETFL, fcntl( h->wake[1], F_GETFL ) | O_NONBLOCK );
+
+#if defined LINUX
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    if ( ( h->epfd = epoll_create1( 0 ) ) < 0 )
+    {
+        genericsReport( V_ERROR, "Failed to create epoll instance" EOL );
+        goto free_and_return;
+    }
+
+    ev.data.ptr = &h->sockfd;
+    epoll_ctl( h->epfd, EPOLL_CTL_ADD, h->sockfd, &ev );
+    ev.data.ptr = &h->wake[0];
+    epoll_ctl( h->epfd, EPOLL_CTL_ADD, h->wake[0], &ev );
+#endif
+
     /* Create a mutex to lock the client list */
     pthread_mutex_init( &h->clientList, NULL );
 
-    /* We have the listening socket - spawn a thread to handle it */
-    if ( pthread_create( &( h->ipThread ), NULL, &_listenTask, h ) )
+    /* We have the listening socket - spawn the event loop to handle it */
+    if ( pthread_create( &( h->ipThread ), NULL, &_loopTask, h ) )
     {
-        genericsReport( V_ERROR, "Failed to create listening thread" EOL );
+        genericsReport( V_ERROR, "Failed to create event loop thread" EOL );
         goto free_and_return;
     }
 
     return h;
 
 free_and_return:
+    free( h->hist );
     free( h );
     return NULL;
 }
@@ -329,44 +1485,22 @@ free_and_return:
 void nwclientShutdown( struct nwclientsHandle *h )
 
 {
-    const struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
-
     if ( !h )
     {
         return;
     }
 
-    struct nwClient *c = h->firstClient;
-
-    /* Flag that we're ending */
+    /* Flag that we're ending, and get the loop to close everything down */
     h->finish = true;
-
-    if ( lock_with_timeout( &h->clientList, &ts ) < 0 )
-    {
-        genericsExit( -1, "Failed to acquire mutex" EOL );
-    }
-
-    /* Tell all the clients to terminate */
-    while ( c )
-    {
-        c->finish = true;
-
-        /* Closing both ends of the connection will kill the client */
-        close( c->handle );
-        close( c->listenHandle );
-
-        /* This is safe because we are locked by the mutex */
-        c = c->nextClient;
-    }
-
-    pthread_mutex_unlock( &h->clientList );
+    _wakeLoop( h );
 }
 // ====================================================================================================
 bool nwclientShutdownComplete( struct nwclientsHandle *h )
 
 {
-    if ( ! h->firstClient )
+    if ( h->loopDone )
     {
+        free( h->hist );
         free( h );
         return true;
     }
@@ -65,12 +65,18 @@
 #include "git_version_info.h"
 #include "generics.h"
 #include "tpiuDecoder.h"
+#include "tpiuDemux.h"
+#include "parDecoder.h"
+#include "fileSource.h"
 #include "itmDecoder.h"
 #include "msgDecoder.h"
+#include "msgDispatch.h"
+#include "msgStream.h"
 
 #define SERVER_PORT 3443                  /* Server port definition */
 
 #define TRANSFER_SIZE (4096)
+#define FILE_BLOCK    (64*1024)               /* Largest block taken from a file at a time */
 #define NUM_CHANNELS  32
 #define HW_CHANNEL    (NUM_CHANNELS)      /* Make the hardware fifo on the end of the software ones */
 
@@ -91,9 +97,13 @@ struct
     /* Source information */
     int port;
     char *server;
+    bool events;                                         /* Server sends decoded events rather than raw trace */
 
     char *file;                                          /* File host connection */
     bool fileTerminate;                                  /* Terminate when file read isn't successful */
+    double fileRate;                                     /* Bytes per second to replay file at (0 for max speed) */
+    bool parallel;                                       /* Decode file in parallel */
+    uint32_t threads;                                    /* ...on this many threads (0 for one per processor) */
 } options = {.hwOutputs = 1, .forceITMSync = true, .tpiuITMChannel = 1, .port = SERVER_PORT, .server = "localhost"};
 
 struct
@@ -101,8 +111,9 @@ struct
     /* The decoders and the packets from them */
     struct ITMDecoder i;
     struct ITMPacket h;
-    struct TPIUDecoder t;
-    struct TPIUPacket p;
+    struct TPIUDemux t;
+    struct MSGDispatch m;                /* Dispatcher of decoded messages to their handlers */
+    struct MSGStream es;                 /* Frames of decoded events from the server */
     enum timeDelay timeStatus;           /* Indicator of if this time is exact */
     uint64_t timeStamp;                  /* Latest received time */
 } _r;
@@ -248,125 +259,73 @@ void _handleTS( struct TSMsg *m, struct ITMDecoder *i )
     fprintf( stdout, "%d,%d,%" PRIu64 EOL, HWEVENT_TS, _r.timeStatus, _r.timeStamp );
 }
 // ====================================================================================================
-void _itmPumpProcess( char c )
+void _handleMsg( struct msg *decoded, void *param )
+
+/* Dispatch an already decoded message (from a parallel decode of a file, or by orbuculum) */
 
 {
-    struct msg decoded;
+    MSGDispatchMsg( &_r.m, decoded );
+}
+// ====================================================================================================
+void _handleEvent( enum ITMPumpEvent e, void *param )
 
-    typedef void ( *handlers )( void *decoded, struct ITMDecoder * i );
+/* Decoder events from a parallel decode of a file, dealt with as the dispatcher deals with its own */
 
-    /* Handlers for each complete message received */
-    static const handlers h[MSG_NUM_MSGS] =
-    {
-        /* MSG_UNKNOWN */         NULL,
-        /* MSG_RESERVED */        NULL,
-        /* MSG_ERROR */           NULL,
-        /* MSG_NONE */            NULL,
-        /* MSG_SOFTWARE */        ( handlers )_handleSW,
-        /* MSG_NISYNC */          NULL,
-        /* MSG_OSW */             ( handlers )_handleDataOffsetWP,
-        /* MSG_DATA_ACCESS_WP */  ( handlers )_handleDataAccessWP,
-        /* MSG_DATA_RWWP */       ( handlers )_handleDataRWWP,
-        /* MSG_PC_SAMPLE */       ( handlers )_handlePCSample,
-        /* MSG_DWT_EVENT */       ( handlers )_handleDWTEvent,
-        /* MSG_EXCEPTION */       ( handlers )_handleException,
-        /* MSG_TS */              ( handlers )_handleTS
-    };
-
-    switch ( ITMPump( &_r.i, c ) )
-    {
-        case ITM_EV_NONE:
-            break;
+{
+    MSGDispatchEvent( &_r.m, e );
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Protocol pump for decoding messages
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+void _itmPumpBlock( uint8_t *c, uint32_t len, void *param )
 
-        case ITM_EV_UNSYNCED:
-            genericsReport( V_INFO, "ITM Unsynced" EOL );
-            break;
+/* Pump a run of ITM data into the decoder */
 
-        case ITM_EV_SYNCED:
-            genericsReport( V_INFO, "ITM Synced" EOL );
-            break;
+{
+    MSGDispatchPump( &_r.m, c, len );
+}
+// ====================================================================================================
+void _tpiuEvent( enum TPIUPumpEvent e, void *param )
 
-        case ITM_EV_OVERFLOW:
-            genericsReport( V_WARN, "ITM Overflow" EOL );
-            break;
+/* Callback for sync events from the TPIU decoder */
 
-        case ITM_EV_ERROR:
-            genericsReport( V_WARN, "ITM Error" EOL );
+{
+    switch ( e )
+    {
+        case TPIU_EV_NEWSYNC:
+        case TPIU_EV_SYNCED:
+            ITMDecoderForceSync( &_r.i, true );
             break;
 
-        case ITM_EV_PACKET_RXED:
-            ITMGetDecodedPacket( &_r.i, &decoded );
-
-            /* See if we decoded a dispatchable match. genericMsg is just used to access */
-            /* the first two members of the decoded structs in a portable way.           */
-            if ( h[decoded.genericMsg.msgtype] )
-            {
-                ( h[decoded.genericMsg.msgtype] )( &decoded, &_r.i );
-            }
+        case TPIU_EV_RXING:
+        case TPIU_EV_NONE:
+        case TPIU_EV_RXEDPACKET:
+            break;
 
+        case TPIU_EV_UNSYNCED:
+            ITMDecoderForceSync( &_r.i, false );
             break;
 
-        default:
+        case TPIU_EV_ERROR:
+            genericsReport( V_WARN, "****ERROR****" EOL );
             break;
     }
 }
 // ====================================================================================================
-// ====================================================================================================
-// ====================================================================================================
-// Protocol pump for decoding messages
-// ====================================================================================================
-// ====================================================================================================
-// ====================================================================================================
-void _protocolPump( uint8_t c )
+void _protocolPump( uint8_t *c, int len )
 
 {
     if ( options.useTPIU )
     {
-        switch ( TPIUPump( &_r.t, c ) )
-        {
-            case TPIU_EV_NEWSYNC:
-            case TPIU_EV_SYNCED:
-                ITMDecoderForceSync( &_r.i, true );
-                break;
-
-            case TPIU_EV_RXING:
-            case TPIU_EV_NONE:
-                break;
-
-            case TPIU_EV_UNSYNCED:
-                ITMDecoderForceSync( &_r.i, false );
-                break;
-
-            case TPIU_EV_RXEDPACKET:
-                if ( !TPIUGetPacket( &_r.t, &_r.p ) )
-                {
-                    genericsReport( V_WARN, "TPIUGetPacket fell over" EOL );
-                }
-
-                for ( uint32_t g = 0; g < _r.p.len; g++ )
-                {
-                    if ( _r.p.packet[g].s == options.tpiuITMChannel )
-                    {
-                        _itmPumpProcess( _r.p.packet[g].d );
-                        continue;
-                    }
-
-                    if  ( _r.p.packet[g].s != 0 )
-                    {
-                        genericsReport( V_WARN, "Unknown TPIU channel %02x" EOL, _r.p.packet[g].s );
-                    }
-                }
-
-                break;
-
-            case TPIU_EV_ERROR:
-                genericsReport( V_WARN, "****ERROR****" EOL );
-                break;
-        }
+        TPIUDemuxPump( &_r.t, c, len );
     }
     else
     {
-        _itmPumpProcess( c );
+        _itmPumpBlock( c, len, NULL );
     }
 }
 // ====================================================================================================
@@ -380,9 +339,12 @@ void _printHelp( char *progName )
     fprintf( stdout, "       h: This help" EOL );
     fprintf( stdout, "       i: <channel> Set ITM Channel in TPIU decode (defaults to 1)" EOL );
     fprintf( stdout, "       n: Enforce sync requirement for ITM (i.e. ITM needsd to issue syncs)" EOL );
+    fprintf( stdout, "       P: <threads> Decode file in parallel on this many threads (0 for one per processor), implies -e" EOL );
+    fprintf( stdout, "       r: <bytes/sec>[,<multiplier>] Replay file paced to this data rate, scaled by multiplier (default max speed)" EOL );
     fprintf( stdout, "       s: <Server>:<Port> to use" EOL );
     fprintf( stdout, "       t: Use TPIU decoder" EOL );
     fprintf( stdout, "       v: <level> Verbose mode 0(errors)..3(debug)" EOL );
+    fprintf( stdout, "       x: Server is an orbuculum decoded event port (orbuculum -x) rather than raw trace" EOL );
 }
 // ====================================================================================================
 int _processOptions( int argc, char *argv[] )
@@ -394,7 +356,7 @@ int _processOptions( int argc, char *argv[] )
     char *chanIndex;
 #define DELIMITER ','
 
-    while ( ( c = getopt ( argc, argv, "c:ef:hi:ns:tv:" ) ) != -1 )
+    while ( ( c = getopt ( argc, argv, "c:ef:hi:nP:r:s:tv:x" ) ) != -1 )
         switch ( c )
         {
             // ------------------------------------
@@ -422,6 +384,31 @@ int _processOptions( int argc, char *argv[] )
                 options.forceITMSync = false;
                 break;
 
+            // ------------------------------------
+            case 'P':
+                options.parallel = true;
+                options.threads = atoi( optarg );
+                break;
+
+            // ------------------------------------
+            case 'r':
+                options.fileRate = atof( optarg );
+
+                // See if we have an optional multiplier too
+                char *r = optarg;
+
+                while ( ( *r ) && ( *r != DELIMITER ) )
+                {
+                    r++;
+                }
+
+                if ( *r == DELIMITER )
+                {
+                    options.fileRate *= atof( ++r );
+                }
+
+                break;
+
             // ------------------------------------
             case 's':
                 options.server = optarg;
@@ -457,6 +444,11 @@ int _processOptions( int argc, char *argv[] )
                 genericsSetReportLevel( atoi( optarg ) );
                 break;
 
+            // ------------------------------------
+            case 'x':
+                options.events = true;
+                break;
+
             // ------------------------------------
             /* Individual channel setup */
             case 'c':
@@ -510,9 +502,27 @@ int _processOptions( int argc, char *argv[] )
         return false;
     }
 
+    if ( ( options.events ) && ( options.file ) )
+    {
+        genericsReport( V_ERROR, "Decoded events only come from a server" EOL );
+        return false;
+    }
+
+    if ( options.fileRate < 0 )
+    {
+        genericsReport( V_ERROR, "File replay rate must be positive" EOL );
+        return false;
+    }
+
+    if ( ( options.fileRate ) && ( options.parallel ) )
+    {
+        genericsReport( V_ERROR, "Parallel decode can't be paced" EOL );
+        return false;
+    }
+
     genericsReport( V_INFO, "orbcat V" VERSION " (Git %08X %s, Built " BUILD_DATE EOL, GIT_HASH, ( GIT_DIRTY ? "Dirty" : "Clean" ) );
 
-    genericsReport( V_INFO, "Server     : %s:%d" EOL, options.server, options.port );
+    genericsReport( V_INFO, "Server     : %s:%d%s" EOL, options.server, options.port, options.events ? " (Decoded events)" : "" );
     genericsReport( V_INFO, "ForceSync  : %s" EOL, options.forceITMSync ? "true" : "false" );
 
     if ( options.file )
@@ -520,7 +530,11 @@ int _processOptions( int argc, char *argv[] )
 
         genericsReport( V_INFO, "Input File : %s", options.file );
 
-        if ( options.fileTerminate )
+        if ( options.parallel )
+        {
+            genericsReport( V_INFO, " (Parallel decode)" EOL );
+        }
+        else if ( options.fileTerminate )
         {
             genericsReport( V_INFO, " (Terminate on exhaustion)" EOL );
         }
@@ -528,6 +542,11 @@ int _processOptions( int argc, char *argv[] )
         {
             genericsReport( V_INFO, " (Ongoing read)" EOL );
         }
+
+        if ( options.fileRate )
+        {
+            genericsReport( V_INFO, "Replay     : %.0f bytes/sec" EOL, options.fileRate );
+        }
     }
 
     if ( options.useTPIU )
@@ -556,46 +575,43 @@ int _processOptions( int argc, char *argv[] )
 int fileFeeder( void )
 
 {
-    int f;
-    unsigned char cbw[TRANSFER_SIZE];
-    ssize_t t;
+    struct FileSource f;
+    const uint8_t *d;
+    int32_t t;
+    struct ParDecoder *p;
 
-    if ( ( f = open( options.file, O_RDONLY ) ) < 0 )
+    if ( options.parallel )
     {
-        genericsExit( -4, "Can't open file %s" EOL, options.file );
+        /* The file gets decoded in chunks on a pool of threads, with the messages coming back in order */
+        if ( !( p = ParDecoderOpen( options.file, &_r.i, options.useTPIU, options.tpiuITMChannel, options.threads ) ) )
+        {
+            genericsExit( -4, "Can't open file %s" EOL, options.file );
+        }
+
+        while ( ParDecoderPump( p, _handleMsg, _handleEvent, NULL ) );
+
+        ParDecoderClose( p );
+        return true;
     }
 
-    while ( ( t = read( f, cbw, TRANSFER_SIZE ) ) >= 0 )
+    if ( !FileSourceOpen( &f, options.file, !options.fileTerminate, options.fileRate ) )
     {
+        genericsExit( -4, "Can't open file %s" EOL, options.file );
+    }
 
-        if ( !t )
-        {
-            if ( options.fileTerminate )
-            {
-                break;
-            }
-            else
-            {
-                // Just spin for a while to avoid clogging the CPU
-                usleep( 100000 );
-                continue;
-            }
-        }
-
-        unsigned char *c = cbw;
+    while ( ( t = FileSourceGet( &f, &d, FILE_BLOCK ) ) > 0 )
+    {
+        _protocolPump( ( uint8_t * )d, t );
 
-        while ( t-- )
-        {
-            _protocolPump( *c++ );
-        }
+        fflush( stdout );
     }
 
-    if ( !options.fileTerminate )
+    if ( t < 0 )
     {
         genericsReport( V_INFO, "File read error" EOL );
     }
 
-    close( f );
+    FileSourceClose( &f );
     return true;
 }
 
@@ -615,10 +631,27 @@ int main( int argc, char *argv[] )
         exit( -1 );
     }
 
-    /* Reset the TPIU handler before we start */
-    TPIUDecoderInit( &_r.t );
+    /* Reset the TPIU handler before we start...frame timing means nothing when reading a file */
+    TPIUDemuxInit( &_r.t, options.file ? TPIU_TIMING_NONE : TPIU_TIMING_BLOCK_CLOCK, _tpiuEvent, NULL );
+
+    if ( !TPIUDemuxRegister( &_r.t, options.tpiuITMChannel, _itmPumpBlock, NULL ) )
+    {
+        genericsExit( -1, "Cannot use TPIU channel %d for ITM" EOL, options.tpiuITMChannel );
+    }
+
     ITMDecoderInit( &_r.i, options.forceITMSync );
 
+    /* Handlers for each complete message received */
+    MSGDispatchInit( &_r.m, &_r.i, NULL, &_r.i );
+    MSGDispatchRegister( &_r.m, MSG_SOFTWARE, ( MSGDispatchHandler )_handleSW );
+    MSGDispatchRegister( &_r.m, MSG_OSW, ( MSGDispatchHandler )_handleDataOffsetWP );
+    MSGDispatchRegister( &_r.m, MSG_DATA_ACCESS_WP, ( MSGDispatchHandler )_handleDataAccessWP );
+    MSGDispatchRegister( &_r.m, MSG_DATA_RWWP, ( MSGDispatchHandler )_handleDataRWWP );
+    MSGDispatchRegister( &_r.m, MSG_PC_SAMPLE, ( MSGDispatchHandler )_handlePCSample );
+    MSGDispatchRegister( &_r.m, MSG_DWT_EVENT, ( MSGDispatchHandler )_handleDWTEvent );
+    MSGDispatchRegister( &_r.m, MSG_EXCEPTION, ( MSGDispatchHandler )_handleException );
+    MSGDispatchRegister( &_r.m, MSG_TS, ( MSGDispatchHandler )_handleTS );
+
     sockfd = socket( AF_INET, SOCK_STREAM, 0 );
     setsockopt( sockfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof( flag ) );
 
@@ -655,13 +688,18 @@ int main( int argc, char *argv[] )
         return -1;
     }
 
+    MSGStreamInit( &_r.es );
+
     while ( ( t = read( sockfd, cbw, TRANSFER_SIZE ) ) > 0 )
     {
-        unsigned char *c = cbw;
-
-        while ( t-- )
+        if ( options.events )
+        {
+            /* orbuculum has done the decoding, so the messages go straight to their handlers */
+            MSGStreamPump( &_r.es, cbw, t, _handleMsg, NULL );
+        }
+        else
         {
-            _protocolPump( *c++ );
+            _protocolPump( cbw, t );
         }
 
         fflush( stdout );
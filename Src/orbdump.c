@@ -64,6 +64,7 @@
 #include "git_version_info.h"
 #include "generics.h"
 #include "tpiuDecoder.h"
+#include "tpiuDemux.h"
 #include "itmDecoder.h"
 
 #define SERVER_PORT 3443                     /* Server port definition */
@@ -111,8 +112,7 @@ struct
     /* The decoders and the packets from them */
     struct ITMDecoder i;
     struct ITMPacket h;
-    struct TPIUDecoder t;
-    struct TPIUPacket p;
+    struct TPIUDemux t;
 } _r;
 
 // ====================================================================================================
@@ -137,65 +137,71 @@ uint64_t _timestamp( void )
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
-void _protocolPump( uint8_t c )
+void _itmPumpBlock( uint8_t *c, uint32_t len, void *param )
 
-/* Top level protocol pump */
+/* Pump a run of ITM data into the decoder */
 
 {
-    if ( options.useTPIU )
+    while ( len )
     {
-        switch ( TPIUPump( &_r.t, c ) )
+        /* While unsynced we can skip over anything that can't contain a sync */
+        uint32_t skip = ITMDecoderSkipToSync( &_r.i, c, len );
+        c += skip;
+        len -= skip;
+
+        if ( len )
         {
-            // ------------------------------------
-            case TPIU_EV_NEWSYNC:
-            case TPIU_EV_SYNCED:
-                ITMDecoderForceSync( &_r.i, true );
-                break;
+            ITMPump( &_r.i, *c++ );
+            len--;
+        }
+    }
+}
+// ====================================================================================================
+void _tpiuEvent( enum TPIUPumpEvent e, void *param )
 
-            // ------------------------------------
-            case TPIU_EV_RXING:
-            case TPIU_EV_NONE:
-                break;
+/* Callback for sync events from the TPIU decoder */
 
-            // ------------------------------------
-            case TPIU_EV_UNSYNCED:
-                ITMDecoderForceSync( &_r.i, false );
-                break;
-
-            // ------------------------------------
-            case TPIU_EV_RXEDPACKET:
-                if ( !TPIUGetPacket( &_r.t, &_r.p ) )
-                {
-                    genericsReport( V_WARN, "TPIUGetPacket fell over" EOL );
-                }
+{
+    switch ( e )
+    {
+        // ------------------------------------
+        case TPIU_EV_NEWSYNC:
+        case TPIU_EV_SYNCED:
+            ITMDecoderForceSync( &_r.i, true );
+            break;
 
-                for ( uint32_t g = 0; g < _r.p.len; g++ )
-                {
-                    if ( _r.p.packet[g].s == options.tpiuITMChannel )
-                    {
-                        ITMPump( &_r.i, _r.p.packet[g].d );
-                        continue;
-                    }
-
-                    if ( _r.p.packet[g].s != 0 )
-                    {
-                        genericsReport( V_WARN, "Unknown TPIU channel %02x" EOL, _r.p.packet[g].s );
-                    }
-                }
+        // ------------------------------------
+        case TPIU_EV_RXING:
+        case TPIU_EV_NONE:
+        case TPIU_EV_RXEDPACKET:
+            break;
 
-                break;
+        // ------------------------------------
+        case TPIU_EV_UNSYNCED:
+            ITMDecoderForceSync( &_r.i, false );
+            break;
 
+        // ------------------------------------
+        case TPIU_EV_ERROR:
+            genericsReport( V_WARN, "****ERROR****" EOL );
+            break;
             // ------------------------------------
-            case TPIU_EV_ERROR:
-                genericsReport( V_WARN, "****ERROR****" EOL );
-                break;
-                // ------------------------------------
-        }
+    }
+}
+// ====================================================================================================
+void _protocolPump( uint8_t *c, int len )
+
+/* Top level protocol pump */
+
+{
+    if ( options.useTPIU )
+    {
+        TPIUDemuxPump( &_r.t, c, len );
     }
     else
     {
         /* There's no TPIU in use, so this goes straight to the ITM layer */
-        ITMPump( &_r.i, c );
+        _itmPumpBlock( c, len, NULL );
     }
 }
 // ====================================================================================================
@@ -322,7 +328,7 @@ int main( int argc, char *argv[] )
     size_t octetsRxed = 0;
     FILE *opFile;
 
-    ssize_t readLength, t;
+    ssize_t readLength;
     int flag = 1;
 
     bool haveSynced = false;
@@ -333,7 +339,13 @@ int main( int argc, char *argv[] )
     }
 
     /* Reset the TPIU handler before we start */
-    TPIUDecoderInit( &_r.t );
+    TPIUDemuxInit( &_r.t, TPIU_TIMING_BLOCK_CLOCK, _tpiuEvent, NULL );
+
+    if ( !TPIUDemuxRegister( &_r.t, options.tpiuITMChannel, _itmPumpBlock, NULL ) )
+    {
+        genericsExit( -1, "Cannot use TPIU channel %d for ITM" EOL, options.tpiuITMChannel );
+    }
+
     ITMDecoderInit( &_r.i, options.forceITMSync );
 
     sockfd = socket( AF_INET, SOCK_STREAM, 0 );
@@ -388,14 +400,7 @@ int main( int argc, char *argv[] )
             break;
         }
 
-        uint8_t *c = cbw;
-
-        t = readLength;
-
-        while ( t-- )
-        {
-            _protocolPump( *c++ );
-        }
+        _protocolPump( cbw, readLength );
 
         /* Check to make sure there's not an unexpected TPIU in here */
         if ( ITMDecoderGetStats( &_r.i )->tpiuSyncCount )
@@ -68,9 +68,12 @@
 #include "uthash.h"
 #include "generics.h"
 #include "tpiuDecoder.h"
+#include "tpiuDemux.h"
 #include "itmDecoder.h"
 #include "symbols.h"
 #include "msgDecoder.h"
+#include "msgDispatch.h"
+#include "msgStream.h"
 
 #define TEXT_SEGMENT ".text"
 #define DEFAULT_TRACE_CHANNEL  30            /* Channel that we expect trace data to arrive on */
@@ -133,6 +136,7 @@ struct                                       /* Record for options, either defau
     int fileChannel;                         /* ITM Channel used for file output */
     int port;                                /* Source information for where to connect to */
     char *server;
+    bool events;                             /* Server sends decoded events rather than raw trace */
 
 } options =
 {
@@ -149,8 +153,9 @@ struct
 {
     struct ITMDecoder i;                    /* The decoders and the packets from them */
     struct ITMPacket h;
-    struct TPIUDecoder t;
-    struct TPIUPacket p;
+    struct TPIUDemux t;
+    struct MSGDispatch m;                   /* Dispatcher of decoded messages to their handlers */
+    struct MSGStream es;                    /* Frames of decoded events from the server */
 
     /* Calls related info */
     enum CDState CDState;                   /* State of the call data machine */
@@ -660,144 +665,76 @@ void _outputDot( void )
     fclose( c );
 }
 // ====================================================================================================
-void _itmPumpProcess( char c )
+// ====================================================================================================
+// ====================================================================================================
+// Protocol pump for decoding messages
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+void _itmPumpBlock( uint8_t *c, uint32_t len, void *param )
 
-/* Handle individual characters into the itm decoder */
+/* Pump a run of ITM data into the decoder */
 
 {
-    struct msg decoded;
+    MSGDispatchPump( &_r.m, c, len );
+}
+// ====================================================================================================
+void _handleMsg( struct msg *m, void *param )
 
-    typedef void ( *handlers )( void *decoded, struct ITMDecoder * i );
+/* Messages that orbuculum has already decoded */
 
-    /* Handlers for each complete message received */
-    static const handlers h[MSG_NUM_MSGS] =
-    {
-        /* MSG_UNKNOWN */         NULL,
-        /* MSG_RESERVED */        NULL,
-        /* MSG_ERROR */           NULL,
-        /* MSG_NONE */            NULL,
-        /* MSG_SOFTWARE */        ( handlers )_handleSW,
-        /* MSG_NISYNC */          NULL,
-        /* MSG_OSW */             NULL,
-        /* MSG_DATA_ACCESS_WP */  NULL,
-        /* MSG_DATA_RWWP */       NULL,
-        /* MSG_PC_SAMPLE */       NULL,
-        /* MSG_DWT_EVENT */       NULL,
-        /* MSG_EXCEPTION */       NULL,
-        /* MSG_TS */              NULL
-    };
-
-    switch ( ITMPump( &_r.i, c ) )
-    {
-        // ------------------------------------
-        case ITM_EV_NONE:
-            break;
+{
+    MSGDispatchMsg( &_r.m, m );
+}
+// ====================================================================================================
+void _tpiuEvent( enum TPIUPumpEvent e, void *param )
 
-        // ------------------------------------
-        case ITM_EV_UNSYNCED:
-            genericsReport( V_INFO, "ITM Lost Sync (%d)" EOL, ITMDecoderGetStats( &_r.i )->lostSyncCount );
-            break;
+/* Callback for sync events from the TPIU decoder */
 
+{
+    switch ( e )
+    {
         // ------------------------------------
-        case ITM_EV_SYNCED:
-            genericsReport( V_INFO, "ITM In Sync (%d)" EOL, ITMDecoderGetStats( &_r.i )->syncCount );
+        case TPIU_EV_NEWSYNC:
+            genericsReport( V_INFO, "TPIU In Sync (%d)" EOL, TPIUDemuxGetStats( &_r.t )->syncCount );
+
+        case TPIU_EV_SYNCED:
+            ITMDecoderForceSync( &_r.i, true );
             break;
 
         // ------------------------------------
-        case ITM_EV_OVERFLOW:
-            genericsReport( V_WARN, "ITM Overflow (%d)" EOL, ITMDecoderGetStats( &_r.i )->overflow );
+        case TPIU_EV_RXING:
+        case TPIU_EV_NONE:
+        case TPIU_EV_RXEDPACKET:
             break;
 
         // ------------------------------------
-        case ITM_EV_ERROR:
-            genericsReport( V_WARN, "ITM Error" EOL );
+        case TPIU_EV_UNSYNCED:
+            genericsReport( V_INFO, "TPIU Lost Sync (%d)" EOL, TPIUDemuxGetStats( &_r.t )->lostSync );
+            ITMDecoderForceSync( &_r.i, false );
             break;
 
         // ------------------------------------
-        case ITM_EV_PACKET_RXED:
-            ITMGetDecodedPacket( &_r.i, &decoded );
-
-            /* See if we decoded a dispatchable match. genericMsg is just used to access */
-            /* the first two members of the decoded structs in a portable way.           */
-            if ( h[decoded.genericMsg.msgtype] )
-            {
-                ( h[decoded.genericMsg.msgtype] )( &decoded, &_r.i );
-            }
-
+        case TPIU_EV_ERROR:
+            genericsReport( V_WARN, "****ERROR****" EOL );
             break;
-
             // ------------------------------------
     }
 }
 // ====================================================================================================
-// ====================================================================================================
-// ====================================================================================================
-// Protocol pump for decoding messages
-// ====================================================================================================
-// ====================================================================================================
-// ====================================================================================================
-void _protocolPump( uint8_t c )
+void _protocolPump( uint8_t *c, int len )
 
 /* Top level protocol pump */
 
 {
     if ( options.useTPIU )
     {
-        switch ( TPIUPump( &_r.t, c ) )
-        {
-            // ------------------------------------
-            case TPIU_EV_NEWSYNC:
-                genericsReport( V_INFO, "TPIU In Sync (%d)" EOL, TPIUDecoderGetStats( &_r.t )->syncCount );
-
-            case TPIU_EV_SYNCED:
-                ITMDecoderForceSync( &_r.i, true );
-                break;
-
-            // ------------------------------------
-            case TPIU_EV_RXING:
-            case TPIU_EV_NONE:
-                break;
-
-            // ------------------------------------
-            case TPIU_EV_UNSYNCED:
-                genericsReport( V_INFO, "TPIU Lost Sync (%d)" EOL, TPIUDecoderGetStats( &_r.t )->lostSync );
-                ITMDecoderForceSync( &_r.i, false );
-                break;
-
-            // ------------------------------------
-            case TPIU_EV_RXEDPACKET:
-                if ( !TPIUGetPacket( &_r.t, &_r.p ) )
-                {
-                    genericsReport( V_WARN, "TPIUGetPacket fell over" EOL );
-                }
-
-                for ( uint32_t g = 0; g < _r.p.len; g++ )
-                {
-                    if ( _r.p.packet[g].s == options.tpiuITMChannel )
-                    {
-                        _itmPumpProcess( _r.p.packet[g].d );
-                        continue;
-                    }
-
-                    if ( _r.p.packet[g].s != 0 )
-                    {
-                        genericsReport( V_WARN, "Unknown TPIU channel %02x" EOL, _r.p.packet[g].s );
-                    }
-                }
-
-                break;
-
-            // ------------------------------------
-            case TPIU_EV_ERROR:
-                genericsReport( V_WARN, "****ERROR****" EOL );
-                break;
-                // ------------------------------------
-        }
+        TPIUDemuxPump( &_r.t, c, len );
     }
     else
     {
         /* There's no TPIU in use, so this goes straight to the ITM layer */
-        _itmPumpProcess( c );
+        _itmPumpBlock( c, len, NULL );
     }
 }
 // ====================================================================================================
@@ -816,6 +753,7 @@ void _printHelp( char *progName )
     fprintf( stdout, "       s: <Server>:<Port> to use" EOL );
     fprintf( stdout, "       t: Use TPIU decoder" EOL );
     fprintf( stdout, "       v: <level> Verbose mode 0(errors)..3(debug)" EOL );
+    fprintf( stdout, "       x: Server is an orbuculum decoded event port (orbuculum -x) rather than raw trace" EOL );
     fprintf( stdout, "       y: <Filename> dotty filename for structured callgraph output" EOL );
     fprintf( stdout, "       z: <Filename> profile filename for kcachegrind output" EOL );
 }
@@ -825,7 +763,7 @@ int _processOptions( int argc, char *argv[] )
 {
     int c;
 
-    while ( ( c = getopt ( argc, argv, "d:e:f:g:hi:lnp:s:tvy:z:" ) ) != -1 )
+    while ( ( c = getopt ( argc, argv, "d:e:f:g:hi:lnp:s:tvxy:z:" ) ) != -1 )
 
         switch ( c )
         {
@@ -899,6 +837,11 @@ int _processOptions( int argc, char *argv[] )
                 genericsSetReportLevel( atoi( optarg ) );
                 break;
 
+            // ------------------------------------
+            case 'x':
+                options.events = true;
+                break;
+
             // ------------------------------------
             case 'y':
                 options.dotfile = optarg;
@@ -943,7 +886,7 @@ int _processOptions( int argc, char *argv[] )
 
     genericsReport( V_INFO, "orbtop V" VERSION " (Git %08X %s, Built " BUILD_DATE ")" EOL, GIT_HASH, ( GIT_DIRTY ? "Dirty" : "Clean" ) );
 
-    genericsReport( V_INFO, "Server        : %s:%d" EOL, options.server, options.port );
+    genericsReport( V_INFO, "Server        : %s:%d%s" EOL, options.server, options.port, options.events ? " (Decoded events)" : "" );
     genericsReport( V_INFO, "Delete Mat    : %s" EOL, options.deleteMaterial ? options.deleteMaterial : "None" );
     genericsReport( V_INFO, "Elf File      : %s" EOL, options.elffile );
     genericsReport( V_INFO, "DOT file      : %s" EOL, options.dotfile ? options.dotfile : "None" );
@@ -987,9 +930,19 @@ int main( int argc, char *argv[] )
     }
 
     /* Reset the TPIU handler before we start */
-    TPIUDecoderInit( &_r.t );
+    TPIUDemuxInit( &_r.t, TPIU_TIMING_BLOCK_CLOCK, _tpiuEvent, NULL );
+
+    if ( !TPIUDemuxRegister( &_r.t, options.tpiuITMChannel, _itmPumpBlock, NULL ) )
+    {
+        genericsExit( -1, "Cannot use TPIU channel %d for ITM" EOL, options.tpiuITMChannel );
+    }
+
     ITMDecoderInit( &_r.i, options.forceITMSync );
 
+    /* Handlers for each complete message received */
+    MSGDispatchInit( &_r.m, &_r.i, NULL, &_r.i );
+    MSGDispatchRegister( &_r.m, MSG_SOFTWARE, ( MSGDispatchHandler )_handleSW );
+
     sockfd = socket( AF_INET, SOCK_STREAM, 0 );
     setsockopt( sockfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof( flag ) );
 
@@ -1021,13 +974,18 @@ int main( int argc, char *argv[] )
         return -1;
     }
 
+    MSGStreamInit( &_r.es );
+
     while ( ( t = read( sockfd, cbw, TRANSFER_SIZE ) ) > 0 )
     {
-        uint8_t *c = cbw;
-
-        while ( t-- )
+        if ( options.events )
+        {
+            /* orbuculum has done the decoding, so the messages go straight to their handlers */
+            MSGStreamPump( &_r.es, cbw, t, _handleMsg, NULL );
+        }
+        else
         {
-            _protocolPump( *c++ );
+            _protocolPump( cbw, t );
         }
 
         if ( _timestamp() - lastTime > TOP_UPDATE_INTERVAL )
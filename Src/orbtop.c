@@ -67,9 +67,13 @@
 #include "git_version_info.h"
 #include "generics.h"
 #include "tpiuDecoder.h"
+#include "tpiuDemux.h"
+#include "parDecoder.h"
 #include "itmDecoder.h"
 #include "symbols.h"
 #include "msgSeq.h"
+#include "msgDispatch.h"
+#include "msgStream.h"
 
 #define CUTOFF              (10)             /* Default cutoff at 0.1% */
 #define SERVER_PORT         (3443)           /* Server port definition */
@@ -79,7 +83,8 @@
 #define MAX_EXCEPTIONS      (512)            /* Maximum number of exceptions to be considered */
 #define NO_EXCEPTION        (0xFFFFFFFF)     /* Flag indicating no exception is being processed */
 
-#define MSG_REORDER_BUFLEN  (10)             /* Maximum number of samples to re-order for timekeeping */
+#define MSG_REORDER_BUFLEN  (10)             /* Initial number of samples to re-order for timekeeping */
+#define MSG_REORDER_MAXLEN  (4096)           /* ...and the most it can grow to */
 
 #define CLEAR_SCREEN        "\033[2J\033[;H" /* ASCII Sequence for clear screen */
 
@@ -123,6 +128,8 @@ struct                                       /* Record for options, either defau
     uint32_t tpiuITMChannel;                 /* What channel? */
     bool forceITMSync;                       /* Must ITM start synced? */
     char *file;                              /* File host connection */
+    bool parallel;                           /* Decode file in parallel */
+    uint32_t threads;                        /* ...on this many threads (0 for one per processor) */
 
     uint32_t hwOutputs;                      /* What hardware outputs are enabled */
 
@@ -142,6 +149,7 @@ struct                                       /* Record for options, either defau
 
     int port;                                /* Source information */
     char *server;
+    bool events;                             /* Server sends decoded events rather than raw trace */
 
 } options =
 {
@@ -163,9 +171,12 @@ struct
 {
     struct ITMDecoder i;                               /* The decoders and the packets from them */
     struct MSGSeq    d;                                   /* Message (re-)sequencer */
+    struct MSGDispatch m;                              /* Dispatcher of decoded messages into the sequencer */
+    struct MSGDispatch ms;                             /* ...and of sequenced messages to their handlers */
+    struct MSGStream es;                               /* Frames of decoded events from the server */
     struct ITMPacket h;
-    struct TPIUDecoder t;
-    struct TPIUPacket p;
+    struct TPIUDemux t;
+    struct ParDecoder *pd;                             /* Parallel decoder of the file, when there is one */
     enum timeDelay timeStatus;                         /* Indicator of if this time is exact */
     uint64_t timeStamp;                                /* Latest received time */
 
@@ -336,7 +347,7 @@ void _handleException( struct excMsg *m, struct ITMDecoder *i )
             if ( _r.currentException != NO_EXCEPTION )
             {
                 /* Already in an exception ... account for time until now */
-                _r.er[_r.currentException].thisTime += _r.timeStamp - _r.er[_r.currentException].entryTime;
+                _r.er[_r.currentException].thisTime += m->ts - _r.er[_r.currentException].entryTime;
             }
 
             /* Record however we got to this exception */
@@ -344,7 +355,7 @@ void _handleException( struct excMsg *m, struct ITMDecoder *i )
 
             /* Now dip into this exception */
             _r.currentException = m->exceptionNumber;
-            _r.er[m->exceptionNumber].entryTime = _r.timeStamp;
+            _r.er[m->exceptionNumber].entryTime = m->ts;
             _r.er[m->exceptionNumber].thisTime = 0;
             _r.erDepth++;
             break;
@@ -352,14 +363,14 @@ void _handleException( struct excMsg *m, struct ITMDecoder *i )
         case EXEVENT_RESUME: /* Unwind all levels of exception (deals with tail chaining) */
             while ( ( _r.currentException != NO_EXCEPTION ) && ( _r.erDepth ) )
             {
-                _exitEx( _r.timeStamp );
+                _exitEx( m->ts );
             }
 
             _r.currentException = NO_EXCEPTION;
             break;
 
         case EXEVENT_EXIT: /* Exit single level of exception */
-            _exitEx( _r.timeStamp );
+            _exitEx( m->ts );
             break;
 
         default:
@@ -460,6 +471,14 @@ uint32_t _consolodateReport( struct reportLine **returnReport, uint32_t *returnR
     return total;
 }
 // ====================================================================================================
+static struct TPIUDecoderStats *_tpiuStats( void )
+
+/* The TPIU stats, from whichever decoder is handling the input */
+
+{
+    return _r.pd ? ParDecoderGetTPIUStats( _r.pd ) : TPIUDemuxGetStats( &_r.t );
+}
+// ====================================================================================================
 static void _outputJson( FILE *f, uint32_t total, uint32_t reportLines, struct reportLine *report, int64_t timeStamp )
 
 /* Produce the output to JSON */
@@ -499,12 +518,15 @@ static void _outputJson( FILE *f, uint32_t total, uint32_t reportLines, struct r
     jsonElement = cJSON_CreateNumber( ITMDecoderGetStats( &_r.i )->syncCount );
     assert( jsonElement );
     cJSON_AddItemToObject( jsonStatsTable, "itmsync", jsonElement );
-    jsonElement = cJSON_CreateNumber( TPIUDecoderGetStats( &_r.t )->syncCount );
+    jsonElement = cJSON_CreateNumber( _tpiuStats()->syncCount );
     assert( jsonElement );
     cJSON_AddItemToObject( jsonStatsTable, "tpiusync", jsonElement );
     jsonElement = cJSON_CreateNumber( ITMDecoderGetStats( &_r.i )->ErrorPkt );
     assert( jsonElement );
     cJSON_AddItemToObject( jsonStatsTable, "error", jsonElement );
+    jsonElement = cJSON_CreateNumber( MSGSeqGetOverflow( &_r.d ) );
+    assert( jsonElement );
+    cJSON_AddItemToObject( jsonStatsTable, "seqoverflow", jsonElement );
 
 
     /* Create top table ====================================================== */
@@ -747,11 +769,12 @@ static void _outputTop( uint32_t total, uint32_t reportLines, struct reportLine
         fprintf( stdout, C_RESET "Interval = " C_YELLOW "%" PRIu64 C_RESET "mS" EOL, lastTime - _r.lastReportmS );
     }
 
-    genericsReport( V_INFO, "         Ovf=%3d  ITMSync=%3d TPIUSync=%3d ITMErrors=%3d" EOL,
+    genericsReport( V_INFO, "         Ovf=%3d  ITMSync=%3d TPIUSync=%3d ITMErrors=%3d SeqOvf=%3d" EOL,
                     ITMDecoderGetStats( &_r.i )->overflow,
                     ITMDecoderGetStats( &_r.i )->syncCount,
-                    TPIUDecoderGetStats( &_r.t )->syncCount,
-                    ITMDecoderGetStats( &_r.i )->ErrorPkt );
+                    _tpiuStats()->syncCount,
+                    ITMDecoderGetStats( &_r.i )->ErrorPkt,
+                    MSGSeqGetOverflow( &_r.d ) );
 
 }
 
@@ -812,124 +835,107 @@ void _flushHash( void )
 // ====================================================================================================
 // Pump characters into the itm decoder
 // ====================================================================================================
-void _itmPumpProcess( uint8_t c )
-
-{
-    typedef void ( *handlers )( void *decoded, struct ITMDecoder * i );
+void _flushSeq( void )
 
-    /* Handlers for each complete message received */
-    static const handlers h[MSG_NUM_MSGS] =
-    {
-        /* MSG_UNKNOWN */         NULL,
-        /* MSG_RESERVED */        NULL,
-        /* MSG_ERROR */           NULL,
-        /* MSG_NONE */            NULL,
-        /* MSG_SOFTWARE */        NULL,
-        /* MSG_NISYNC */          NULL,
-        /* MSG_OSW */             NULL,
-        /* MSG_DATA_ACCESS_WP */  NULL,
-        /* MSG_DATA_RWWP */       NULL,
-        /* MSG_PC_SAMPLE */       ( handlers )_handlePCSample,
-        /* MSG_DWT_EVENT */       NULL,
-        /* MSG_EXCEPTION */       ( handlers )_handleException,
-        /* MSG_TS */              ( handlers )_handleTS
-    };
+/* Empty the sequencer out through the handlers */
 
+{
     struct msg *p;
 
-    if ( !MSGSeqPump( &_r.d, c ) )
+    /* We are synced timewise, so empty anything that has been waiting */
+    while ( ( p = MSGSeqGetPacket( &_r.d ) ) )
     {
-        return;
+        MSGDispatchMsg( &_r.ms, p );
     }
+}
+// ====================================================================================================
+void _itmMsgProcess( struct msg *m, void *param )
 
-    /* We are synced timewise, so empty anything that has been waiting */
-    while ( 1 )
+/* Put a decoded message into the sequencer, emptying it if it's time to */
+
+{
+    if ( MSGSeqPumpMsg( &_r.d, m ) )
     {
-        p = MSGSeqGetPacket( &_r.d );
+        _flushSeq();
+    }
+}
+// ====================================================================================================
+void _handleMsg( struct msg *m, void *param )
 
-        if ( !p )
-        {
-            /* all read */
-            break;
-        }
+/* Messages that have already been decoded, from a parallel decode of a file or by orbuculum */
 
-        assert( p->genericMsg.msgtype < MSG_NUM_MSGS );
+{
+    MSGDispatchMsg( &_r.m, m );
+}
+// ====================================================================================================
+void _handleEvent( enum ITMPumpEvent e, void *param )
 
-        if ( h[p->genericMsg.msgtype] )
-        {
-            ( h[p->genericMsg.msgtype] )( p, &_r.i );
-        }
-    }
+/* Decoder events from a parallel decode of a file, dealt with as the dispatcher deals with its own */
 
-    return;
+{
+    MSGDispatchEvent( &_r.m, e );
 }
 // ====================================================================================================
 // ====================================================================================================
 // Protocol pump for decoding messages
 // ====================================================================================================
 // ====================================================================================================
-void _protocolPump( uint8_t c )
+void _itmPumpBlock( uint8_t *c, uint32_t len, void *param )
 
-/* Top level protocol pump */
+/* Pump a run of ITM data into the decoder */
 
 {
-    if ( options.useTPIU )
-    {
-        switch ( TPIUPump( &_r.t, c ) )
-        {
-            // ------------------------------------
-            case TPIU_EV_NEWSYNC:
-                genericsReport( V_INFO, "TPIU In Sync (%d)" EOL, TPIUDecoderGetStats( &_r.t )->syncCount );
+    MSGDispatchPump( &_r.m, c, len );
+}
+// ====================================================================================================
+void _tpiuEvent( enum TPIUPumpEvent e, void *param )
 
-            case TPIU_EV_SYNCED:
-                ITMDecoderForceSync( &_r.i, true );
-                break;
+/* Callback for sync events from the TPIU decoder */
 
-            // ------------------------------------
-            case TPIU_EV_RXING:
-            case TPIU_EV_NONE:
-                break;
+{
+    switch ( e )
+    {
+        // ------------------------------------
+        case TPIU_EV_NEWSYNC:
+            genericsReport( V_INFO, "TPIU In Sync (%d)" EOL, TPIUDemuxGetStats( &_r.t )->syncCount );
 
-            // ------------------------------------
-            case TPIU_EV_UNSYNCED:
-                genericsReport( V_WARN, "TPIU Lost Sync (%d)" EOL, TPIUDecoderGetStats( &_r.t )->lostSync );
-                ITMDecoderForceSync( &_r.i, false );
-                break;
+        case TPIU_EV_SYNCED:
+            ITMDecoderForceSync( &_r.i, true );
+            break;
 
-            // ------------------------------------
-            case TPIU_EV_RXEDPACKET:
-                if ( !TPIUGetPacket( &_r.t, &_r.p ) )
-                {
-                    genericsReport( V_WARN, "TPIUGetPacket fell over" EOL );
-                }
+        // ------------------------------------
+        case TPIU_EV_RXING:
+        case TPIU_EV_NONE:
+        case TPIU_EV_RXEDPACKET:
+            break;
 
-                for ( uint32_t g = 0; g < _r.p.len; g++ )
-                {
-                    if ( _r.p.packet[g].s == options.tpiuITMChannel )
-                    {
-                        _itmPumpProcess( _r.p.packet[g].d );
-                        continue;
-                    }
+        // ------------------------------------
+        case TPIU_EV_UNSYNCED:
+            genericsReport( V_WARN, "TPIU Lost Sync (%d)" EOL, TPIUDemuxGetStats( &_r.t )->lostSync );
+            ITMDecoderForceSync( &_r.i, false );
+            break;
 
-                    if ( _r.p.packet[g].s != 0 )
-                    {
-                        genericsReport( V_WARN, "Unknown TPIU channel %02x" EOL, _r.p.packet[g].s );
-                    }
-                }
+        // ------------------------------------
+        case TPIU_EV_ERROR:
+            genericsReport( V_WARN, "****ERROR****" EOL );
+            break;
+            // ------------------------------------
+    }
+}
+// ====================================================================================================
+void _protocolPump( uint8_t *c, int len )
 
-                break;
+/* Top level protocol pump */
 
-            // ------------------------------------
-            case TPIU_EV_ERROR:
-                genericsReport( V_WARN, "****ERROR****" EOL );
-                break;
-                // ------------------------------------
-        }
+{
+    if ( options.useTPIU )
+    {
+        TPIUDemuxPump( &_r.t, c, len );
     }
     else
     {
         /* There's no TPIU in use, so this goes straight to the ITM layer */
-        _itmPumpProcess( c );
+        _itmPumpBlock( c, len, NULL );
     }
 }
 // ====================================================================================================
@@ -951,10 +957,12 @@ void _printHelp( char *progName )
     fprintf( stdout, "        l: Aggregate per line rather than per function" EOL );
     fprintf( stdout, "        n: Enforce sync requirement for ITM (i.e. ITM needs to issue syncs)" EOL );
     fprintf( stdout, "        o: <filename> to be used for output live file" EOL );
+    fprintf( stdout, "        P: <threads> Decode file in parallel on this many threads (0 for one per processor)" EOL );
     fprintf( stdout, "        r: <routines> to record in live file (default %d routines)" EOL, options.maxRoutines );
     fprintf( stdout, "        s: <Server>:<Port> to use" EOL );
     fprintf( stdout, "        t: Use TPIU decoder" EOL );
     fprintf( stdout, "        v: <level> Verbose mode 0(errors)..3(debug)" EOL );
+    fprintf( stdout, "        x: Server is an orbuculum decoded event port (orbuculum -x) rather than raw trace" EOL );
 }
 // ====================================================================================================
 int _processOptions( int argc, char *argv[] )
@@ -962,7 +970,7 @@ int _processOptions( int argc, char *argv[] )
 {
     int c;
 
-    while ( ( c = getopt ( argc, argv, "c:d:DEe:f:g:hi:I:j:lm:no:r:s:tv:" ) ) != -1 )
+    while ( ( c = getopt ( argc, argv, "c:d:DEe:f:g:hi:I:j:lm:no:P:r:s:tv:x" ) ) != -1 )
         switch ( c )
         {
             // ------------------------------------
@@ -1031,11 +1039,22 @@ int _processOptions( int argc, char *argv[] )
                 options.outfile = optarg;
                 break;
 
+            // ------------------------------------
+            case 'P':
+                options.parallel = true;
+                options.threads = atoi( optarg );
+                break;
+
             // ------------------------------------
             case 'v':
                 genericsSetReportLevel( atoi( optarg ) );
                 break;
 
+            // ------------------------------------
+            case 'x':
+                options.events = true;
+                break;
+
             // ------------------------------------
             case 't':
                 options.useTPIU = true;
@@ -1102,6 +1121,12 @@ int _processOptions( int argc, char *argv[] )
         return -EINVAL;
     }
 
+    if ( ( options.events ) && ( options.file ) )
+    {
+        genericsReport( V_ERROR, "Decoded events only come from a server" EOL );
+        return -EINVAL;
+    }
+
     if ( !options.elffile )
     {
         genericsReport( V_ERROR, "Elf File not specified" EOL );
@@ -1112,11 +1137,11 @@ int _processOptions( int argc, char *argv[] )
 
     if ( options.file )
     {
-        genericsReport( V_INFO, "Input File       : %s", options.file );
+        genericsReport( V_INFO, "Input File       : %s%s" EOL, options.file, options.parallel ? " (Parallel decode)" : "" );
     }
     else
     {
-        genericsReport( V_INFO, "Server           : %s:%d" EOL, options.server, options.port );
+        genericsReport( V_INFO, "Server           : %s:%d%s" EOL, options.server, options.port, options.events ? " (Decoded events)" : "" );
     }
 
     genericsReport( V_INFO, "Delete Mat       : %s" EOL, options.deleteMaterial ? options.deleteMaterial : "None" );
@@ -1169,10 +1194,28 @@ int main( int argc, char *argv[] )
         exit( -EINVAL );
     }
 
-    /* Reset the TPIU handler before we start */
-    TPIUDecoderInit( &_r.t );
+    /* Reset the TPIU handler before we start...frame timing means nothing when reading a file */
+    TPIUDemuxInit( &_r.t, options.file ? TPIU_TIMING_NONE : TPIU_TIMING_BLOCK_CLOCK, _tpiuEvent, NULL );
+
+    if ( !TPIUDemuxRegister( &_r.t, options.tpiuITMChannel, _itmPumpBlock, NULL ) )
+    {
+        genericsExit( -1, "Cannot use TPIU channel %d for ITM" EOL, options.tpiuITMChannel );
+    }
+
     ITMDecoderInit( &_r.i, options.forceITMSync );
-    MSGSeqInit( &_r.d, &_r.i, MSG_REORDER_BUFLEN );
+    MSGSeqInit( &_r.d, &_r.i, MSG_REORDER_BUFLEN, MSG_REORDER_MAXLEN );
+
+    /* Messages of interest go through the sequencer, and on to their handlers once in order */
+    MSGDispatchInit( &_r.m, &_r.i, NULL, NULL );
+    MSGDispatchRegister( &_r.m, MSG_PC_SAMPLE, ( MSGDispatchHandler )_itmMsgProcess );
+    MSGDispatchRegister( &_r.m, MSG_EXCEPTION, ( MSGDispatchHandler )_itmMsgProcess );
+    MSGDispatchRegister( &_r.m, MSG_TS, ( MSGDispatchHandler )_itmMsgProcess );
+    MSGDispatchRegister( &_r.m, MSG_GTS, ( MSGDispatchHandler )_itmMsgProcess );
+
+    MSGDispatchInit( &_r.ms, &_r.i, NULL, &_r.i );
+    MSGDispatchRegister( &_r.ms, MSG_PC_SAMPLE, ( MSGDispatchHandler )_handlePCSample );
+    MSGDispatchRegister( &_r.ms, MSG_EXCEPTION, ( MSGDispatchHandler )_handleException );
+    MSGDispatchRegister( &_r.ms, MSG_TS, ( MSGDispatchHandler )_handleTS );
 
     /* First interval will be from startup to first packet arriving */
     _r.lastReportmS = _timestamp();
@@ -1246,6 +1289,17 @@ int main( int argc, char *argv[] )
                 perror( "Could not connect" );
                 usleep( 1000000 );
             }
+
+            /* A new connection starts at a frame of its own */
+            MSGStreamInit( &_r.es );
+        }
+        else if ( options.parallel )
+        {
+            /* The file gets decoded in chunks on a pool of threads, with the messages coming back in order */
+            if ( !( _r.pd = ParDecoderOpen( options.file, &_r.i, options.useTPIU, options.tpiuITMChannel, options.threads ) ) )
+            {
+                genericsExit( -EIO, "Can't open file %s" EOL, options.file );
+            }
         }
         else
         {
@@ -1271,7 +1325,12 @@ int main( int argc, char *argv[] )
             remainTime = ( ( lastTime + options.displayInterval - _timestamp() ) * 1000 ) - 500;
             r = t = 0;
 
-            if ( remainTime > 0 )
+            if ( ( remainTime > 0 ) && ( _r.pd ) )
+            {
+                /* The next chunk of the file is always ready to go */
+                r = 1;
+            }
+            else if ( remainTime > 0 )
             {
                 tv.tv_sec = remainTime / 1000000;
                 tv.tv_usec  = remainTime % 1000000;
@@ -1287,7 +1346,7 @@ int main( int argc, char *argv[] )
                 break;
             }
 
-            if ( r > 0 )
+            if ( ( r > 0 ) && ( !_r.pd ) )
             {
                 t = read( sourcefd, cbw, TRANSFER_SIZE );
 
@@ -1316,11 +1375,19 @@ int main( int argc, char *argv[] )
             }
 
             /* Pump all of the data through the protocol handler */
-            uint8_t *c = cbw;
-
-            while ( t-- )
+            if ( ( !_r.pd ) && ( options.events ) )
             {
-                _protocolPump( *c++ );
+                /* orbuculum has done the decoding, so the messages go straight into the sequencer */
+                MSGStreamPump( &_r.es, cbw, t, _handleMsg, NULL );
+            }
+            else if ( !_r.pd )
+            {
+                _protocolPump( cbw, t );
+            }
+            else if ( ( r > 0 ) && ( !ParDecoderPump( _r.pd, _handleMsg, _handleEvent, NULL ) ) )
+            {
+                /* We are at the end of the file */
+                break;
             }
 
             /* See if its time to post-process it */
@@ -1367,7 +1434,15 @@ int main( int argc, char *argv[] )
             }
         }
 
-        close( sourcefd );
+        if ( _r.pd )
+        {
+            ParDecoderClose( _r.pd );
+            _r.pd = NULL;
+        }
+        else
+        {
+            close( sourcefd );
+        }
     }
 
     if ( ( !ITMDecoderGetStats( &_r.i )->tpiuSyncCount ) )
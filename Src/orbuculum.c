@@ -74,6 +74,10 @@
 #include "git_version_info.h"
 #include "generics.h"
 #include "fileWriter.h"
+#include "spscRing.h"
+#include "fileSource.h"
+#include "metrics.h"
+#include "recorder.h"
 
 #ifdef WITH_FIFOS
     #include "fifos.h"
@@ -93,18 +97,30 @@
     #define IF_NOT_WITH_NWCLIENT(...) __VA_ARGS__
 #endif
 
+/* Serving decoded events needs the decoders from the fifos, and a network server */
+#if defined WITH_FIFOS && defined WITH_NWCLIENT
+    #include "msgStream.h"
+    #define WITH_EVENTS
+    #define IF_WITH_EVENTS(...) __VA_ARGS__
+#else
+    #define IF_WITH_EVENTS(...)
+#endif
+
 #ifdef INCLUDE_FPGA_SUPPORT
     #include <libftdi1/ftdi.h>
     #include "ftdispi.h"
+    #include "fpgaFrames.h"
     #define IF_INCLUDE_FPGA_SUPPORT(...) __VA_ARGS__
     #define FTDI_VID  (0x0403)
     #define FTDI_PID  (0x6010)
     #define FTDI_INTERFACE (INTERFACE_A)
     #define FTDI_UART_INTERFACE (INTERFACE_B)
     #define FTDI_INTERFACE_SPEED CLOCK_MAX_SPEEDX5
-    #define FTDI_PACKET_SIZE  (17)
-    #define FTDI_NUM_FRAMES   (900)  // If you make this too large the driver drops frames
+    #define FTDI_PACKET_SIZE  (FPGA_FRAME_LEN)
+    #define FTDI_NUM_FRAMES   (900)  // Frames in each SPI read queued to the FTDI
     #define FTDI_HS_TRANSFER_SIZE (FTDI_PACKET_SIZE*FTDI_NUM_FRAMES)
+    #define FTDI_STATUS_BYTES (2)    // Modem status at the start of every USB packet from the FTDI
+    #define FPGA_READS_QUEUED (4)    // SPI reads kept queued so the link never waits for the host
     #define FPGA_AWAKE (0x80)
     #define FPGA_ASLEEP (0x90)
     // #define DUMP_FTDI_BYTES // Uncomment to get data dump of bytes from FTDI transfer
@@ -125,11 +141,121 @@
     #define TRANSFER_SIZE (4096)
 #endif
 
-/* Record for options, either defaults or from command line */
-struct
+#define USB_TRANSFERS     (8)                 /* Default number of USB transfers kept in flight */
+#define USB_MAX_TRANSFERS (64)                /* ...and the most that can be asked for */
+#define USB_PACKET_SIZE   (512)               /* USB transfer sizes must be a multiple of this */
+#define USB_TIMEOUT       (10)                /* mS before a transfer hands over what it's got so far */
+
+#define FILE_BLOCK        (64*1024)           /* Largest block taken from a file at a time */
+
+#define RECORDER_MAX_MB   (4095)              /* Largest flight recorder, in MBytes (its size is held in 32 bits) */
+
+#define CLIENT_MIN_KB     (64)                /* Smallest queue for a network client, in KBytes... */
+#define CLIENT_MAX_KB     (1024*1024)         /* ...and the largest */
+
+#ifndef PROCESS_RING_SIZE
+    #define PROCESS_RING_SIZE (8*1024*1024)   /* Buffering between capture and each processor */
+#endif
+#define PROCESS_WAIT      (100)               /* mS a processor waits for data before checking if it's finished */
+
+/* Each consumer of captured data from a source is fed through its own ring, so that neither */
+/* capture nor the other consumers ever wait for it.                                         */
+enum processorID
+{
+    IF_WITH_NWCLIENT( PROC_NWCLIENT, )
+    IF_WITH_FIFOS( PROC_FIFOS, )
+    NUM_PROCESSORS
+};
+
+struct source;
+
+struct processor
+{
+    const char *name;                         /* What it's called in reports */
+    void ( *process )( struct source *src, uint8_t *d, uint32_t len ); /* Routine doing the work */
+    struct source *src;                       /* Source it's working for */
+    struct SPSCRing r;                        /* Captured data waiting for it */
+    uint64_t reportedOverrunBytes;            /* Overrun at the last interval report */
+    uint64_t bytes;                           /* Bytes it has processed */
+    struct metricsHistogram processTime;      /* Time taken by each call of process */
+};
+
+/* The processors of all of the sources are shared out between a pool of worker threads. Each */
+/* worker sleeps until any of its processors has something to do.                             */
+struct worker
+{
+    struct processor **p;                     /* Processors it looks after */
+    struct SPSCRing **r;                      /* ...their rings */
+    uint32_t n;                               /* ...and how many there are */
+    struct SPSCWaiter w;                      /* Where it sleeps */
+    pthread_t thread;                         /* Thread it runs on */
+};
+
+/* Asynchronous USB capture. Transfers are kept queued to the device while completed ones */
+/* are processed, so nothing is lost between them. Each completed transfer is passed to a */
+/* usbHandler, with live false once capture is being wound down. The handler returns     */
+/* false if capture should stop.                                                          */
+typedef bool ( *usbHandler )( struct libusb_transfer *t, bool live, void *param );
+
+/* libusb event handling, which is where transfer completions get delivered. The USB probes */
+/* share one context, and so one event thread, between them. Anything else (i.e. the FPGA, */
+/* via libftdi) brings its own context and gets its own thread while it's capturing.        */
+struct usbEvents
+{
+    libusb_context *ctx;                      /* Context events are handled for */
+    pthread_t thread;                         /* Thread handling them */
+    bool exit;                                /* ...and flag for it to stop */
+};
+
+struct usbCapture
+{
+    struct libusb_transfer **t;               /* The transfers */
+    uint32_t transfers;                       /* ...and how many there are */
+    struct libusb_transfer **done;            /* Completed transfers waiting to be processed */
+    uint32_t dwp;                             /* Write pointer into done */
+    uint32_t drp;                             /* ...and read pointer */
+    uint32_t inFlight;                        /* Number of transfers currently submitted */
+    bool failed;                              /* A transfer failed, so the device needs reopening */
+
+    struct usbEvents events;                  /* Event handling, if it's not shared */
+    pthread_mutex_t lock;                     /* Protection for all of the above */
+    pthread_cond_t cond;                      /* ...and signal that a transfer has completed */
+};
+
+#ifdef INCLUDE_FPGA_SUPPORT
+/* Streaming from the orbtrace FPGA. SPI reads are kept queued to the FTDI while the USB */
+/* transfers carrying their data are collected, and frames are reassembled across them.  */
+struct fpgaStream
+{
+    uint8_t frame[FTDI_PACKET_SIZE];          /* Frame split between USB packets, being assembled */
+    uint32_t framePos;                        /* ...and how much of it has arrived */
+    uint8_t *payload;                         /* Payload compacted from the current transfer */
+    uint32_t packetSize;                      /* USB packet size, each with its own status bytes */
+    uint8_t hdr;                              /* Header every frame should carry, idle flag aside */
+
+    uint64_t requested;                       /* Bytes of reads queued to the FTDI */
+    uint64_t received;                        /* ...and bytes that have arrived from them */
+    bool failed;                              /* Further reads could not be queued */
+    bool aligned;                             /* Frame headers are where they should be */
+    uint32_t slipped;                         /* Bytes discarded while looking for alignment */
+
+    uint64_t frames;                          /* Frames received */
+    uint64_t dataFrames;                      /* ...of which carried data */
+    uint64_t droppedFrames;                   /* ...and frames known to have been lost */
+    uint64_t reportedFrames;                  /* Counts at the last interval report */
+    uint64_t reportedDataFrames;
+    uint64_t reportedDroppedFrames;
+};
+#endif
+
+/* Configuration and state for each source of trace. Each one has its own capture, decoders */
+/* and outputs, configured by the options given before the next -S.                         */
+struct source
 {
+    uint32_t index;                                      /* Which source this is, from 0 */
+    char label[20];                                      /* ...as a metrics label */
+
     /* Config information */
-    bool segger;                                         /* Using a segger debugger */
     IF_WITH_FIFOS( bool filewriter; )                    /* Supporting filewriter functionality */
     IF_WITH_FIFOS( char *fwbasedir; )                    /* Base directory for filewriter output */
     IF_WITH_FIFOS( bool permafile; )                     /* Use permanent files rather than fifos */
@@ -145,38 +271,96 @@ struct
     int speed;                                           /* Speed of serial link */
     char *file;                                          /* File host connection */
     bool fileTerminate;                                  /* Terminate when file read isn't successful */
+    double fileRate;                                     /* Bytes per second to replay file at (0 for max speed) */
+    char *serial;                                        /* Serial number of the USB probe (or FPGA) to use */
+    uint32_t usbTransfers;                               /* Number of USB transfers kept in flight */
+    uint32_t usbTransferSize;                            /* ...and the size of each of them */
 
-    uint32_t intervalReportTime;                         /* If we want interval reports about performance */
+    /* Flight recorder */
+    uint32_t recorderMB;                                 /* MBytes of trace to keep (0 for none) */
+    char *recorderPrefix;                                /* Start of the name of its dump files */
+    char *recorderPattern;                               /* Hex pattern to dump on when seen */
+    IF_WITH_FIFOS( bool recorderOnSyncLoss; )            /* Dump when TPIU or ITM loses sync */
 
     /* Network link */
     IF_WITH_NWCLIENT( int listenPort );                  /* Listening port for network */
-} options =
-{
-    IF_WITH_NWCLIENT( .listenPort = NWCLIENT_SERVER_PORT, )
-    .seggerHost = SEGGER_HOST,
-#ifdef INCLUDE_FPGA_SUPPORT
-    .orbtraceWidth = 4
-#endif
-};
+    IF_WITH_NWCLIENT( uint32_t queueKB );                /* Data that can wait for each client, in KBytes */
+    IF_WITH_NWCLIENT( enum nwclientOverflow overflow );  /* ...and what happens when there's more */
+    IF_WITH_NWCLIENT( uint32_t historyKB );              /* History kept to start new clients from, in KBytes */
+    IF_WITH_NWCLIENT( bool zeroCopy );                   /* Send large blocks to clients zero copy */
+    IF_WITH_EVENTS( int eventPort );                     /* Port serving decoded events (0 for none) */
 
-struct
-{
     /* Link to the fifo subsystem */
     IF_WITH_FIFOS( struct fifosHandle *f );
+    IF_WITH_FIFOS( uint32_t reportedUnrouted );          /* TPIU bytes with no consumer at the last interval report */
+    IF_WITH_FIFOS( uint32_t reportedTPIUOverflow );      /* ...and those lost to a full stream buffer */
 
     /* Link to the network client subsystem */
     IF_WITH_NWCLIENT( struct nwclientsHandle *n );
 
+    /* Link to the decoded event server, and the frame of events being built for it */
+    IF_WITH_EVENTS( struct nwclientsHandle *e );
+    IF_WITH_EVENTS( struct MSGStream es );
+    IF_WITH_EVENTS( char eventLabel[40] );               /* ...and its metrics label */
+
+    /* Link to the flight recorder */
+    struct recorderHandle *rec;
+
     /* Link to the FPGA subsystem */
-    IF_INCLUDE_FPGA_SUPPORT( bool feederExit );                        /* Do we need to leave now? */
     IF_INCLUDE_FPGA_SUPPORT( struct ftdi_context *ftdi );              /* Connection materials for ftdi fpga interface */
     IF_INCLUDE_FPGA_SUPPORT( struct ftdispi_context ftdifsc );
+    IF_INCLUDE_FPGA_SUPPORT( struct fpgaStream fpga );                 /* Streaming state for the fpga link */
+
+    struct processor p[NUM_PROCESSORS];                                /* Consumers of the captured data */
 
     uint64_t  intervalBytes;                                           /* Number of bytes transferred in current interval */
+    uint64_t  captureBytes;                                            /* Total bytes captured */
+    uint64_t  captureBlocks;                                           /* ...and the blocks they arrived in */
+
+    pthread_t feederThread;                                            /* Thread capturing from the source */
+    int       feederResult;                                            /* ...what it returned */
+};
+
+/* Record for options, either defaults or from command line. These apply to all sources */
+struct
+{
+    uint32_t intervalReportTime;                         /* If we want interval reports about performance */
+    int metricsPort;                                     /* Local port to serve metrics on (0 for none) */
+    uint32_t workers;                                    /* Worker threads shared by the processors */
+} options =
+{
+    .workers = NUM_PROCESSORS
+};
+
+struct
+{
+    struct source **s;                                                 /* The sources of trace */
+    uint32_t numSources;                                               /* ...and how many there are */
+
+    struct worker *w;                                                  /* Workers running the processors */
+    uint32_t numWorkers;                                               /* ...and how many there are */
+
+    struct usbEvents usb;                                              /* Event handling shared by the USB probes */
+
+    IF_INCLUDE_FPGA_SUPPORT( bool feederExit );                        /* Do we need to leave now? */
+
+    /* Link to the metrics server */
+    struct metricsHandle *m;
+
     pthread_t intervalThread;                                          /* Thread reporting on intervals */
     bool      ending;                                                  /* Flag indicating app is terminating */
 } _r;
 
+#ifdef WITH_NWCLIENT
+/* Names of the client overflow policies, as given on the command line */
+static const char *_overflowName[] =
+{
+    [NWCLIENT_DROP_NEWEST] = "newest",
+    [NWCLIENT_DROP_OLDEST] = "oldest",
+    [NWCLIENT_DISCONNECT]  = "disconnect",
+};
+#endif
+
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
@@ -191,6 +375,16 @@ static void _intHandler( int sig, siginfo_t *si, void *unused )
     exit( 0 );
 }
 // ====================================================================================================
+static void _usr1Handler( int sig, siginfo_t *si, void *unused )
+
+{
+    /* Dump all of the flight recorders */
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
+    {
+        recorderTrigger( _r.s[n]->rec, RECORDER_TRIG_SIGNAL );
+    }
+}
+// ====================================================================================================
 #if defined(LINUX) && defined (TCGETS2)
 static int _setSerialConfig ( int f, speed_t speed )
 {
@@ -333,446 +527,1437 @@ void _printHelp( char *progName )
 
 {
 
-    IF_WITH_FIFOS( fprintf( stdout, "Usage: %s <hntv> <s name:number> <b basedir> <f filename>  <i channel> <p port> <a speed>" EOL, progName ) );
-    IF_NOT_WITH_FIFOS( fprintf( stdout, "Usage: %s <hv> <s name:number> <f filename>  <p port> <a speed>" EOL, progName ) );
+    IF_WITH_FIFOS( fprintf( stdout, "Usage: %s <hntv> <s name:number> <b basedir> <f filename>  <i channel> <p port> <a speed> [S <options for next source>]..." EOL, progName ) );
+    IF_NOT_WITH_FIFOS( fprintf( stdout, "Usage: %s <hv> <s name:number> <f filename>  <p port> <a speed> [S <options for next source>]..." EOL, progName ) );
     fprintf( stdout, "        a: <serialSpeed> to use" EOL );
     IF_WITH_FIFOS( fprintf( stdout, "        b: <basedir> for channels" EOL ) );
     IF_WITH_FIFOS( fprintf( stdout, "        c: <Number>,<Name>,<Format> of channel to populate (repeat per channel)" EOL ) );
+    fprintf( stdout, "        d: <serialNumber> of the USB probe (or FPGA interface) to use" EOL );
     fprintf( stdout, "        e: When reading from file, terminate at end of file rather than waiting for further input" EOL );
     fprintf( stdout, "        f: <filename> Take input from specified file" EOL );
+    fprintf( stdout, "        F: <MBytes>[,<prefix>] Keep the latest trace in a flight recorder, dumped to <prefix><time>... on SIGUSR1 (default prefix orbrec<source>-)" EOL );
     fprintf( stdout, "        h: This help" EOL );
+    IF_WITH_NWCLIENT( fprintf( stdout, "        H: <KBytes> Keep up to this much from the latest sync to start new clients from (default 0, none)" EOL ) );
     IF_WITH_FIFOS( fprintf( stdout, "        i: <channel> Set ITM Channel in TPIU decode (defaults to 1)" EOL ) );
-    IF_WITH_NWCLIENT( fprintf( stdout, "        l: <port> Listen port for the incoming connections (defaults to %d)" EOL, NWCLIENT_SERVER_PORT ) );
+    IF_WITH_NWCLIENT( fprintf( stdout, "        l: <port> Listen port for the incoming connections (defaults to %d, then the next one along for each source)" EOL, NWCLIENT_SERVER_PORT ) );
+    IF_WITH_FIFOS( fprintf( stdout, "        L: Dump the flight recorder when TPIU or ITM loses sync" EOL ) );
     fprintf( stdout, "        m: <interval> Output monitor information about the link at <interval>ms" EOL );
+    fprintf( stdout, "        M: <port> Serve metrics in Prometheus text format on local port" EOL );
     IF_WITH_FIFOS( fprintf( stdout, "        n: Enforce sync requirement for ITM (i.e. ITM needs to issue syncs)" EOL ) );
     IF_INCLUDE_FPGA_SUPPORT( fprintf( stdout, "        o: <num> Use traceport FPGA custom interface with 1, 2 or 4 bits width" EOL ) );
     fprintf( stdout, "        p: <serialPort> to use" EOL );
     IF_WITH_FIFOS( fprintf( stdout, "        P: Create permanent files rather than fifos" EOL ) );
+    IF_WITH_NWCLIENT( fprintf( stdout, "        q: <KBytes>[,newest|oldest|disconnect] Data that can wait for each client, and what to drop when there's more (defaults to %d,newest)" EOL, NWCLIENT_QUEUE_KB ) );
+    fprintf( stdout, "        r: <bytes/sec>[,<multiplier>] Replay file paced to this data rate, scaled by multiplier (default max speed)" EOL );
     fprintf( stdout, "        s: <address>:<port> Set address for SEGGER JLink connection (default none:%d)" EOL, SEGGER_PORT );
+    fprintf( stdout, "        S: Start another source, the source options that follow (all but h, m, M, v and W) are for it" EOL );
     IF_WITH_FIFOS( fprintf( stdout, "        t: Use TPIU decoder" EOL ) );
+    fprintf( stdout, "        T: <hex bytes> Dump the flight recorder when this pattern is seen in the trace" EOL );
+    fprintf( stdout, "        u: <transfers>,<size> USB (or FPGA) transfers to keep in flight and size of each (defaults to %d,%d)" EOL, USB_TRANSFERS, TRANSFER_SIZE );
     fprintf( stdout, "        v: <level> Verbose mode 0(errors)..3(debug)" EOL );
     IF_WITH_FIFOS( fprintf( stdout, "        w: <path> Enable filewriter functionality using specified base path" EOL ) );
+    fprintf( stdout, "        W: <threads> Worker threads processing data from all of the sources (defaults to %d)" EOL, NUM_PROCESSORS );
+    IF_WITH_EVENTS( fprintf( stdout, "        x: <port> Serve decoded events on this port too, for clients started with -x" EOL ) );
+    IF_WITH_NWCLIENT( fprintf( stdout, "        z: Send large blocks to network clients zero copy (Linux)" EOL ) );
     IF_WITH_FIFOS( fprintf( stdout, "        (Built with fifo support)" EOL ) );
     IF_NOT_WITH_FIFOS( fprintf( stdout, "        (Built without fifo support)" EOL ) );
 }
 // ====================================================================================================
-int _processOptions( int argc, char *argv[] )
+static struct source *_newSource( void )
+
+/* Add another source, with the default settings */
 
 {
-    int c;
-#define DELIMITER ','
+    struct source *src;
+    struct source **s = ( struct source ** )realloc( _r.s, ( _r.numSources + 1 ) * sizeof( struct source * ) );
 
-    IF_WITH_FIFOS( char *chanConfig );
-    IF_WITH_FIFOS( char *chanName );
-    IF_WITH_FIFOS( uint chan );
-    IF_WITH_FIFOS( char *chanIndex );
+    if ( !s )
+    {
+        return NULL;
+    }
 
-#ifdef WITH_FIFOS
+    _r.s = s;
 
-    IF_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:b:c:ef:hl:m:no:p:Ps:tv:w:" ) ) != -1 ) )
-        IF_NOT_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:b:c:ef:hm:o:p:Ps:tv:w:" ) ) != -1 ) )
-#else
-    IF_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:ef:hi:l:m:no:p:s:v:" ) ) != -1 ) )
-        IF_NOT_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:ef:hi:m:no:p:s:v:" ) ) != -1 ) )
-#endif
-            switch ( c )
-            {
-                // ------------------------------------
-                case 'a':
-                    options.speed = atoi( optarg );
-                    break;
+    if ( !( src = ( struct source * )calloc( 1, sizeof( struct source ) ) ) )
+    {
+        return NULL;
+    }
 
-                    // ------------------------------------
-#ifdef WITH_FIFOS
+    src->index = _r.numSources;
+    snprintf( src->label, sizeof( src->label ), "source=\"%d\"", src->index );
+    src->seggerHost = SEGGER_HOST;
+    src->usbTransfers = USB_TRANSFERS;
+    src->usbTransferSize = TRANSFER_SIZE;
+    IF_INCLUDE_FPGA_SUPPORT( src->orbtraceWidth = 4 );
 
-                case 'b':
-                    fifoSetChanPath( _r.f, optarg );
-                    break;
-#endif
+    /* Each source listens on the port after the previous one, unless told otherwise */
+    IF_WITH_NWCLIENT( src->listenPort = ( _r.numSources ) ? _r.s[_r.numSources - 1]->listenPort + 1 : NWCLIENT_SERVER_PORT );
+    IF_WITH_NWCLIENT( src->queueKB = NWCLIENT_QUEUE_KB );
+    IF_WITH_EVENTS( MSGStreamInit( &src->es ) );
 
-                // ------------------------------------
-                case 'e':
-                    options.fileTerminate = true;
-                    break;
+    /* Setup fifos with forced ITM sync, no TPIU and TPIU on channel 1 if its engaged later */
+    IF_WITH_FIFOS( src->f = fifoInit( true, false, 1 ) );
+    IF_WITH_FIFOS( assert( src->f ) );
 
-                // ------------------------------------
-                case 'f':
-                    options.file = optarg;
-                    break;
+    _r.s[_r.numSources++] = src;
+    return src;
+}
+// ====================================================================================================
+static bool _isUSBProbe( struct source *src )
 
-                // ------------------------------------
-                case 'h':
-                    _printHelp( argv[0] );
-                    return false;
+/* Is this source a USB probe (i.e. none of the other sorts)? */
 
-                    // ------------------------------------
-#ifdef WITH_FIFOS
+{
+    IF_INCLUDE_FPGA_SUPPORT( if ( src->orbtrace ) return false );
 
-                case 'i':
-                    fifoSettpiuITMChannel( _r.f, atoi( optarg ) );
-                    break;
-#endif
-                    // ------------------------------------
-#if WITH_NWCLIENT
+    return ( !src->seggerPort ) && ( !src->port ) && ( !src->file );
+}
+// ====================================================================================================
+#ifdef WITH_NWCLIENT
+static enum nwclientRestart _restartFor( struct source *src )
 
-                case 'l':
-                    options.listenPort = atoi( optarg );
-                    break;
-#endif
+/* Where network clients of this source can pick the stream up again after data is dropped */
 
-                // ------------------------------------
+{
+    IF_INCLUDE_FPGA_SUPPORT( if ( src->orbtrace ) return NWCLIENT_RESTART_FRAMES );
+    IF_WITH_FIFOS( if ( fifoGetUseTPIU( src->f ) ) return NWCLIENT_RESTART_TPIU );
 
-                case 'm':
-                    options.intervalReportTime = atoi( optarg );
-                    break;
+    return NWCLIENT_RESTART_ITM;
+}
+#endif
+// ====================================================================================================
+static bool _checkSource( struct source *src )
 
-                    // ------------------------------------
+/* Sanity checks on the options for a source */
 
+{
 #ifdef WITH_FIFOS
 
-                case 'n':
-                    fifoSetForceITMSync( _r.f, false );
-                    break;
-#endif
-                    // ------------------------------------
-#ifdef INCLUDE_FPGA_SUPPORT
+    if ( fifoGetUseTPIU( src->f ) && ( !fifoGettpiuITMChannel( src->f ) ) )
+    {
+        genericsReport( V_ERROR, "TPIU set for use but no channel set for ITM output" EOL );
+        return false;
+    }
 
-                case 'o':
-                    // Generally you need TPIU for orbtrace
-                    IF_WITH_FIFOS( fifoSetUseTPIU( _r.f, true ) );
-                    options.orbtrace = true;
-                    options.orbtraceWidth = atoi( optarg );
-                    break;
 #endif
 
-                // ------------------------------------
+    if ( ( !src->usbTransfers ) || ( src->usbTransfers > USB_MAX_TRANSFERS ) )
+    {
+        genericsReport( V_ERROR, "Number of USB transfers must be between 1 and %d" EOL, USB_MAX_TRANSFERS );
+        return false;
+    }
 
-                case 'p':
-                    options.port = optarg;
-                    break;
+    if ( ( !src->usbTransferSize ) || ( src->usbTransferSize % USB_PACKET_SIZE ) )
+    {
+        genericsReport( V_ERROR, "USB transfer size must be a multiple of %d" EOL, USB_PACKET_SIZE );
+        return false;
+    }
 
-                    // ------------------------------------
+#ifdef INCLUDE_FPGA_SUPPORT
 
-#ifdef WITH_FIFOS
+    if ( ( src->orbtrace ) && !( ( src->orbtraceWidth == 1 ) || ( src->orbtraceWidth == 2 ) || ( src->orbtraceWidth == 4 ) ) )
+    {
+        genericsReport( V_ERROR, "Orbtrace interface illegal port width" EOL );
+        return false;
+    }
 
-                case 'P':
-                    options.permafile = true;
-                    break;
 #endif
 
-                // ------------------------------------
-                case 's':
-                    IF_WITH_FIFOS( fifoSetForceITMSync( _r.f, true ) );
-                    options.seggerHost = optarg;
+#ifdef WITH_NWCLIENT
 
-                    // See if we have an optional port number too
-                    char *a = optarg;
+    if ( ( src->queueKB < CLIENT_MIN_KB ) || ( src->queueKB > CLIENT_MAX_KB ) )
+    {
+        genericsReport( V_ERROR, "Client queue must be between %d and %d KBytes" EOL, CLIENT_MIN_KB, CLIENT_MAX_KB );
+        return false;
+    }
 
-                    while ( ( *a ) && ( *a != ':' ) )
-                    {
-                        a++;
-                    }
+    if ( src->historyKB > src->queueKB / 2 )
+    {
+        genericsReport( V_ERROR, "Client history can't be more than half of the client queue" EOL );
+        return false;
+    }
 
-                    if ( *a == ':' )
-                    {
-                        *a = 0;
-                        options.seggerPort = atoi( ++a );
-                    }
+#endif
 
-                    if ( !options.seggerPort )
-                    {
-                        options.seggerPort = SEGGER_PORT;
-                    }
+    if ( src->recorderMB > RECORDER_MAX_MB )
+    {
+        genericsReport( V_ERROR, "Flight recorder can't be bigger than %d MBytes" EOL, RECORDER_MAX_MB );
+        return false;
+    }
 
-                    break;
+    if ( ( !src->recorderMB ) && ( ( src->recorderPattern ) IF_WITH_FIFOS( || ( src->recorderOnSyncLoss ) ) ) )
+    {
+        genericsReport( V_ERROR, "Flight recorder triggers need a flight recorder (-F)" EOL );
+        return false;
+    }
 
-                    // ------------------------------------
-#ifdef WITH_FIFOS
+    if ( src->fileRate < 0 )
+    {
+        genericsReport( V_ERROR, "File replay rate must be positive" EOL );
+        return false;
+    }
 
-                case 't':
-                    fifoSetUseTPIU( _r.f, true );
-                    break;
-#endif
+    if ( ( src->file ) && ( ( src->port ) || ( src->seggerPort ) ) )
+    {
+        genericsReport( V_ERROR, "Cannot specify file and port or Segger at same time" EOL );
+        return false;
+    }
 
-                // ------------------------------------
-                case 'v':
-                    genericsSetReportLevel( atoi( optarg ) );
-                    break;
+    if ( ( src->port ) && ( src->seggerPort ) )
+    {
+        genericsReport( V_ERROR, "Cannot specify port and Segger at same time" EOL );
+        return false;
+    }
 
-                    // ------------------------------------
+    return true;
+}
+// ====================================================================================================
+static bool _checkSourcePair( struct source *a, struct source *b )
 
-#ifdef WITH_FIFOS
+/* Sanity checks that two sources won't trip over each other */
 
-                case 'w':
-                    options.filewriter = true;
-                    options.fwbasedir = optarg;
-                    break;
+{
+    IF_WITH_NWCLIENT( if ( a->listenPort == b->listenPort ) )
+    IF_WITH_NWCLIENT( {
+        genericsReport( V_ERROR, "Sources %d and %d can't both listen on port %d" EOL, a->index, b->index, a->listenPort );
+        return false;
+    } )
 
-                // ------------------------------------
+#ifdef WITH_FIFOS
 
-                /* Individual channel setup */
-                case 'c':
-                    chanIndex = chanConfig = strdup( optarg );
-                    chan = atoi( optarg );
+    if ( !strcmp( fifoGetChanPath( a->f ), fifoGetChanPath( b->f ) ) )
+    {
+        genericsReport( V_ERROR, "Sources %d and %d can't both put their fifos in '%s', use -b to separate them" EOL, a->index, b->index, fifoGetChanPath( a->f ) );
+        return false;
+    }
 
-                    if ( chan >= NUM_CHANNELS )
-                    {
-                        genericsReport( V_ERROR, "Channel index out of range" EOL );
-                        return false;
-                    }
+    if ( ( a->filewriter ) && ( b->filewriter ) )
+    {
+        genericsReport( V_ERROR, "Only one source can use the filewriter" EOL );
+        return false;
+    }
 
-                    /* Scan for start of filename */
-                    while ( ( *chanIndex ) && ( *chanIndex != DELIMITER ) )
-                    {
-                        chanIndex++;
-                    }
+#endif
 
-                    if ( !*chanIndex )
-                    {
-                        genericsReport( V_ERROR, "No filename for channel %d" EOL, chan );
-                        return false;
-                    }
+    if ( ( a->recorderPrefix ) && ( b->recorderPrefix ) && ( !strcmp( a->recorderPrefix, b->recorderPrefix ) ) )
+    {
+        genericsReport( V_ERROR, "Sources %d and %d can't both dump their flight recorders to '%s'" EOL, a->index, b->index, a->recorderPrefix );
+        return false;
+    }
 
-                    chanName = ++chanIndex;
+    /* Probes of the same sort can only be told apart by their serial numbers */
+    if ( ( ( _isUSBProbe( a ) && _isUSBProbe( b ) ) IF_INCLUDE_FPGA_SUPPORT( || ( a->orbtrace && b->orbtrace ) ) ) &&
+            ( ( !a->serial ) || ( !b->serial ) || ( !strcmp( a->serial, b->serial ) ) ) )
+    {
+        genericsReport( V_ERROR, "Sources %d and %d need different serial numbers (-d) to tell their probes apart" EOL, a->index, b->index );
+        return false;
+    }
+
+    return true;
+}
+// ====================================================================================================
+static void _reportSource( struct source *src )
+
+/* Dump the config for a source */
+
+{
+    if ( _r.numSources > 1 )
+    {
+        genericsReport( V_INFO, "Source     : %d" EOL, src->index );
+    }
+
+    IF_WITH_FIFOS( genericsReport( V_INFO, "BasePath   : %s" EOL, fifoGetChanPath( src->f ) ) );
+    IF_WITH_FIFOS( genericsReport( V_INFO, "ForceSync  : %s" EOL, fifoGetForceITMSync( src->f ) ? "true" : "false" ) );
+    IF_WITH_FIFOS( genericsReport( V_INFO, "Permafile  : %s" EOL, src->permafile ? "true" : "false" ) );
+    IF_WITH_NWCLIENT( genericsReport( V_INFO, "Listen Port: %d" EOL, src->listenPort ) );
+    IF_WITH_NWCLIENT( genericsReport( V_INFO, "Client Q   : %d KBytes, %s" EOL, src->queueKB, _overflowName[src->overflow] ) );
+    IF_WITH_NWCLIENT( genericsReport( V_INFO, "History    : %d KBytes" EOL, src->historyKB ) );
+    IF_WITH_NWCLIENT( genericsReport( V_INFO, "Zero Copy  : %s" EOL, src->zeroCopy ? "true" : "false" ) );
+    IF_WITH_EVENTS( if ( src->eventPort ) genericsReport( V_INFO, "Events     : Port %d" EOL, src->eventPort ) );
+
+    if ( src->port )
+    {
+        genericsReport( V_INFO, "Serial Port : %s" EOL "Serial Speed: %d" EOL, src->port, src->speed );
+    }
+
+    if ( src->seggerPort )
+    {
+        genericsReport( V_INFO, "SEGGER H&P : %s:%d" EOL, src->seggerHost, src->seggerPort );
+    }
+
+    if ( src->serial )
+    {
+        genericsReport( V_INFO, "Serial No  : %s" EOL, src->serial );
+    }
+
+    if ( _isUSBProbe( src ) )
+    {
+        genericsReport( V_INFO, "USB Xfers  : %d x %d bytes" EOL, src->usbTransfers, src->usbTransferSize );
+    }
+
+#ifdef INCLUDE_FPGA_SUPPORT
+
+    if ( src->orbtrace )
+    {
+        genericsReport( V_INFO, "Orbtrace   : %d bits width" EOL, src->orbtraceWidth );
+    }
+
+#endif
+
+    if ( src->recorderMB )
+    {
+        genericsReport( V_INFO, "Recorder   : %d MBytes" EOL, src->recorderMB );
+
+        if ( src->recorderPattern )
+        {
+            genericsReport( V_INFO, "Rec Pattern: %s" EOL, src->recorderPattern );
+        }
+
+        IF_WITH_FIFOS( genericsReport( V_INFO, "Rec Sync   : %s" EOL, src->recorderOnSyncLoss ? "true" : "false" ) );
+    }
+
+#ifdef WITH_FIFOS
+
+    if ( fifoGetUseTPIU( src->f ) )
+    {
+        genericsReport( V_INFO, "Using TPIU : true (ITM on channel %d)" EOL, fifoGettpiuITMChannel( src->f ) );
+    }
+    else
+    {
+        genericsReport( V_INFO, "Using TPIU : false" EOL );
+    }
+
+#endif
+
+    if ( src->file )
+    {
+        genericsReport( V_INFO, "Input File : %s", src->file );
+
+        if ( src->fileTerminate )
+        {
+            genericsReport( V_INFO, " (Terminate on exhaustion)" EOL );
+        }
+        else
+        {
+            genericsReport( V_INFO, " (Ongoing read)" EOL );
+        }
+
+        if ( src->fileRate )
+        {
+            genericsReport( V_INFO, "Replay     : %.0f bytes/sec" EOL, src->fileRate );
+        }
+        else
+        {
+            genericsReport( V_INFO, "Replay     : Max speed" EOL );
+        }
+    }
+
+#ifdef WITH_FIFOS
+    genericsReport( V_INFO, "Channels   :" EOL );
+
+    for ( int g = 0; g < NUM_CHANNELS; g++ )
+    {
+        if ( fifoGetChannelName( src->f, g ) )
+        {
+            genericsReport( V_INFO, "         %02d [%s] [%s]" EOL, g, genericsEscape( fifoGetChannelFormat( src->f, g ) ? : "RAW" ), fifoGetChannelName( src->f, g ) );
+        }
+    }
+
+    genericsReport( V_INFO, "         HW [Predefined] [" HWFIFO_NAME "]" EOL );
+#endif
+}
+// ====================================================================================================
+int _processOptions( int argc, char *argv[] )
+
+{
+    int c;
+    struct source *src = _r.s[0];
+#define DELIMITER ','
+
+    IF_WITH_FIFOS( char *chanConfig );
+    IF_WITH_FIFOS( char *chanName );
+    IF_WITH_FIFOS( uint chan );
+    IF_WITH_FIFOS( char *chanIndex );
+
+#ifdef WITH_FIFOS
+
+    IF_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:b:c:d:ef:F:hH:l:Lm:M:no:p:Pq:r:s:StT:u:v:w:W:x:z" ) ) != -1 ) )
+        IF_NOT_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:b:c:d:ef:F:hLm:M:o:p:Pr:s:StT:u:v:w:W:" ) ) != -1 ) )
+#else
+    IF_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:d:ef:F:hH:i:l:m:M:no:p:q:r:s:ST:u:v:W:z" ) ) != -1 ) )
+        IF_NOT_WITH_NWCLIENT( while ( ( c = getopt ( argc, argv, "a:d:ef:F:hi:m:M:no:p:r:s:ST:u:v:W:" ) ) != -1 ) )
+#endif
+            switch ( c )
+            {
+                // ------------------------------------
+                case 'a':
+                    src->speed = atoi( optarg );
+                    break;
+
+                    // ------------------------------------
+#ifdef WITH_FIFOS
+
+                case 'b':
+                    fifoSetChanPath( src->f, optarg );
+                    break;
+#endif
+
+                // ------------------------------------
+                case 'd':
+                    src->serial = optarg;
+                    break;
+
+                // ------------------------------------
+                case 'e':
+                    src->fileTerminate = true;
+                    break;
+
+                // ------------------------------------
+                case 'f':
+                    src->file = optarg;
+                    break;
+
+                // ------------------------------------
+                case 'F':
+                    src->recorderMB = atoi( optarg );
+
+                    // See if we have an optional prefix too
+                    char *p = optarg;
+
+                    while ( ( *p ) && ( *p != DELIMITER ) )
+                    {
+                        p++;
+                    }
+
+                    if ( *p == DELIMITER )
+                    {
+                        src->recorderPrefix = ++p;
+                    }
+
+                    break;
+
+                // ------------------------------------
+                case 'h':
+                    _printHelp( argv[0] );
+                    return false;
+
+                    // ------------------------------------
+#ifdef WITH_NWCLIENT
+
+                case 'H':
+                    src->historyKB = atoi( optarg );
+                    break;
+#endif
+
+                    // ------------------------------------
+#ifdef WITH_FIFOS
+
+                case 'i':
+                    fifoSettpiuITMChannel( src->f, atoi( optarg ) );
+                    break;
+#endif
+                    // ------------------------------------
+#if WITH_NWCLIENT
+
+                case 'l':
+                    src->listenPort = atoi( optarg );
+                    break;
+#endif
+
+                    // ------------------------------------
+#ifdef WITH_FIFOS
+
+                case 'L':
+                    src->recorderOnSyncLoss = true;
+                    break;
+#endif
+
+                // ------------------------------------
+
+                case 'm':
+                    options.intervalReportTime = atoi( optarg );
+                    break;
+
+                // ------------------------------------
+                case 'M':
+                    options.metricsPort = atoi( optarg );
+                    break;
+
+                    // ------------------------------------
+
+#ifdef WITH_FIFOS
+
+                case 'n':
+                    fifoSetForceITMSync( src->f, false );
+                    break;
+#endif
+                    // ------------------------------------
+#ifdef INCLUDE_FPGA_SUPPORT
+
+                case 'o':
+                    // Generally you need TPIU for orbtrace
+                    IF_WITH_FIFOS( fifoSetUseTPIU( src->f, true ) );
+                    src->orbtrace = true;
+                    src->orbtraceWidth = atoi( optarg );
+                    break;
+#endif
+
+                // ------------------------------------
+
+                case 'p':
+                    src->port = optarg;
+                    break;
+
+                    // ------------------------------------
+
+#ifdef WITH_FIFOS
+
+                case 'P':
+                    src->permafile = true;
+                    break;
+#endif
+
+                    // ------------------------------------
+#ifdef WITH_NWCLIENT
+
+                case 'q':
+                    src->queueKB = atoi( optarg );
+
+                    // See if we have an optional overflow policy too
+                    char *q = optarg;
+
+                    while ( ( *q ) && ( *q != DELIMITER ) )
+                    {
+                        q++;
+                    }
+
+                    if ( *q == DELIMITER )
+                    {
+                        q++;
+                        src->overflow = NWCLIENT_DISCONNECT + 1;
+
+                        for ( uint32_t n = 0; n <= NWCLIENT_DISCONNECT; n++ )
+                        {
+                            if ( !strcmp( q, _overflowName[n] ) )
+                            {
+                                src->overflow = n;
+                            }
+                        }
+
+                        if ( src->overflow > NWCLIENT_DISCONNECT )
+                        {
+                            genericsReport( V_ERROR, "Unrecognised client overflow policy %s" EOL, q );
+                            return false;
+                        }
+                    }
+
+                    break;
+#endif
+
+                // ------------------------------------
+                case 'r':
+                    src->fileRate = atof( optarg );
+
+                    // See if we have an optional multiplier too
+                    char *r = optarg;
+
+                    while ( ( *r ) && ( *r != DELIMITER ) )
+                    {
+                        r++;
+                    }
+
+                    if ( *r == DELIMITER )
+                    {
+                        src->fileRate *= atof( ++r );
+                    }
+
+                    break;
+
+                // ------------------------------------
+                case 's':
+                    IF_WITH_FIFOS( fifoSetForceITMSync( src->f, true ) );
+                    src->seggerHost = optarg;
+
+                    // See if we have an optional port number too
+                    char *a = optarg;
+
+                    while ( ( *a ) && ( *a != ':' ) )
+                    {
+                        a++;
+                    }
+
+                    if ( *a == ':' )
+                    {
+                        *a = 0;
+                        src->seggerPort = atoi( ++a );
+                    }
+
+                    if ( !src->seggerPort )
+                    {
+                        src->seggerPort = SEGGER_PORT;
+                    }
+
+                    break;
+
+                // ------------------------------------
+                case 'S':
+                    if ( !( src = _newSource() ) )
+                    {
+                        genericsReport( V_ERROR, "Cannot create source" EOL );
+                        return false;
+                    }
+
+                    break;
+
+                    // ------------------------------------
+#ifdef WITH_FIFOS
+
+                case 't':
+                    fifoSetUseTPIU( src->f, true );
+                    break;
+#endif
+
+                // ------------------------------------
+                case 'T':
+                    src->recorderPattern = optarg;
+                    break;
+
+                // ------------------------------------
+                case 'u':
+                    src->usbTransfers = atoi( optarg );
+
+                    // See if we have an optional size too
+                    char *u = optarg;
+
+                    while ( ( *u ) && ( *u != DELIMITER ) )
+                    {
+                        u++;
+                    }
+
+                    if ( *u == DELIMITER )
+                    {
+                        src->usbTransferSize = atoi( ++u );
+                    }
+
+                    break;
+
+                // ------------------------------------
+                case 'v':
+                    genericsSetReportLevel( atoi( optarg ) );
+                    break;
+
+                    // ------------------------------------
+
+#ifdef WITH_FIFOS
+
+                case 'w':
+                    src->filewriter = true;
+                    src->fwbasedir = optarg;
+                    break;
+#endif
+
+                // ------------------------------------
+                case 'W':
+                    options.workers = atoi( optarg );
+                    break;
+
+                    // ------------------------------------
+#ifdef WITH_NWCLIENT
+
+                case 'z':
+                    src->zeroCopy = true;
+                    break;
+#endif
+
+                    // ------------------------------------
+#ifdef WITH_EVENTS
+
+                case 'x':
+                    src->eventPort = atoi( optarg );
+                    break;
+#endif
+
+                    // ------------------------------------
+
+#ifdef WITH_FIFOS
+
+                /* Individual channel setup */
+                case 'c':
+                    chanIndex = chanConfig = strdup( optarg );
+                    chan = atoi( optarg );
+
+                    if ( chan >= NUM_CHANNELS )
+                    {
+                        genericsReport( V_ERROR, "Channel index out of range" EOL );
+                        return false;
+                    }
+
+                    /* Scan for start of filename */
+                    while ( ( *chanIndex ) && ( *chanIndex != DELIMITER ) )
+                    {
+                        chanIndex++;
+                    }
+
+                    if ( !*chanIndex )
+                    {
+                        genericsReport( V_ERROR, "No filename for channel %d" EOL, chan );
+                        return false;
+                    }
+
+                    chanName = ++chanIndex;
+
+                    /* Scan for format */
+                    while ( ( *chanIndex ) && ( *chanIndex != DELIMITER ) )
+                    {
+                        chanIndex++;
+                    }
+
+                    if ( !*chanIndex )
+                    {
+                        genericsReport( V_WARN, "No output format for channel %d, output raw!" EOL, chan );
+                        fifoSetChannel( src->f, chan, chanName, NULL );
+                        break;
+                    }
+
+                    *chanIndex++ = 0;
+                    fifoSetChannel( src->f, chan, chanName, genericsUnescape( chanIndex ) );
+                    break;
+#endif
+
+                // ------------------------------------
+
+
+                case '?':
+                    if ( optopt == 'b' )
+                    {
+                        genericsReport( V_ERROR, "Option '%c' requires an argument." EOL, optopt );
+                    }
+                    else if ( !isprint ( optopt ) )
+                    {
+                        genericsReport( V_ERROR, "Unknown option character `\\x%x'." EOL, optopt );
+                    }
+
+                    return false;
+
+                // ------------------------------------
+                default:
+                    genericsReport( V_ERROR, "%c" EOL, c );
+                    return false;
+                    // ------------------------------------
+            }
+
+    /* Now perform sanity checks.... */
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
+    {
+        if ( !_checkSource( _r.s[n] ) )
+        {
+            if ( _r.numSources > 1 )
+            {
+                genericsReport( V_ERROR, "(for source %d)" EOL, n );
+            }
+
+            return false;
+        }
+
+        for ( uint32_t m = 0; m < n; m++ )
+        {
+            if ( !_checkSourcePair( _r.s[m], _r.s[n] ) )
+            {
+                return false;
+            }
+        }
+    }
+
+    if ( ( NUM_PROCESSORS ) && ( !options.workers ) )
+    {
+        genericsReport( V_ERROR, "Need at least one worker thread" EOL );
+        return false;
+    }
+
+    /* ... and dump the config if we're being verbose */
+    genericsReport( V_INFO, "Orbuculum V" VERSION " (Git %08X %s, Built " BUILD_DATE ")" EOL, GIT_HASH, ( GIT_DIRTY ? "Dirty" : "Clean" ) );
+
+    if ( options.intervalReportTime )
+    {
+        genericsReport( V_INFO, "Report Intv : %dmS" EOL, options.intervalReportTime );
+    }
+
+    if ( options.metricsPort )
+    {
+        genericsReport( V_INFO, "Metrics    : localhost:%d" EOL, options.metricsPort );
+    }
+
+    if ( _r.numSources > 1 )
+    {
+        genericsReport( V_INFO, "Workers    : %d" EOL, options.workers );
+    }
+
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
+    {
+        _reportSource( _r.s[n] );
+    }
+
+    return true;
+}
+// ====================================================================================================
+void *_checkInterval( void *params )
+
+/* Perform any interval reporting that may be needed, a line for each source */
+
+{
+    uint64_t snapInterval;
+    struct SPSCRingStats ringStats;
+    struct source *src;
+
+    while ( !_r.ending )
+    {
+        usleep( options.intervalReportTime * 1000 );
+
+        /* Back up over the lines from last time */
+        for ( uint32_t s = 0; s < _r.numSources; s++ )
+        {
+            genericsPrintf( C_PREV_LN );
+        }
+
+        for ( uint32_t s = 0; s < _r.numSources; s++ )
+        {
+            src = _r.s[s];
+
+            /* Grab the interval and scale to 1 second */
+            snapInterval = __atomic_exchange_n( &src->intervalBytes, 0, __ATOMIC_RELAXED ) * 1000 / options.intervalReportTime;
+
+            /* Async channel, so each byte is 10 bits */
+            snapInterval *= 10;
+            genericsPrintf( C_CLR_LN );
+
+            if ( _r.numSources > 1 )
+            {
+                genericsPrintf( "%2d: ", src->index );
+            }
+
+            genericsPrintf( C_YELLOW );
+
+            if ( snapInterval / 1000000 )
+            {
+                genericsPrintf( "%4d.%d " C_RESET "MBits/sec ", snapInterval / 1000000, ( snapInterval * 1 / 100000 ) % 10 );
+            }
+            else if ( snapInterval / 1000 )
+            {
+                genericsPrintf( "%4d.%d " C_RESET "KBits/sec ", snapInterval / 1000, ( snapInterval / 100 ) % 10 );
+            }
+            else
+            {
+                genericsPrintf( "  %4d " C_RESET " Bits/sec ", snapInterval );
+            }
+
+            if ( src->speed > 100 )
+            {
+                /* Conversion to percentage done as a division to avoid overflow */
+                uint32_t fullPercent = ( snapInterval * 100 ) / src->speed;
+                genericsPrintf( "(" C_YELLOW " %3d%% " C_RESET "full)", ( fullPercent > 100 ) ? 100 : fullPercent );
+            }
+
+#ifdef INCLUDE_FPGA_SUPPORT
+
+            if ( src->orbtrace )
+            {
+                uint64_t frames = __atomic_load_n( &src->fpga.frames, __ATOMIC_RELAXED ) - src->fpga.reportedFrames;
+                uint64_t dataFrames = __atomic_load_n( &src->fpga.dataFrames, __ATOMIC_RELAXED ) - src->fpga.reportedDataFrames;
+                uint64_t droppedFrames = __atomic_load_n( &src->fpga.droppedFrames, __ATOMIC_RELAXED ) - src->fpga.reportedDroppedFrames;
+                src->fpga.reportedFrames += frames;
+                src->fpga.reportedDataFrames += dataFrames;
+                src->fpga.reportedDroppedFrames += droppedFrames;
+
+                genericsPrintf( "(" C_YELLOW " %3d%% " C_RESET "frames full)", frames ? ( uint32_t )( ( dataFrames * 100 ) / frames ) : 0 );
+
+                if ( droppedFrames )
+                {
+                    genericsPrintf( " " C_LRED "%" PRIu64 " frames dropped" C_RESET, droppedFrames );
+                }
+            }
+
+#endif
+
+            /* Report anything that's been lost because a consumer couldn't keep up */
+            for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
+            {
+                SPSCRingGetStats( &src->p[n].r, &ringStats );
+
+                if ( ringStats.overrunBytes != src->p[n].reportedOverrunBytes )
+                {
+                    genericsPrintf( " " C_LRED "%s overrun %" PRIu64 " bytes" C_RESET, src->p[n].name, ringStats.overrunBytes - src->p[n].reportedOverrunBytes );
+                    src->p[n].reportedOverrunBytes = ringStats.overrunBytes;
+                }
+            }
 
-                    /* Scan for format */
-                    while ( ( *chanIndex ) && ( *chanIndex != DELIMITER ) )
-                    {
-                        chanIndex++;
-                    }
+#ifdef WITH_FIFOS
 
-                    if ( !*chanIndex )
-                    {
-                        genericsReport( V_WARN, "No output format for channel %d, output raw!" EOL, chan );
-                        fifoSetChannel( _r.f, chan, chanName, NULL );
-                        break;
-                    }
+            /* ...and anything the TPIU demux had nowhere to put */
+            if ( fifoGetUseTPIU( src->f ) )
+            {
+                uint32_t unrouted = fifoGetTPIUUnrouted( src->f );
+                uint32_t overflow = fifoGetTPIUOverflow( src->f );
+
+                if ( unrouted != src->reportedUnrouted )
+                {
+                    genericsPrintf( " " C_LRED "TPIU unrouted %" PRIu32 " bytes" C_RESET, unrouted - src->reportedUnrouted );
+                    src->reportedUnrouted = unrouted;
+                }
+
+                if ( overflow != src->reportedTPIUOverflow )
+                {
+                    genericsPrintf( " " C_LRED "TPIU overflow %" PRIu32 " bytes" C_RESET, overflow - src->reportedTPIUOverflow );
+                    src->reportedTPIUOverflow = overflow;
+                }
+            }
 
-                    *chanIndex++ = 0;
-                    fifoSetChannel( _r.f, chan, chanName, genericsUnescape( chanIndex ) );
-                    break;
 #endif
 
-                // ------------------------------------
+            genericsPrintf( C_RESET EOL );
+        }
+    }
 
+    return NULL;
+}
+// ====================================================================================================
+static void _metrics( struct metricsOut *o, void *param )
 
-                case '?':
-                    if ( optopt == 'b' )
-                    {
-                        genericsReport( V_ERROR, "Option '%c' requires an argument." EOL, optopt );
-                    }
-                    else if ( !isprint ( optopt ) )
-                    {
-                        genericsReport( V_ERROR, "Unknown option character `\\x%x'." EOL, optopt );
-                    }
+/* Collector for the metrics server, reporting on capture from a source and the processors fed from it */
 
-                    return false;
+{
+    struct source *src = ( struct source * )param;
+    struct SPSCRingStats ringStats;
+    char labels[NUM_PROCESSORS + 1][40];
 
-                // ------------------------------------
-                default:
-                    genericsReport( V_ERROR, "%c" EOL, c );
-                    return false;
-                    // ------------------------------------
-            }
+    metricsFamily( o, "orbuculum_capture_bytes_total", "counter", "Bytes received from the source" );
+    metricsValue( o, "orbuculum_capture_bytes_total", NULL, __atomic_load_n( &src->captureBytes, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_capture_blocks_total", "counter", "Blocks the source delivered them in" );
+    metricsValue( o, "orbuculum_capture_blocks_total", NULL, __atomic_load_n( &src->captureBlocks, __ATOMIC_RELAXED ) );
 
-#ifdef WITH_FIFOS
+#ifdef INCLUDE_FPGA_SUPPORT
 
-    /* Now perform sanity checks.... */
-    if ( fifoGetUseTPIU( _r.f ) && ( !fifoGettpiuITMChannel( _r.f ) ) )
+    if ( src->orbtrace )
     {
-        genericsReport( V_ERROR, "TPIU set for use but no channel set for ITM output" EOL );
-        return false;
+        metricsFamily( o, "orbuculum_fpga_frames_total", "counter", "Frames received from the FPGA" );
+        metricsValue( o, "orbuculum_fpga_frames_total", NULL, __atomic_load_n( &src->fpga.frames, __ATOMIC_RELAXED ) );
+        metricsFamily( o, "orbuculum_fpga_data_frames_total", "counter", "Frames received from the FPGA carrying data" );
+        metricsValue( o, "orbuculum_fpga_data_frames_total", NULL, __atomic_load_n( &src->fpga.dataFrames, __ATOMIC_RELAXED ) );
+        metricsFamily( o, "orbuculum_fpga_dropped_frames_total", "counter", "Frames from the FPGA known to have been lost" );
+        metricsValue( o, "orbuculum_fpga_dropped_frames_total", NULL, __atomic_load_n( &src->fpga.droppedFrames, __ATOMIC_RELAXED ) );
     }
 
 #endif
 
-#ifdef INCLUDE_FPGA_SUPPORT
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
+    {
+        snprintf( labels[n], sizeof( labels[n] ), "processor=\"%s\"", src->p[n].name );
+    }
 
-    if ( ( options.orbtrace ) && !( ( options.orbtraceWidth == 1 ) || ( options.orbtraceWidth == 2 ) || ( options.orbtraceWidth == 4 ) ) )
+    metricsFamily( o, "orbuculum_processed_bytes_total", "counter", "Bytes dealt with by each processor" );
+
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_ERROR, "Orbtrace interface illegal port width" EOL );
-        return false;
+        metricsValue( o, "orbuculum_processed_bytes_total", labels[n], __atomic_load_n( &src->p[n].bytes, __ATOMIC_RELAXED ) );
     }
 
-#endif
+    metricsFamily( o, "orbuculum_queue_bytes", "gauge", "Bytes waiting for each processor" );
 
-    /* ... and dump the config if we're being verbose */
-    genericsReport( V_INFO, "Orbuculum V" VERSION " (Git %08X %s, Built " BUILD_DATE ")" EOL, GIT_HASH, ( GIT_DIRTY ? "Dirty" : "Clean" ) );
-    IF_WITH_FIFOS( genericsReport( V_INFO, "BasePath   : %s" EOL, fifoGetChanPath( _r.f ) ) );
-    IF_WITH_FIFOS( genericsReport( V_INFO, "ForceSync  : %s" EOL, fifoGetForceITMSync( _r.f ) ? "true" : "false" ) );
-    IF_WITH_FIFOS( genericsReport( V_INFO, "Permafile  : %s" EOL, options.permafile ? "true" : "false" ) );
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
+    {
+        metricsValue( o, "orbuculum_queue_bytes", labels[n], SPSCRingUsed( &src->p[n].r ) );
+    }
 
-    if ( options.intervalReportTime )
+    metricsFamily( o, "orbuculum_queue_high_water_bytes", "gauge", "Most bytes that have been waiting for each processor" );
+
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_INFO, "Report Intv : %dmS" EOL, options.intervalReportTime );
+        SPSCRingGetStats( &src->p[n].r, &ringStats );
+        metricsValue( o, "orbuculum_queue_high_water_bytes", labels[n], ringStats.highWater );
     }
 
-    if ( options.port )
+    metricsFamily( o, "orbuculum_overruns_total", "counter", "Blocks lost because a processor couldn't keep up" );
+
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_INFO, "Serial Port : %s" EOL "Serial Speed: %d" EOL, options.port, options.speed );
+        SPSCRingGetStats( &src->p[n].r, &ringStats );
+        metricsValue( o, "orbuculum_overruns_total", labels[n], ringStats.overruns );
     }
 
-    if ( options.seggerPort )
+    metricsFamily( o, "orbuculum_overrun_bytes_total", "counter", "Bytes lost because a processor couldn't keep up" );
+
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_INFO, "SEGGER H&P : %s:%d" EOL, options.seggerHost, options.seggerPort );
+        SPSCRingGetStats( &src->p[n].r, &ringStats );
+        metricsValue( o, "orbuculum_overrun_bytes_total", labels[n], ringStats.overrunBytes );
     }
 
-#ifdef INCLUDE_FPGA_SUPPORT
+    metricsFamily( o, "orbuculum_process_seconds", "histogram", "Time taken by each processor to deal with a block" );
 
-    if ( options.orbtrace )
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_INFO, "Orbtrace   : %d bits width" EOL, options.orbtraceWidth );
+        metricsHistogram( o, "orbuculum_process_seconds", labels[n], &src->p[n].processTime );
     }
+}
+// ====================================================================================================
+#ifdef WITH_NWCLIENT
+static void _nwclientProcess( struct source *src, uint8_t *d, uint32_t len )
 
+{
+    nwclientSend( src->n, len, d );
+}
 #endif
+// ====================================================================================================
+#ifdef WITH_EVENTS
+static void _eventFlush( struct source *src )
 
-#ifdef WITH_FIFOS
+/* Send the frame of events built so far to the decoded event clients */
+
+{
+    const uint8_t *f;
+    uint32_t len = MSGStreamFrame( &src->es, &f );
 
-    if ( fifoGetUseTPIU( _r.f ) )
+    if ( len )
     {
-        genericsReport( V_INFO, "Using TPIU : true (ITM on channel %d)" EOL, fifoGettpiuITMChannel( _r.f ) );
+        nwclientSend( src->e, len, ( uint8_t * )f );
     }
-    else
+}
+// ====================================================================================================
+static void _eventMsg( struct msg *m, void *param )
+
+/* A message has been decoded by the fifo processing, add it to the frame for the event clients */
+
+{
+    struct source *src = ( struct source * )param;
+
+    if ( MSGStreamAdd( &src->es, m ) )
     {
-        genericsReport( V_INFO, "Using TPIU : false" EOL );
+        _eventFlush( src );
     }
+}
+#endif
+// ====================================================================================================
+#ifdef WITH_FIFOS
+static void _fifosProcess( struct source *src, uint8_t *d, uint32_t len )
+
+{
+    fifoProtocolPump( src->f, d, len );
 
+    /* Whatever events came out of this block go in one frame */
+    IF_WITH_EVENTS( if ( src->e ) _eventFlush( src ) );
+}
 #endif
+// ====================================================================================================
+static void _runProcessor( struct processor *p )
+
+/* Hand whatever captured data is waiting to a consumer */
 
-    if ( options.file )
+{
+    uint8_t *d;
+    uint32_t len;
+    uint64_t startTime;
+
+    if ( ( len = SPSCRingPeek( &p->r, &d, 0 ) ) )
     {
-        genericsReport( V_INFO, "Input File : %s", options.file );
+        startTime = metricsTimeUs();
+        p->process( p->src, d, len );
+        SPSCRingConsume( &p->r, len );
+        metricsHistogramAdd( &p->processTime, metricsTimeUs() - startTime );
+        __atomic_store_n( &p->bytes, p->bytes + len, __ATOMIC_RELAXED );
+    }
+}
+// ====================================================================================================
+static void *_runWorker( void *arg )
+
+/* Run the processors this worker looks after as data arrives for them, taking turns */
+
+{
+    struct worker *w = ( struct worker * )arg;
 
-        if ( options.fileTerminate )
+    while ( !_r.ending )
+    {
+        if ( SPSCWaiterWait( &w->w, w->r, w->n, PROCESS_WAIT ) )
         {
-            genericsReport( V_INFO, " (Terminate on exhaustion)" EOL );
+            for ( uint32_t n = 0; n < w->n; n++ )
+            {
+                _runProcessor( w->p[n] );
+            }
         }
-        else
+    }
+
+    return NULL;
+}
+// ====================================================================================================
+static bool _startProcessors( void )
+
+/* Set up the consumers of captured data, each with its own ring, and share them between the workers */
+
+{
+    uint32_t total = _r.numSources * NUM_PROCESSORS;
+    struct processor *p;
+    struct worker *w;
+
+    _r.numWorkers = ( options.workers < total ) ? options.workers : total;
+
+    if ( ( _r.numWorkers ) && ( !( _r.w = ( struct worker * )calloc( _r.numWorkers, sizeof( struct worker ) ) ) ) )
+    {
+        return false;
+    }
+
+    for ( uint32_t n = 0; n < _r.numWorkers; n++ )
+    {
+        w = &_r.w[n];
+        SPSCWaiterInit( &w->w );
+
+        /* Processors are dealt out in turn, so each worker gets this many of them at most */
+        w->p = ( struct processor ** )calloc( ( total + _r.numWorkers - 1 ) / _r.numWorkers, sizeof( struct processor * ) );
+        w->r = ( struct SPSCRing ** )calloc( ( total + _r.numWorkers - 1 ) / _r.numWorkers, sizeof( struct SPSCRing * ) );
+
+        if ( ( !w->p ) || ( !w->r ) )
         {
-            genericsReport( V_INFO, " (Ongoing read)" EOL );
+            return false;
         }
     }
 
-#ifdef WITH_FIFOS
-    genericsReport( V_INFO, "Channels   :" EOL );
+    for ( uint32_t s = 0; s < _r.numSources; s++ )
+    {
+        IF_WITH_NWCLIENT( _r.s[s]->p[PROC_NWCLIENT].name = "Network" );
+        IF_WITH_NWCLIENT( _r.s[s]->p[PROC_NWCLIENT].process = _nwclientProcess );
+        IF_WITH_FIFOS( _r.s[s]->p[PROC_FIFOS].name = "Fifos" );
+        IF_WITH_FIFOS( _r.s[s]->p[PROC_FIFOS].process = _fifosProcess );
 
-    for ( int g = 0; g < NUM_CHANNELS; g++ )
+        for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
+        {
+            p = &_r.s[s]->p[n];
+            p->src = _r.s[s];
+
+            if ( !SPSCRingInit( &p->r, PROCESS_RING_SIZE ) )
+            {
+                return false;
+            }
+
+            w = &_r.w[( s * NUM_PROCESSORS + n ) % _r.numWorkers];
+            SPSCRingSetWaiter( &p->r, &w->w );
+            w->p[w->n] = p;
+            w->r[w->n++] = &p->r;
+        }
+    }
+
+    for ( uint32_t n = 0; n < _r.numWorkers; n++ )
     {
-        if ( fifoGetChannelName( _r.f, g ) )
+        if ( pthread_create( &_r.w[n].thread, NULL, &_runWorker, &_r.w[n] ) )
         {
-            genericsReport( V_INFO, "         %02d [%s] [%s]" EOL, g, genericsEscape( fifoGetChannelFormat( _r.f, g ) ? : "RAW" ), fifoGetChannelName( _r.f, g ) );
+            return false;
         }
     }
 
-    genericsReport( V_INFO, "         HW [Predefined] [" HWFIFO_NAME "]" EOL );
-#endif
+    return true;
+}
+// ====================================================================================================
+static void _waitForProcessors( struct source *src, uint32_t s )
 
-    if ( ( options.file ) && ( ( options.port ) || ( options.seggerPort ) ) )
+/* Wait until every consumer of a source has room for s bytes, for sources that can wait (i.e. files) */
+
+{
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_ERROR, "Cannot specify file and port or Segger at same time" EOL );
-        return false;
+        while ( ( SPSCRingSpace( &src->p[n].r ) < s ) && ( !_r.ending ) )
+        {
+            usleep( 1000 );
+        }
     }
+}
+// ====================================================================================================
+static void _drainProcessors( struct source *src )
 
-    if ( ( options.port ) && ( options.seggerPort ) )
+/* Wait until every consumer of a source has dealt with everything it's been given */
+
+{
+    for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
     {
-        genericsReport( V_ERROR, "Cannot specify port and Segger at same time" EOL );
-        return false;
+        while ( ( SPSCRingUsed( &src->p[n].r ) ) && ( !_r.ending ) )
+        {
+            usleep( 1000 );
+        }
     }
+}
+// ====================================================================================================
+static void _processBlock( struct source *src, int s, unsigned char *cbw )
 
-    return true;
+/* Generic block processor for received data. This runs on the capture thread so it never */
+/* waits; if a consumer has fallen so far behind that its ring is full then it loses this */
+/* block, and that's accounted as an overrun.                                             */
+
+{
+    genericsReport( V_DEBUG, "RXED Packet of %d bytes" EOL, s );
+
+    if ( ( src->rec ) && ( s ) )
+    {
+        recorderWrite( src->rec, cbw, s );
+    }
+
+    /* Account for this reception */
+    __atomic_fetch_add( &src->intervalBytes, s, __ATOMIC_RELAXED );
+    __atomic_store_n( &src->captureBytes, src->captureBytes + s, __ATOMIC_RELAXED );
+    __atomic_store_n( &src->captureBlocks, src->captureBlocks + 1, __ATOMIC_RELAXED );
+
+    if ( s )
+    {
+        for ( uint32_t n = 0; n < NUM_PROCESSORS; n++ )
+        {
+            SPSCRingWrite( &src->p[n].r, cbw, s );
+        }
+    }
 }
 // ====================================================================================================
-void *_checkInterval( void *params )
+static void LIBUSB_CALL _usbTransferCB( struct libusb_transfer *t )
 
-/* Perform any interval reporting that may be needed */
+/* A transfer has completed (or failed, or been cancelled), queue it for processing */
 
 {
-    uint64_t snapInterval;
+    struct usbCapture *u = ( struct usbCapture * )t->user_data;
 
-    while ( !_r.ending )
+    pthread_mutex_lock( &u->lock );
+    u->inFlight--;
+
+    if ( ( t->status != LIBUSB_TRANSFER_COMPLETED ) && ( t->status != LIBUSB_TRANSFER_TIMED_OUT ) )
     {
-        usleep( options.intervalReportTime * 1000 );
+        /* ...only the first failure is interesting, the rest follow from it */
+        if ( ( t->status != LIBUSB_TRANSFER_CANCELLED ) && ( !u->failed ) )
+        {
+            genericsReport( V_INFO, "USB data collection failed with status %d" EOL, t->status );
+        }
+
+        u->failed = true;
+    }
+
+    u->done[u->dwp] = t;
+    u->dwp = ( u->dwp + 1 ) % ( u->transfers + 1 );
+    pthread_cond_signal( &u->cond );
+    pthread_mutex_unlock( &u->lock );
+}
+// ====================================================================================================
+static void *_usbEvents( void *arg )
+
+/* Keep libusb going, which is where transfer completions get delivered */
+
+{
+    struct usbEvents *e = ( struct usbEvents * )arg;
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+
+    while ( !e->exit )
+    {
+        libusb_handle_events_timeout_completed( e->ctx, &tv, NULL );
+    }
+
+    return NULL;
+}
+// ====================================================================================================
+static bool _usbSubmit( struct usbCapture *u, struct libusb_transfer *t )
+
+/* Hand a transfer to libusb, accounting for it as in flight before the callback could happen */
+
+{
+    pthread_mutex_lock( &u->lock );
+    u->inFlight++;
+    pthread_mutex_unlock( &u->lock );
+
+    if ( libusb_submit_transfer( t ) == LIBUSB_SUCCESS )
+    {
+        return true;
+    }
+
+    pthread_mutex_lock( &u->lock );
+    u->inFlight--;
+    u->failed = true;
+    pthread_mutex_unlock( &u->lock );
+    return false;
+}
+// ====================================================================================================
+static struct libusb_transfer *_usbNextDone( struct usbCapture *u, bool *failed )
+
+/* Wait for the next completed transfer. Returns NULL if there's nothing left to wait for */
+
+{
+    struct libusb_transfer *t = NULL;
+
+    pthread_mutex_lock( &u->lock );
+
+    while ( ( u->drp == u->dwp ) && ( u->inFlight ) )
+    {
+        pthread_cond_wait( &u->cond, &u->lock );
+    }
+
+    if ( u->drp != u->dwp )
+    {
+        t = u->done[u->drp];
+        u->drp = ( u->drp + 1 ) % ( u->transfers + 1 );
+    }
+
+    *failed = u->failed;
+    pthread_mutex_unlock( &u->lock );
+    return t;
+}
+// ====================================================================================================
+static void _usbCapture( struct source *src, libusb_context *ctx, bool sharedEvents, libusb_device_handle *handle,
+                         unsigned char endpoint, usbHandler handler, void *param )
+
+/* Collect data from the device, keeping transfers queued to it, until it fails. If ctx doesn't */
+/* have its events handled elsewhere (sharedEvents) then that's done here while capturing.     */
+
+{
+    struct usbCapture u = { .transfers = src->usbTransfers, .events = { .ctx = ctx } };
+    struct libusb_transfer *t;
+    uint32_t n;
+    bool failed = false;
+
+    u.t = ( struct libusb_transfer ** )calloc( u.transfers, sizeof( struct libusb_transfer * ) );
+    u.done = ( struct libusb_transfer ** )calloc( u.transfers + 1, sizeof( struct libusb_transfer * ) );
+    failed = ( !u.t ) || ( !u.done );
+
+    for ( n = 0; ( n < u.transfers ) && ( !failed ); n++ )
+    {
+        if ( ( !( u.t[n] = libusb_alloc_transfer( 0 ) ) ) || ( !( u.t[n]->buffer = ( unsigned char * )malloc( src->usbTransferSize ) ) ) )
+        {
+            failed = true;
+            break;
+        }
 
-        /* Grab the interval and scale to 1 second */
-        snapInterval = _r.intervalBytes * 1000 / options.intervalReportTime;
-        _r.intervalBytes = 0;
+        libusb_fill_bulk_transfer( u.t[n], handle, endpoint, u.t[n]->buffer, src->usbTransferSize, _usbTransferCB, &u, USB_TIMEOUT );
+    }
 
-        /* Async channel, so each byte is 10 bits */
-        snapInterval *= 10;
-        genericsPrintf( C_PREV_LN C_CLR_LN C_YELLOW );
+    pthread_mutex_init( &u.lock, NULL );
+    pthread_cond_init( &u.cond, NULL );
 
-        if ( snapInterval / 1000000 )
+    if ( ( failed ) || ( ( !sharedEvents ) && ( pthread_create( &u.events.thread, NULL, &_usbEvents, &u.events ) ) ) )
+    {
+        genericsReport( V_ERROR, "Failed to start USB capture" EOL );
+    }
+    else
+    {
+        /* Get all of the transfers queued to the device... */
+        for ( n = 0; n < u.transfers; n++ )
         {
-            genericsPrintf( "%4d.%d " C_RESET "MBits/sec ", snapInterval / 1000000, ( snapInterval * 1 / 100000 ) % 10 );
+            if ( !_usbSubmit( &u, u.t[n] ) )
+            {
+                break;
+            }
         }
-        else if ( snapInterval / 1000 )
+
+        genericsReport( V_INFO, "USB Interface claimed, ready for data" EOL );
+
+        /* ...then process them as they complete, handing each one straight back again */
+        while ( ( t = _usbNextDone( &u, &failed ) ) )
         {
-            genericsPrintf( "%4d.%d " C_RESET "KBits/sec ", snapInterval / 1000, ( snapInterval / 100 ) % 10 );
+            if ( ( !handler( t, !failed, param ) ) || ( failed ) || ( !_usbSubmit( &u, t ) ) )
+            {
+                break;
+            }
         }
-        else
+
+        /* Something went wrong, so retrieve everything that's still out there */
+        for ( n = 0; n < u.transfers; n++ )
+        {
+            libusb_cancel_transfer( u.t[n] );
+        }
+
+        while ( ( t = _usbNextDone( &u, &failed ) ) )
         {
-            genericsPrintf( "  %4d " C_RESET " Bits/sec ", snapInterval );
+            /* ...including anything they'd collected before they went */
+            handler( t, false, param );
         }
 
-        if ( options.speed > 100 )
+        if ( !sharedEvents )
+        {
+            u.events.exit = true;
+            pthread_join( u.events.thread, NULL );
+        }
+    }
+
+    for ( n = 0; ( u.t ) && ( n < u.transfers ); n++ )
+    {
+        if ( u.t[n] )
         {
-            /* Conversion to percentage done as a division to avoid overflow */
-            uint32_t fullPercent = ( snapInterval * 100 ) / options.speed;
-            genericsPrintf( "(" C_YELLOW " %3d%% " C_RESET "full)", ( fullPercent > 100 ) ? 100 : fullPercent );
+            free( u.t[n]->buffer );
+            libusb_free_transfer( u.t[n] );
         }
+    }
+
+    free( u.t );
+    free( u.done );
+    pthread_cond_destroy( &u.cond );
+    pthread_mutex_destroy( &u.lock );
+}
+// ====================================================================================================
+static bool _usbHandler( struct libusb_transfer *t, bool live, void *param )
+
+/* Data from the probe goes straight out for processing */
+
+{
+    ( void )live;
 
-        genericsPrintf( C_RESET EOL );
+    if ( t->actual_length )
+    {
+        _processBlock( ( struct source * )param, t->actual_length, t->buffer );
     }
 
-    return NULL;
+    return true;
 }
 // ====================================================================================================
-static void _processBlock( int s, unsigned char *cbw )
+static libusb_device_handle *_usbOpen( libusb_context *ctx, uint16_t vid, uint16_t pid, const char *serial )
 
-/* Generic block processor for received data */
+/* Open a device with this vid and pid, and serial number if one is given. Returns NULL if there isn't one */
 
 {
-    genericsReport( V_DEBUG, "RXED Packet of %d bytes" EOL, s );
+    libusb_device **list;
+    libusb_device_handle *handle = NULL;
+    struct libusb_device_descriptor desc;
+    unsigned char s[256];
+    ssize_t n;
 
-    /* Account for this reception */
-    _r.intervalBytes += s;
+    if ( !serial )
+    {
+        return libusb_open_device_with_vid_pid( ctx, vid, pid );
+    }
 
-    if ( s )
+    if ( ( n = libusb_get_device_list( ctx, &list ) ) < 0 )
     {
-        IF_WITH_NWCLIENT( nwclientSend( _r.n, s, cbw ) );
-#ifdef WITH_FIFOS
-        unsigned char *c = cbw;
+        return NULL;
+    }
+
+    for ( ssize_t i = 0; ( i < n ) && ( !handle ); i++ )
+    {
+        if ( ( libusb_get_device_descriptor( list[i], &desc ) < 0 ) || ( desc.idVendor != vid ) || ( desc.idProduct != pid ) ||
+                ( libusb_open( list[i], &handle ) < 0 ) )
+        {
+            handle = NULL;
+            continue;
+        }
 
-        while ( s-- )
+        /* It's the right sort of device, but is it the right one? */
+        if ( ( libusb_get_string_descriptor_ascii( handle, desc.iSerialNumber, s, sizeof( s ) ) < 0 ) || ( strcmp( ( char * )s, serial ) ) )
         {
-            fifoProtocolPump( _r.f, *c++ );
+            libusb_close( handle );
+            handle = NULL;
         }
     }
 
-#endif
+    libusb_free_device_list( list, 1 );
+    return handle;
 }
 // ====================================================================================================
-int usbFeeder( void )
+int usbFeeder( struct source *src )
 
 {
-    unsigned char cbw[TRANSFER_SIZE];
     libusb_device_handle *handle;
     libusb_device *dev;
-    int size;
     int32_t err;
 
     while ( 1 )
     {
-        if ( libusb_init( NULL ) < 0 )
-        {
-            genericsReport( V_ERROR, "Failed to initalise USB interface" EOL );
-            return ( -1 );
-        }
-
         genericsReport( V_INFO, "Opening USB Device" EOL );
 
         /* Snooze waiting for the device to appear .... this is useful for when they come and go */
-        while ( !( handle = libusb_open_device_with_vid_pid( NULL, VID, PID ) ) )
+        while ( !( handle = _usbOpen( _r.usb.ctx, VID, PID, src->serial ) ) )
         {
             usleep( 500000 );
         }
@@ -791,25 +1976,7 @@ int usbFeeder( void )
             return 0;
         }
 
-        int32_t r;
-
-        genericsReport( V_INFO, "USB Interface claimed, ready for data" EOL );
-
-        while ( true )
-        {
-            r = libusb_bulk_transfer( handle, ENDPOINT, cbw, TRANSFER_SIZE, &size, 10 );
-
-            if ( ( r < 0 ) && ( r != LIBUSB_ERROR_TIMEOUT ) )
-            {
-                genericsReport( V_INFO, "USB data collection failed with error %d" EOL, r );
-                break;
-            }
-
-            if ( size )
-            {
-                _processBlock( size, cbw );
-            }
-        }
+        _usbCapture( src, _r.usb.ctx, true, handle, ENDPOINT, _usbHandler, src );
 
         libusb_close( handle );
         genericsReport( V_INFO, "USB Interface closed" EOL );
@@ -818,7 +1985,7 @@ int usbFeeder( void )
     return 0;
 }
 // ====================================================================================================
-int seggerFeeder( void )
+int seggerFeeder( struct source *src )
 
 {
     int sockfd;
@@ -830,7 +1997,7 @@ int seggerFeeder( void )
     int flag = 1;
 
     bzero( ( char * ) &serv_addr, sizeof( serv_addr ) );
-    server = gethostbyname( options.seggerHost );
+    server = gethostbyname( src->seggerHost );
 
     if ( !server )
     {
@@ -842,7 +2009,7 @@ int seggerFeeder( void )
     bcopy( ( char * )server->h_addr,
            ( char * )&serv_addr.sin_addr.s_addr,
            server->h_length );
-    serv_addr.sin_port = htons( options.seggerPort );
+    serv_addr.sin_port = htons( src->seggerPort );
 
     while ( 1 )
     {
@@ -862,11 +2029,11 @@ int seggerFeeder( void )
 
         genericsReport( V_INFO, "Established Segger Link" EOL );
 
-        IF_WITH_FIFOS( fifoForceSync( _r.f, true ) );
+        IF_WITH_FIFOS( fifoForceSync( src->f, true ) );
 
         while ( ( t = read( sockfd, cbw, TRANSFER_SIZE ) ) > 0 )
         {
-            _processBlock( t, cbw );
+            _processBlock( src, t, cbw );
         }
 
         close( sockfd );
@@ -877,7 +2044,7 @@ int seggerFeeder( void )
     return -2;
 }
 // ====================================================================================================
-int serialFeeder( void )
+int serialFeeder( struct source *src )
 {
     int f, ret;
     unsigned char cbw[TRANSFER_SIZE];
@@ -888,9 +2055,9 @@ int serialFeeder( void )
 #ifdef OSX
         int flags;
 
-        while ( ( f = open( options.port, O_RDONLY | O_NONBLOCK ) ) < 0 )
+        while ( ( f = open( src->port, O_RDONLY | O_NONBLOCK ) ) < 0 )
 #else
-        while ( ( f = open( options.port, O_RDONLY ) ) < 0 )
+        while ( ( f = open( src->port, O_RDONLY ) ) < 0 )
 #endif
         {
             genericsReport( V_WARN, "Can't open serial port" EOL );
@@ -916,14 +2083,14 @@ int serialFeeder( void )
 
 #endif
 
-        if ( ( ret = _setSerialConfig ( f, options.speed ) ) < 0 )
+        if ( ( ret = _setSerialConfig ( f, src->speed ) ) < 0 )
         {
             genericsExit( ret, "setSerialConfig failed" EOL );
         }
 
         while ( ( t = read( f, cbw, TRANSFER_SIZE ) ) > 0 )
         {
-            _processBlock( t, cbw );
+            _processBlock( src, t, cbw );
         }
 
         genericsReport( V_INFO, "Read failed" EOL );
@@ -934,119 +2101,278 @@ int serialFeeder( void )
 // ====================================================================================================
 #ifdef INCLUDE_FPGA_SUPPORT
 
-int fpgaFeeder( void )
+static uint32_t _fpgaRun( struct fpgaStream *s, const uint8_t *f, uint32_t frames, uint8_t **d )
+
+/* Compact a run of whole frames into d, dealing with anything that stops the compactor. Returns */
+/* the number of bytes used, which is one past the start of the run if it's not aligned.       */
+
+{
+    uint32_t done = 0;
+    uint32_t n;
+    uint32_t dataFrames;
+
+    while ( done < frames )
+    {
+        n = FPGAFramesCompact( &f[done * FTDI_PACKET_SIZE], frames - done, s->hdr, *d, &dataFrames );
+        *d += dataFrames * FPGA_PAYLOAD_LEN;
+        __atomic_store_n( &s->frames, s->frames + n, __ATOMIC_RELAXED );
+        __atomic_store_n( &s->dataFrames, s->dataFrames + dataFrames, __ATOMIC_RELAXED );
+
+        if ( ( n ) && ( !s->aligned ) )
+        {
+            genericsReport( V_WARN, "FPGA frame alignment regained after %d bytes" EOL, s->slipped );
+            s->aligned = true;
+            s->slipped = 0;
+        }
+
+        done += n;
+
+        if ( done == frames )
+        {
+            break;
+        }
+
+        if ( ( f[done * FTDI_PACKET_SIZE] ^ s->hdr ) & ( FPGA_HDR_FIXED | FPGA_HDR_WIDTH ) )
+        {
+            /* This can't be a frame, so the caller needs to try again one byte further on */
+            if ( s->aligned )
+            {
+                genericsReport( V_WARN, "Lost FPGA frame alignment" EOL );
+                s->aligned = false;
+            }
+
+            /* Every frame's worth of bytes thrown away is a frame lost */
+            if ( !( s->slipped++ % FTDI_PACKET_SIZE ) )
+            {
+                __atomic_store_n( &s->droppedFrames, s->droppedFrames + 1, __ATOMIC_RELAXED );
+            }
+
+            return done * FTDI_PACKET_SIZE + 1;
+        }
+
+        /* Only the sync flag changed. Trace is lost while the FPGA is out of sync with the */
+        /* target, so note when that happens.                                               */
+        s->hdr ^= FPGA_HDR_SYNC;
+        genericsReport( V_WARN, "FPGA %s trace port sync" EOL, ( s->hdr & FPGA_HDR_SYNC ) ? "regained" : "lost" );
+    }
+
+    return done * FTDI_PACKET_SIZE;
+}
+// ====================================================================================================
+static uint8_t *_fpgaFrames( struct fpgaStream *s, uint8_t *c, uint32_t len, uint8_t *d )
+
+/* Pull frames out of the stream, compacting their payload into d. Returns the end of the payload */
+
+{
+    uint32_t n;
+
+    s->received += len;
+
+    while ( len )
+    {
+        if ( ( s->framePos ) || ( len < FTDI_PACKET_SIZE ) )
+        {
+            /* Frames don't respect USB packets, so one that's split is collected up before use */
+            n = ( len < FTDI_PACKET_SIZE - s->framePos ) ? len : FTDI_PACKET_SIZE - s->framePos;
+            memcpy( &s->frame[s->framePos], c, n );
+            s->framePos += n;
+            c += n;
+            len -= n;
+
+            if ( s->framePos < FTDI_PACKET_SIZE )
+            {
+                break;
+            }
+
+            if ( _fpgaRun( s, s->frame, 1, &d ) == FTDI_PACKET_SIZE )
+            {
+                s->framePos = 0;
+            }
+            else
+            {
+                /* Try again one byte further on */
+                memmove( s->frame, &s->frame[1], FTDI_PACKET_SIZE - 1 );
+                s->framePos = FTDI_PACKET_SIZE - 1;
+            }
+        }
+        else
+        {
+            /* Runs of whole frames are compacted where they are */
+            n = _fpgaRun( s, c, len / FTDI_PACKET_SIZE, &d );
+            c += n;
+            len -= n;
+        }
+    }
+
+    return d;
+}
+// ====================================================================================================
+static bool _fpgaQueueReads( struct source *src )
+
+/* Keep enough reads queued to the FTDI that the SPI link is never waiting for the host */
+
+{
+    struct fpgaStream *s = &src->fpga;
+
+    while ( ( !s->failed ) && ( s->requested - s->received <= ( FPGA_READS_QUEUED - 1 ) * FTDI_HS_TRANSFER_SIZE ) )
+    {
+        if ( ftdispi_stream_read( &src->ftdifsc, FTDI_HS_TRANSFER_SIZE ) < 0 )
+        {
+            genericsReport( V_WARN, "Cannot queue read (%s)" EOL, ftdi_get_error_string( &src->ftdifsc.fc ) );
+            s->failed = true;
+        }
+        else
+        {
+            s->requested += FTDI_HS_TRANSFER_SIZE;
+        }
+    }
+
+    return !s->failed;
+}
+// ====================================================================================================
+static bool _fpgaHandler( struct libusb_transfer *t, bool live, void *param )
+
+/* Handle a transfer from the FTDI, passing on the frame payloads it carries */
+
+{
+    struct source *src = ( struct source * )param;
+    struct fpgaStream *s = &src->fpga;
+    uint8_t *d = s->payload;
+    uint32_t len;
+
+    /* Every USB packet starts with the FTDI modem status, which isn't part of the stream */
+    for ( uint32_t p = 0; p < ( uint32_t )t->actual_length; p += s->packetSize )
+    {
+        len = ( t->actual_length - p < s->packetSize ) ? t->actual_length - p : s->packetSize;
+
+        if ( len > FTDI_STATUS_BYTES )
+        {
+            d = _fpgaFrames( s, &t->buffer[p + FTDI_STATUS_BYTES], len - FTDI_STATUS_BYTES, d );
+        }
+    }
+
+#ifdef DUMP_FTDI_BYTES
+
+    for ( uint8_t *e = s->payload; e < d; e++ )
+    {
+        printf( "%02X%s", *e, ( ( e - s->payload ) % FPGA_PAYLOAD_LEN == FPGA_PAYLOAD_LEN - 1 ) ? "\n" : " " );
+    }
+
+#endif
+    _processBlock( src, d - s->payload, s->payload );
+
+    if ( ( !live ) || ( _r.feederExit ) )
+    {
+        return false;
+    }
+
+    return _fpgaQueueReads( src );
+}
+// ====================================================================================================
+int fpgaFeeder( struct source *src )
 
 {
     int f;
-    int t = 0;
-    uint8_t cbw[FTDI_HS_TRANSFER_SIZE];
-    uint8_t scratchBuffer[FTDI_HS_TRANSFER_SIZE - FTDI_NUM_FRAMES];
-    uint8_t *c;
-    uint8_t *d;
+    uint64_t lost;
     uint8_t initSequence[] = {0xA5, 0xAC};
 
     // Insert appropriate control byte to set port width for trace
     initSequence[1] = ( char[] )
     {
         0xA0, 0xA4, 0xAC, 0xAC
-    }[options.orbtraceWidth - 1];
+    }[src->orbtraceWidth - 1];
+
+    // ...which is what comes back in the header of every frame
+    src->fpga.hdr = ( initSequence[1] & 0x0C ) >> 1;
+
+    // Payload from a transfer can never be bigger than the transfer itself
+    if ( !( src->fpga.payload = ( uint8_t * )malloc( src->usbTransferSize ) ) )
+    {
+        genericsReport( V_ERROR, "Cannot allocate FPGA buffer" EOL );
+        return -2;
+    }
 
     // FTDI Chip takes a little while to reset itself
     // usleep( 400000 );
 
-    _r.feederExit = false;
-
     while ( !_r.feederExit )
     {
-        _r.ftdi = ftdi_new();
-        ftdi_set_interface( _r.ftdi, FTDI_INTERFACE );
+        src->ftdi = ftdi_new();
+        ftdi_set_interface( src->ftdi, FTDI_INTERFACE );
 
         do
         {
-            f = ftdi_usb_open( _r.ftdi, FTDI_VID, FTDI_PID );
+            f = ftdi_usb_open_desc( src->ftdi, FTDI_VID, FTDI_PID, NULL, src->serial );
 
             if ( f < 0 )
             {
-                genericsReport( V_WARN, "Cannot open device (%s)" EOL, ftdi_get_error_string( _r.ftdi ) );
+                genericsReport( V_WARN, "Cannot open device (%s)" EOL, ftdi_get_error_string( src->ftdi ) );
                 usleep( 50000 );
             }
         }
         while ( ( f < 0 ) && ( !_r.feederExit ) );
 
         genericsReport( V_INFO, "Port opened" EOL );
-        f = ftdispi_open( &_r.ftdifsc, _r.ftdi, FTDI_INTERFACE );
+        f = ftdispi_open( &src->ftdifsc, src->ftdi, FTDI_INTERFACE );
 
         if ( f < 0 )
         {
-            genericsReport( V_ERROR, "Cannot open spi %d (%s)" EOL, f, ftdi_get_error_string( _r.ftdi ) );
+            genericsReport( V_ERROR, "Cannot open spi %d (%s)" EOL, f, ftdi_get_error_string( src->ftdi ) );
             return -2;
         }
 
-        ftdispi_setmode( &_r.ftdifsc, 1, 0, 1, 0, 0, FPGA_AWAKE );
+        ftdispi_setmode( &src->ftdifsc, 1, 0, 1, 0, 0, FPGA_AWAKE );
 
-        ftdispi_setloopback( &_r.ftdifsc, 0 );
+        ftdispi_setloopback( &src->ftdifsc, 0 );
 
-        f = ftdispi_setclock( &_r.ftdifsc, FTDI_INTERFACE_SPEED );
+        f = ftdispi_setclock( &src->ftdifsc, FTDI_INTERFACE_SPEED );
 
         if ( f < 0 )
         {
-            genericsReport( V_ERROR, "Cannot set clockrate %d %d (%s)" EOL, f, FTDI_INTERFACE_SPEED, ftdi_get_error_string( _r.ftdi ) );
+            genericsReport( V_ERROR, "Cannot set clockrate %d %d (%s)" EOL, f, FTDI_INTERFACE_SPEED, ftdi_get_error_string( src->ftdi ) );
             return -2;
         }
 
         genericsReport( V_INFO, "All parameters configured" EOL );
 
-        IF_WITH_FIFOS( fifoForceSync( _r.f, true ) );
+        IF_WITH_FIFOS( fifoForceSync( src->f, true ) );
+
+        /* Fresh stream, which starts aligned to a frame */
+        src->fpga.packetSize = src->ftdifsc.fc.max_packet_size ? src->ftdifsc.fc.max_packet_size : USB_PACKET_SIZE;
+        src->fpga.framePos = 0;
+        src->fpga.requested = src->fpga.received = 0;
+        src->fpga.failed = false;
+        src->fpga.hdr |= FPGA_HDR_SYNC;
+        src->fpga.aligned = true;
+        src->fpga.slipped = 0;
 
-        while ( ( !_r.feederExit ) && ( ( t = ftdispi_write_read( &_r.ftdifsc, initSequence, 2, cbw, FTDI_HS_TRANSFER_SIZE, FPGA_AWAKE ) ) >= 0 ) )
+        /* Reads are queued as soon as the stream starts, the FTDI holds their data until it's collected */
+        if ( ( ftdispi_stream_start( &src->ftdifsc, initSequence, 2, FPGA_AWAKE ) < 0 ) || ( !_fpgaQueueReads( src ) ) )
+        {
+            genericsReport( V_WARN, "Cannot start stream (%s)" EOL, ftdi_get_error_string( &src->ftdifsc.fc ) );
+        }
+        else
         {
-            c = cbw;
-            d = scratchBuffer;
+            _usbCapture( src, src->ftdifsc.fc.usb_ctx, false, src->ftdifsc.fc.usb_dev, src->ftdifsc.fc.in_ep, _fpgaHandler, src );
 
-            for ( f = 0; f < FTDI_NUM_FRAMES; f++ )
+            /* If the link went down then whatever it hadn't delivered is gone */
+            if ( ( !_r.feederExit ) && ( src->fpga.requested > src->fpga.received ) )
             {
-                if ( ( *c ) & 0x80 )
-                {
-                    // This frame has no useful data
-                    c += FTDI_PACKET_SIZE;
-                    continue;
-                }
-                else
-                {
-                    // This frame contains something - copy and feed it, excluding header byte
-                    memcpy( d, &c[1], FTDI_PACKET_SIZE - 1 );
-                    d += FTDI_PACKET_SIZE - 1;
-
-                    for ( uint32_t e = 1; e < FTDI_PACKET_SIZE; e++ )
-                    {
-#ifdef DUMP_FTDI_BYTES
-                        printf( "%02X ", c[e] );
-#endif
-                        IF_WITH_FIFOS( fifoProtocolPump( _r.f, c[e] ) );
-                    }
-
-                    c += FTDI_PACKET_SIZE;
-#ifdef DUMP_FTDI_BYTES
-                    printf( "\n" );
-#endif
-                }
+                lost = ( src->fpga.requested - src->fpga.received ) / FTDI_PACKET_SIZE;
+                __atomic_store_n( &src->fpga.droppedFrames, src->fpga.droppedFrames + lost, __ATOMIC_RELAXED );
+                genericsReport( V_WARN, "Stream failed, %" PRIu64 " frames lost" EOL, lost );
             }
 
-            genericsReport( V_WARN, "RXED frame of %d/%d full packets (%3d%%)    \r",
-                            ( d - scratchBuffer ) / ( FTDI_PACKET_SIZE - 1 ), FTDI_NUM_FRAMES, ( ( d - scratchBuffer ) * 100 ) / ( FTDI_HS_TRANSFER_SIZE - FTDI_NUM_FRAMES ) );
-
-            if ( d - scratchBuffer )
-            {
-                IF_WITH_NWCLIENT( nwclientSend( _r.n, ( d - scratchBuffer ), scratchBuffer ) );
-            }
+            ftdispi_stream_stop( &src->ftdifsc );
         }
 
-        genericsReport( V_WARN, "Exit Requested (%d, %s)" EOL, t, ftdi_get_error_string( _r.ftdi ) );
+        genericsReport( V_WARN, "Exit Requested (%s)" EOL, ftdi_get_error_string( src->ftdi ) );
 
-        ftdispi_setgpo( &_r.ftdifsc, FPGA_ASLEEP );
-        ftdispi_close( &_r.ftdifsc, 1 );
+        ftdispi_setgpo( &src->ftdifsc, FPGA_ASLEEP );
+        ftdispi_close( &src->ftdifsc, 1 );
     }
 
+    free( src->fpga.payload );
     return 0;
 }
 
@@ -1059,53 +2385,99 @@ void fpgaFeederClose( int dummy )
 }
 #endif
 // ====================================================================================================
-int fileFeeder( void )
+int fileFeeder( struct source *src )
 
 {
-    int f;
-    unsigned char cbw[TRANSFER_SIZE];
-    ssize_t t;
+    struct FileSource f;
+    const uint8_t *d;
+    int32_t t;
 
-    if ( ( f = open( options.file, O_RDONLY ) ) < 0 )
+    if ( !FileSourceOpen( &f, src->file, !src->fileTerminate, src->fileRate ) )
     {
-        genericsExit( -4, "Can't open file %s" EOL, options.file );
+        genericsExit( -4, "Can't open file %s" EOL, src->file );
     }
 
-    while ( ( t = read( f, cbw, TRANSFER_SIZE ) ) >= 0 )
+    while ( ( t = FileSourceGet( &f, &d, FILE_BLOCK ) ) > 0 )
     {
-
-        if ( !t )
-        {
-            if ( options.fileTerminate )
-            {
-                break;
-            }
-            else
-            {
-                // Just spin for a while to avoid clogging the CPU
-                usleep( 100000 );
-                continue;
-            }
-        }
-
-        _processBlock( t, cbw );
+        /* A file can wait for processing to catch up, so nothing gets dropped */
+        _waitForProcessors( src, t );
+        _processBlock( src, t, ( uint8_t * )d );
     }
 
-    if ( !options.fileTerminate )
+    /* Let everything that's been read get processed before we go */
+    _drainProcessors( src );
+
+    if ( t < 0 )
     {
         genericsReport( V_INFO, "File read error" EOL );
     }
 
-    close( f );
+    FileSourceClose( &f );
     return true;
 }
 // ====================================================================================================
+static void *_runFeeder( void *arg )
+
+/* Capture from a source, using whichever feeder suits it, until that's finished */
+
+{
+    struct source *src = ( struct source * )arg;
+
+#ifdef INCLUDE_FPGA_SUPPORT
+
+    if ( src->orbtrace )
+    {
+        src->feederResult = fpgaFeeder( src );
+    }
+    else
+#endif
+        if ( src->seggerPort )
+        {
+            src->feederResult = seggerFeeder( src );
+        }
+        else if ( src->port )
+        {
+            src->feederResult = serialFeeder( src );
+        }
+        else if ( src->file )
+        {
+            src->feederResult = fileFeeder( src );
+        }
+        else
+        {
+            src->feederResult = usbFeeder( src );
+        }
+
+    return NULL;
+}
+// ====================================================================================================
+#ifdef WITH_FIFOS
+static void _recorderSyncLoss( void *param )
+
+/* The decoders for a source lost sync, which is worth a look at what led up to it */
+
+{
+    recorderTrigger( ( struct recorderHandle * )param, RECORDER_TRIG_SYNCLOSS );
+}
+#endif
+// ====================================================================================================
 static void _doExit( void )
 
 {
     _r.ending = true;
-    IF_WITH_FIFOS( fifoShutdown( _r.f ) );
-    IF_WITH_NWCLIENT( nwclientShutdown( _r.n ) );
+
+    /* Any FPGA stream is stopped, and the part put to sleep, while we wait below */
+    IF_INCLUDE_FPGA_SUPPORT( fpgaFeederClose( 0 ) );
+
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
+    {
+        IF_WITH_FIFOS( fifoShutdown( _r.s[n]->f ) );
+        IF_WITH_NWCLIENT( nwclientShutdown( _r.s[n]->n ) );
+        IF_WITH_EVENTS( nwclientShutdown( _r.s[n]->e ) );
+        recorderShutdown( _r.s[n]->rec );
+    }
+
+    metricsShutdown( _r.m );
 
     /* Give them a bit of time, then we're leaving anyway */
     usleep( 200000 );
@@ -1116,10 +2488,16 @@ int main( int argc, char *argv[] )
 {
     sigset_t set;
     struct sigaction sa;
+    struct source *src;
+    bool usbProbes = false;
+    int result = 0;
+    char prefix[20];
 
-    /* Setup fifos with forced ITM sync, no TPIU and TPIU on channel 1 if its engaged later */
-    IF_WITH_FIFOS( _r.f = fifoInit( true, false, 1 ) );
-    IF_WITH_FIFOS( assert( _r.f ) );
+    /* There's always at least one source, the options for it come first */
+    if ( !_newSource() )
+    {
+        genericsExit( -1, "Cannot create source" EOL );
+    }
 
     if ( !_processOptions( argc, argv ) )
     {
@@ -1127,8 +2505,6 @@ int main( int argc, char *argv[] )
         genericsExit( -1, "" EOL );
     }
 
-    IF_WITH_FIFOS( fifoUsePermafiles( _r.f, options.permafile ) );
-
     /* Make sure the fifos get removed at the end */
     atexit( _doExit );
 
@@ -1142,6 +2518,14 @@ int main( int argc, char *argv[] )
         genericsExit( -1, "Failed to establish Int handler" EOL );
     }
 
+    /* SIGUSR1 dumps the flight recorders */
+    sa.sa_sigaction = _usr1Handler;
+
+    if ( sigaction( SIGUSR1, &sa, NULL ) == -1 )
+    {
+        genericsExit( -1, "Failed to establish USR1 handler" EOL );
+    }
+
     /* Don't kill a sub-process when any reader or writer evaporates */
     sigemptyset( &set );
     sigaddset( &set, SIGPIPE );
@@ -1151,57 +2535,133 @@ int main( int argc, char *argv[] )
         genericsExit( -1, "Failed to establish Int handler" EOL );
     }
 
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
+    {
+        src = _r.s[n];
+        IF_WITH_FIFOS( fifoUsePermafiles( src->f, src->permafile ) );
+
+        if ( src->recorderMB )
+        {
+            snprintf( prefix, sizeof( prefix ), "orbrec%d-", src->index );
+
+            if ( !( src->rec = recorderStart( src->recorderMB * 1024 * 1024, src->recorderPrefix ? : prefix ) ) )
+            {
+                genericsExit( -1, "Failed to make flight recorder" EOL );
+            }
+
+            if ( ( src->recorderPattern ) && ( !recorderSetPattern( src->rec, src->recorderPattern ) ) )
+            {
+                genericsExit( -1, "Flight recorder trigger must be up to %d hex bytes" EOL, RECORDER_MAX_PATTERN );
+            }
+
+            IF_WITH_FIFOS( if ( src->recorderOnSyncLoss ) fifoSetSyncLossCB( src->f, _recorderSyncLoss, src->rec ) );
+        }
+
+        /* Decoded events are taken from the fifo processing, which decodes everything anyway */
+        IF_WITH_EVENTS( if ( src->eventPort ) fifoSetMsgCB( src->f, _eventMsg, src ) );
+
 #ifdef WITH_FIFOS
 
-    if ( ! ( fifoCreate( _r.f ) ) )
-    {
-        genericsExit( -1, "Failed to make channel devices" EOL );
-    }
+        if ( ! ( fifoCreate( src->f ) ) )
+        {
+            genericsExit( -1, "Failed to make channel devices" EOL );
+        }
 
 #endif
 
 #ifdef WITH_NWCLIENT
 
-    if ( !( _r.n = nwclientStart( options.listenPort ) ) )
-    {
-        genericsExit( -1, "Failed to make network server" EOL );
-    }
+        if ( !( src->n = nwclientStart( src->listenPort, src->queueKB * 1024, src->overflow, _restartFor( src ), src->historyKB * 1024, src->zeroCopy ) ) )
+        {
+            genericsExit( -1, "Failed to make network server" EOL );
+        }
 
 #endif
 
-    /* Start the filewriter */
-    IF_WITH_FIFOS( fifoFilewriter( _r.f, options.filewriter, options.fwbasedir ) );
+#ifdef WITH_EVENTS
 
-    if ( options.intervalReportTime )
+        if ( ( src->eventPort ) && ( !( src->e = nwclientStart( src->eventPort, src->queueKB * 1024, src->overflow, NWCLIENT_RESTART_MSGS, src->historyKB * 1024, src->zeroCopy ) ) ) )
+        {
+            genericsExit( -1, "Failed to make decoded event server" EOL );
+        }
+
+#endif
+    }
+
+    if ( !_startProcessors() )
     {
-        pthread_create( &_r.intervalThread, NULL, &_checkInterval, NULL );
+        genericsExit( -1, "Failed to start processing" EOL );
     }
 
-#ifdef INCLUDE_FPGA_SUPPORT
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
+    {
+        src = _r.s[n];
 
-    if ( options.orbtrace )
+        /* Start the filewriter */
+        IF_WITH_FIFOS( fifoFilewriter( src->f, src->filewriter, src->fwbasedir ) );
+
+        usbProbes |= _isUSBProbe( src );
+    }
+
+    if ( options.metricsPort )
     {
-        signal( SIGINT, fpgaFeederClose );
-        exit( fpgaFeeder() );
+        if ( !( _r.m = metricsStart( options.metricsPort ) ) )
+        {
+            genericsExit( -1, "Failed to make metrics server" EOL );
+        }
+
+        /* With only one source there's no need to say which one things are about */
+        for ( uint32_t n = 0; n < _r.numSources; n++ )
+        {
+            src = _r.s[n];
+            metricsRegister( _r.m, _metrics, src, ( _r.numSources > 1 ) ? src->label : NULL );
+            IF_WITH_FIFOS( metricsRegister( _r.m, fifoMetrics, src->f, ( _r.numSources > 1 ) ? src->label : NULL ) );
+            IF_WITH_NWCLIENT( metricsRegister( _r.m, nwclientMetrics, src->n, ( _r.numSources > 1 ) ? src->label : NULL ) );
+
+            /* The event server's clients are told apart from the raw ones by a label of their own */
+            IF_WITH_EVENTS( snprintf( src->eventLabel, sizeof( src->eventLabel ), "%s%sserver=\"events\"", ( _r.numSources > 1 ) ? src->label : "", ( _r.numSources > 1 ) ? "," : "" ) );
+            IF_WITH_EVENTS( if ( src->e ) metricsRegister( _r.m, nwclientMetrics, src->e, src->eventLabel ) );
+
+            if ( src->rec )
+            {
+                metricsRegister( _r.m, recorderMetrics, src->rec, ( _r.numSources > 1 ) ? src->label : NULL );
+            }
+        }
     }
 
-#endif
+    if ( options.intervalReportTime )
+    {
+        pthread_create( &_r.intervalThread, NULL, &_checkInterval, NULL );
+    }
 
-    if ( options.seggerPort )
+    /* The USB probes all share one libusb context, and one thread handling its events */
+    if ( usbProbes )
     {
-        exit( seggerFeeder() );
+        if ( ( libusb_init( &_r.usb.ctx ) < 0 ) || ( pthread_create( &_r.usb.thread, NULL, &_usbEvents, &_r.usb ) ) )
+        {
+            genericsExit( -1, "Failed to initalise USB interface" EOL );
+        }
     }
 
-    if ( options.port )
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
     {
-        exit( serialFeeder() );
+        if ( pthread_create( &_r.s[n]->feederThread, NULL, &_runFeeder, _r.s[n] ) )
+        {
+            genericsExit( -1, "Failed to start capture" EOL );
+        }
     }
 
-    if ( options.file )
+    /* We're finished when all of the sources are, reporting the first one that had a problem */
+    for ( uint32_t n = 0; n < _r.numSources; n++ )
     {
-        exit( fileFeeder() );
+        pthread_join( _r.s[n]->feederThread, NULL );
+
+        if ( !result )
+        {
+            result = _r.s[n]->feederResult;
+        }
     }
 
-    exit( usbFeeder() );
+    exit( result );
 }
 // ====================================================================================================
@@ -0,0 +1,823 @@
+/*
+ * Parallel Capture Decoder Module
+ * ===============================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The file is mapped and cut into chunks of around PAR_CHUNK_SIZE, ending just before a sync
+ * where there is one nearby. A pool of workers decodes the chunks with decoders of their own,
+ * recording the messages they find and the points near the start of the chunk where their ITM
+ * decoder was idle between packets (checkpoints).
+ *
+ * Chunks are merged in file order. The true ITM state at the start of a chunk depends on what
+ * came before it (a packet can straddle the seam, the page register carries over), so the merge
+ * runs the start of each chunk through the caller's decoder, which holds that state, until it is
+ * idle at one of the worker's checkpoints. From there the two decoders are in step, so the rest
+ * of the worker's messages and events are used as they are and its final decoder state carries
+ * on into the next chunk, with its stats added to the caller's. If they never fall into step
+ * the merge just decodes the whole chunk itself, which is also what happens with TPIU data when
+ * there was no TPIU sync to start a chunk on.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "generics.h"
+#include "tpiuDemux.h"
+#include "parDecoder.h"
+#include "msgCodec.h"
+
+#define PAR_INITIAL_MSGBUF  (65536)        /* Initial encoded message capacity of a chunk, it grows as needed */
+#define PAR_MERGE_STEP      (64)           /* Amount of TPIU data fed to the merge at a time until it's in step */
+#define PAR_MIN_CHECKPOINT  (6)            /* ITM bytes before both decoders have the same sync history */
+#define PAR_GUESS_FRAMES    (8)            /* Frames to look back through for the stream selected at a chunk start */
+#define PAR_INITIAL_EVENTS  (64)           /* Initial event capacity of a chunk, it grows as needed */
+
+/* Somewhere a worker's ITM decoder was idle */
+struct parCheckpoint
+{
+    uint32_t ofs;                          /* ITM bytes consumed from the start of the chunk */
+    uint32_t msgOfs;                       /* Encoded messages up to that point */
+    struct ITMDecoderStats stats;          /* ...and the decoder stats at that point */
+};
+
+/* An ITM event a worker's decoder raised */
+struct parEvent
+{
+    enum ITMPumpEvent e;                   /* The event */
+    uint32_t ofs;                          /* ITM bytes consumed from the start of the chunk when it happened */
+    uint32_t msgOfs;                       /* Encoded messages before it */
+    struct ITMDecoderStats stats;          /* ...and the decoder stats just after it */
+};
+
+struct parChunk
+{
+    const uint8_t *d;                      /* Data for this chunk */
+    uint32_t len;                          /* ...and its length */
+    bool decode;                           /* Worker should decode it (false if the merge has to do it all) */
+    bool done;                             /* Worker has finished with it */
+    bool failed;                           /* Worker ran out of memory, so the merge has to do it all */
+    uint8_t stream;                        /* TPIU stream the worker assumed was selected at the start */
+    bool streamFree;                       /* ...though it doesn't matter, the first frame selects one */
+
+    uint8_t *m;                            /* Messages decoded from the chunk, encoded */
+    uint32_t mlen;                         /* ...how many bytes of them there are */
+    uint32_t msize;                        /* ...and how many there is room for */
+
+    struct parEvent *ev;                   /* Events raised while decoding the chunk */
+    uint32_t nev;                          /* ...how many of them there are */
+    uint32_t evsize;                       /* ...and how many there is room for */
+
+    struct parCheckpoint cp[PAR_MAX_CHECKPOINTS + 1]; /* Idle points, plus the first ITM sync after them */
+    uint32_t ncp;                          /* Number of checkpoints */
+    bool syncCp;                           /* The ITM sync checkpoint has been taken */
+
+    bool pageSet;                          /* Page register was set in this chunk */
+    uint32_t pageSetOfs;                   /* ...the last time being at this ITM offset */
+
+    struct ITMDecoder i;                   /* Worker's ITM decoder at the end of the chunk */
+    struct TPIUDecoder t;                  /* ...and its TPIU decoder */
+    uint32_t unrouted;                     /* ...and TPIU bytes its demux had no consumer for */
+    uint32_t overflow;                     /* ...or room for */
+};
+
+struct parWorker
+{
+    struct ParDecoder *p;                  /* The decoder this worker belongs to */
+    pthread_t thread;                      /* Thread running the worker */
+    struct TPIUDemux t;                    /* Its TPIU decoder */
+    struct ITMDecoder i;                   /* ...and ITM decoder */
+    struct parChunk *c;                    /* Chunk currently being decoded */
+    uint32_t ofs;                          /* ITM bytes consumed from it */
+};
+
+struct ParDecoder
+{
+    int fd;                                /* File being decoded */
+    const uint8_t *map;                    /* ...its contents */
+    size_t mapLen;                         /* ...and length */
+    size_t next;                           /* Where the next chunk will be cut from */
+    bool useTPIU;                          /* File contains TPIU frames */
+    uint8_t channel;                       /* ...with ITM on this stream */
+
+    struct ITMDecoder *i;                  /* Caller's ITM decoder, holding the true state across seams */
+    struct TPIUDemux t;                    /* TPIU decoder doing the same */
+
+    uint32_t numWorkers;                   /* Number of worker threads running */
+    struct parWorker *w;                   /* ...and the workers themselves */
+
+    uint32_t numChunks;                    /* Number of chunks that can be in flight */
+    struct parChunk *c;                    /* ...and the chunks */
+    uint32_t head;                         /* Next chunk to merge */
+    uint32_t nextJob;                      /* Next chunk for a worker to decode */
+    uint32_t tail;                         /* Next chunk to be cut */
+    bool ending;                           /* Workers are to exit */
+    pthread_mutex_t lock;                  /* Lock for the above */
+    pthread_cond_t jobReady;               /* Signalled when a chunk is cut */
+    pthread_cond_t jobDone;                /* Signalled when a chunk is decoded */
+
+    /* The merge in progress */
+    struct parChunk *mc;                   /* Chunk being merged */
+    uint32_t ofs;                          /* ITM bytes consumed from it */
+    uint32_t nextCp;                       /* Next checkpoint it could fall into step at */
+    bool inStep;                           /* Caller's decoder is now in step with the worker's */
+    uint64_t ts;                           /* Timestamp for messages from this chunk */
+    ParDecoderMsgCB cb;                    /* Where the messages go */
+    ParDecoderEventCB ecb;                 /* ...and the events */
+    void *param;                           /* ...and what to pass with them */
+};
+
+static const uint8_t _tpiuSync[] = { 0xFF, 0xFF, 0xFF, 0x7F };
+static const uint8_t _itmSync[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x80 };
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _syncITM( struct ITMDecoder *i, enum TPIUPumpEvent e )
+
+/* Do what the clients do to the ITM decoder when the TPIU sync state changes */
+
+{
+    switch ( e )
+    {
+        // ------------------------------------
+        case TPIU_EV_NEWSYNC:
+        case TPIU_EV_SYNCED:
+            ITMDecoderForceSync( i, true );
+            break;
+
+        // ------------------------------------
+        case TPIU_EV_UNSYNCED:
+            ITMDecoderForceSync( i, false );
+            break;
+
+        // ------------------------------------
+        default:
+            break;
+            // ------------------------------------
+    }
+}
+// ====================================================================================================
+static void _workerEvent( enum TPIUPumpEvent e, void *param )
+
+{
+    _syncITM( &( ( struct parWorker * )param )->i, e );
+}
+// ====================================================================================================
+static void _workerITM( uint8_t *d, uint32_t len, void *param )
+
+/* Decode a run of ITM data from a chunk, recording the messages and checkpoints */
+
+{
+    struct parWorker *w = ( struct parWorker * )param;
+    struct parChunk *c = w->c;
+    struct parCheckpoint *cp;
+    struct parEvent *ev;
+    enum ITMPumpEvent e;
+    uint32_t pagePkts;
+    uint32_t skip;
+    struct MSGCodec codec;
+    struct msg m;
+    uint8_t *b;
+
+    /* Timestamps are all zero (the merge stamps messages) so each record stands alone */
+    MSGCodecInit( &codec );
+
+    while ( len )
+    {
+        /* While unsynced we can skip over anything that can't contain a sync */
+        skip = ITMDecoderSkipToSync( &w->i, d, len );
+        d += skip;
+        len -= skip;
+        w->ofs += skip;
+
+        if ( !len )
+        {
+            break;
+        }
+
+        pagePkts = w->i.stats.PagePkt;
+        e = ITMPump( &w->i, *d++ );
+        len--;
+        w->ofs++;
+
+        if ( ( e != ITM_EV_NONE ) && ( e != ITM_EV_PACKET_RXED ) && ( !c->failed ) )
+        {
+            if ( c->nev == c->evsize )
+            {
+                if ( !( ev = ( struct parEvent * )realloc( c->ev, ( c->evsize ? c->evsize * 2 : PAR_INITIAL_EVENTS ) * sizeof( struct parEvent ) ) ) )
+                {
+                    c->failed = true;
+                    continue;
+                }
+
+                c->ev = ev;
+                c->evsize = c->evsize ? c->evsize * 2 : PAR_INITIAL_EVENTS;
+            }
+
+            ev = &c->ev[c->nev++];
+            ev->e = e;
+            ev->ofs = w->ofs;
+            ev->msgOfs = c->mlen;
+            ev->stats = w->i.stats;
+        }
+
+        if ( ( e == ITM_EV_PACKET_RXED ) && ( !c->failed ) )
+        {
+            if ( c->msize - c->mlen < MSG_CODEC_MAXLEN )
+            {
+                if ( !( b = ( uint8_t * )realloc( c->m, c->msize ? c->msize * 2 : PAR_INITIAL_MSGBUF ) ) )
+                {
+                    c->failed = true;
+                    continue;
+                }
+
+                c->m = b;
+                c->msize = c->msize ? c->msize * 2 : PAR_INITIAL_MSGBUF;
+            }
+
+            if ( ITMGetDecodedPacket( &w->i, &m ) )
+            {
+                m.genericMsg.ts = 0;
+                c->mlen += MSGCodecEncode( &codec, &m, &c->m[c->mlen] );
+            }
+        }
+
+        /* The page register is set by a page packet or a sync */
+        if ( ( e == ITM_EV_SYNCED ) || ( w->i.stats.PagePkt != pagePkts ) )
+        {
+            c->pageSet = true;
+            c->pageSetOfs = w->ofs;
+        }
+
+        /* Record where we're idle, near the start of the chunk or at the first sync after that */
+        if ( ( w->i.p == ITM_IDLE ) && ( w->ofs >= PAR_MIN_CHECKPOINT ) && ( !c->failed ) &&
+                ( ( c->ncp < PAR_MAX_CHECKPOINTS ) || ( ( e == ITM_EV_SYNCED ) && ( !c->syncCp ) ) ) )
+        {
+            c->syncCp = ( c->ncp == PAR_MAX_CHECKPOINTS );
+            cp = &c->cp[c->ncp++];
+            cp->ofs = w->ofs;
+            cp->msgOfs = c->mlen;
+            cp->stats = w->i.stats;
+        }
+    }
+}
+// ====================================================================================================
+static void _guessStream( struct ParDecoder *p, struct parChunk *c )
+
+/* Guess which stream is selected at the sync starting a chunk from the last stream ID in the frames */
+/* before it. The merge checks the guess, this just makes it likely to be right.                     */
+
+{
+    size_t o = c->d - p->map;
+    const uint8_t *f;
+
+    c->stream = p->channel;
+
+    for ( uint32_t k = 1; ( k <= PAR_GUESS_FRAMES ) && ( o >= k * TPIU_PACKET_LEN ); k++ )
+    {
+        f = c->d - k * TPIU_PACKET_LEN;
+
+        for ( int32_t i = TPIU_PACKET_LEN - 2; i >= 0; i -= 2 )
+        {
+            if ( f[i] & 1 )
+            {
+                c->stream = f[i] >> 1;
+                return;
+            }
+        }
+    }
+}
+// ====================================================================================================
+static void _decodeChunk( struct parWorker *w, struct parChunk *c )
+
+{
+    const uint8_t *f;
+
+    w->c = c;
+    w->ofs = 0;
+    c->mlen = c->ncp = c->nev = 0;
+    c->unrouted = c->overflow = 0;
+    c->syncCp = c->pageSet = c->failed = false;
+
+    if ( !c->decode )
+    {
+        return;
+    }
+
+    /* Start idle, so we've the best chance of falling into step with the real decoder early */
+    ITMDecoderInit( &w->i, true );
+
+    if ( w->p->useTPIU )
+    {
+        _guessStream( w->p, c );
+
+        /* The selected stream doesn't matter if the first frame after the sync starts by changing */
+        /* it (and doesn't contain the end of another sync).                                        */
+        f = c->d + sizeof( _tpiuSync );
+        c->streamFree = ( c->len >= sizeof( _tpiuSync ) + TPIU_PACKET_LEN ) && ( f[0] & 1 ) &&
+                        ( !( f[TPIU_PACKET_LEN - 1] & 1 ) ) && ( !memchr( f, _tpiuSync[3], TPIU_PACKET_LEN ) );
+
+        TPIUDemuxReset( &w->t );
+        w->t.t.currentStream = c->stream;
+        TPIUDemuxPump( &w->t, ( uint8_t * )c->d, c->len );
+        c->t = w->t.t;
+        c->unrouted = TPIUDemuxGetUnrouted( &w->t );
+        c->overflow = TPIUDemuxGetOverflow( &w->t );
+    }
+    else
+    {
+        _workerITM( ( uint8_t * )c->d, c->len, w );
+    }
+
+    c->i = w->i;
+
+    if ( c->failed )
+    {
+        c->ncp = 0;
+    }
+}
+// ====================================================================================================
+static void *_workerThread( void *arg )
+
+/* Take chunks as they're cut and decode them */
+
+{
+    struct parWorker *w = ( struct parWorker * )arg;
+    struct ParDecoder *p = w->p;
+    struct parChunk *c;
+
+    pthread_mutex_lock( &p->lock );
+
+    while ( !p->ending )
+    {
+        if ( p->nextJob == p->tail )
+        {
+            pthread_cond_wait( &p->jobReady, &p->lock );
+            continue;
+        }
+
+        c = &p->c[p->nextJob++ % p->numChunks];
+        pthread_mutex_unlock( &p->lock );
+
+        _decodeChunk( w, c );
+
+        pthread_mutex_lock( &p->lock );
+        c->done = true;
+        pthread_cond_signal( &p->jobDone );
+    }
+
+    pthread_mutex_unlock( &p->lock );
+    return NULL;
+}
+// ====================================================================================================
+static void _cutChunk( struct ParDecoder *p, struct parChunk *c )
+
+/* Cut the next chunk from the file, ending it just before a sync if there's one near the target size */
+
+{
+    const uint8_t *s = p->useTPIU ? _tpiuSync : _itmSync;
+    size_t slen = p->useTPIU ? sizeof( _tpiuSync ) : sizeof( _itmSync );
+    size_t end = p->next + PAR_CHUNK_SIZE;
+    const uint8_t *f;
+
+    if ( end >= p->mapLen )
+    {
+        end = p->mapLen;
+    }
+    else
+    {
+        f = memmem( p->map + end, ( p->mapLen - end < PAR_CHUNK_SIZE ) ? p->mapLen - end : PAR_CHUNK_SIZE, s, slen );
+
+        if ( f )
+        {
+            end = f - p->map;
+        }
+    }
+
+    c->d = p->map + p->next;
+    c->len = end - p->next;
+
+    /* A TPIU chunk that doesn't start at a sync can't be decoded independently */
+    c->decode = ( !p->useTPIU ) || ( ( c->len >= slen ) && ( !memcmp( c->d, s, slen ) ) );
+    c->done = false;
+
+    p->next = end;
+}
+// ====================================================================================================
+static void _fillPipeline( struct ParDecoder *p )
+
+/* Cut as many chunks as there is room for, and hand them to the workers */
+
+{
+    while ( ( p->tail - p->head < p->numChunks ) && ( p->next < p->mapLen ) )
+    {
+        _cutChunk( p, &p->c[p->tail % p->numChunks] );
+
+        pthread_mutex_lock( &p->lock );
+        p->tail++;
+        pthread_cond_broadcast( &p->jobReady );
+        pthread_mutex_unlock( &p->lock );
+    }
+}
+// ====================================================================================================
+static void _mergeEvent( enum TPIUPumpEvent e, void *param )
+
+{
+    struct ParDecoder *p = ( struct ParDecoder * )param;
+
+    if ( !p->inStep )
+    {
+        _syncITM( p->i, e );
+    }
+}
+// ====================================================================================================
+static void _mergeITM( uint8_t *d, uint32_t len, void *param )
+
+/* Decode a run of ITM data from a chunk with the caller's decoder, until it falls into step with the worker's */
+
+{
+    struct ParDecoder *p = ( struct ParDecoder * )param;
+    struct parChunk *c = p->mc;
+    enum ITMPumpEvent e;
+    uint32_t skip;
+    struct msg m;
+
+    while ( ( len ) && ( !p->inStep ) )
+    {
+        skip = ITMDecoderSkipToSync( p->i, d, len );
+        d += skip;
+        len -= skip;
+        p->ofs += skip;
+
+        if ( !len )
+        {
+            break;
+        }
+
+        e = ITMPump( p->i, *d++ );
+
+        if ( e == ITM_EV_PACKET_RXED )
+        {
+            if ( ITMGetDecodedPacket( p->i, &m ) )
+            {
+                m.genericMsg.ts = p->ts;
+                p->cb( &m, p->param );
+            }
+        }
+        else if ( ( e != ITM_EV_NONE ) && ( p->ecb ) )
+        {
+            p->ecb( e, p->param );
+        }
+
+        len--;
+        p->ofs++;
+
+        /* Pass any checkpoints we've gone beyond, then see if we're idle at the next one */
+        while ( ( p->nextCp < c->ncp ) && ( c->cp[p->nextCp].ofs < p->ofs ) )
+        {
+            p->nextCp++;
+        }
+
+        p->inStep = ( p->nextCp < c->ncp ) && ( c->cp[p->nextCp].ofs == p->ofs ) && ( p->i->p == ITM_IDLE );
+    }
+}
+// ====================================================================================================
+static void _mergeStats( struct ITMDecoderStats *s, const struct ITMDecoderStats *b,
+                         const struct ITMDecoderStats *from, const struct ITMDecoderStats *to )
+
+/* Set s to the caller's stats b, plus however much the worker's went up by between from and to */
+
+{
+    uint32_t *sp = ( uint32_t * )s;
+    const uint32_t *bp = ( const uint32_t * )b;
+    const uint32_t *fp = ( const uint32_t * )from;
+    const uint32_t *tp = ( const uint32_t * )to;
+
+    for ( uint32_t n = 0; n < sizeof( struct ITMDecoderStats ) / sizeof( uint32_t ); n++ )
+    {
+        /* ...the stats are all uint32_t counters */
+        sp[n] = bp[n] + tp[n] - fp[n];
+    }
+}
+// ====================================================================================================
+static void _mergeChunk( struct ParDecoder *p, struct parChunk *c, ParDecoderMsgCB cb, ParDecoderEventCB ecb, void *param )
+
+/* Deliver the messages and events from a decoded chunk, reconciling them with the state at the end of the last one */
+
+{
+    struct TPIUDecoderStats tstats = p->t.t.stats;
+    uint32_t unrouted = TPIUDemuxGetUnrouted( &p->t );
+    uint32_t overflow = TPIUDemuxGetOverflow( &p->t );
+    struct ITMDecoderStats istats;
+    struct parCheckpoint *cp;
+    struct parEvent *ev;
+    uint8_t pageRegister;
+    uint32_t o = 0;
+    uint32_t n;
+    struct MSGCodec codec;
+    struct msg m;
+    int32_t used;
+
+    p->mc = c;
+    p->ofs = 0;
+    p->nextCp = 0;
+    p->inStep = false;
+    p->ts = genericsTimestampuS();
+    p->cb = cb;
+    p->ecb = ecb;
+    p->param = param;
+
+    if ( p->useTPIU )
+    {
+        if ( c->decode )
+        {
+            /* The worker saw nothing until this sync completed, so that's where ITM offsets start from */
+            p->nextCp = c->ncp;
+            TPIUDemuxPump( &p->t, ( uint8_t * )c->d, sizeof( _tpiuSync ) );
+            p->ofs = 0;
+            o = sizeof( _tpiuSync );
+
+            /* ...and its guess at the selected stream had better have been right */
+            p->nextCp = ( ( c->streamFree ) || ( p->t.t.currentStream == c->stream ) ) ? 0 : c->ncp;
+        }
+
+        for ( ; ( o < c->len ) && ( !p->inStep ); o += PAR_MERGE_STEP )
+        {
+            TPIUDemuxPump( &p->t, ( uint8_t * )c->d + o, ( c->len - o < PAR_MERGE_STEP ) ? c->len - o : PAR_MERGE_STEP );
+        }
+    }
+    else
+    {
+        _mergeITM( ( uint8_t * )c->d, c->len, p );
+    }
+
+    if ( !p->inStep )
+    {
+        /* We decoded the whole chunk ourselves, so there's nothing more to do */
+        return;
+    }
+
+    cp = &c->cp[p->nextCp];
+    istats = p->i->stats;
+
+    /* Events we decoded ourselves on the way into step have already been raised */
+    for ( ev = c->ev; ( ev < &c->ev[c->nev] ) && ( ev->ofs <= cp->ofs ); ev++ );
+
+    MSGCodecInit( &codec );
+
+    for ( n = cp->msgOfs; ; n += used )
+    {
+        /* Raise the worker's events in order with its messages, with the stats they'd have seen */
+        for ( ; ( ev < &c->ev[c->nev] ) && ( ev->msgOfs <= n ); ev++ )
+        {
+            if ( ecb )
+            {
+                _mergeStats( &p->i->stats, &istats, &cp->stats, &ev->stats );
+                ecb( ev->e, param );
+            }
+        }
+
+        if ( ( n >= c->mlen ) || ( ( used = MSGCodecDecode( &codec, &c->m[n], c->mlen - n, &m ) ) <= 0 ) )
+        {
+            break;
+        }
+
+        m.genericMsg.ts = p->ts;
+        cb( &m, param );
+    }
+
+    /* The worker's decoder carries on from here, but with our stats up to this point, and */
+    /* our page register unless the worker set it after we fell into step.                */
+    pageRegister = p->i->pk.pageRegister;
+    *p->i = c->i;
+    _mergeStats( &p->i->stats, &istats, &cp->stats, &c->i.stats );
+
+    if ( ( !c->pageSet ) || ( c->pageSetOfs <= cp->ofs ) )
+    {
+        p->i->pk.pageRegister = pageRegister;
+    }
+
+    if ( p->useTPIU )
+    {
+        /* The TPIU decoders were in step from the sync at the start of the chunk */
+        p->t.t = c->t;
+        p->t.t.stats.lostSync += tstats.lostSync;
+        p->t.t.stats.syncCount += tstats.syncCount;
+        p->t.t.stats.packets += tstats.packets;
+        p->t.t.stats.error += tstats.error;
+
+        /* ...and its demux had the whole chunk too */
+        __atomic_store_n( &p->t.b.unrouted, unrouted + c->unrouted, __ATOMIC_RELAXED );
+        __atomic_store_n( &p->t.b.overflow, overflow + c->overflow, __ATOMIC_RELAXED );
+    }
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+struct ParDecoder *ParDecoderOpen( const char *filename, struct ITMDecoder *i, bool useTPIU, uint8_t tpiuITMChannel, uint32_t threads )
+
+/* Open a capture file for decoding on a number of threads (0 for one per processor). The ITM decoder */
+/* i is the caller's, and is left in the same state as it would have been by decoding the file serially */
+
+{
+    struct ParDecoder *p;
+    struct stat st;
+
+    if ( !( p = ( struct ParDecoder * )calloc( 1, sizeof( struct ParDecoder ) ) ) )
+    {
+        return NULL;
+    }
+
+    p->i = i;
+    p->useTPIU = useTPIU;
+    p->channel = tpiuITMChannel;
+    pthread_mutex_init( &p->lock, NULL );
+    pthread_cond_init( &p->jobReady, NULL );
+    pthread_cond_init( &p->jobDone, NULL );
+    TPIUDemuxInit( &p->t, TPIU_TIMING_NONE, _mergeEvent, p );
+
+    if ( ( ( p->fd = open( filename, O_RDONLY ) ) < 0 ) || ( fstat( p->fd, &st ) < 0 ) )
+    {
+        ParDecoderClose( p );
+        return NULL;
+    }
+
+    p->mapLen = st.st_size;
+
+    if ( p->mapLen )
+    {
+        if ( ( p->map = mmap( NULL, p->mapLen, PROT_READ, MAP_PRIVATE, p->fd, 0 ) ) == MAP_FAILED )
+        {
+            p->map = NULL;
+            ParDecoderClose( p );
+            return NULL;
+        }
+
+        madvise( ( void * )p->map, p->mapLen, MADV_SEQUENTIAL );
+    }
+
+    if ( !threads )
+    {
+        long n = sysconf( _SC_NPROCESSORS_ONLN );
+        threads = ( n > 0 ) ? n : 1;
+    }
+
+    /* Keep twice as many chunks in flight as there are workers, so they've always got another to go at */
+    p->numChunks = 2 * threads;
+    p->c = ( struct parChunk * )calloc( p->numChunks, sizeof( struct parChunk ) );
+    p->w = ( struct parWorker * )calloc( threads, sizeof( struct parWorker ) );
+
+    if ( ( !p->c ) || ( !p->w ) || ( !TPIUDemuxRegister( &p->t, tpiuITMChannel, _mergeITM, p ) ) )
+    {
+        ParDecoderClose( p );
+        return NULL;
+    }
+
+    for ( uint32_t n = 0; n < threads; n++ )
+    {
+        struct parWorker *w = &p->w[p->numWorkers];
+
+        w->p = p;
+        TPIUDemuxInit( &w->t, TPIU_TIMING_NONE, _workerEvent, w );
+
+        if ( ( !TPIUDemuxRegister( &w->t, tpiuITMChannel, _workerITM, w ) ) ||
+                ( pthread_create( &w->thread, NULL, _workerThread, w ) ) )
+        {
+            TPIUDemuxShutdown( &w->t );
+            break;
+        }
+
+        p->numWorkers++;
+    }
+
+    if ( !p->numWorkers )
+    {
+        ParDecoderClose( p );
+        return NULL;
+    }
+
+    _fillPipeline( p );
+    return p;
+}
+// ====================================================================================================
+bool ParDecoderPump( struct ParDecoder *p, ParDecoderMsgCB cb, ParDecoderEventCB ecb, void *param )
+
+/* Deliver the messages (and events, if ecb is set) from the next chunk of the file. Returns false */
+/* when there are no more.                                                                           */
+
+{
+    struct parChunk *c;
+
+    if ( p->head == p->tail )
+    {
+        return false;
+    }
+
+    c = &p->c[p->head % p->numChunks];
+
+    pthread_mutex_lock( &p->lock );
+
+    while ( !c->done )
+    {
+        pthread_cond_wait( &p->jobDone, &p->lock );
+    }
+
+    pthread_mutex_unlock( &p->lock );
+
+    _mergeChunk( p, c, cb, ecb, param );
+
+    /* ...and that frees up a chunk to cut */
+    p->head++;
+    _fillPipeline( p );
+    return true;
+}
+// ====================================================================================================
+struct TPIUDecoderStats *ParDecoderGetTPIUStats( struct ParDecoder *p )
+
+{
+    return TPIUDemuxGetStats( &p->t );
+}
+// ====================================================================================================
+void ParDecoderClose( struct ParDecoder *p )
+
+/* Stop the workers and release everything */
+
+{
+    pthread_mutex_lock( &p->lock );
+    p->ending = true;
+    pthread_cond_broadcast( &p->jobReady );
+    pthread_mutex_unlock( &p->lock );
+
+    for ( uint32_t n = 0; n < p->numWorkers; n++ )
+    {
+        pthread_join( p->w[n].thread, NULL );
+        TPIUDemuxShutdown( &p->w[n].t );
+    }
+
+    for ( uint32_t n = 0; ( p->c ) && ( n < p->numChunks ); n++ )
+    {
+        free( p->c[n].m );
+        free( p->c[n].ev );
+    }
+
+    TPIUDemuxShutdown( &p->t );
+
+    if ( p->map )
+    {
+        munmap( ( void * )p->map, p->mapLen );
+    }
+
+    if ( p->fd >= 0 )
+    {
+        close( p->fd );
+    }
+
+    pthread_cond_destroy( &p->jobDone );
+    pthread_cond_destroy( &p->jobReady );
+    pthread_mutex_destroy( &p->lock );
+    free( p->c );
+    free( p->w );
+    free( p );
+}
+// ====================================================================================================
@@ -0,0 +1,394 @@
+/*
+ * Flight Recorder Module
+ * ============================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The capture thread is the only writer. Before it copies a block into the
+ * ring it advances 'reserved' past it, and once the copy is done it advances
+ * 'written'. A dump runs from the oldest data to where 'written' was when it
+ * started, and the capture thread carries on regardless. After each chunk
+ * goes to the file 'reserved' shows whether the writer has lapped it while
+ * it was being copied; if it has, the dump starts again from further on.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "generics.h"
+#include "recorder.h"
+
+#define DUMP_CHUNK        (256*1024)          /* Most written to the file at a time */
+#define TRIGGER_POLL_MS   (100)               /* How often the dump thread looks for triggers */
+#define TRIGGER_HOLDOFF_S (10)                /* Least time between dumps that weren't asked for */
+
+struct recorderHandle
+{
+    uint8_t *d;                               /* The ring */
+    uint32_t size;                            /* ...and its size */
+    uint64_t reserved;                        /* Total bytes written, or being written */
+    uint64_t written;                         /* Total bytes written */
+
+    uint8_t pattern[RECORDER_MAX_PATTERN];    /* Trigger pattern */
+    uint32_t patternLen;                      /* ...its length (0 for none) */
+    uint8_t tail[RECORDER_MAX_PATTERN];       /* End of the last block, in case the pattern straddles it */
+    uint32_t tailLen;                         /* ...and how much of it there is */
+
+    char *prefix;                             /* Start of the name of dump files */
+    uint32_t pending;                         /* Triggers waiting to be dealt with, one bit each */
+    time_t lastDump;                          /* When the last dump happened */
+
+    uint64_t triggers[RECORDER_NUM_TRIGGERS]; /* Each sort of trigger seen */
+    uint64_t dumps;                           /* Dumps made */
+    uint64_t dumpBytes;                       /* ...and bytes written in them */
+    uint64_t ignored;                         /* Triggers ignored as too soon after the last dump */
+
+    bool finish;                              /* Flag for the dump thread to stop */
+    pthread_t thread;                         /* ...which is this */
+};
+
+static const char *_triggerName[RECORDER_NUM_TRIGGERS] = { "signal", "pattern", "syncloss" };
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _checkPattern( struct recorderHandle *r, const uint8_t *d, uint32_t len )
+
+/* Look for the trigger pattern in a block, including where it straddles the previous one */
+
+{
+    uint8_t join[2 * RECORDER_MAX_PATTERN];
+    uint32_t n = ( len < r->patternLen - 1 ) ? len : r->patternLen - 1;
+    uint32_t j = r->tailLen + n;
+
+    memcpy( join, r->tail, r->tailLen );
+    memcpy( &join[r->tailLen], d, n );
+
+    if ( ( memmem( join, j, r->pattern, r->patternLen ) ) || ( memmem( d, len, r->pattern, r->patternLen ) ) )
+    {
+        recorderTrigger( r, RECORDER_TRIG_PATTERN );
+    }
+
+    /* Keep what might be the start of the pattern for next time */
+    if ( len >= r->patternLen - 1 )
+    {
+        r->tailLen = r->patternLen - 1;
+        memcpy( r->tail, &d[len - r->tailLen], r->tailLen );
+    }
+    else
+    {
+        /* ...which for a short block includes some of the last tail too */
+        r->tailLen = ( j < r->patternLen - 1 ) ? j : r->patternLen - 1;
+        memcpy( r->tail, &join[j - r->tailLen], r->tailLen );
+    }
+}
+// ====================================================================================================
+static bool _writeAll( int fd, const uint8_t *d, uint32_t len )
+
+{
+    ssize_t w;
+
+    while ( len )
+    {
+        if ( ( w = write( fd, d, len ) ) <= 0 )
+        {
+            return false;
+        }
+
+        d += w;
+        len -= w;
+    }
+
+    return true;
+}
+// ====================================================================================================
+static void _dump( struct recorderHandle *r, uint32_t triggers )
+
+/* Write what's in the ring out to a new file */
+
+{
+    char name[PATH_MAX];
+    char when[32];
+    struct tm tm;
+    time_t now = time( NULL );
+    uint64_t end = __atomic_load_n( &r->written, __ATOMIC_ACQUIRE );
+    uint64_t pos;
+    uint32_t margin = 0;
+    uint32_t n;
+    int t;
+    int fd;
+
+    for ( t = 0; !( triggers & ( 1 << t ) ); t++ );
+
+    strftime( when, sizeof( when ), "%Y%m%d-%H%M%S", localtime_r( &now, &tm ) );
+    snprintf( name, sizeof( name ), "%s%s-%s.swo", r->prefix, when, _triggerName[t] );
+
+    if ( ( fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 )
+    {
+        genericsReport( V_ERROR, "Cannot create flight recorder dump %s" EOL, name );
+        return;
+    }
+
+    /* If the ring is full then its oldest data is being overwritten as we speak, so keep clear of it */
+    if ( end > r->size )
+    {
+        margin = r->size / 16;
+    }
+
+    pos = ( end > r->size ) ? end - r->size + margin : 0;
+
+    while ( pos < end )
+    {
+        n = ( end - pos < DUMP_CHUNK ) ? end - pos : DUMP_CHUNK;
+        n = ( n < r->size - pos % r->size ) ? n : r->size - pos % r->size;
+
+        if ( !_writeAll( fd, &r->d[pos % r->size], n ) )
+        {
+            genericsReport( V_ERROR, "Failed writing flight recorder dump %s" EOL, name );
+            break;
+        }
+
+        /* Did capture get round to this chunk while we were copying it? */
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+        if ( __atomic_load_n( &r->reserved, __ATOMIC_RELAXED ) > pos + r->size )
+        {
+            /* It did, so start again further from the oldest data */
+            margin = margin ? margin * 2 : r->size / 16;
+
+            if ( ( margin >= r->size ) || ( ftruncate( fd, 0 ) < 0 ) || ( lseek( fd, 0, SEEK_SET ) < 0 ) )
+            {
+                genericsReport( V_ERROR, "Capture is outrunning flight recorder dump %s" EOL, name );
+                break;
+            }
+
+            pos = __atomic_load_n( &r->reserved, __ATOMIC_RELAXED ) - r->size + margin;
+            continue;
+        }
+
+        pos += n;
+        __atomic_store_n( &r->dumpBytes, r->dumpBytes + n, __ATOMIC_RELAXED );
+    }
+
+    close( fd );
+    __atomic_store_n( &r->dumps, r->dumps + 1, __ATOMIC_RELAXED );
+    genericsReport( V_WARN, "Flight recorder dumped to %s" EOL, name );
+}
+// ====================================================================================================
+static void *_dumpTask( void *arg )
+
+/* Wait for triggers, and dump the ring when they happen */
+
+{
+    struct recorderHandle *r = ( struct recorderHandle * )arg;
+    uint32_t triggers;
+
+    while ( !r->finish )
+    {
+        usleep( TRIGGER_POLL_MS * 1000 );
+
+        if ( !( triggers = __atomic_exchange_n( &r->pending, 0, __ATOMIC_ACQUIRE ) ) )
+        {
+            continue;
+        }
+
+        /* Something that keeps happening (e.g. sync flapping) mustn't bury us in dumps */
+        if ( ( !( triggers & ( 1 << RECORDER_TRIG_SIGNAL ) ) ) && ( r->lastDump ) && ( time( NULL ) - r->lastDump < TRIGGER_HOLDOFF_S ) )
+        {
+            __atomic_store_n( &r->ignored, r->ignored + 1, __ATOMIC_RELAXED );
+            continue;
+        }
+
+        _dump( r, triggers );
+        r->lastDump = time( NULL );
+    }
+
+    return NULL;
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+void recorderWrite( struct recorderHandle *r, const uint8_t *d, uint32_t len )
+
+/* Add a block of captured data to the ring, overwriting the oldest */
+
+{
+    uint32_t ofs;
+    uint32_t n;
+    uint64_t end = r->written + len;
+
+    if ( r->patternLen )
+    {
+        _checkPattern( r, d, len );
+    }
+
+    /* Only as much as fits is kept */
+    if ( len > r->size )
+    {
+        d += len - r->size;
+        len = r->size;
+    }
+
+    /* Let a dump know that this part of the ring is about to change before changing it */
+    __atomic_store_n( &r->reserved, end, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    ofs = ( end - len ) % r->size;
+    n = ( len < r->size - ofs ) ? len : r->size - ofs;
+    memcpy( &r->d[ofs], d, n );
+    memcpy( r->d, &d[n], len - n );
+
+    __atomic_store_n( &r->written, end, __ATOMIC_RELEASE );
+}
+// ====================================================================================================
+void recorderTrigger( struct recorderHandle *r, enum recorderTrigger t )
+
+/* Ask for a dump. This only sets a flag, so it's safe from a signal handler */
+
+{
+    if ( r )
+    {
+        __atomic_fetch_or( &r->pending, 1 << t, __ATOMIC_RELEASE );
+        __atomic_fetch_add( &r->triggers[t], 1, __ATOMIC_RELAXED );
+    }
+}
+// ====================================================================================================
+bool recorderSetPattern( struct recorderHandle *r, const char *pattern )
+
+{
+    unsigned int b;
+
+    for ( r->patternLen = 0; ( *pattern ) && ( r->patternLen < RECORDER_MAX_PATTERN ); pattern += 2 )
+    {
+        if ( sscanf( pattern, "%2x", &b ) != 1 )
+        {
+            r->patternLen = 0;
+            return false;
+        }
+
+        r->pattern[r->patternLen++] = b;
+
+        if ( !pattern[1] )
+        {
+            break;
+        }
+    }
+
+    return ( r->patternLen ) && ( !*pattern );
+}
+// ====================================================================================================
+void recorderMetrics( struct metricsOut *o, void *param )
+
+/* Collector for the metrics server */
+
+{
+    struct recorderHandle *r = ( struct recorderHandle * )param;
+    char labels[40];
+
+    metricsFamily( o, "orbuculum_recorder_bytes_total", "counter", "Bytes taken by the flight recorder" );
+    metricsValue( o, "orbuculum_recorder_bytes_total", NULL, __atomic_load_n( &r->written, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_recorder_triggers_total", "counter", "Flight recorder triggers of each sort" );
+
+    for ( uint32_t t = 0; t < RECORDER_NUM_TRIGGERS; t++ )
+    {
+        snprintf( labels, sizeof( labels ), "trigger=\"%s\"", _triggerName[t] );
+        metricsValue( o, "orbuculum_recorder_triggers_total", labels, __atomic_load_n( &r->triggers[t], __ATOMIC_RELAXED ) );
+    }
+
+    metricsFamily( o, "orbuculum_recorder_ignored_total", "counter", "Flight recorder triggers ignored as too soon after the last dump" );
+    metricsValue( o, "orbuculum_recorder_ignored_total", NULL, __atomic_load_n( &r->ignored, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_recorder_dumps_total", "counter", "Flight recorder dumps made" );
+    metricsValue( o, "orbuculum_recorder_dumps_total", NULL, __atomic_load_n( &r->dumps, __ATOMIC_RELAXED ) );
+    metricsFamily( o, "orbuculum_recorder_dump_bytes_total", "counter", "Bytes written in flight recorder dumps" );
+    metricsValue( o, "orbuculum_recorder_dump_bytes_total", NULL, __atomic_load_n( &r->dumpBytes, __ATOMIC_RELAXED ) );
+}
+// ====================================================================================================
+void recorderShutdown( struct recorderHandle *r )
+
+{
+    if ( r )
+    {
+        r->finish = true;
+    }
+}
+// ====================================================================================================
+struct recorderHandle *recorderStart( uint32_t size, const char *prefix )
+
+/* Create a flight recorder keeping the last size bytes, dumping to files starting with prefix */
+
+{
+    struct recorderHandle *r = ( struct recorderHandle * )calloc( 1, sizeof( struct recorderHandle ) );
+
+    if ( !r )
+    {
+        return NULL;
+    }
+
+    r->size = size;
+
+    if ( ( !size ) || ( !( r->d = ( uint8_t * )malloc( size ) ) ) || ( !( r->prefix = strdup( prefix ) ) ) )
+    {
+        goto free_and_return;
+    }
+
+    /* Touch all of it now, so capture doesn't take page faults later */
+    memset( r->d, 0, size );
+
+    if ( pthread_create( &r->thread, NULL, &_dumpTask, r ) )
+    {
+        genericsReport( V_ERROR, "Failed to create flight recorder thread" EOL );
+        goto free_and_return;
+    }
+
+    return r;
+
+free_and_return:
+    free( r->prefix );
+    free( r->d );
+    free( r );
+    return NULL;
+}
+// ====================================================================================================
@@ -0,0 +1,259 @@
+/*
+ * SPSC Ring Buffer Module
+ * =======================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "spscRing.h"
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _wake( struct SPSCRing *r )
+
+/* Wake the consumer if it's asleep. The sequentially consistent accesses here and in */
+/* SPSCWaiterWait mean that either it sees the new data, or we see that it's waiting. */
+
+{
+    if ( __atomic_load_n( &r->w->waiting, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &r->w->lock );
+        pthread_cond_signal( &r->w->cond );
+        pthread_mutex_unlock( &r->w->lock );
+    }
+}
+// ====================================================================================================
+static bool _anyData( struct SPSCRing **r, uint32_t n )
+
+{
+    for ( uint32_t i = 0; i < n; i++ )
+    {
+        if ( __atomic_load_n( &r[i]->wp, __ATOMIC_SEQ_CST ) != r[i]->rp )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+uint32_t SPSCRingSpace( struct SPSCRing *r )
+
+/* Room available for the producer */
+
+{
+    return r->size - ( uint32_t )( r->wp - __atomic_load_n( &r->rp, __ATOMIC_ACQUIRE ) );
+}
+// ====================================================================================================
+uint32_t SPSCRingUsed( struct SPSCRing *r )
+
+/* Data waiting for the consumer */
+
+{
+    return ( uint32_t )( __atomic_load_n( &r->wp, __ATOMIC_ACQUIRE ) - __atomic_load_n( &r->rp, __ATOMIC_ACQUIRE ) );
+}
+// ====================================================================================================
+bool SPSCRingWrite( struct SPSCRing *r, const uint8_t *d, uint32_t len )
+
+/* Add a block to the ring. If there isn't room then it's dropped, and false returned */
+
+{
+    uint32_t used = r->size - SPSCRingSpace( r );
+    uint32_t ofs = r->wp & ( r->size - 1 );
+    uint32_t first = ( len < r->size - ofs ) ? len : r->size - ofs;
+
+    if ( len > r->size - used )
+    {
+        __atomic_store_n( &r->stats.overruns, r->stats.overruns + 1, __ATOMIC_RELAXED );
+        __atomic_store_n( &r->stats.overrunBytes, r->stats.overrunBytes + len, __ATOMIC_RELAXED );
+        return false;
+    }
+
+    /* Copy in, wrapping around the end if needed... */
+    memcpy( &r->d[ofs], d, first );
+    memcpy( r->d, &d[first], len - first );
+
+    if ( used + len > r->stats.highWater )
+    {
+        __atomic_store_n( &r->stats.highWater, used + len, __ATOMIC_RELAXED );
+    }
+
+    /* ...and only then make it visible */
+    __atomic_store_n( &r->wp, r->wp + len, __ATOMIC_SEQ_CST );
+    _wake( r );
+    return true;
+}
+// ====================================================================================================
+uint32_t SPSCRingPeek( struct SPSCRing *r, uint8_t **d, uint32_t timeoutmS )
+
+/* Get the next contiguous run of data for the consumer, waiting up to timeoutmS for some to */
+/* arrive. Returns its length (zero if there's none), which must be released with           */
+/* SPSCRingConsume once it's been dealt with.                                               */
+
+{
+    uint32_t avail = SPSCRingUsed( r );
+    uint32_t ofs = r->rp & ( r->size - 1 );
+
+    if ( ( !avail ) && ( timeoutmS ) && ( SPSCWaiterWait( r->w, &r, 1, timeoutmS ) ) )
+    {
+        avail = SPSCRingUsed( r );
+    }
+
+    *d = &r->d[ofs];
+    return ( avail < r->size - ofs ) ? avail : r->size - ofs;
+}
+// ====================================================================================================
+bool SPSCWaiterWait( struct SPSCWaiter *w, struct SPSCRing **r, uint32_t n, uint32_t timeoutmS )
+
+/* Wait up to timeoutmS for any of the n rings sharing waiter w to have data. Returns true if */
+/* one of them does. Only their consumer can call this.                                      */
+
+{
+    struct timespec ts;
+    bool avail;
+
+    if ( _anyData( r, n ) )
+    {
+        return true;
+    }
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_sec += timeoutmS / 1000;
+    ts.tv_nsec += ( timeoutmS % 1000 ) * 1000000;
+
+    if ( ts.tv_nsec >= 1000000000 )
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock( &w->lock );
+    __atomic_store_n( &w->waiting, true, __ATOMIC_SEQ_CST );
+
+    while ( !( avail = _anyData( r, n ) ) )
+    {
+        if ( pthread_cond_timedwait( &w->cond, &w->lock, &ts ) )
+        {
+            break;
+        }
+    }
+
+    __atomic_store_n( &w->waiting, false, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock( &w->lock );
+    return avail;
+}
+// ====================================================================================================
+void SPSCRingConsume( struct SPSCRing *r, uint32_t len )
+
+/* Release data the consumer has finished with, making the space available to the producer */
+
+{
+    __atomic_store_n( &r->rp, r->rp + len, __ATOMIC_RELEASE );
+}
+// ====================================================================================================
+void SPSCRingGetStats( struct SPSCRing *r, struct SPSCRingStats *s )
+
+/* Snapshot of the stats ... they're only updated by the producer, so may be a moment out of date */
+
+{
+    s->overruns = __atomic_load_n( &r->stats.overruns, __ATOMIC_RELAXED );
+    s->overrunBytes = __atomic_load_n( &r->stats.overrunBytes, __ATOMIC_RELAXED );
+    s->highWater = __atomic_load_n( &r->stats.highWater, __ATOMIC_RELAXED );
+}
+// ====================================================================================================
+bool SPSCRingInit( struct SPSCRing *r, uint32_t size )
+
+/* Create a ring with room for at least size bytes */
+
+{
+    memset( r, 0, sizeof( struct SPSCRing ) );
+
+    r->size = 1;
+
+    while ( ( r->size < size ) && ( r->size < 0x80000000 ) )
+    {
+        r->size <<= 1;
+    }
+
+    if ( !( r->d = ( uint8_t * )malloc( r->size ) ) )
+    {
+        return false;
+    }
+
+    SPSCWaiterInit( &r->ownWaiter );
+    r->w = &r->ownWaiter;
+    return true;
+}
+// ====================================================================================================
+void SPSCRingSetWaiter( struct SPSCRing *r, struct SPSCWaiter *w )
+
+/* Have the consumer wait on w (shared with its other rings) rather than the ring's own waiter. */
+/* This has to be done before the ring is used.                                                */
+
+{
+    r->w = w ? w : &r->ownWaiter;
+}
+// ====================================================================================================
+void SPSCRingFree( struct SPSCRing *r )
+
+{
+    free( r->d );
+    r->d = NULL;
+    SPSCWaiterFree( &r->ownWaiter );
+}
+// ====================================================================================================
+void SPSCWaiterInit( struct SPSCWaiter *w )
+
+{
+    w->waiting = false;
+    pthread_mutex_init( &w->lock, NULL );
+    pthread_cond_init( &w->cond, NULL );
+}
+// ====================================================================================================
+void SPSCWaiterFree( struct SPSCWaiter *w )
+
+{
+    pthread_cond_destroy( &w->cond );
+    pthread_mutex_destroy( &w->lock );
+}
+// ====================================================================================================
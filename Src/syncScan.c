@@ -0,0 +1,278 @@
+/*
+ * Sync Scanner Module
+ * ===================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Bulk search for sync patterns in TPIU and ITM streams. While a decoder is unsynced nothing
+ * but a sync can change its state, so rather than crawl through a byte at a time we look for
+ * the terminating byte of the pattern (and confirm the ones before it) a vector at a time.
+ * The best implementation available on the host is selected on first use.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "syncScan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HAVE_X86_SIMD
+#endif
+
+struct _pattern
+{
+    uint8_t term;                           /* Final byte of the pattern */
+    uint8_t pre;                            /* Byte repeated before it... */
+    uint32_t preLen;                        /* ...this many times */
+};
+
+/* TPIU full sync, as it arrives on the wire */
+static const struct _pattern _tpiuPattern = { .term = 0x7F, .pre = 0xFF, .preLen = 3 };
+
+/* ITM sync is 47 zero bits followed by a one */
+static const struct _pattern _itmPattern = { .term = 0x80, .pre = 0x00, .preLen = 5 };
+
+typedef uint32_t ( *_scanFn )( const uint8_t *d, uint32_t len, const struct _pattern *p );
+static _scanFn _scan;
+static pthread_once_t _scanOnce = PTHREAD_ONCE_INIT;
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static bool _isCandidate( const uint8_t *d, uint32_t q, const struct _pattern *p )
+
+/* Check if the pattern could finish at q, with anything before the buffer matching */
+
+{
+    if ( d[q] != p->term )
+    {
+        return false;
+    }
+
+    for ( uint32_t k = 1; ( k <= p->preLen ) && ( k <= q ); k++ )
+    {
+        if ( d[q - k] != p->pre )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+// ====================================================================================================
+static uint32_t _restartPoint( uint32_t q, const struct _pattern *p )
+
+{
+    return ( q > p->preLen ) ? q - p->preLen : 0;
+}
+// ====================================================================================================
+static uint32_t _scanScalar( const uint8_t *d, uint32_t len, const struct _pattern *p )
+
+/* Portable version, lets the C library find the candidate terminators for us */
+
+{
+    const uint8_t *s = d;
+    const uint8_t *end = d + len;
+
+    while ( ( s < end ) && ( s = memchr( s, p->term, end - s ) ) )
+    {
+        if ( _isCandidate( d, s - d, p ) )
+        {
+            return _restartPoint( s - d, p );
+        }
+
+        s++;
+    }
+
+    return len;
+}
+// ====================================================================================================
+#ifdef HAVE_X86_SIMD
+__attribute__( ( target( "sse2" ) ) )
+static uint32_t _scanSSE2( const uint8_t *d, uint32_t len, const struct _pattern *p )
+
+{
+    const __m128i term = _mm_set1_epi8( p->term );
+    const __m128i pre = _mm_set1_epi8( p->pre );
+    uint32_t q;
+
+    /* Candidates finishing before the vector loop can look backwards are done one at a time */
+    for ( q = 0; ( q < p->preLen ) && ( q < len ); q++ )
+    {
+        if ( _isCandidate( d, q, p ) )
+        {
+            return 0;
+        }
+    }
+
+    for ( ; q + sizeof( __m128i ) <= len; q += sizeof( __m128i ) )
+    {
+        __m128i m = _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )&d[q] ), term );
+
+        if ( !_mm_movemask_epi8( m ) )
+        {
+            continue;
+        }
+
+        for ( uint32_t k = 1; k <= p->preLen; k++ )
+        {
+            m = _mm_and_si128( m, _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )&d[q - k] ), pre ) );
+        }
+
+        uint32_t hits = _mm_movemask_epi8( m );
+
+        if ( hits )
+        {
+            return _restartPoint( q + __builtin_ctz( hits ), p );
+        }
+    }
+
+    /* ...and the same for anything that is left at the end */
+    for ( ; q < len; q++ )
+    {
+        if ( _isCandidate( d, q, p ) )
+        {
+            return _restartPoint( q, p );
+        }
+    }
+
+    return len;
+}
+// ====================================================================================================
+__attribute__( ( target( "avx2" ) ) )
+static uint32_t _scanAVX2( const uint8_t *d, uint32_t len, const struct _pattern *p )
+
+{
+    const __m256i term = _mm256_set1_epi8( p->term );
+    const __m256i pre = _mm256_set1_epi8( p->pre );
+    uint32_t q;
+
+    for ( q = 0; ( q < p->preLen ) && ( q < len ); q++ )
+    {
+        if ( _isCandidate( d, q, p ) )
+        {
+            return 0;
+        }
+    }
+
+    for ( ; q + sizeof( __m256i ) <= len; q += sizeof( __m256i ) )
+    {
+        __m256i m = _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )&d[q] ), term );
+
+        if ( !_mm256_movemask_epi8( m ) )
+        {
+            continue;
+        }
+
+        for ( uint32_t k = 1; k <= p->preLen; k++ )
+        {
+            m = _mm256_and_si256( m, _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )&d[q - k] ), pre ) );
+        }
+
+        uint32_t hits = _mm256_movemask_epi8( m );
+
+        if ( hits )
+        {
+            return _restartPoint( q + __builtin_ctz( hits ), p );
+        }
+    }
+
+    for ( ; q < len; q++ )
+    {
+        if ( _isCandidate( d, q, p ) )
+        {
+            return _restartPoint( q, p );
+        }
+    }
+
+    return len;
+}
+#endif
+// ====================================================================================================
+static void _selectScan( void )
+
+/* Select the best scanner for this host. Called once, whichever thread gets here first */
+
+{
+    _scan = _scanScalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        _scan = _scanAVX2;
+    }
+    else if ( __builtin_cpu_supports( "sse2" ) )
+    {
+        _scan = _scanSSE2;
+    }
+
+#endif
+}
+// ====================================================================================================
+static uint32_t _doScan( const uint8_t *d, uint32_t len, const struct _pattern *p )
+
+{
+    pthread_once( &_scanOnce, _selectScan );
+    return _scan( d, len, p );
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+uint32_t SyncScanTPIU( const uint8_t *d, uint32_t len )
+
+{
+    return _doScan( d, len, &_tpiuPattern );
+}
+// ====================================================================================================
+uint32_t SyncScanITM( const uint8_t *d, uint32_t len )
+
+/* The ITM decoder counts TPIU syncs too, so we have to stop for whichever comes first */
+
+{
+    uint32_t r = _doScan( d, len, &_itmPattern );
+
+    /* A TPIU sync can only need an earlier restart if it finishes before this limit */
+    uint32_t limit = ( r + _tpiuPattern.preLen < len ) ? r + _tpiuPattern.preLen : len;
+    uint32_t t = _doScan( d, limit, &_tpiuPattern );
+
+    return ( t < r ) ? t : r;
+}
+// ====================================================================================================
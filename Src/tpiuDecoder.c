@@ -33,129 +33,265 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef DEBUG
     #include "generics.h"
 #else
     #define genericsReport(x...)
 #endif
 #include "tpiuDecoder.h"
+#include "syncScan.h"
 
 #define SYNCPATTERN 0xFFFFFF7F
-#define NO_CHANNEL_CHANGE (0xFF)
-#define TIMEOUT (3)
+#define TIMEOUT (3000)                       /* Maximum frame spacing (mS) for TPIU_TIMING_BLOCK_CLOCK */
+#define MAX_RUNS (TPIU_PACKET_LEN / 2 + 1)    /* Max number of stream runs in one frame */
 
-// ====================================================================================================
-void TPIUDecoderInit( struct TPIUDecoder *t )
+/* Stats are read from other threads (e.g. for metrics), so they're only ever added to atomically */
+#define STAT_ADD(s,n) __atomic_fetch_add( &( s ), ( n ), __ATOMIC_RELAXED )
 
-/* Reset a TPIUDecoder instance */
+/* Frame unpacking is driven by which of the even bytes carry stream IDs. For each of the 256 */
+/* possibilities this table says where in the (lowbit restored) frame the data bytes are.     */
+struct _unpackEntry
+{
+    uint8_t len;                                /* Number of data bytes in the frame */
+    uint8_t idx[TPIU_PACKET_LEN - 1];           /* Where each one comes from */
+    uint8_t before[TPIU_PACKET_LEN / 2];        /* Data bytes before second byte of each pair */
+};
+
+static struct _unpackEntry _unpackTable[256];
+static pthread_once_t _unpackOnce = PTHREAD_ONCE_INIT;
 
+/* Lowbits for four byte pairs spread onto the even bytes of a word (built so it's endian neutral) */
+static uint64_t _lowbitSpread[16];
+
+/* A run of data bytes from the unpacked frame that all belong to the same stream */
+struct _run
 {
-    t->state = TPIU_UNSYNCED;
-    t->syncMonitor = 0;
-    TPIUDecoderZeroStats( t );
-}
+    uint8_t s;                                  /* Stream */
+    uint8_t start;                              /* Offset of first byte */
+    uint8_t len;                                /* Number of bytes */
+};
+
 // ====================================================================================================
-void TPIUDecoderZeroStats( struct TPIUDecoder *t )
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static uint64_t _clockNow( void )
+
+/* Coarse monotonic time in mS ... it's only used for a sanity check, so cheap is more important than precise */
 
 {
-    memset( &t->stats, 0, sizeof( struct TPIUDecoderStats ) );
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+#else
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+#endif
+    return ( uint64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 // ====================================================================================================
-bool TPIUDecoderSynced( struct TPIUDecoder *t )
+static void _sampleClock( struct TPIUDecoder *t )
+
+/* Note the time, if we're using the clock to check frames are current */
+
 {
-    return t->state != TPIU_UNSYNCED;
+    if ( t->timing == TPIU_TIMING_BLOCK_CLOCK )
+    {
+        t->now = _clockNow();
+    }
 }
 // ====================================================================================================
-struct TPIUDecoderStats *TPIUDecoderGetStats( struct TPIUDecoder *t )
+static void _resetStaleness( struct TPIUDecoder *t )
+
+/* Something has happened that shows the link is current */
+
 {
-    return &t->stats;
+    t->lastPacket = t->now;
+    t->framesSinceSync = 0;
 }
 // ====================================================================================================
-void TPIUDecoderForceSync( struct TPIUDecoder *t, uint8_t offset )
+static enum TPIUPumpEvent _frameComplete( struct TPIUDecoder *t )
 
-/* Force the decoder into a specific sync state */
+/* A full frame has been collected into rxedPacket, check it isn't stale */
 
 {
-    if ( t->state == TPIU_UNSYNCED )
+    bool stale;
+
+    t->byteCount = 0;
+
+    switch ( t->timing )
     {
-        t->stats.syncCount++;
-    }
+        // -----------------------------------
+        case TPIU_TIMING_BLOCK_CLOCK:
+            /* Check if this packet arrived a sensible time since the last one */
+            stale = ( t->now - t->lastPacket ) >= TIMEOUT;
+            t->lastPacket = t->now;
+            break;
 
-    t->state = TPIU_RXING;
-    t->byteCount = offset;
+        // -----------------------------------
+        case TPIU_TIMING_FRAME_COUNT:
+            stale = ( ++t->framesSinceSync > TPIU_STALE_FRAMES );
+            break;
 
-    /* Consider this a valid timestamp */
-    gettimeofday( &t->lastPacket, NULL );
+        // -----------------------------------
+        default:
+            stale = false;
+            break;
+            // -----------------------------------
+    }
+
+    if ( !stale )
+    {
+        STAT_ADD( t->stats.packets, 1 );
+        return TPIU_EV_RXEDPACKET;
+    }
+    else
+    {
+        genericsReport( V_WARN, ">>>>>>>>> PACKET INTERVAL TOO LONG <<<<<<<<<<<<<<" EOL );
+        t->state = TPIU_UNSYNCED;
+        STAT_ADD( t->stats.lostSync, 1 );
+        return TPIU_EV_UNSYNCED;
+    }
 }
 // ====================================================================================================
-bool TPIUGetPacket( struct TPIUDecoder *t, struct TPIUPacket *p )
+static void _buildUnpackTable( void )
 
-/* Copy received packet into transfer buffer, and reset receiver */
+/* Create the tables that drive frame unpacking (done once, they're the same for all decoders) */
 
 {
-    uint8_t delayedStreamChange = NO_CHANNEL_CHANGE;
-
-    /* This should have been reset in the call */
-    if ( ( t->byteCount ) || ( !p ) )
+    for ( uint32_t n = 0; n < 16; n++ )
     {
-        return false;
-    }
+        uint8_t b[sizeof( uint64_t )] = { 0 };
 
-    p->len = 0;
-    uint8_t lowbits = t->rxedPacket[TPIU_PACKET_LEN - 1];
+        for ( uint32_t k = 0; k < 4; k++ )
+        {
+            b[2 * k] = ( n >> k ) & 1;
+        }
 
-    for ( uint32_t i = 0; i < TPIU_PACKET_LEN; i += 2 )
+        memcpy( &_lowbitSpread[n], b, sizeof( uint64_t ) );
+    }
+
+    for ( uint32_t m = 0; m < 256; m++ )
     {
-        if ( ( t->rxedPacket[i] ) & 1 )
+        uint8_t *idx = _unpackTable[m].idx;
+
+        for ( uint32_t k = 0; k < TPIU_PACKET_LEN / 2; k++ )
         {
-            /* This is a stream change - either before or after the data byte */
-            if ( lowbits & 1 )
+            /* Even byte is data unless it's flagged as a stream ID... */
+            if ( !( m & ( 1 << k ) ) )
             {
-                delayedStreamChange = t->rxedPacket[i] >> 1;
+                *idx++ = 2 * k;
             }
-            else
+
+            _unpackTable[m].before[k] = idx - _unpackTable[m].idx;
+
+            /* ...odd byte is always data, apart from the last one which holds the lowbits */
+            if ( k < TPIU_PACKET_LEN / 2 - 1 )
             {
-                t->currentStream = t->rxedPacket[i] >> 1;
+                *idx++ = 2 * k + 1;
             }
         }
-        else
+
+        _unpackTable[m].len = idx - _unpackTable[m].idx;
+
+        /* Unused entries point somewhere harmless so the unpack can always copy a full frame */
+        while ( idx < &_unpackTable[m].idx[TPIU_PACKET_LEN - 1] )
         {
-            /* This is a data byte - store it */
-            p->packet[p->len].d = t->rxedPacket[i] | ( lowbits & 1 );
-            p->packet[p->len].s = t->currentStream;
-            p->len++;
+            *idx++ = 0;
         }
+    }
+}
+// ====================================================================================================
+static uint32_t _unpackFrame( struct TPIUDecoder *t, uint8_t *d, struct _run *r )
+
+/* Unpack received frame into data bytes in d, and the runs of streams they belong to in r. */
+/* Returns number of runs.                                                                  */
+
+{
+    uint8_t e[TPIU_PACKET_LEN];
+    uint64_t w[2];
+    uint8_t lowbits = t->rxedPacket[TPIU_PACKET_LEN - 1];
+    uint32_t idMask = 0;
+    uint32_t nruns = 0;
 
-        /* Now deal with the second byte of the pair */
-        if ( i < 14 )
+    /* Restore the lowbits of the even bytes, eight bytes at a time... */
+    memcpy( w, t->rxedPacket, TPIU_PACKET_LEN );
+    w[0] |= _lowbitSpread[lowbits & 0x0F];
+    w[1] |= _lowbitSpread[lowbits >> 4];
+    memcpy( e, w, TPIU_PACKET_LEN );
+
+    /* ...and note which of them are stream IDs */
+    for ( uint32_t k = 0; k < TPIU_PACKET_LEN / 2; k++ )
+    {
+        idMask |= ( t->rxedPacket[2 * k] & 1 ) << k;
+    }
+
+    if ( !idMask )
+    {
+        /* The usual case, no stream changes so it's all data */
+        memcpy( d, e, TPIU_PACKET_LEN - 1 );
+        r[0].s = t->currentStream;
+        r[0].start = 0;
+        r[0].len = TPIU_PACKET_LEN - 1;
+        return 1;
+    }
+
+    /* The table tells us where the data is, so we just collect it */
+    const struct _unpackEntry *u = &_unpackTable[idMask];
+
+    for ( uint32_t i = 0; i < TPIU_PACKET_LEN - 1; i++ )
+    {
+        d[i] = e[u->idx[i]];
+    }
+
+    /* Now split it into runs by stream. Usually there are no IDs in a frame, so this is quick */
+    r[0].s = t->currentStream;
+    r[0].start = 0;
+
+    for ( uint32_t m = idMask; m; m &= m - 1 )
+    {
+        uint32_t k = __builtin_ctz( m );
+
+        /* A clear lowbit means the change applies immediately to the second byte of the pair, */
+        /* otherwise it happens after it.                                                      */
+        uint32_t boundary = u->before[k] + ( ( lowbits >> k ) & 1 );
+
+        if ( boundary > u->len )
         {
-            /* Now deal with the other byte of the pair ... this is always data */
-            p->packet[p->len].d = t->rxedPacket[i + 1];
-            p->packet[p->len].s = t->currentStream;
-            p->len++;
+            boundary = u->len;
         }
 
-        /* ... and finally, if there's a delayed channel change, deal with it */
-        if ( delayedStreamChange != NO_CHANNEL_CHANGE )
+        if ( boundary > r[nruns].start )
         {
-            t->currentStream = delayedStreamChange;
-            delayedStreamChange = NO_CHANNEL_CHANGE;
+            r[nruns].len = boundary - r[nruns].start;
+            r[++nruns].start = boundary;
         }
 
-        /* Make sure we accomodate the lowbit for the next two bytes */
-        lowbits >>= 1;
+        r[nruns].s = t->rxedPacket[2 * k] >> 1;
     }
 
-    return true;
+    /* Whatever we finished on is the stream for the next frame */
+    t->currentStream = r[nruns].s;
+
+    if ( u->len > r[nruns].start )
+    {
+        r[nruns].len = u->len - r[nruns].start;
+        nruns++;
+    }
+
+    return nruns;
 }
 // ====================================================================================================
-enum TPIUPumpEvent TPIUPump( struct TPIUDecoder *t, uint8_t d )
+static enum TPIUPumpEvent _pumpByte( struct TPIUDecoder *t, uint8_t d )
 
-/* Pump next byte into the protocol decoder */
+/* Pump next byte into the protocol decoder, with t->now already sampled by the caller */
 
 {
-    struct timeval nowTime, diffTime;
-
     t->syncMonitor = ( t->syncMonitor << 8 ) | d;
 
     if ( t->syncMonitor == SYNCPATTERN )
@@ -173,11 +309,11 @@ enum TPIUPumpEvent TPIUPump( struct TPIUDecoder *t, uint8_t d )
         }
 
         t->state = TPIU_RXING;
-        t->stats.syncCount++;
+        STAT_ADD( t->stats.syncCount, 1 );
         t->byteCount = 0;
 
         /* Consider this a valid timestamp */
-        gettimeofday( &t->lastPacket, NULL );
+        _resetStaleness( t );
 
         return r;
     }
@@ -197,32 +333,258 @@ enum TPIUPumpEvent TPIUPump( struct TPIUDecoder *t, uint8_t d )
                 return TPIU_EV_RXING;
             }
 
-            /* Check if this packet arrived a sensible time since the last one */
-            gettimeofday( &nowTime, NULL );
-            timersub( &nowTime, &t->lastPacket, &diffTime );
-            memcpy( &t->lastPacket, &nowTime, sizeof( struct timeval ) );
-            t->byteCount = 0;
-
-            /* If it was less than a second since the last packet then it's valid */
-            if ( diffTime.tv_sec < TIMEOUT )
-            {
-                t->stats.packets++;
-                return TPIU_EV_RXEDPACKET;
-            }
-            else
-            {
-                genericsReport( V_WARN, ">>>>>>>>> PACKET INTERVAL TOO LONG <<<<<<<<<<<<<<" EOL );
-                t->state = TPIU_UNSYNCED;
-                t->stats.lostSync++;
-                return TPIU_EV_UNSYNCED;
-            }
+            return _frameComplete( t );
 
         // -----------------------------------
         default:
             genericsReport( V_WARN, "In illegal state %d" EOL, t->state );
-            t->stats.error++;
+            STAT_ADD( t->stats.error, 1 );
             return TPIU_EV_ERROR;
             // -----------------------------------
     }
 }
 // ====================================================================================================
+static void _pumpBlock( struct TPIUDecoder *t, uint8_t *d, uint32_t len, struct TPIUStreamBuffers *b, TPIUPacketCB cb, void *param )
+
+/* Pump a block of bytes into the protocol decoder, reporting events through cb. Frames go to */
+/* the stream buffers b if we have them, otherwise they're passed to cb too.                  */
+
+{
+    struct TPIUPacket p;
+    enum TPIUPumpEvent e;
+    uint32_t skip;
+    uint8_t *end = d + len;
+
+    /* One clock read covers every frame in the block */
+    _sampleClock( t );
+
+    while ( d < end )
+    {
+        /* Nothing but a sync matters while we're unsynced, so go straight to the next candidate */
+        if ( ( t->state == TPIU_UNSYNCED ) && ( ( skip = SyncScanTPIU( d, end - d ) ) ) )
+        {
+            /* ...keeping the tail of what we skipped in case a sync straddles the block */
+            for ( uint8_t *s = ( skip > sizeof( t->syncMonitor ) ) ? d + skip - sizeof( t->syncMonitor ) : d; s < d + skip; s++ )
+            {
+                t->syncMonitor = ( t->syncMonitor << 8 ) | *s;
+            }
+
+            d += skip;
+            continue;
+        }
+
+        /* When we're frame aligned and a whole frame is available we can take it in one go, */
+        /* provided it can't contain the end of a sync (which always finishes in SYNCPATTERN's */
+        /* bottom byte). Anything else goes through the bytewise pump.                         */
+        if ( ( t->state == TPIU_RXING ) && ( !t->byteCount ) && ( end - d >= TPIU_PACKET_LEN ) &&
+                ( !memchr( d, SYNCPATTERN & 0xFF, TPIU_PACKET_LEN ) ) )
+        {
+            memcpy( t->rxedPacket, d, TPIU_PACKET_LEN );
+            d += TPIU_PACKET_LEN;
+            t->syncMonitor = ( ( uint32_t )d[-4] << 24 ) | ( d[-3] << 16 ) | ( d[-2] << 8 ) | d[-1];
+            e = _frameComplete( t );
+        }
+        else
+        {
+            e = _pumpByte( t, *d++ );
+        }
+
+        switch ( e )
+        {
+            case TPIU_EV_NONE:
+            case TPIU_EV_RXING:
+                break;
+
+            // -----------------------------------
+            case TPIU_EV_RXEDPACKET:
+                if ( b )
+                {
+                    TPIUGetStreamData( t, b );
+                    cb( e, NULL, param );
+                }
+                else
+                {
+                    TPIUGetPacket( t, &p );
+                    cb( e, &p, param );
+                }
+
+                break;
+
+            // -----------------------------------
+            default:
+                cb( e, NULL, param );
+                break;
+        }
+    }
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+void TPIUDecoderInit( struct TPIUDecoder *t, enum TPIUTimingPolicy timing )
+
+/* Reset a TPIUDecoder instance */
+
+{
+    t->state = TPIU_UNSYNCED;
+    t->currentStream = TPIU_NULL_STREAM;
+    t->syncMonitor = 0;
+    t->timing = timing;
+    pthread_once( &_unpackOnce, _buildUnpackTable );
+    t->now = ( timing == TPIU_TIMING_BLOCK_CLOCK ) ? _clockNow() : 0;
+    _resetStaleness( t );
+    TPIUDecoderZeroStats( t );
+}
+// ====================================================================================================
+void TPIUDecoderZeroStats( struct TPIUDecoder *t )
+
+{
+    uint32_t *s = ( uint32_t * )&t->stats;
+
+    /* ...the stats are all uint32_t counters */
+    for ( uint32_t n = 0; n < sizeof( struct TPIUDecoderStats ) / sizeof( uint32_t ); n++ )
+    {
+        __atomic_store_n( &s[n], 0, __ATOMIC_RELAXED );
+    }
+}
+// ====================================================================================================
+bool TPIUDecoderSynced( struct TPIUDecoder *t )
+{
+    return t->state != TPIU_UNSYNCED;
+}
+// ====================================================================================================
+struct TPIUDecoderStats *TPIUDecoderGetStats( struct TPIUDecoder *t )
+{
+    return &t->stats;
+}
+// ====================================================================================================
+void TPIUDecoderForceSync( struct TPIUDecoder *t, uint8_t offset )
+
+/* Force the decoder into a specific sync state */
+
+{
+    if ( t->state == TPIU_UNSYNCED )
+    {
+        STAT_ADD( t->stats.syncCount, 1 );
+    }
+
+    t->state = TPIU_RXING;
+    t->byteCount = offset;
+
+    /* Consider this a valid timestamp */
+    _sampleClock( t );
+    _resetStaleness( t );
+}
+// ====================================================================================================
+bool TPIUGetPacket( struct TPIUDecoder *t, struct TPIUPacket *p )
+
+/* Copy received packet into transfer buffer, and reset receiver */
+
+{
+    struct _run r[MAX_RUNS];
+    uint8_t d[TPIU_PACKET_LEN];
+    uint32_t nruns;
+
+    /* This should have been reset in the call */
+    if ( ( t->byteCount ) || ( !p ) )
+    {
+        return false;
+    }
+
+    nruns = _unpackFrame( t, d, r );
+
+    /* There's always at least one run, since the odd bytes are always data */
+    for ( uint32_t i = 0; i < nruns; i++ )
+    {
+        for ( uint32_t j = r[i].start; j < r[i].start + r[i].len; j++ )
+        {
+            p->packet[j].d = d[j];
+            p->packet[j].s = r[i].s;
+        }
+    }
+
+    p->len = r[nruns - 1].start + r[nruns - 1].len;
+
+    return true;
+}
+// ====================================================================================================
+bool TPIUGetStreamData( struct TPIUDecoder *t, struct TPIUStreamBuffers *b )
+
+/* Unpack received frame straight into per-stream buffers, and reset receiver */
+
+{
+    struct _run r[MAX_RUNS];
+    uint8_t d[TPIU_PACKET_LEN];
+    uint32_t nruns;
+
+    /* This should have been reset in the call */
+    if ( ( t->byteCount ) || ( !b ) )
+    {
+        return false;
+    }
+
+    nruns = _unpackFrame( t, d, r );
+
+    for ( uint32_t i = 0; i < nruns; i++ )
+    {
+        uint8_t s = r[i].s;
+
+        /* Nobody is interested in this stream */
+        if ( !b->d[s] )
+        {
+            if ( ( s != TPIU_NULL_STREAM ) && ( s != TPIU_RESERVED_STREAM ) )
+            {
+                STAT_ADD( b->unrouted, r[i].len );
+            }
+
+            continue;
+        }
+
+        if ( b->len[s] + r[i].len > b->size[s] )
+        {
+            STAT_ADD( b->overflow, r[i].len );
+            continue;
+        }
+
+        memcpy( &b->d[s][b->len[s]], &d[r[i].start], r[i].len );
+        b->len[s] += r[i].len;
+    }
+
+    return true;
+}
+// ====================================================================================================
+enum TPIUPumpEvent TPIUPump( struct TPIUDecoder *t, uint8_t d )
+
+/* Pump next byte into the protocol decoder. There's no block here, so the clock is only read */
+/* when this byte completes a sync or a frame, which is when it's used.                       */
+
+{
+    if ( ( ( ( t->syncMonitor << 8 ) | d ) == SYNCPATTERN ) ||
+            ( ( t->state == TPIU_RXING ) && ( t->byteCount == TPIU_PACKET_LEN - 1 ) ) )
+    {
+        _sampleClock( t );
+    }
+
+    return _pumpByte( t, d );
+}
+// ====================================================================================================
+void TPIUPumpBlock( struct TPIUDecoder *t, uint8_t *d, uint32_t len, TPIUPacketCB cb, void *param )
+
+/* Pump a block of bytes into the protocol decoder, reporting events and frames through cb */
+
+{
+    _pumpBlock( t, d, len, NULL, cb, param );
+}
+// ====================================================================================================
+void TPIUPumpBlockStreams( struct TPIUDecoder *t, uint8_t *d, uint32_t len, struct TPIUStreamBuffers *b, TPIUPacketCB cb, void *param )
+
+/* Pump a block of bytes into the protocol decoder, unpacking frames into b. Events go to cb, */
+/* including TPIU_EV_RXEDPACKET after each frame has been unpacked.                          */
+
+{
+    _pumpBlock( t, d, len, b, cb, param );
+}
+// ====================================================================================================
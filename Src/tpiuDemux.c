@@ -0,0 +1,213 @@
+/*
+ * TPIU Demultiplexer Module
+ * =========================
+ *
+ * Copyright (C) 2020  Dave Marples  <dave@marples.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names Orbtrace, Orbuculum nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Routes the output of a TPIU decoder into a buffer for each stream that has a consumer,
+ * and hands the consumers what they've got in contiguous runs. Runs are delivered when a
+ * buffer fills, before any sync event (so consumers see data in order with the events that
+ * affect it) and at the end of each block.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tpiuDemux.h"
+
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Internal routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static void _flushStream( struct TPIUDemux *m, uint8_t stream )
+
+/* Give the consumer of this stream everything we've got for it */
+
+{
+    if ( m->b.len[stream] )
+    {
+        m->cb[stream]( m->b.d[stream], m->b.len[stream], m->param[stream] );
+        m->b.len[stream] = 0;
+    }
+}
+// ====================================================================================================
+static void _flushAll( struct TPIUDemux *m )
+
+{
+    for ( uint32_t i = 0; i < m->numRegistered; i++ )
+    {
+        _flushStream( m, m->registered[i] );
+    }
+}
+// ====================================================================================================
+static void _tpiuEvent( enum TPIUPumpEvent e, struct TPIUPacket *p, void *param )
+
+/* Callback from the decoder, for each frame received or change in sync */
+
+{
+    struct TPIUDemux *m = ( struct TPIUDemux * )param;
+
+    if ( e == TPIU_EV_RXEDPACKET )
+    {
+        /* Make sure there's room for the next frame on every stream */
+        for ( uint32_t i = 0; i < m->numRegistered; i++ )
+        {
+            if ( m->b.len[m->registered[i]] > TPIU_DEMUX_BUFLEN - TPIU_PACKET_LEN )
+            {
+                _flushStream( m, m->registered[i] );
+            }
+        }
+    }
+    else
+    {
+        /* Data before the event needs to be handled before the event itself */
+        _flushAll( m );
+
+        if ( m->ecb )
+        {
+            m->ecb( e, m->eparam );
+        }
+    }
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+// Externally available routines
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+bool TPIUDemuxRegister( struct TPIUDemux *m, uint8_t stream, TPIUDemuxStreamCB cb, void *param )
+
+/* Register a consumer for a stream */
+
+{
+    if ( ( stream >= TPIU_NUM_STREAMS ) || ( stream == TPIU_NULL_STREAM ) || ( !cb ) )
+    {
+        return false;
+    }
+
+    if ( !m->b.d[stream] )
+    {
+        if ( !( m->b.d[stream] = ( uint8_t * )malloc( TPIU_DEMUX_BUFLEN ) ) )
+        {
+            return false;
+        }
+
+        m->b.size[stream] = TPIU_DEMUX_BUFLEN;
+        m->b.len[stream] = 0;
+        m->registered[m->numRegistered++] = stream;
+    }
+
+    m->cb[stream] = cb;
+    m->param[stream] = param;
+    return true;
+}
+// ====================================================================================================
+void TPIUDemuxPump( struct TPIUDemux *m, uint8_t *d, uint32_t len )
+
+/* Pump a block of data through the decoder, delivering whatever it contained to the consumers */
+
+{
+    TPIUPumpBlockStreams( &m->t, d, len, &m->b, _tpiuEvent, m );
+    _flushAll( m );
+}
+// ====================================================================================================
+void TPIUDemuxForceSync( struct TPIUDemux *m, uint8_t offset )
+
+{
+    _flushAll( m );
+    TPIUDecoderForceSync( &m->t, offset );
+}
+// ====================================================================================================
+struct TPIUDecoderStats *TPIUDemuxGetStats( struct TPIUDemux *m )
+
+{
+    return TPIUDecoderGetStats( &m->t );
+}
+// ====================================================================================================
+uint32_t TPIUDemuxGetUnrouted( struct TPIUDemux *m )
+
+/* Number of bytes received for streams that nobody registered for. Safe from another thread. */
+
+{
+    return __atomic_load_n( &m->b.unrouted, __ATOMIC_RELAXED );
+}
+// ====================================================================================================
+uint32_t TPIUDemuxGetOverflow( struct TPIUDemux *m )
+
+/* Number of bytes lost because a stream's buffer was full. Safe from another thread. */
+
+{
+    return __atomic_load_n( &m->b.overflow, __ATOMIC_RELAXED );
+}
+// ====================================================================================================
+void TPIUDemuxReset( struct TPIUDemux *m )
+
+/* Put the decoder back to its initial state, keeping the registered streams */
+
+{
+    for ( uint32_t i = 0; i < m->numRegistered; i++ )
+    {
+        m->b.len[m->registered[i]] = 0;
+    }
+
+    __atomic_store_n( &m->b.overflow, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &m->b.unrouted, 0, __ATOMIC_RELAXED );
+    TPIUDecoderInit( &m->t, m->t.timing );
+}
+// ====================================================================================================
+void TPIUDemuxShutdown( struct TPIUDemux *m )
+
+/* Release the stream buffers */
+
+{
+    for ( uint32_t i = 0; i < m->numRegistered; i++ )
+    {
+        free( m->b.d[m->registered[i]] );
+        m->b.d[m->registered[i]] = NULL;
+    }
+
+    m->numRegistered = 0;
+}
+// ====================================================================================================
+void TPIUDemuxInit( struct TPIUDemux *m, enum TPIUTimingPolicy timing, TPIUDemuxEventCB ecb, void *eparam )
+
+/* Reset a TPIUDemux instance, with no streams registered */
+
+{
+    memset( m, 0, sizeof( struct TPIUDemux ) );
+    TPIUDecoderInit( &m->t, timing );
+    m->ecb = ecb;
+    m->eparam = eparam;
+}
+// ====================================================================================================
@@ -67,8 +67,10 @@
 #include "git_version_info.h"
 #include "generics.h"
 #include "tpiuDecoder.h"
+#include "tpiuDemux.h"
 #include "itmDecoder.h"
 #include "msgDecoder.h"
+#include "msgDispatch.h"
 
 #define SERVER_PORT 3443                  /* Server port definition */
 
@@ -105,8 +107,8 @@ struct
     /* The decoders and the packets from them */
     struct ITMDecoder i;
     struct ITMPacket h;
-    struct TPIUDecoder t;
-    struct TPIUPacket p;
+    struct TPIUDemux t;
+    struct MSGDispatch m;                /* Dispatcher of decoded messages to their handlers */
     enum timeDelay timeStatus;           /* Indicator of if this time is exact */
     uint64_t timeStamp;                  /* Latest received time */
 } _r;
@@ -271,36 +273,13 @@ void _handleTS( struct TSMsg *m, struct ITMDecoder *i )
     fprintf( stdout, "%d,%d,%" PRIu64 EOL, HWEVENT_TS, _r.timeStatus, _r.timeStamp );
 }
 // ====================================================================================================
-void _itmPumpProcess( char c )
+void _itmEvent( enum ITMPumpEvent e, void *param )
 
-{
-    struct msg decoded;
-
-    typedef void ( *handlers )( void *decoded, struct ITMDecoder * i );
-
-    /* Handlers for each complete message received */
-    static const handlers h[MSG_NUM_MSGS] =
-    {
-        /* MSG_UNKNOWN */         NULL,
-        /* MSG_RESERVED */        NULL,
-        /* MSG_ERROR */           NULL,
-        /* MSG_NONE */            NULL,
-        /* MSG_SOFTWARE */        ( handlers )_handleSW,
-        /* MSG_NISYNC */          NULL,
-        /* MSG_OSW */             ( handlers )_handleDataOffsetWP,
-        /* MSG_DATA_ACCESS_WP */  ( handlers )_handleDataAccessWP,
-        /* MSG_DATA_RWWP */       ( handlers )_handleDataRWWP,
-        /* MSG_PC_SAMPLE */       ( handlers )_handlePCSample,
-        /* MSG_DWT_EVENT */       ( handlers )_handleDWTEvent,
-        /* MSG_EXCEPTION */       ( handlers )_handleException,
-        /* MSG_TS */              ( handlers )_handleTS
-    };
-
-    switch ( ITMPump( &_r.i, c ) )
-    {
-        case ITM_EV_NONE:
-            break;
+/* Events from the itm decoder ... overflows go into the trace output */
 
+{
+    switch ( e )
+    {
         case ITM_EV_UNSYNCED:
             genericsReport( V_INFO, "ITM Unsynced" EOL );
             break;
@@ -310,26 +289,13 @@ void _itmPumpProcess( char c )
             break;
 
         case ITM_EV_OVERFLOW:
-            //genericsReport( V_WARN, "ITM Overflow" EOL );
-	    fprintf( stdout, "ITM_OVERFLOW" EOL );
+            fprintf( stdout, "ITM_OVERFLOW" EOL );
             break;
 
         case ITM_EV_ERROR:
             genericsReport( V_WARN, "ITM Error" EOL );
             break;
 
-        case ITM_EV_PACKET_RXED:
-            ITMGetDecodedPacket( &_r.i, &decoded );
-
-            /* See if we decoded a dispatchable match. genericMsg is just used to access */
-            /* the first two members of the decoded structs in a portable way.           */
-            if ( h[decoded.genericMsg.msgtype] )
-            {
-                ( h[decoded.genericMsg.msgtype] )( &decoded, &_r.i );
-            }
-
-            break;
-
         default:
             break;
     }
@@ -341,56 +307,51 @@ void _itmPumpProcess( char c )
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
-void _protocolPump( uint8_t c )
+void _itmPumpBlock( uint8_t *c, uint32_t len, void *param )
+
+/* Pump a run of ITM data into the decoder */
 
 {
-    if ( options.useTPIU )
-    {
-        switch ( TPIUPump( &_r.t, c ) )
-        {
-            case TPIU_EV_NEWSYNC:
-            case TPIU_EV_SYNCED:
-                ITMDecoderForceSync( &_r.i, true );
-                break;
+    MSGDispatchPump( &_r.m, c, len );
+}
+// ====================================================================================================
+void _tpiuEvent( enum TPIUPumpEvent e, void *param )
 
-            case TPIU_EV_RXING:
-            case TPIU_EV_NONE:
-                break;
+/* Callback for sync events from the TPIU decoder */
 
-            case TPIU_EV_UNSYNCED:
-                ITMDecoderForceSync( &_r.i, false );
-                break;
+{
+    switch ( e )
+    {
+        case TPIU_EV_NEWSYNC:
+        case TPIU_EV_SYNCED:
+            ITMDecoderForceSync( &_r.i, true );
+            break;
 
-            case TPIU_EV_RXEDPACKET:
-                if ( !TPIUGetPacket( &_r.t, &_r.p ) )
-                {
-                    genericsReport( V_WARN, "TPIUGetPacket fell over" EOL );
-                }
+        case TPIU_EV_RXING:
+        case TPIU_EV_NONE:
+        case TPIU_EV_RXEDPACKET:
+            break;
 
-                for ( uint32_t g = 0; g < _r.p.len; g++ )
-                {
-                    if ( _r.p.packet[g].s == options.tpiuITMChannel )
-                    {
-                        _itmPumpProcess( _r.p.packet[g].d );
-                        continue;
-                    }
-
-                    if  ( _r.p.packet[g].s != 0 )
-                    {
-                        genericsReport( V_WARN, "Unknown TPIU channel %02x" EOL, _r.p.packet[g].s );
-                    }
-                }
+        case TPIU_EV_UNSYNCED:
+            ITMDecoderForceSync( &_r.i, false );
+            break;
 
-                break;
+        case TPIU_EV_ERROR:
+            genericsReport( V_WARN, "****ERROR****" EOL );
+            break;
+    }
+}
+// ====================================================================================================
+void _protocolPump( uint8_t *c, int len )
 
-            case TPIU_EV_ERROR:
-                genericsReport( V_WARN, "****ERROR****" EOL );
-                break;
-        }
+{
+    if ( options.useTPIU )
+    {
+        TPIUDemuxPump( &_r.t, c, len );
     }
     else
     {
-        _itmPumpProcess( c );
+        _itmPumpBlock( c, len, NULL );
     }
 }
 // ====================================================================================================
@@ -572,12 +533,7 @@ int fileFeeder( void )
             }
         }
 
-        unsigned char *c = cbw;
-
-        while ( t-- )
-        {
-            _protocolPump( *c++ );
-        }
+        _protocolPump( cbw, t );
     }
 
     if ( !options.fileTerminate )
@@ -605,10 +561,27 @@ int main( int argc, char *argv[] )
         exit( -1 );
     }
 
-    /* Reset the TPIU handler before we start */
-    TPIUDecoderInit( &_r.t );
+    /* Reset the TPIU handler before we start...frame timing means nothing when reading a file */
+    TPIUDemuxInit( &_r.t, options.file ? TPIU_TIMING_NONE : TPIU_TIMING_BLOCK_CLOCK, _tpiuEvent, NULL );
+
+    if ( !TPIUDemuxRegister( &_r.t, options.tpiuITMChannel, _itmPumpBlock, NULL ) )
+    {
+        genericsExit( -1, "Cannot use TPIU channel %d for ITM" EOL, options.tpiuITMChannel );
+    }
+
     ITMDecoderInit( &_r.i, options.forceITMSync );
 
+    /* Handlers for each complete message received */
+    MSGDispatchInit( &_r.m, &_r.i, _itmEvent, NULL );
+    MSGDispatchRegister( &_r.m, MSG_SOFTWARE, ( MSGDispatchHandler )_handleSW );
+    MSGDispatchRegister( &_r.m, MSG_OSW, ( MSGDispatchHandler )_handleDataOffsetWP );
+    MSGDispatchRegister( &_r.m, MSG_DATA_ACCESS_WP, ( MSGDispatchHandler )_handleDataAccessWP );
+    MSGDispatchRegister( &_r.m, MSG_DATA_RWWP, ( MSGDispatchHandler )_handleDataRWWP );
+    MSGDispatchRegister( &_r.m, MSG_PC_SAMPLE, ( MSGDispatchHandler )_handlePCSample );
+    MSGDispatchRegister( &_r.m, MSG_DWT_EVENT, ( MSGDispatchHandler )_handleDWTEvent );
+    MSGDispatchRegister( &_r.m, MSG_EXCEPTION, ( MSGDispatchHandler )_handleException );
+    MSGDispatchRegister( &_r.m, MSG_TS, ( MSGDispatchHandler )_handleTS );
+
     sockfd = socket( AF_INET, SOCK_STREAM, 0 );
     setsockopt( sockfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof( flag ) );
 
@@ -647,12 +620,7 @@ int main( int argc, char *argv[] )
 
     while ( ( t = read( sockfd, cbw, TRANSFER_SIZE ) ) > 0 )
     {
-        unsigned char *c = cbw;
-
-        while ( t-- )
-        {
-            _protocolPump( *c++ );
-        }
+        _protocolPump( cbw, t );
 
         fflush( stdout );
     }